@@ -17,20 +17,95 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>
 #include <complex.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <io.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP 1
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #define BUFFER_MAX 1000            /* max string length */
-#define STACK_MAX 2048             /* VM Size */
+#define READER_CHUNK 65536         /* refill size for pipes and terminals */
+#define WRITER_CHUNK 8192          /* output port buffer size */
+#define STACK_MAX 2048             /* initial VM stack size */
 #define INITIAL_GC_THRESHOLD 1000  /* maximum number of obj to start GC */
 
+/* bit scanning on 64 bit words (x must be non zero for ctz and clz) */
+#if defined(__GNUC__)
+#define popcount64(x) __builtin_popcountll(x)
+#define ctz64(x) __builtin_ctzll(x)
+#define clz64(x) __builtin_clzll(x)
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define popcount64(x) ((int)__popcnt64(x))
+
+static int ctz64(uint64_t x) {
+    unsigned long i;
+
+    _BitScanForward64(&i, x);
+    return (int)i;
+}
+
+static int clz64(uint64_t x) {
+    unsigned long i;
+
+    _BitScanReverse64(&i, x);
+    return 63 - (int)i;
+}
+#else
+static int popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+}
+
+static int ctz64(uint64_t x) {
+    return popcount64((x & (0 - x)) - 1);
+}
+
+static int clz64(uint64_t x) {
+    int n = 0;
+
+    while (!(x & ((uint64_t)1 << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
 #define add_procedure(scheme_name, c_name)    \
-    define_var(make_symbol(scheme_name),      \
-                    make_primitive(c_name),   \
-                    env);
+    add_primitive(env, scheme_name, c_name, 0)
+
+#define add_inline_procedure(scheme_name, c_name, op)  \
+    add_primitive(env, scheme_name, c_name, op)
 
 /**************************** MODEL ******************************/
 
@@ -38,7 +113,9 @@ typedef enum {
     BOOLEAN, FIXNUM, CHARACTER, FLONUM,
     CPXNUM, STRING, PAIR, THE_NIL, SYMBOL,
     PRIMITIVE_PROC, COMPOUND_PROC, INPUT_PORT,
-    OUTPUT_PORT, EOF_OBJECT
+    OUTPUT_PORT, EOF_OBJECT, MATRIX, BITSET, VECTOR,
+    HASH_TABLE, STRING_BUILDER, BYTEVECTOR, PMAP, PMAP_NODE,
+    RECORD_TYPE, RECORD, RECORD_PROC, PROMISE
 } object_type;
 
 #if defined(_MSC_VER)
@@ -47,6 +124,70 @@ typedef _Dcomplex sComplex;
 typedef double complex sComplex;
 #endif
 
+/* dense row-major storage; views share elems with their base */
+typedef struct matrix {
+    long rows;
+    long cols;
+    long stride;            /* elements from one row to the next */
+    char is_complex;        /* elems holds (re, im) pairs */
+    double* elems;
+} matrix;
+
+/* growable character buffer behind string builders and the reader */
+typedef struct strbuf {
+    char* data;
+    long length;
+    long capacity;
+} strbuf;
+
+/* the source behind an input port: a regular file is mapped (or read
+ * whole) at open, pipes and terminals refill a chunk at a time */
+typedef struct reader {
+    FILE* stream;
+    unsigned char* buf;
+    size_t pos;
+    size_t end;
+    size_t capacity;
+    char whole;   /* buf holds the rest of the file, no refills */
+    char mapped;  /* buf is unmapped rather than freed */
+} reader;
+
+typedef enum { BUFFER_NONE, BUFFER_LINE, BUFFER_BLOCK } buffer_mode;
+
+/* the buffer in front of an output port's stream */
+typedef struct writer {
+    FILE* stream;
+    char* buf;
+    size_t length;
+    size_t capacity;
+    buffer_mode mode;
+    char line_ready;  /* a newline went in since the last flush */
+    struct writer* next;
+} writer;
+
+typedef enum {
+    HASH_EQ, HASH_EQV, HASH_EQUAL, HASH_STRING
+} hash_kind;
+
+typedef struct hash_entry {
+    struct object* key;     /* NULL when the slot is empty */
+    struct object* value;
+    uint32_t hash;
+    uint32_t dist;          /* distance from the home slot */
+} hash_entry;
+
+typedef struct hash_table {
+    hash_kind kind;
+    char weak;              /* keys are not traced by the collector */
+    long count;
+    long capacity;          /* power of two */
+    hash_entry* entries;
+    hash_entry* old_entries; /* being migrated after a resize */
+    long old_capacity;
+    long migrated;          /* old slots below this have moved */
+    struct hash_table* next_weak;
+} hash_table;
+
 typedef struct object {
     object_type type;
     unsigned char marked;
@@ -71,7 +212,8 @@ typedef struct object {
             char value;
         } character;
         struct {
-            char* value;
+            char* value;    /* NUL terminated, may also hold NULs */
+            long length;
         } string;
         struct {
             struct object* car;
@@ -79,6 +221,7 @@ typedef struct object {
         } pair;
         struct {
             struct object* (*fn)(struct object* args);
+            int inline_op;  /* typed arithmetic eval runs in place */
         } primitive_proc;
         struct {
             struct object* params;
@@ -87,11 +230,66 @@ typedef struct object {
             /* TODO: keys, and optional like COMMON LISP */
         } compound_proc;
         struct {
-            FILE* stream;
+            struct reader* reader;
         } input_port;
         struct {
-            FILE* stream;
+            struct writer* writer;
         } output_port;
+        struct {
+            struct matrix* m;
+            struct object* base; /* owner of the storage of a view */
+        } matrix;
+        struct {
+            long nbits;
+            uint64_t* words;
+            uint64_t* ranks;     /* rank directory, NULL when stale */
+        } bitset;
+        struct {
+            long length;
+            struct object* items[1]; /* really length items */
+        } vector;
+        struct {
+            long length;
+            unsigned char bytes[1]; /* really length bytes */
+        } bytevector;
+        struct {
+            struct object* root;    /* NULL when empty */
+            long count;
+            uint32_t edit;          /* nonzero while transient */
+            char is_set;
+        } pmap;
+        struct {
+            uint32_t bitmap;        /* 0 in collision nodes */
+            uint32_t edit;          /* transient that may change it */
+            long length;            /* slots in use, two per branch */
+            long capacity;
+            struct object* slots[1]; /* really capacity slots */
+        } pmap_node;
+        struct {
+            struct object* name;
+            struct object* fields;  /* field names in slot order */
+            long nfields;
+        } record_type;
+        struct {
+            struct object* rtd;
+            struct object* slots[1]; /* really nfields slots */
+        } record;
+        struct {
+            int kind;
+            struct object* rtd;
+            long slot;
+            struct object* slots;   /* constructor: vector of slots */
+        } record_proc;
+        struct {
+            int state;
+            struct object* value;   /* depends on the state */
+            struct object* env;     /* of a delayed expression */
+            struct object* (*step)(struct object* state);
+        } promise;
+        struct {
+            struct hash_table* t;
+        } hash_table;
+        strbuf builder;
     } data;
 } object;
 
@@ -99,8 +297,9 @@ typedef struct {
     int numObj;
     int maxObj;
     object* firstObject;
-    object* stack[STACK_MAX];
+    object** stack;
     int stackSize;
+    int stackCapacity;  /* doubles when a push finds it full */
 } VM;
 
 VM* the_vm;
@@ -109,35 +308,64 @@ object * false;
 object * true;
 object* nil;
 object* symtab;
+object* eof_object;
+object* stream_null;
+object* the_empty;
+object* the_global;
+
+reader* stdin_reader;
+writer* stdout_writer;
+writer* stderr_writer;
+
+void diagnostic(const char* format, ...);
+
+char unsafe_mode = 0;  /* --unsafe: typed arithmetic skips its checks */
+char relocate_image = 0;  /* --relocate-image: map away from the base */
+char interactive = 1;  /* prompts, echo and collector messages */
+int command_argc = 0;  /* the script and its arguments */
+char** command_argv = NULL;
+char fresh_arguments;  /* the primitive running owns its argument list */
 
 VM* newVM(void) {
     VM* vm = malloc(sizeof(VM));
 
     if (vm) {
+        vm->stack = malloc(STACK_MAX * sizeof(object*));
+        if (vm->stack == NULL) {
+            diagnostic("*** cannot allocate VM for the stack\n");
+            exit(1);
+        }
+        vm->stackCapacity = STACK_MAX;
         vm->stackSize = 0;
         vm->firstObject = NULL;
         vm->numObj = 0;
         vm->maxObj = INITIAL_GC_THRESHOLD;
     }
     else {
-        fprintf(stderr, "*** cannot allocate VM for the stack\n");
+        diagnostic("*** cannot allocate VM for the stack\n");
     }
     return vm;
 }
 
 void push(VM* vm, object* val) {
-    if (vm->stackSize >= STACK_MAX) {
-        fprintf(stderr, "*** STACK OVERFLOW\n");
-        exit(1);
-    }
-    else {
-        vm->stack[vm->stackSize++] = val;
+    object** stack;
+
+    if (vm->stackSize >= vm->stackCapacity) {
+        stack = realloc(vm->stack,
+            2 * vm->stackCapacity * sizeof(object*));
+        if (stack == NULL) {
+            diagnostic("*** STACK OVERFLOW\n");
+            exit(1);
+        }
+        vm->stack = stack;
+        vm->stackCapacity *= 2;
     }
+    vm->stack[vm->stackSize++] = val;
 }
 
 object* pop(VM* vm) {
     if (vm->stackSize <= 0) {
-        fprintf(stderr, "*** STACK UNDERFLOW\n");
+        diagnostic("*** STACK UNDERFLOW\n");
         exit(1);
     }
     else {
@@ -145,37 +373,175 @@ object* pop(VM* vm) {
     }
 }
 
-void mark(object* obj) {
+/* objects restored from a heap image are never swept, and keep their
+ * mark bits here so that collecting does not copy the shared pages */
+char* image_start = NULL;
+char* image_end = NULL;
+unsigned char* image_marks = NULL;
 
-    if (obj->marked) return;
+#define IMAGE_ALIGN 16
 
-    obj->marked = 1;
+char is_marked(object* obj) {
+    size_t i;
+
+    if ((char*)obj >= image_start && (char*)obj < image_end) {
+        i = (size_t)((char*)obj - image_start) / IMAGE_ALIGN;
+        return (image_marks[i / 8] >> (i % 8)) & 1;
+    }
+    return obj->marked;
+}
 
-    if (obj->type == PAIR) {
-        mark(obj->data.pair.car);
-        mark(obj->data.pair.cdr);
+void set_marked(object* obj) {
+    size_t i;
+
+    if ((char*)obj >= image_start && (char*)obj < image_end) {
+        i = (size_t)((char*)obj - image_start) / IMAGE_ALIGN;
+        image_marks[i / 8] |= (unsigned char)(1 << (i % 8));
+        return;
     }
-    else if (obj->type == COMPOUND_PROC) {
-        mark(obj->data.compound_proc.body);
-        mark(obj->data.compound_proc.env);
-        mark(obj->data.compound_proc.params);
+    obj->marked = 1;
+}
+
+void mark_hash_table(hash_table* t);
+void clear_weak_tables(void);
+
+void mark(object* obj) {
+    object* next;
+
+    /* cdrs and promise chains are followed in a loop, so long lists
+     * and streams do not recurse */
+    while (obj != NULL && !is_marked(obj)) {
+        set_marked(obj);
+        next = NULL;
+
+        if (obj->type == PAIR) {
+            mark(obj->data.pair.car);
+            next = obj->data.pair.cdr;
+        }
+        else if (obj->type == PROMISE) {
+            mark(obj->data.promise.env);
+            next = obj->data.promise.value;
+        }
+        else if (obj->type == COMPOUND_PROC) {
+            mark(obj->data.compound_proc.body);
+            mark(obj->data.compound_proc.env);
+            mark(obj->data.compound_proc.params);
+        }
+        else if (obj->type == MATRIX && obj->data.matrix.base != NULL) {
+            mark(obj->data.matrix.base);
+        }
+        else if (obj->type == VECTOR) {
+            for (long i = 0; i < obj->data.vector.length; i++) {
+                mark(obj->data.vector.items[i]);
+            }
+        }
+        else if (obj->type == HASH_TABLE) {
+            mark_hash_table(obj->data.hash_table.t);
+        }
+        else if (obj->type == PMAP && obj->data.pmap.root != NULL) {
+            mark(obj->data.pmap.root);
+        }
+        else if (obj->type == RECORD_TYPE) {
+            mark(obj->data.record_type.name);
+            mark(obj->data.record_type.fields);
+        }
+        else if (obj->type == RECORD) {
+            mark(obj->data.record.rtd);
+            for (long i = 0;
+                 i < obj->data.record.rtd->data.record_type.nfields; i++) {
+                mark(obj->data.record.slots[i]);
+            }
+        }
+        else if (obj->type == RECORD_PROC) {
+            mark(obj->data.record_proc.rtd);
+            mark(obj->data.record_proc.slots);
+        }
+        else if (obj->type == PMAP_NODE) {
+            for (long i = 0; i < obj->data.pmap_node.length; i++) {
+                if (obj->data.pmap_node.slots[i] != NULL) {
+                    mark(obj->data.pmap_node.slots[i]);
+                }
+            }
+        }
+        obj = next;
     }
 }
 
 void markAll(VM* vm) {
+    object* roots[] = { nil, false, true, symtab, eof_object, the_global,
+                        stream_null };
+
+    /* the interpreter constants are never pushed on the stack */
+    for (int i = 0; i < (int)(sizeof(roots) / sizeof(roots[0])); i++) {
+        if (roots[i] != NULL) {
+            mark(roots[i]);
+        }
+    }
     for (int i = 0; i < vm->stackSize; i++) {
         mark(vm->stack[i]);
     }
 }
 
+void release_reader(reader* r);
+char release_writer(writer* w);
+void writer_puts(writer* w, const char* str);
+void writer_printf(writer* w, const char* format, ...);
+
+/* releases the obj and any storage it owns */
+void free_object(object* obj) {
+    switch (obj->type) {
+    case MATRIX:
+        if (obj->data.matrix.base == NULL) {
+            free(obj->data.matrix.m->elems);
+        }
+        free(obj->data.matrix.m);
+        break;
+    case BITSET:
+        free(obj->data.bitset.words);
+        free(obj->data.bitset.ranks);
+        break;
+    case STRING:
+        free(obj->data.string.value);
+        break;
+    case STRING_BUILDER:
+        free(obj->data.builder.data);
+        break;
+    case HASH_TABLE:
+        free(obj->data.hash_table.t->entries);
+        free(obj->data.hash_table.t->old_entries);
+        free(obj->data.hash_table.t);
+        break;
+    case OUTPUT_PORT:
+        /* a dropped port still gets what was written to it */
+        if (obj->data.output_port.writer != stdout_writer &&
+            obj->data.output_port.writer != stderr_writer) {
+            release_writer(obj->data.output_port.writer);
+            free(obj->data.output_port.writer);
+        }
+        break;
+    case INPUT_PORT:
+        /* the stream of a port never closed stays open */
+        if (obj->data.input_port.reader != stdin_reader) {
+            release_reader(obj->data.input_port.reader);
+            free(obj->data.input_port.reader);
+        }
+        break;
+    default:
+        break;
+    }
+    free(obj);
+}
+
 void sweep(VM* vm) {
     object** obj = &vm->firstObject;
+
+    clear_weak_tables();
     while (*obj) {
         if (!(*obj)->marked) {
             /* This obj wasn't reached so remove it from the list */
             object* unreached = *obj;
             *obj = unreached->next;
-            free(unreached);
+            free_object(unreached);
 
             vm->numObj--;
         }
@@ -185,20 +551,31 @@ void sweep(VM* vm) {
             obj = &(*obj)->next;
         }
     }
+    if (image_marks != NULL) {
+        memset(image_marks, 0,
+            (size_t)(image_end - image_start) / IMAGE_ALIGN / 8 + 1);
+    }
 }
 
 void gc(VM* vm) {
     int numObj = vm->numObj;
 
-    printf("*** GC: marking %d objects\n", numObj);
+    if (interactive) {
+        writer_printf(stdout_writer, "*** GC: marking %d objects\n",
+            numObj);
+    }
     markAll(vm);
-    printf("*** GC: sweeping\n");
+    if (interactive) {
+        writer_puts(stdout_writer, "*** GC: sweeping\n");
+    }
     sweep(vm);
 
     vm->maxObj = vm->numObj == 0 ? INITIAL_GC_THRESHOLD : vm->numObj * 2;
 
-    printf("*** GC: collected %d objects, %d remaining.\n", numObj - vm->numObj,
-        vm->numObj);
+    if (interactive) {
+        writer_printf(stdout_writer, "*** GC: collected %d objects, "
+            "%d remaining.\n", numObj - vm->numObj, vm->numObj);
+    }
 }
 
 object* gc_proc(object* dummy) {
@@ -207,26 +584,30 @@ object* gc_proc(object* dummy) {
 }
 
 object* gc_stats_proc(object* dummy) {
-    printf("*** GARBAGE COLLECTOR STATS ***\n");
-    printf("*** Current number of objs: %d\n", the_vm->numObj);
-    printf("*** Maximum number of objs: %d\n", the_vm->maxObj);
+    writer_puts(stdout_writer, "*** GARBAGE COLLECTOR STATS ***\n");
+    writer_printf(stdout_writer, "*** Current number of objs: %d\n",
+        the_vm->numObj);
+    writer_printf(stdout_writer, "*** Maximum number of objs: %d\n",
+        the_vm->maxObj);
     return nil;
 }
 
 void freeVM(VM* vm) {
     vm->stackSize = 0;
     gc(vm);
+    free(vm->stack);
     free(vm);
 }
 
-object* alloc_object(void) {
+/* size may be larger than an object for types with inline storage */
+object* alloc_object_sized(size_t size) {
     object* obj;
 
     if (the_vm->numObj == the_vm->maxObj) gc(the_vm);
 
-    obj = malloc(sizeof(object));
+    obj = malloc(size < sizeof(object) ? sizeof(object) : size);
     if (obj == NULL) {
-        fprintf(stderr, "out of memory\n");
+        diagnostic("out of memory\n");
         exit(1);
     }
     obj->marked = 0;
@@ -237,6 +618,10 @@ object* alloc_object(void) {
     return obj;
 }
 
+object* alloc_object(void) {
+    return alloc_object_sized(sizeof(object));
+}
+
 
 
 /**************** SYMBOL DEFINITION ***********/
@@ -253,10 +638,13 @@ object* else_symbol;
 object* let_symbol;
 object* and_symbol;
 object* or_symbol;
+object* big_symbol;
+object* little_symbol;
+object* define_record_type_symbol;
+object* delay_symbol;
+object* delay_force_symbol;
+object* stream_cons_symbol;
 
-object* eof_object;
-object* the_empty;
-object* the_global;
 
 
 object* cons(object* car, object* cdr); /* forward declaration */
@@ -298,13 +686,12 @@ object* make_symbol(char* value) {
     obj->type = SYMBOL;
     obj->data.symbol.value = malloc(strlen(value) + 1);
     if (obj->data.symbol.value == NULL) {
-        fprintf(stderr, "*** symbol - out of memory\n");
+        diagnostic("*** symbol - out of memory\n");
         exit(1);
     }
     strcpy(obj->data.symbol.value, value);
-    symtab = cons(obj, symtab);
-
     push(the_vm, obj);
+    symtab = cons(obj, symtab);
     return obj;
 }
 
@@ -326,6 +713,14 @@ char is_fixnum(object* obj) {
     return obj->type == FIXNUM;
 }
 
+long fixnum_argument(object* obj) {
+    if (!is_fixnum(obj)) {
+        diagnostic("*** expected an integer\n");
+        exit(1);
+    }
+    return obj->data.fixnum.value;
+}
+
 object* make_flonum(double value) {
     object* obj;
 
@@ -382,868 +777,10120 @@ char is_character(object* obj) {
     return obj->type == CHARACTER;
 }
 
-object* make_string(char* value) {
+/* a string of length bytes copied from value, or blank if value is NULL */
+object* make_string_n(char* value, long length) {
     object* obj;
 
     obj = alloc_object();
     obj->type = STRING;
-    obj->data.string.value = malloc(strlen(value) + 1);
+    obj->data.string.value = malloc(length + 1);
     if (obj->data.string.value == NULL) {
-        fprintf(stderr, "*** cannot create string - out of memory\n");
+        diagnostic("*** cannot create string - out of memory\n");
         exit(1);
     }
-    strcpy(obj->data.string.value, value);
+    if (value != NULL) {
+        memcpy(obj->data.string.value, value, length);
+    }
+    obj->data.string.value[length] = '\0';
+    obj->data.string.length = length;
     push(the_vm, obj);
     return obj;
 }
 
-char is_string(object* obj) {
-    return obj->type == STRING;
+object* make_string(char* value) {
+    return make_string_n(value, (long)strlen(value));
 }
 
-object* cons(object* car, object* cdr) {
-    object* obj;
-
-    obj = alloc_object();
-    obj->type = PAIR;
-    obj->data.pair.car = car;
-    obj->data.pair.cdr = cdr;
-    push(the_vm, obj);
-    return obj;
+void strbuf_init(strbuf* buf) {
+    buf->data = NULL;
+    buf->length = 0;
+    buf->capacity = 0;
 }
 
-char is_pair(object* obj) {
-    return obj->type == PAIR;
-}
+/* doubles the capacity, so appending is amortized O(1) */
+void strbuf_reserve(strbuf* buf, long extra) {
+    long capacity;
+    char* data;
 
-object* car(object* pair) {
-    return pair->data.pair.car;
+    if (buf->length + extra + 1 <= buf->capacity) {
+        return;
+    }
+    capacity = (buf->capacity < 32) ? 32 : buf->capacity;
+    while (capacity < buf->length + extra + 1) {
+        capacity *= 2;
+    }
+    data = realloc(buf->data, capacity);
+    if (data == NULL) {
+        diagnostic("*** string buffer - out of memory\n");
+        exit(1);
+    }
+    buf->data = data;
+    buf->capacity = capacity;
 }
 
-void set_car(object* obj, object* value) {
-    obj->data.pair.car = value;
+void strbuf_add(strbuf* buf, char* str, long length) {
+    strbuf_reserve(buf, length);
+    memcpy(buf->data + buf->length, str, length);
+    buf->length += length;
+    buf->data[buf->length] = '\0';
 }
 
-object* cdr(object* pair) {
-    return pair->data.pair.cdr;
+void strbuf_add_char(strbuf* buf, char c) {
+    strbuf_reserve(buf, 1);
+    buf->data[buf->length++] = c;
+    buf->data[buf->length] = '\0';
 }
 
-void set_cdr(object* obj, object* value) {
-    obj->data.pair.cdr = value;
-}
+/* writes out what the buffer holds, answering 0 if the stream failed */
+char writer_flush(writer* w) {
+    size_t n;
 
-#define caar(obj)   car(car(obj))
-#define cadr(obj)   car(cdr(obj))
-#define cdar(obj)   cdr(car(obj))
-#define cddr(obj)   cdr(cdr(obj))
-#define caaar(obj)  car(car(car(obj)))
-#define caadr(obj)  car(car(cdr(obj)))
-#define cadar(obj)  car(cdr(car(obj)))
-#define caddr(obj)  car(cdr(cdr(obj)))
-#define cdaar(obj)  cdr(car(car(obj)))
-#define cdadr(obj)  cdr(car(cdr(obj)))
-#define cddar(obj)  cdr(cdr(car(obj)))
-#define cdddr(obj)  cdr(cdr(cdr(obj)))
-#define caaaar(obj) car(car(car(car(obj))))
-#define caaadr(obj) car(car(car(cdr(obj))))
-#define caadar(obj) car(car(cdr(car(obj))))
-#define caaddr(obj) car(car(cdr(cdr(obj))))
-#define cadaar(obj) car(cdr(car(car(obj))))
-#define cadadr(obj) car(cdr(car(cdr(obj))))
-#define caddar(obj) car(cdr(cdr(car(obj))))
-#define cadddr(obj) car(cdr(cdr(cdr(obj))))
-#define cdaaar(obj) cdr(car(car(car(obj))))
-#define cdaadr(obj) cdr(car(car(cdr(obj))))
-#define cdadar(obj) cdr(car(cdr(car(obj))))
-#define cdaddr(obj) cdr(car(cdr(cdr(obj))))
-#define cddaar(obj) cdr(cdr(car(car(obj))))
-#define cddadr(obj) cdr(cdr(car(cdr(obj))))
-#define cdddar(obj) cdr(cdr(cdr(car(obj))))
-#define cddddr(obj) cdr(cdr(cdr(cdr(obj))))
+    n = w->length;
+    w->length = 0;
+    w->line_ready = 0;
+    if (w->stream == NULL) {
+        return 1;
+    }
+    if (n > 0 && fwrite(w->buf, 1, n, w->stream) != n) {
+        return 0;
+    }
+    return fflush(w->stream) != EOF;
+}
 
-object* make_primitive(object* (*fn)(struct object* args)) {
-    object* obj;
+/* a message for stderr, written after what stdout still holds, so the
+ * two come out in order when they share a terminal or a pipe */
+void diagnostic(const char* format, ...) {
+    va_list args;
 
-    obj = alloc_object();
-    obj->type = PRIMITIVE_PROC;
-    obj->data.primitive_proc.fn = fn;
-    push(the_vm, obj);
-    return obj;
+    if (stdout_writer != NULL) {
+        writer_flush(stdout_writer);
+    }
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
 }
 
-char is_primitive(object* obj) {
-    return obj->type == PRIMITIVE_PROC;
+void writer_flush_or_die(writer* w) {
+    if (!writer_flush(w)) {
+        diagnostic("*** could not write to output port\n");
+        exit(1);
+    }
 }
 
-object* is_null_proc(object* arguments) {
-    return is_nil(car(arguments)) ? true : false;
-}
+/* every writer still open, so they can all be flushed at exit */
+writer* open_writers = NULL;
 
-object* is_boolean_proc(object* arguments) {
-    return is_boolean(car(arguments)) ? true : false;
-}
+void flush_open_writers(void) {
+    writer* w;
 
-object* is_symbol_proc(object* arguments) {
-    return is_symbol(car(arguments)) ? true : false;
+    for (w = open_writers; w != NULL; w = w->next) {
+        writer_flush(w);
+    }
 }
 
-char is_number(object* obj) {
-    return ((obj->type == FIXNUM) ||
-            (obj->type == FLONUM) ||
-            (obj->type == CPXNUM));
-}
+writer* open_writer(FILE* stream, buffer_mode mode) {
+    writer* w;
 
-object* is_integer_proc(object* arguments) {
-    return is_fixnum(car(arguments)) ? true : false;
+    w = malloc(sizeof(writer));
+    if (w != NULL) {
+        w->buf = malloc(WRITER_CHUNK);
+    }
+    if (w == NULL || w->buf == NULL) {
+        diagnostic("*** writer - out of memory\n");
+        exit(1);
+    }
+    w->stream = stream;
+    w->length = 0;
+    w->capacity = WRITER_CHUNK;
+    w->mode = mode;
+    w->line_ready = 0;
+    w->next = open_writers;
+    open_writers = w;
+    return w;
+}
+
+/* flushes and drops the buffer, the stream is left to the caller */
+char release_writer(writer* w) {
+    writer** link;
+    char ok;
+
+    ok = writer_flush(w);
+    for (link = &open_writers; *link != NULL; link = &(*link)->next) {
+        if (*link == w) {
+            *link = w->next;
+            break;
+        }
+    }
+    free(w->buf);
+    w->buf = NULL;
+    w->capacity = 0;
+    w->stream = NULL;
+    return ok;
 }
 
-object* is_real_proc(object* arguments) {
-    return is_flonum(car(arguments)) ? true : false;
+void writer_write(writer* w, const char* data, size_t n) {
+    if (w->stream == NULL) {
+        diagnostic("*** write to a closed output port\n");
+        exit(1);
+    }
+    if (w->mode == BUFFER_LINE && memchr(data, '\n', n) != NULL) {
+        w->line_ready = 1;
+    }
+    if (w->length + n > w->capacity) {
+        writer_flush_or_die(w);
+        if (n > w->capacity) {
+            /* too big to buffer, it goes out as it is */
+            if (fwrite(data, 1, n, w->stream) != n) {
+                diagnostic("*** could not write to output port\n");
+                exit(1);
+            }
+            return;
+        }
+    }
+    memcpy(w->buf + w->length, data, n);
+    w->length += n;
 }
 
-object* is_complex_proc(object* arguments) {
-    return is_number(car(arguments)) ? true : false;
+void writer_putc(writer* w, char c) {
+    if (w->length < w->capacity && w->stream != NULL &&
+        c != '\n') {
+        w->buf[w->length++] = c;
+        return;
+    }
+    writer_write(w, &c, 1);
 }
 
-object* is_char_proc(object* arguments) {
-    return is_character(car(arguments)) ? true : false;
+void writer_puts(writer* w, const char* str) {
+    writer_write(w, str, strlen(str));
 }
 
-object* is_string_proc(object* arguments) {
-    return is_string(car(arguments)) ? true : false;
-}
+void writer_printf(writer* w, const char* format, ...) {
+    va_list args;
+    char small[256];
+    char* text;
+    int n;
 
-object* is_pair_proc(object* arguments) {
-    return is_pair(car(arguments)) ? true : false;
+    va_start(args, format);
+    n = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < sizeof(small)) {
+        writer_write(w, small, n);
+        return;
+    }
+    text = malloc(n + 1);
+    if (text == NULL) {
+        diagnostic("*** writer - out of memory\n");
+        exit(1);
+    }
+    va_start(args, format);
+    vsnprintf(text, n + 1, format, args);
+    va_end(args);
+    writer_write(w, text, n);
+    free(text);
+}
+
+/* ends an output operation, flushing as the buffering mode asks */
+void writer_done(writer* w) {
+    if (w->mode == BUFFER_NONE ||
+        (w->mode == BUFFER_LINE && w->line_ready)) {
+        writer_flush_or_die(w);
+    }
 }
 
-char is_compound_proc(object* obj); /* forward declaration */
+/* maps or reads the rest of a regular file in one go, answering 0
+ * for streams whose size is not known up front */
+char reader_load_file(reader* r) {
+    long start;
+    size_t size;
+#if defined(_MSC_VER)
+    struct _stat64 st;
 
-object* is_procedure_proc(object* arguments) {
-    object* obj;
+    if (_fstat64(_fileno(r->stream), &st) != 0 ||
+        (st.st_mode & _S_IFMT) != _S_IFREG) {
+        return 0;
+    }
+#else
+    struct stat st;
 
-    obj = car(arguments);
-    return (is_primitive(obj) ||
-            is_compound_proc(obj)) ?
+    if (fstat(fileno(r->stream), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+#endif
+    start = ftell(r->stream);
+    if (start < 0 || (long long)start > (long long)st.st_size) {
+        return 0;
+    }
+    size = (size_t)st.st_size;
+#if defined(HAVE_MMAP)
+    if (size > 0) {
+        void* map;
+
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+            fileno(r->stream), 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+            r->buf = map;
+            r->pos = (size_t)start;
+            r->end = size;
+            r->capacity = size;
+            r->whole = 1;
+            r->mapped = 1;
+            return 1;
+        }
+    }
+#endif
+    /* text mode may translate line ends, so the count read is what
+     * counts, size is only an upper bound */
+    size -= (size_t)start;
+    r->buf = malloc(size + 1);
+    if (r->buf == NULL) {
+        diagnostic("*** reader - out of memory\n");
+        exit(1);
+    }
+    r->pos = 0;
+    r->end = fread(r->buf, 1, size, r->stream);
+    r->capacity = size + 1;
+    r->whole = 1;
+    return 1;
+}
+
+reader* open_reader(FILE* stream) {
+    reader* r;
+
+    r = malloc(sizeof(reader));
+    if (r == NULL) {
+        diagnostic("*** reader - out of memory\n");
+        exit(1);
+    }
+    r->stream = stream;
+    r->buf = NULL;
+    r->pos = 0;
+    r->end = 0;
+    r->capacity = 0;
+    r->whole = 0;
+    r->mapped = 0;
+    if (!reader_load_file(r)) {
+        r->buf = malloc(READER_CHUNK);
+        if (r->buf == NULL) {
+            diagnostic("*** reader - out of memory\n");
+            exit(1);
+        }
+        r->capacity = READER_CHUNK;
+    }
+    return r;
+}
+
+/* reads length bytes from a malloced buf, which the reader then owns */
+reader* open_buffer_reader(unsigned char* buf, size_t length) {
+    reader* r;
+
+    r = malloc(sizeof(reader));
+    if (r == NULL) {
+        diagnostic("*** reader - out of memory\n");
+        exit(1);
+    }
+    r->buf = buf;
+    r->stream = NULL;
+    r->pos = 0;
+    r->end = length;
+    r->capacity = length;
+    r->whole = 1;
+    r->mapped = 0;
+    return r;
+}
+
+/* reads a copy of text, as for expressions on the command line */
+reader* open_string_reader(char* text) {
+    unsigned char* buf;
+    size_t length;
+
+    length = strlen(text);
+    buf = malloc(length + 1);
+    if (buf == NULL) {
+        diagnostic("*** reader - out of memory\n");
+        exit(1);
+    }
+    memcpy(buf, text, length + 1);
+    return open_buffer_reader(buf, length);
+}
+
+/* drops the buffer, the reader then only answers EOF */
+void release_reader(reader* r) {
+#if defined(HAVE_MMAP)
+    if (r->mapped) {
+        munmap(r->buf, r->capacity);
+    }
+    else
+#endif
+    {
+        free(r->buf);
+    }
+    r->stream = NULL;
+    r->buf = NULL;
+    r->pos = 0;
+    r->end = 0;
+    r->capacity = 0;
+    r->whole = 1;
+    r->mapped = 0;
+}
+
+/* refills a consumed buffer, answering the number of new bytes. The
+ * last byte read is kept in front, so a character just read can
+ * always be unread */
+size_t reader_fill(reader* r) {
+    size_t keep;
+    size_t n;
+
+    if (r->whole) {
+        return 0;
+    }
+    keep = 0;
+    if (r->end > 0) {
+        r->buf[0] = r->buf[r->end - 1];
+        keep = 1;
+    }
+    r->pos = keep;
+    r->end = keep;
+    /* the prompt must show before blocking on a terminal */
+    writer_flush(stdout_writer);
+#if defined(HAVE_MMAP)
+    {
+        ssize_t got;
+
+        /* read answers what is there, a line on a terminal */
+        do {
+            got = read(fileno(r->stream), r->buf + keep,
+                r->capacity - keep);
+        } while (got < 0 && errno == EINTR);
+        n = (got < 0) ? 0 : (size_t)got;
+    }
+#else
+    {
+        int c;
+
+        n = 0;
+        while (keep + n < r->capacity) {
+            c = getc(r->stream);
+            if (c == EOF) {
+                break;
+            }
+            r->buf[keep + n++] = (unsigned char)c;
+            if (c == '\n') {
+                break;
+            }
+        }
+    }
+#endif
+    r->end += n;
+    return n;
+}
+
+int next_char(reader* r) {
+    if (r->pos < r->end || reader_fill(r) > 0) {
+        return r->buf[r->pos++];
+    }
+    return EOF;
+}
+
+int peek(reader* r) {
+    if (r->pos < r->end || reader_fill(r) > 0) {
+        return r->buf[r->pos];
+    }
+    return EOF;
+}
+
+/* c must be the character next_char just answered */
+void unread_char(reader* r, int c) {
+    if (c != EOF) {
+        r->pos--;
+    }
+}
+
+/* copies up to n bytes out of the buffer, answering the count */
+size_t reader_read(reader* r, unsigned char* dest, size_t n) {
+    size_t done;
+    size_t avail;
+
+    done = 0;
+    while (done < n) {
+        if (r->pos == r->end && reader_fill(r) == 0) {
+            break;
+        }
+        avail = r->end - r->pos;
+        if (avail > n - done) {
+            avail = n - done;
+        }
+        memcpy(dest + done, r->buf + r->pos, avail);
+        r->pos += avail;
+        done += avail;
+    }
+    return done;
+}
+
+char is_string(object* obj) {
+    return obj->type == STRING;
+}
+
+object* cons(object* car, object* cdr) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = PAIR;
+    obj->data.pair.car = car;
+    obj->data.pair.cdr = cdr;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_pair(object* obj) {
+    return obj->type == PAIR;
+}
+
+object* car(object* pair) {
+    return pair->data.pair.car;
+}
+
+void set_car(object* obj, object* value) {
+    obj->data.pair.car = value;
+}
+
+object* cdr(object* pair) {
+    return pair->data.pair.cdr;
+}
+
+void set_cdr(object* obj, object* value) {
+    obj->data.pair.cdr = value;
+}
+
+#define caar(obj)   car(car(obj))
+#define cadr(obj)   car(cdr(obj))
+#define cdar(obj)   cdr(car(obj))
+#define cddr(obj)   cdr(cdr(obj))
+#define caaar(obj)  car(car(car(obj)))
+#define caadr(obj)  car(car(cdr(obj)))
+#define cadar(obj)  car(cdr(car(obj)))
+#define caddr(obj)  car(cdr(cdr(obj)))
+#define cdaar(obj)  cdr(car(car(obj)))
+#define cdadr(obj)  cdr(car(cdr(obj)))
+#define cddar(obj)  cdr(cdr(car(obj)))
+#define cdddr(obj)  cdr(cdr(cdr(obj)))
+#define caaaar(obj) car(car(car(car(obj))))
+#define caaadr(obj) car(car(car(cdr(obj))))
+#define caadar(obj) car(car(cdr(car(obj))))
+#define caaddr(obj) car(car(cdr(cdr(obj))))
+#define cadaar(obj) car(cdr(car(car(obj))))
+#define cadadr(obj) car(cdr(car(cdr(obj))))
+#define caddar(obj) car(cdr(cdr(car(obj))))
+#define cadddr(obj) car(cdr(cdr(cdr(obj))))
+#define cdaaar(obj) cdr(car(car(car(obj))))
+#define cdaadr(obj) cdr(car(car(cdr(obj))))
+#define cdadar(obj) cdr(car(cdr(car(obj))))
+#define cdaddr(obj) cdr(car(cdr(cdr(obj))))
+#define cddaar(obj) cdr(cdr(car(car(obj))))
+#define cddadr(obj) cdr(cdr(car(cdr(obj))))
+#define cdddar(obj) cdr(cdr(cdr(car(obj))))
+#define cddddr(obj) cdr(cdr(cdr(cdr(obj))))
+
+/*********************** NUMBER CONVERSION ***********************/
+
+#define NUMBER_BUFFER_MAX 128      /* longest printed number */
+
+/* powers of ten that are exactly representable as doubles */
+static const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+int digit_value(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 10;
+    }
+    return 36;
+}
+
+/* integers in any radix, falling back to a flonum on overflow */
+object* parse_integer(char* str, int radix, short sign) {
+    uint64_t num = 0;
+    double dnum = 0.0;
+    short overflow = 0;
+    int d;
+
+    if (*str == '\0') {
+        return NULL;
+    }
+    while (*str != '\0') {
+        d = digit_value(*str++);
+        if (d >= radix) {
+            return NULL;
+        }
+        if (num > (UINT64_MAX - d) / radix) {
+            overflow = 1;
+        }
+        num = num * radix + d;
+        dnum = dnum * radix + d;
+    }
+    if (!overflow &&
+        (num <= (uint64_t)LONG_MAX ||
+         (sign < 0 && num == (uint64_t)LONG_MAX + 1))) {
+        return make_fixnum(sign < 0 ? (long)(0 - num) : (long)num);
+    }
+    return make_flonum(sign * dnum);
+}
+
+/*
+ * Decimal literals: up to 19 significant digits are gathered in a
+ * 64 bit mantissa. When mantissa and power of ten are both exact
+ * doubles a single multiplication or division is correctly rounded
+ * (Clinger's fast path); otherwise strtod does the exact conversion.
+ */
+object* parse_decimal(char* str, short sign) {
+    char* p = str;
+    uint64_t mant = 0;
+    int digits = 0;
+    int exp10 = 0;
+    int e = 0;
+    short esign = 1;
+    short any = 0;
+    short isflo = 0;
+    short truncated = 0;
+    double dnum;
+
+    while (isdigit((unsigned char)*p)) {
+        any = 1;
+        if (digits < 19) {
+            mant = mant * 10 + (*p - '0');
+            if (mant != 0) {
+                digits++;
+            }
+        }
+        else {
+            exp10++;
+            truncated |= (*p != '0');
+        }
+        p++;
+    }
+    if (*p == '.') {
+        isflo = 1;
+        p++;
+        while (isdigit((unsigned char)*p)) {
+            any = 1;
+            if (digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                if (mant != 0) {
+                    digits++;
+                }
+                exp10--;
+            }
+            else {
+                truncated |= (*p != '0');
+            }
+            p++;
+        }
+    }
+    if (!any) {
+        return NULL;
+    }
+    if (*p == 'e' || *p == 'E') {
+        isflo = 1;
+        p++;
+        if (*p == '+' || *p == '-') {
+            esign = (*p++ == '-') ? -1 : 1;
+        }
+        if (!isdigit((unsigned char)*p)) {
+            return NULL;
+        }
+        while (isdigit((unsigned char)*p)) {
+            if (e < 100000) {
+                e = e * 10 + (*p - '0');
+            }
+            p++;
+        }
+        exp10 += esign * e;
+    }
+    if (*p != '\0') {
+        return NULL;
+    }
+
+    if (!isflo && exp10 == 0 &&
+        (mant <= (uint64_t)LONG_MAX ||
+         (sign < 0 && mant == (uint64_t)LONG_MAX + 1))) {
+        return make_fixnum(sign < 0 ? (long)(0 - mant) : (long)mant);
+    }
+    if (!truncated && mant <= ((uint64_t)1 << 53)) {
+        if (exp10 >= 0 && exp10 <= 22) {
+            return make_flonum(sign * ((double)mant *
+                exact_powers_of_ten[exp10]));
+        }
+        if (exp10 < 0 && exp10 >= -22) {
+            return make_flonum(sign * ((double)mant /
+                exact_powers_of_ten[-exp10]));
+        }
+        if (exp10 > 22 && exp10 <= 22 + 15) {
+            /* move the excess exponent into the mantissa if exact */
+            dnum = (double)mant * exact_powers_of_ten[exp10 - 22];
+            if (dnum <= 9007199254740992.0) {
+                return make_flonum(sign * (dnum *
+                    exact_powers_of_ten[22]));
+            }
+        }
+    }
+    return make_flonum(sign * strtod(str, NULL));
+}
+
+/*
+ * Parses a complete numeric literal: optional #x #b #o #d radix and
+ * #e #i exactness prefixes, a sign, then digits with an optional
+ * fraction and exponent. Also accepts +inf.0, -inf.0 and +nan.0.
+ * Returns NULL when str is not a number.
+ */
+object* parse_number(char* str, int radix) {
+    char exactness = 0;
+    short sign = 1;
+    short has_sign = 0;
+    object* num;
+
+    while (*str == '#') {
+        switch (str[1]) {
+        case 'x': case 'X':
+            radix = 16;
+            break;
+        case 'b': case 'B':
+            radix = 2;
+            break;
+        case 'o': case 'O':
+            radix = 8;
+            break;
+        case 'd': case 'D':
+            radix = 10;
+            break;
+        case 'e': case 'E':
+        case 'i': case 'I':
+            exactness = (char)tolower(str[1]);
+            break;
+        default:
+            return NULL;
+        }
+        str += 2;
+    }
+    if (*str == '+' || *str == '-') {
+        sign = (*str++ == '-') ? -1 : 1;
+        has_sign = 1;
+    }
+    if (has_sign && strcmp(str, "inf.0") == 0) {
+        num = make_flonum(sign * HUGE_VAL);
+    }
+    else if (has_sign && strcmp(str, "nan.0") == 0) {
+        num = make_flonum(NAN);
+    }
+    else if (radix == 10) {
+        num = parse_decimal(str, sign);
+    }
+    else {
+        num = parse_integer(str, radix, sign);
+    }
+
+    if (num == NULL || exactness == 0) {
+        return num;
+    }
+    if (exactness == 'i' && is_fixnum(num)) {
+        return make_flonum((double)num->data.fixnum.value);
+    }
+    if (exactness == 'e' && is_flonum(num)) {
+        /* no rationals: only integral values have an exact form */
+        if (num->data.flonum.value != floor(num->data.flonum.value) ||
+            fabs(num->data.flonum.value) > (double)LONG_MAX) {
+            return NULL;
+        }
+        return make_fixnum((long)num->data.flonum.value);
+    }
+    return num;
+}
+
+int format_fixnum(char* buffer, long value, int radix) {
+    char digits[72];
+    unsigned long mag;
+    int i = 0;
+    int len = 0;
+
+    mag = (value < 0) ? 0UL - (unsigned long)value : (unsigned long)value;
+    do {
+        digits[i++] = "0123456789abcdefghijklmnopqrstuvwxyz"[mag % radix];
+        mag /= radix;
+    } while (mag != 0);
+    if (value < 0) {
+        buffer[len++] = '-';
+    }
+    while (i > 0) {
+        buffer[len++] = digits[--i];
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+/*
+ * Flonum printing with Grisu2 (Loitsch, "Printing floating-point
+ * numbers quickly and accurately with integers"). The digits always
+ * read back to the same double and are the shortest such digits for
+ * all but about 0.1% of values, which get one digit more.
+ * A diy_fp is f * 2^e with a 64 bit significand.
+ */
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+static const unsigned long long cached_powers_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+diy_fp diy_fp_sub(diy_fp x, diy_fp y) {
+    diy_fp r;
+
+    r.f = x.f - y.f;
+    r.e = x.e;
+    return r;
+}
+
+diy_fp diy_fp_mul(diy_fp x, diy_fp y) {
+    const uint64_t m32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & m32;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & m32;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    diy_fp r;
+
+    tmp += 1U << 31; /* round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+diy_fp diy_fp_normalize(diy_fp x) {
+    while (!(x.f & ((uint64_t)1 << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+diy_fp diy_fp_from_double(double value) {
+    const uint64_t hidden_bit = (uint64_t)1 << 52;
+    uint64_t bits;
+    int biased_e;
+    diy_fp r;
+
+    memcpy(&bits, &value, sizeof(bits));
+    biased_e = (int)((bits >> 52) & 0x7FF);
+    r.f = bits & (hidden_bit - 1);
+    if (biased_e != 0) {
+        r.f += hidden_bit;
+        r.e = biased_e - 1075;
+    }
+    else {
+        r.e = -1074; /* subnormal */
+    }
+    return r;
+}
+
+/* the boundaries m- and m+ halfway to the neighbouring doubles */
+void diy_fp_boundaries(diy_fp v, diy_fp* minus, diy_fp* plus) {
+    const uint64_t hidden_bit = (uint64_t)1 << 52;
+    diy_fp pl;
+    diy_fp mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    pl = diy_fp_normalize(pl);
+    if (v.f == hidden_bit) {
+        /* lower neighbour is closer when crossing a power of two */
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    }
+    else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+/* cached 10^-k such that the product lands in a 64 bit window */
+diy_fp cached_power(int e, int* k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    unsigned index;
+    diy_fp r;
+
+    if (dk - ik > 0.0) {
+        ik++;
+    }
+    index = (unsigned)((ik >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+    r.f = cached_powers_f[index];
+    r.e = cached_powers_e[index];
+    return r;
+}
+
+static const uint64_t powers_of_ten[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+void grisu_round(char* buffer, int len, uint64_t delta, uint64_t rest,
+    uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+void grisu_digits(diy_fp w, diy_fp mp, uint64_t delta,
+    char* buffer, int* len, int* k) {
+    diy_fp one;
+    diy_fp wp_w;
+    uint32_t p1;
+    uint64_t p2;
+    uint64_t tmp;
+    uint32_t d;
+    int kappa;
+
+    one.f = (uint64_t)1 << -mp.e;
+    one.e = mp.e;
+    wp_w = diy_fp_sub(mp, w);
+    p1 = (uint32_t)(mp.f >> -one.e);
+    p2 = mp.f & (one.f - 1);
+
+    kappa = 10;
+    while (kappa > 1 && p1 < (uint32_t)powers_of_ten[kappa - 1]) {
+        kappa--;
+    }
+    *len = 0;
+    while (kappa > 0) {
+        d = p1 / (uint32_t)powers_of_ten[kappa - 1];
+        p1 %= (uint32_t)powers_of_ten[kappa - 1];
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *k += kappa;
+            grisu_round(buffer, *len, delta, tmp,
+                powers_of_ten[kappa] << -one.e, wp_w.f);
+            return;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buffer, *len, delta, p2, one.f,
+                wp_w.f * (-kappa < 20 ? powers_of_ten[-kappa] : 0));
+            return;
+        }
+    }
+}
+
+/* shortest digits of a positive finite value: value = digits * 10^k */
+void grisu2(double value, char* buffer, int* len, int* k) {
+    diy_fp v;
+    diy_fp w_m;
+    diy_fp w_p;
+    diy_fp c_mk;
+    diy_fp w;
+
+    v = diy_fp_from_double(value);
+    diy_fp_boundaries(v, &w_m, &w_p);
+    c_mk = cached_power(w_p.e, k);
+    w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+    w_p = diy_fp_mul(w_p, c_mk);
+    w_m = diy_fp_mul(w_m, c_mk);
+    w_m.f++;
+    w_p.f--;
+    grisu_digits(w, w_p, w_p.f - w_m.f, buffer, len, k);
+}
+
+/* lays the digits out the way the reader expects to find them */
+int format_flonum(char* buffer, double value) {
+    char digits[32];
+    char* p = buffer;
+    int len;
+    int k;
+    int kk;
+    int i;
+
+    if (isnan(value)) {
+        strcpy(buffer, "+nan.0");
+        return 6;
+    }
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    else if (isinf(value)) {
+        *p++ = '+';
+    }
+    if (isinf(value)) {
+        strcpy(p, "inf.0");
+        return (int)(p - buffer) + 5;
+    }
+    if (value == 0.0) {
+        strcpy(p, "0.0");
+        return (int)(p - buffer) + 3;
+    }
+
+    grisu2(value, digits, &len, &k);
+    kk = len + k; /* 10^(kk-1) <= value < 10^kk */
+
+    if (k >= 0 && kk <= 21) {
+        /* 1234e7 -> 12340000000.0 */
+        memcpy(p, digits, len);
+        p += len;
+        for (i = 0; i < k; i++) {
+            *p++ = '0';
+        }
+        *p++ = '.';
+        *p++ = '0';
+    }
+    else if (kk > 0 && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memcpy(p, digits, kk);
+        p += kk;
+        *p++ = '.';
+        memcpy(p, digits + kk, len - kk);
+        p += len - kk;
+    }
+    else if (kk > -6 && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        *p++ = '0';
+        *p++ = '.';
+        for (i = kk; i < 0; i++) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, len);
+        p += len;
+    }
+    else {
+        /* 1234e30 -> 1.234e33 */
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        p += sprintf(p, "e%d", kk - 1);
+    }
+    *p = '\0';
+    return (int)(p - buffer);
+}
+
+/* the external representation of any number, as written by swrite */
+int format_number(char* buffer, object* obj, int radix) {
+    int len;
+
+    switch (obj->type) {
+    case FIXNUM:
+        return format_fixnum(buffer, obj->data.fixnum.value, radix);
+    case FLONUM:
+        return format_flonum(buffer, obj->data.flonum.value);
+    case CPXNUM:
+        if (cimag(obj->data.cpxnum.value) == 0.0) {
+            return format_flonum(buffer, creal(obj->data.cpxnum.value));
+        }
+        len = sprintf(buffer, "#C(");
+        len += format_flonum(buffer + len, creal(obj->data.cpxnum.value));
+        buffer[len++] = ' ';
+        len += format_flonum(buffer + len, cimag(obj->data.cpxnum.value));
+        buffer[len++] = ')';
+        buffer[len] = '\0';
+        return len;
+    default:
+        buffer[0] = '\0';
+        return 0;
+    }
+}
+
+object* make_primitive(object* (*fn)(struct object* args)) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = PRIMITIVE_PROC;
+    obj->data.primitive_proc.fn = fn;
+    obj->data.primitive_proc.inline_op = 0;
+    push(the_vm, obj);
+    return obj;
+}
+
+object* make_inline_primitive(object* (*fn)(struct object* args),
+    int op) {
+    object* obj;
+
+    obj = make_primitive(fn);
+    obj->data.primitive_proc.inline_op = op;
+    return obj;
+}
+
+char is_primitive(object* obj) {
+    return obj->type == PRIMITIVE_PROC;
+}
+
+object* is_null_proc(object* arguments) {
+    return is_nil(car(arguments)) ? true : false;
+}
+
+object* is_boolean_proc(object* arguments) {
+    return is_boolean(car(arguments)) ? true : false;
+}
+
+object* is_symbol_proc(object* arguments) {
+    return is_symbol(car(arguments)) ? true : false;
+}
+
+char is_number(object* obj) {
+    return ((obj->type == FIXNUM) ||
+            (obj->type == FLONUM) ||
+            (obj->type == CPXNUM));
+}
+
+object* is_integer_proc(object* arguments) {
+    return is_fixnum(car(arguments)) ? true : false;
+}
+
+object* is_real_proc(object* arguments) {
+    return is_flonum(car(arguments)) ? true : false;
+}
+
+object* is_complex_proc(object* arguments) {
+    return is_number(car(arguments)) ? true : false;
+}
+
+object* is_char_proc(object* arguments) {
+    return is_character(car(arguments)) ? true : false;
+}
+
+object* is_string_proc(object* arguments) {
+    return is_string(car(arguments)) ? true : false;
+}
+
+object* is_pair_proc(object* arguments) {
+    return is_pair(car(arguments)) ? true : false;
+}
+
+char is_compound_proc(object* obj); /* forward declaration */
+
+object* is_procedure_proc(object* arguments) {
+    object* obj;
+
+    obj = car(arguments);
+    return (is_primitive(obj) ||
+            is_compound_proc(obj) ||
+            obj->type == RECORD_PROC) ?
               true :
               false;
 }
 
-object* char_to_integer_proc(object* arguments) {
-    return make_fixnum((car(arguments))->data.character.value);
+object* char_to_integer_proc(object* arguments) {
+    return make_fixnum((car(arguments))->data.character.value);
+}
+
+object* integer_to_char_proc(object* arguments) {
+    return make_character((char)(car(arguments))->data.fixnum.value);
+}
+
+int radix_argument(object* arguments) {
+    int radix;
+
+    if (is_nil(arguments)) {
+        return 10;
+    }
+    radix = (int)(car(arguments))->data.fixnum.value;
+    if (radix != 2 && radix != 8 && radix != 10 && radix != 16) {
+        diagnostic("*** unsupported radix %d\n", radix);
+        exit(1);
+    }
+    return radix;
+}
+
+object* number_to_string_proc(object* arguments) {
+    char buffer[NUMBER_BUFFER_MAX];
+
+    format_number(buffer, car(arguments), radix_argument(cdr(arguments)));
+    return make_string(buffer);
+}
+
+object* string_to_number_proc(object* arguments) {
+    object* num;
+
+    num = parse_number((car(arguments))->data.string.value,
+        radix_argument(cdr(arguments)));
+    return (num == NULL) ? false : num;
+}
+
+object* symbol_to_string_proc(object* arguments) {
+    return make_string((car(arguments))->data.symbol.value);
+}
+
+object* string_to_symbol_proc(object* arguments) {
+    return make_symbol((car(arguments))->data.string.value);
+}
+
+object* string_argument(object* obj) {
+    if (!is_string(obj)) {
+        diagnostic("*** expected a string\n");
+        exit(1);
+    }
+    return obj;
+}
+
+long string_index(object* str, object* index) {
+    long i;
+
+    i = fixnum_argument(index);
+    if (i < 0 || i >= str->data.string.length) {
+        diagnostic("*** string index %ld out of range\n", i);
+        exit(1);
+    }
+    return i;
+}
+
+/* -1, 0 or 1 as a is before, equal to or after b */
+int string_compare(object* a, object* b) {
+    long n;
+    int c;
+
+    n = (a->data.string.length < b->data.string.length) ?
+        a->data.string.length : b->data.string.length;
+    c = memcmp(a->data.string.value, b->data.string.value, n);
+    if (c != 0) {
+        return (c < 0) ? -1 : 1;
+    }
+    return (a->data.string.length < b->data.string.length) ? -1 :
+           (a->data.string.length > b->data.string.length) ? 1 : 0;
+}
+
+object* make_string_proc(object* arguments) {
+    object* str;
+    long length;
+
+    length = fixnum_argument(car(arguments));
+    if (length < 0) {
+        diagnostic("*** invalid string length %ld\n", length);
+        exit(1);
+    }
+    str = make_string_n(NULL, length);
+    memset(str->data.string.value,
+        is_nil(cdr(arguments)) ? ' ' : cadr(arguments)->data.character.value,
+        length);
+    return str;
+}
+
+object* string_proc(object* arguments) {
+    object* str;
+    long length = 0;
+    long i;
+
+    for (str = arguments; !is_nil(str); str = cdr(str)) {
+        length++;
+    }
+    str = make_string_n(NULL, length);
+    for (i = 0; i < length; i++) {
+        str->data.string.value[i] = car(arguments)->data.character.value;
+        arguments = cdr(arguments);
+    }
+    return str;
+}
+
+object* string_length_proc(object* arguments) {
+    return make_fixnum(string_argument(car(arguments))->data.string.length);
+}
+
+object* string_ref_proc(object* arguments) {
+    object* str;
+
+    str = string_argument(car(arguments));
+    return make_character(
+        str->data.string.value[string_index(str, cadr(arguments))]);
+}
+
+object* string_set_proc(object* arguments) {
+    object* str;
+
+    str = string_argument(car(arguments));
+    str->data.string.value[string_index(str, cadr(arguments))] =
+        caddr(arguments)->data.character.value;
+    return ok_symbol;
+}
+
+/* (substring str start [end]), also string-copy with optional range */
+object* substring_proc(object* arguments) {
+    object* str;
+    long start = 0;
+    long end;
+
+    str = string_argument(car(arguments));
+    end = str->data.string.length;
+    if (!is_nil(cdr(arguments))) {
+        start = fixnum_argument(cadr(arguments));
+        if (!is_nil(cddr(arguments))) {
+            end = fixnum_argument(caddr(arguments));
+        }
+    }
+    if (start < 0 || end > str->data.string.length || start > end) {
+        diagnostic("*** string range %ld..%ld out of bounds\n",
+            start, end);
+        exit(1);
+    }
+    return make_string_n(str->data.string.value + start, end - start);
+}
+
+object* string_append_proc(object* arguments) {
+    object* result;
+    object* args;
+    long length = 0;
+    long at = 0;
+
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        length += string_argument(car(args))->data.string.length;
+    }
+    result = make_string_n(NULL, length);
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        memcpy(result->data.string.value + at, car(args)->data.string.value,
+            car(args)->data.string.length);
+        at += car(args)->data.string.length;
+    }
+    return result;
+}
+
+object* string_equal_proc(object* arguments) {
+    object* first;
+
+    first = string_argument(car(arguments));
+    while (!is_nil(arguments = cdr(arguments))) {
+        if (string_compare(first, string_argument(car(arguments))) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+object* string_ordered(object* arguments, int order) {
+    object* previous;
+
+    previous = string_argument(car(arguments));
+    while (!is_nil(arguments = cdr(arguments))) {
+        if (string_compare(previous, string_argument(car(arguments))) !=
+            order) {
+            return false;
+        }
+        previous = car(arguments);
+    }
+    return true;
+}
+
+object* string_lessthan_proc(object* arguments) {
+    return string_ordered(arguments, -1);
+}
+
+object* string_greatthan_proc(object* arguments) {
+    return string_ordered(arguments, 1);
+}
+
+/* string builders: append in amortized O(1), then take the string */
+
+object* make_string_builder(void) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = STRING_BUILDER;
+    strbuf_init(&obj->data.builder);
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_string_builder(object* obj) {
+    return obj->type == STRING_BUILDER;
+}
+
+object* string_builder_proc(object* arguments) {
+    return make_string_builder();
+}
+
+/* (builder-add! builder string-or-char) */
+object* builder_add_proc(object* arguments) {
+    object* builder;
+    object* item;
+
+    builder = car(arguments);
+    item = cadr(arguments);
+    if (!is_string_builder(builder)) {
+        diagnostic("*** expected a string builder\n");
+        exit(1);
+    }
+    if (is_character(item)) {
+        strbuf_add_char(&builder->data.builder, item->data.character.value);
+    }
+    else {
+        strbuf_add(&builder->data.builder,
+            string_argument(item)->data.string.value,
+            item->data.string.length);
+    }
+    return ok_symbol;
+}
+
+object* builder_length_proc(object* arguments) {
+    return make_fixnum(car(arguments)->data.builder.length);
+}
+
+object* builder_to_string_proc(object* arguments) {
+    object* builder;
+
+    builder = car(arguments);
+    if (!is_string_builder(builder)) {
+        diagnostic("*** expected a string builder\n");
+        exit(1);
+    }
+    return make_string_n(builder->data.builder.data,
+        builder->data.builder.length);
+}
+
+object* add_proc(object* args) {
+    long result = 0;
+    double dresult = 0;
+    double re = 0.0;
+    double im = 0.0;
+    short op_type = 0;
+
+    while (!is_nil(args)) {
+        if (is_fixnum(car(args))) {
+            result += (car(args))->data.fixnum.value;
+        }
+        else if (is_flonum(car(args))) {
+            dresult += (car(args))->data.flonum.value;
+            op_type = 1;
+        }
+        else if (is_cpxnum(car(args))) {
+            re += creal((car(args))->data.cpxnum.value);
+            im += cimag((car(args))->data.cpxnum.value);
+            op_type = 2;
+        }
+        args = cdr(args);
+    }
+    switch (op_type) {
+    case 0:
+        return make_fixnum(result);
+        break;
+    case 1:
+        dresult += (double)result;
+        return make_flonum(dresult);
+        break;
+    case 2:
+        re += (double)result;
+        re += dresult;
+        return make_cpxnum(re, im);
+        break;
+    default:
+        return nil;
+    }
+}
+
+object* sub_proc(object* args) {
+    long result = 0;
+    double dresult = 0;
+    double re = 0.0;
+    double im = 0.0;
+    short op_type = 0;
+
+    if (is_fixnum(car(args))) {
+        result = (car(args))->data.fixnum.value;
+    }
+    else if (is_flonum(car(args))) {
+        dresult = (car(args))->data.flonum.value;
+        op_type = 1;
+    }
+    else if (is_cpxnum(car(args))) {
+        re = creal((car(args))->data.cpxnum.value);
+        im = cimag((car(args))->data.cpxnum.value);
+        op_type = 2;
+    }
+    while (!is_nil(args = cdr(args))) {
+        if (is_fixnum(car(args))) {
+            result -= (car(args))->data.fixnum.value;
+        }
+        else if (is_flonum(car(args))) {
+            dresult -= (car(args))->data.flonum.value;
+            op_type = 1;
+        }
+        else if (is_cpxnum(car(args))) {
+            re -= creal((car(args))->data.cpxnum.value);
+            im -= cimag((car(args))->data.cpxnum.value);
+            op_type = 2;
+        }
+    }
+    switch (op_type) {
+    case 0:
+        return make_fixnum(result);
+        break;
+    case 1:
+        dresult += (double)result;
+        return make_flonum(dresult);
+        break;
+    case 2:
+        re += (double)result;
+        re += dresult;
+        return make_cpxnum(re, im);
+        break;
+    default:
+        return nil;
+    }
+}
+
+object* mul_proc(object* args) {
+    long result = 1;
+    double dresult = 1;
+    double re = 1.0;
+    double im = 1.0;
+    sComplex cresult;
+    short op_type = 0;
+    short full_cpx = 1;
+
+    cresult = _Cbuild(1.0, 0.0);
+
+    while (!is_nil(args)) {
+        if (is_fixnum(car(args))) {
+            result *= (car(args))->data.fixnum.value;
+            full_cpx &= 0;
+        }
+        else if (is_flonum(car(args))) {
+            dresult *= (car(args))->data.flonum.value;
+            op_type = 1;
+            full_cpx &= 0;
+        }
+        else if (is_cpxnum(car(args))) {
+#if defined(_MSC_VER)
+            cresult = _Cmulcc(cresult, (car(args))->data.cpxnum.value);
+#else
+            cresult *= (car(args))->data.cpxnum.value;
+#endif
+            op_type = 2;
+            full_cpx &= 1;
+        }
+        args = cdr(args);
+    }
+    switch (op_type) {
+    case 0:
+        return make_fixnum(result);
+        break;
+    case 1:
+        dresult *= (double)result;
+        return make_flonum(dresult);
+        break;
+    case 2:
+        if (full_cpx) {
+            return make_cpxnum2(cresult);
+        }
+        else {
+            re *= (double)result;
+            re *= dresult;
+#if defined(_MSC_VER)
+            cresult = _Cmulcr(cresult, re);
+#else
+            cresult *= re;
+#endif
+            return make_cpxnum2(cresult);
+        }
+        break;
+    default:
+        return nil;
+    }
+}
+
+object* quotient_proc(object* arguments) {
+    return make_fixnum(
+        ((car(arguments))->data.fixnum.value) /
+        ((cadr(arguments))->data.fixnum.value));
+}
+
+object* remainder_proc(object* arguments) {
+    return make_fixnum(
+        ((car(arguments))->data.fixnum.value) %
+        ((cadr(arguments))->data.fixnum.value));
+}
+
+sComplex cinv(sComplex z1) {
+    return _Cmulcr(conj(z1), 1.0/pow(cabs(z1),2));
+}
+
+object* div_proc(object* args) {
+    double result = 1.0;
+    double dresult = 1.0;
+    double re = 1.0;
+    double im = 1.0;
+    sComplex cresult;
+    short op_type = 0;
+    short full_cpx = 1;
+
+    cresult = _Cbuild(1.0, 0.0);
+
+    if (is_fixnum(car(args))) {
+        result = (double)(car(args))->data.fixnum.value;
+        full_cpx &= 0;
+    }
+    else if (is_flonum(car(args))) {
+        dresult = (car(args))->data.flonum.value;
+        op_type = 1;
+        full_cpx &= 0;
+    }
+    else if (is_cpxnum(car(args))) {
+        cresult = (car(args))->data.cpxnum.value;
+        op_type = 2;
+        full_cpx &= 1;
+    }
+
+    while (!is_nil(args = cdr(args))) {
+        if (is_fixnum(car(args))) {
+            result /= (double)(car(args))->data.fixnum.value;
+            full_cpx &= 0;
+        }
+        else if (is_flonum(car(args))) {
+            dresult /= (car(args))->data.flonum.value;
+            op_type = 1;
+            full_cpx &= 0;
+        }
+        else if (is_cpxnum(car(args))) {
+            cresult = _Cmulcc(cresult, cinv((car(args))->data.cpxnum.value));
+            op_type = 2;
+            full_cpx &= 1;
+        }
+    }
+
+    switch (op_type) {
+    case 0:
+        return make_fixnum((long)result);
+        break;
+    case 1:
+        dresult *= result;
+        return make_flonum(dresult);
+        break;
+    case 2:
+        if (full_cpx) {
+            return make_cpxnum2(cresult);
+        }
+        else {
+            re *= result;
+            re *= dresult;
+#if defined(_MSC_VER)
+            cresult = _Cmulcr(cresult, re);
+#else
+            cresult *= re;
+#endif
+            return make_cpxnum2(cresult);
+        }
+        break;
+    default:
+        return nil;
+    }
+}
+
+object* is_numbeq_proc(object* arguments) {
+    long value = 0;
+    double dvalue = 0.0;
+    double re = 0.0;
+    double im = 0.0;
+    object_type type;
+    
+    type = (car(arguments))->type;
+
+    switch (type) {
+    case FIXNUM:
+        value = (car(arguments))->data.fixnum.value;
+        break;
+    case FLONUM:
+        dvalue = (car(arguments))->data.flonum.value;
+        break;
+    default:
+        re = creal((car(arguments))->data.cpxnum.value);
+        im = cimag((car(arguments))->data.cpxnum.value);
+    }
+    
+    while (!is_nil(arguments = cdr(arguments))) {
+        if (type != (car(arguments))->type) {
+            /* cannot compare different number types */
+            return false;
+        }
+        switch (type) {
+        case FIXNUM:
+            if (value != ((car(arguments))->data.fixnum.value)) {
+                return false;
+            }
+            break;
+        case FLONUM:
+            if (dvalue != ((car(arguments))->data.flonum.value)) {
+                return false;
+            }
+            break;
+        default:
+            if ((re != creal((car(arguments))->data.cpxnum.value)) &&
+                (im != cimag((car(arguments))->data.cpxnum.value))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+object* is_lessthan_proc(object* arguments) {
+    double previous;
+    double next;
+    object_type type;
+
+    type = (car(arguments))->type;
+
+    switch (type) {
+    case FIXNUM:
+        previous = (double)(car(arguments))->data.fixnum.value;
+        break;
+    case FLONUM:
+        previous = (car(arguments))->data.flonum.value;
+        break;
+    default:
+        diagnostic("*** comparison is not defined for this type\n");
+        exit(1);
+    }
+    
+    while (!is_nil(arguments = cdr(arguments))) {
+        type = (car(arguments))->type;
+
+        switch (type) {
+        case FIXNUM:
+            next = (double)(car(arguments))->data.fixnum.value;
+            break;
+        case FLONUM:
+            next = (car(arguments))->data.fixnum.value;
+            break;
+        default:
+            diagnostic("*** comparison is not defined for this type\n");
+            exit(1);
+        }
+        
+        if (previous < next) {
+            previous = next;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+object* is_greatthan_proc(object* arguments) {
+    double previous;
+    double next;
+    object_type type;
+
+    type = (car(arguments))->type;
+
+    switch (type) {
+    case FIXNUM:
+        previous = (double)(car(arguments))->data.fixnum.value;
+        break;
+    case FLONUM:
+        previous = (car(arguments))->data.flonum.value;
+        break;
+    default:
+        diagnostic("*** comparison is not defined for this type\n");
+        exit(1);
+    }
+
+    while (!is_nil(arguments = cdr(arguments))) {
+        type = (car(arguments))->type;
+
+        switch (type) {
+        case FIXNUM:
+            next = (double)(car(arguments))->data.fixnum.value;
+            break;
+        case FLONUM:
+            next = (car(arguments))->data.fixnum.value;
+            break;
+        default:
+            diagnostic("*** comparison is not defined for this type\n");
+            exit(1);
+        }
+
+        if (previous > next) {
+            previous = next;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* elementary functions: exact in, exact out wherever possible */
+
+sComplex make_complex(double re, double im) {
+#if defined(_MSC_VER)
+    return _Cbuild(re, im);
+#else
+    return CMPLX(re, im);
+#endif
+}
+
+double real_value(object* obj) {
+    switch (obj->type) {
+    case FIXNUM:
+        return (double)obj->data.fixnum.value;
+    case FLONUM:
+        return obj->data.flonum.value;
+    default:
+        diagnostic("*** expected a real number\n");
+        exit(1);
+    }
+}
+
+sComplex complex_value(object* obj) {
+    if (is_cpxnum(obj)) {
+        return obj->data.cpxnum.value;
+    }
+    return make_complex(real_value(obj), 0.0);
+}
+
+sComplex cdiv(sComplex z1, sComplex z2) {
+#if defined(_MSC_VER)
+    return _Cmulcc(z1, cinv(z2));
+#else
+    return z1 / z2;
+#endif
+}
+
+/* exact product of two fixnums; sets *overflow when it does not fit */
+long fixnum_mul(long a, long b, short* overflow) {
+    if (a != 0 && b != 0 &&
+        ((a > 0 && b > 0 && a > LONG_MAX / b) ||
+         (a > 0 && b < 0 && b < LONG_MIN / a) ||
+         (a < 0 && b > 0 && a < LONG_MIN / b) ||
+         (a < 0 && b < 0 && a < LONG_MAX / b))) {
+        *overflow = 1;
+        return 0;
+    }
+    return a * b;
+}
+
+/*
+ * Applies fn on reals in [lo, hi] and the complex variant cfn
+ * anywhere else, so (sqrt -4) and (log -1) give complex results.
+ */
+object* elementary(object* arg, double (*fn)(double),
+    sComplex (*cfn)(sComplex), double lo, double hi) {
+    double x;
+
+    if (is_cpxnum(arg)) {
+        return make_cpxnum2(cfn(arg->data.cpxnum.value));
+    }
+    x = real_value(arg);
+    if (x < lo || x > hi) {
+        return make_cpxnum2(cfn(make_complex(x, 0.0)));
+    }
+    return make_flonum(fn(x));
+}
+
+/* the floor of the square root of m. The double estimate can be one
+ * off for large values, so it is corrected with division, which
+ * cannot overflow or round the way squaring in doubles does */
+unsigned long fixnum_isqrt(unsigned long m) {
+    unsigned long r;
+
+    r = (unsigned long)sqrt((double)m);
+    while (r > 0 && r > m / r) {
+        r--;
+    }
+    while (r + 1 <= m / (r + 1)) {
+        r++;
+    }
+    return r;
+}
+
+object* sqrt_proc(object* arguments) {
+    object* arg;
+    unsigned long m;
+    unsigned long r;
+    long n;
+
+    arg = car(arguments);
+    if (is_fixnum(arg)) {
+        n = arg->data.fixnum.value;
+        m = (n < 0) ? -(unsigned long)n : (unsigned long)n;
+        r = fixnum_isqrt(m);
+        if (r * r == m) {
+            return (n >= 0) ? make_fixnum((long)r) :
+                make_cpxnum(0.0, (double)r);
+        }
+    }
+    return elementary(arg, sqrt, csqrt, 0.0, HUGE_VAL);
+}
+
+/* no multiple values: the root and the remainder come back as a list */
+object* exact_integer_sqrt_proc(object* arguments) {
+    long n;
+    long r;
+
+    if (!is_fixnum(car(arguments)) ||
+        (n = (car(arguments))->data.fixnum.value) < 0) {
+        diagnostic("*** exact-integer-sqrt: "
+            "expected a non-negative integer\n");
+        exit(1);
+    }
+    r = (long)fixnum_isqrt((unsigned long)n);
+    return cons(make_fixnum(r), cons(make_fixnum(n - r * r), nil));
+}
+
+object* exp_proc(object* arguments) {
+    return elementary(car(arguments), exp, cexp, -HUGE_VAL, HUGE_VAL);
+}
+
+object* log_proc(object* arguments) {
+    object* z;
+    object* base;
+    double x;
+    double b;
+
+    z = car(arguments);
+    if (is_nil(cdr(arguments))) {
+        return elementary(z, log, clog, 0.0, HUGE_VAL);
+    }
+    base = cadr(arguments);
+    if (!is_cpxnum(z) && !is_cpxnum(base)) {
+        x = real_value(z);
+        b = real_value(base);
+        if (x >= 0.0 && b > 0.0) {
+            return make_flonum(log(x) / log(b));
+        }
+    }
+    return make_cpxnum2(cdiv(clog(complex_value(z)),
+        clog(complex_value(base))));
+}
+
+object* sin_proc(object* arguments) {
+    return elementary(car(arguments), sin, csin, -HUGE_VAL, HUGE_VAL);
+}
+
+object* cos_proc(object* arguments) {
+    return elementary(car(arguments), cos, ccos, -HUGE_VAL, HUGE_VAL);
+}
+
+object* tan_proc(object* arguments) {
+    return elementary(car(arguments), tan, ctan, -HUGE_VAL, HUGE_VAL);
+}
+
+object* asin_proc(object* arguments) {
+    return elementary(car(arguments), asin, casin, -1.0, 1.0);
+}
+
+object* acos_proc(object* arguments) {
+    return elementary(car(arguments), acos, cacos, -1.0, 1.0);
+}
+
+object* atan_proc(object* arguments) {
+    if (is_nil(cdr(arguments))) {
+        return elementary(car(arguments), atan, catan,
+            -HUGE_VAL, HUGE_VAL);
+    }
+    return make_flonum(atan2(real_value(car(arguments)),
+        real_value(cadr(arguments))));
+}
+
+/*
+ * Batch forms: vector-map and matrix-map recognise the one argument
+ * elementary primitives and run fn straight over the doubles instead
+ * of calling the procedure once per element.
+ */
+
+typedef struct batch_elementary {
+    object* (*proc)(object* arguments);
+    double (*fn)(double);
+    sComplex (*cfn)(sComplex);
+    double lo;
+    double hi;
+} batch_elementary;
+
+batch_elementary batch_elementaries[] = {
+    { sqrt_proc, sqrt, csqrt, 0.0, HUGE_VAL },
+    { exp_proc, exp, cexp, -HUGE_VAL, HUGE_VAL },
+    { log_proc, log, clog, 0.0, HUGE_VAL },
+    { sin_proc, sin, csin, -HUGE_VAL, HUGE_VAL },
+    { cos_proc, cos, ccos, -HUGE_VAL, HUGE_VAL },
+    { tan_proc, tan, ctan, -HUGE_VAL, HUGE_VAL },
+    { asin_proc, asin, casin, -1.0, 1.0 },
+    { acos_proc, acos, cacos, -1.0, 1.0 },
+    { atan_proc, atan, catan, -HUGE_VAL, HUGE_VAL }
+};
+
+/* the entry for proc, or NULL when it has no batch form */
+batch_elementary* find_batch_elementary(object* proc) {
+    size_t i;
+
+    if (!is_primitive(proc)) {
+        return NULL;
+    }
+    for (i = 0; i < sizeof(batch_elementaries) /
+         sizeof(batch_elementaries[0]); i++) {
+        if (batch_elementaries[i].proc == proc->data.primitive_proc.fn) {
+            return &batch_elementaries[i];
+        }
+    }
+    return NULL;
+}
+
+/* 1 when all n doubles lie in the real domain [lo, hi] of b */
+char batch_in_domain(batch_elementary* b, double* x, long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        if (x[i] < b->lo || x[i] > b->hi) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* x = fn(x) in place; square roots take two at a time with SSE2 */
+void batch_apply(batch_elementary* b, double* x, long n) {
+    long i = 0;
+
+#if defined(HAVE_SSE2)
+    if (b->proc == sqrt_proc) {
+        for (; i + 2 <= n; i += 2) {
+            _mm_storeu_pd(x + i, _mm_sqrt_pd(_mm_loadu_pd(x + i)));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] = b->fn(x[i]);
+    }
+}
+
+/* z = cfn(z) in place over n (re, im) pairs */
+void batch_apply_complex(batch_elementary* b, double* z, long n) {
+    sComplex w;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        w = b->cfn(make_complex(z[2 * i], z[2 * i + 1]));
+        z[2 * i] = creal(w);
+        z[2 * i + 1] = cimag(w);
+    }
+}
+
+object* expt_proc(object* arguments) {
+    object* z1;
+    object* z2;
+    long base;
+    long e;
+    long result = 1;
+    short overflow = 0;
+    double x;
+    double y;
+
+    z1 = car(arguments);
+    z2 = cadr(arguments);
+    if (is_fixnum(z1) && is_fixnum(z2) && z2->data.fixnum.value >= 0) {
+        /* exact power by repeated squaring */
+        base = z1->data.fixnum.value;
+        e = z2->data.fixnum.value;
+        while (e > 0 && !overflow) {
+            if (e & 1) {
+                result = fixnum_mul(result, base, &overflow);
+            }
+            e >>= 1;
+            if (e > 0) {
+                base = fixnum_mul(base, base, &overflow);
+            }
+        }
+        if (!overflow) {
+            return make_fixnum(result);
+        }
+    }
+    if (!is_cpxnum(z1) && !is_cpxnum(z2)) {
+        x = real_value(z1);
+        y = real_value(z2);
+        if (x >= 0.0 || y == floor(y)) {
+            return make_flonum(pow(x, y));
+        }
+    }
+    return make_cpxnum2(cpow(complex_value(z1), complex_value(z2)));
+}
+
+object* square_proc(object* arguments) {
+    object* z;
+    sComplex c;
+    long result;
+    short overflow = 0;
+
+    z = car(arguments);
+    switch (z->type) {
+    case FIXNUM:
+        result = fixnum_mul(z->data.fixnum.value, z->data.fixnum.value,
+            &overflow);
+        if (!overflow) {
+            return make_fixnum(result);
+        }
+        return make_flonum((double)z->data.fixnum.value *
+            (double)z->data.fixnum.value);
+    case FLONUM:
+        return make_flonum(z->data.flonum.value * z->data.flonum.value);
+    case CPXNUM:
+        c = z->data.cpxnum.value;
+        return make_cpxnum(creal(c) * creal(c) - cimag(c) * cimag(c),
+            2.0 * creal(c) * cimag(c));
+    default:
+        diagnostic("*** square: expected a number\n");
+        exit(1);
+    }
+}
+
+/* the magnitude, for complex numbers too */
+object* abs_proc(object* arguments) {
+    object* x;
+
+    x = car(arguments);
+    if (is_cpxnum(x)) {
+        return make_flonum(cabs(x->data.cpxnum.value));
+    }
+    if (is_fixnum(x)) {
+        if (x->data.fixnum.value == LONG_MIN) {
+            return make_flonum(-(double)LONG_MIN);
+        }
+        return (x->data.fixnum.value < 0) ?
+            make_fixnum(-x->data.fixnum.value) :
+            x;
+    }
+    return make_flonum(fabs(real_value(x)));
+}
+
+object* rounding(object* x, double (*fn)(double)) {
+    if (is_fixnum(x)) {
+        return x;
+    }
+    return make_flonum(fn(real_value(x)));
+}
+
+object* floor_proc(object* arguments) {
+    return rounding(car(arguments), floor);
+}
+
+object* ceiling_proc(object* arguments) {
+    return rounding(car(arguments), ceil);
+}
+
+object* truncate_proc(object* arguments) {
+    return rounding(car(arguments), trunc);
+}
+
+object* round_proc(object* arguments) {
+    /* nearbyint rounds halfway cases to even */
+    return rounding(car(arguments), nearbyint);
+}
+
+object* magnitude_proc(object* arguments) {
+    return abs_proc(arguments);
+}
+
+object* angle_proc(object* arguments) {
+    object* z;
+
+    z = car(arguments);
+    if (is_cpxnum(z)) {
+        return make_flonum(carg(z->data.cpxnum.value));
+    }
+    if (real_value(z) < 0.0) {
+        return make_flonum(atan2(0.0, -1.0));
+    }
+    return is_fixnum(z) ? make_fixnum(0) : make_flonum(0.0);
+}
+
+object* real_part_proc(object* arguments) {
+    object* z;
+
+    z = car(arguments);
+    if (is_cpxnum(z)) {
+        return make_flonum(creal(z->data.cpxnum.value));
+    }
+    real_value(z);
+    return z;
+}
+
+object* imag_part_proc(object* arguments) {
+    object* z;
+
+    z = car(arguments);
+    if (is_cpxnum(z)) {
+        return make_flonum(cimag(z->data.cpxnum.value));
+    }
+    return is_fixnum(z) ? make_fixnum(0) : make_flonum(0.0);
+}
+
+object* make_rectangular_proc(object* arguments) {
+    return make_cpxnum(real_value(car(arguments)),
+        real_value(cadr(arguments)));
+}
+
+object* make_polar_proc(object* arguments) {
+    double m;
+    double a;
+
+    m = real_value(car(arguments));
+    a = real_value(cadr(arguments));
+    return make_cpxnum(m * cos(a), m * sin(a));
+}
+
+object* exact_proc(object* arguments) {
+    object* z;
+    double x;
+
+    z = car(arguments);
+    if (is_fixnum(z)) {
+        return z;
+    }
+    x = real_value(z);
+    if (x != floor(x) || fabs(x) >= -(double)LONG_MIN) {
+        /* no rationals: only integral values have an exact form */
+        diagnostic("*** exact: no exact representation\n");
+        exit(1);
+    }
+    return make_fixnum((long)x);
+}
+
+object* inexact_proc(object* arguments) {
+    object* z;
+
+    z = car(arguments);
+    if (is_fixnum(z)) {
+        return make_flonum((double)z->data.fixnum.value);
+    }
+    return z;
+}
+
+/* the result is inexact if any argument is, and NaN if any is */
+object* extremum(object* arguments, short sign) {
+    object* best;
+    double x;
+    short inexact = 0;
+
+    best = car(arguments);
+    while (!is_nil(arguments)) {
+        inexact |= is_flonum(car(arguments));
+        x = real_value(car(arguments));
+        if (isnan(x) ||
+            (!isnan(real_value(best)) && sign * x > sign * real_value(best))) {
+            best = car(arguments);
+        }
+        arguments = cdr(arguments);
+    }
+    if (inexact && is_fixnum(best)) {
+        return make_flonum((double)best->data.fixnum.value);
+    }
+    return best;
+}
+
+object* max_proc(object* arguments) {
+    return extremum(arguments, 1);
+}
+
+object* min_proc(object* arguments) {
+    return extremum(arguments, -1);
+}
+
+/*
+ * Type specific arithmetic. These skip the numeric tower: the
+ * arguments must already be fixnums (fx) or flonums (fl). The checks
+ * are dropped when running with --unsafe, and eval calls them inline
+ * without building an argument list.
+ */
+
+typedef enum {
+    NOT_INLINE, FX_ADD, FX_SUB, FX_MUL, FX_QUOTIENT, FX_LT, FX_EQ,
+    FL_ADD, FL_SUB, FL_MUL, FL_DIV, FL_LT, FL_SQRT
+} inline_op;
+
+void typed_arith_error(char* msg) {
+    diagnostic("*** %s\n", msg);
+    exit(1);
+}
+
+object* fixnum_arith(inline_op op, object* x, object* y) {
+    long a;
+    long b;
+    short overflow = 0;
+
+    if (!unsafe_mode && (!is_fixnum(x) || !is_fixnum(y))) {
+        typed_arith_error("fixnum operation on a non fixnum");
+    }
+    a = x->data.fixnum.value;
+    b = y->data.fixnum.value;
+    switch (op) {
+    case FX_ADD:
+        if (!unsafe_mode && ((b > 0 && a > LONG_MAX - b) ||
+                             (b < 0 && a < LONG_MIN - b))) {
+            typed_arith_error("fx+ overflow");
+        }
+        return make_fixnum(a + b);
+    case FX_SUB:
+        if (!unsafe_mode && ((b < 0 && a > LONG_MAX + b) ||
+                             (b > 0 && a < LONG_MIN + b))) {
+            typed_arith_error("fx- overflow");
+        }
+        return make_fixnum(a - b);
+    case FX_MUL:
+        if (unsafe_mode) {
+            return make_fixnum(a * b);
+        }
+        a = fixnum_mul(a, b, &overflow);
+        if (overflow) {
+            typed_arith_error("fx* overflow");
+        }
+        return make_fixnum(a);
+    case FX_QUOTIENT:
+        if (!unsafe_mode && b == 0) {
+            typed_arith_error("fxquotient by zero");
+        }
+        if (!unsafe_mode && a == LONG_MIN && b == -1) {
+            typed_arith_error("fxquotient overflow");
+        }
+        return make_fixnum(a / b);
+    case FX_LT:
+        return (a < b) ? true : false;
+    default: /* FX_EQ */
+        return (a == b) ? true : false;
+    }
+}
+
+object* flonum_arith(inline_op op, object* x, object* y) {
+    double a;
+    double b;
+
+    if (!unsafe_mode && (!is_flonum(x) || !is_flonum(y))) {
+        typed_arith_error("flonum operation on a non flonum");
+    }
+    a = x->data.flonum.value;
+    b = y->data.flonum.value;
+    switch (op) {
+    case FL_ADD:
+        return make_flonum(a + b);
+    case FL_SUB:
+        return make_flonum(a - b);
+    case FL_MUL:
+        return make_flonum(a * b);
+    case FL_DIV:
+        return make_flonum(a / b);
+    case FL_LT:
+        return (a < b) ? true : false;
+    default: /* FL_SQRT */
+        return make_flonum(sqrt(a));
+    }
+}
+
+object* typed_arith(inline_op op, object* x, object* y) {
+    return (op < FL_ADD) ? fixnum_arith(op, x, y) : flonum_arith(op, x, y);
+}
+
+/* called through an argument list, as by apply, the operation must
+ * still get exactly its operands */
+object* typed_arith_list(inline_op op, char* name, object* arguments) {
+    object* rest;
+    int count;
+
+    count = 0;
+    for (rest = arguments; is_pair(rest); rest = cdr(rest)) {
+        count++;
+    }
+    if (count != ((op == FL_SQRT) ? 1 : 2)) {
+        diagnostic("*** %s takes %s, given %d\n", name,
+            (op == FL_SQRT) ? "one argument" : "two arguments", count);
+        exit(1);
+    }
+    return typed_arith(op, car(arguments),
+        (op == FL_SQRT) ? car(arguments) : cadr(arguments));
+}
+
+object* fx_add_proc(object* arguments) {
+    return typed_arith_list(FX_ADD, "fx+", arguments);
+}
+
+object* fx_sub_proc(object* arguments) {
+    return typed_arith_list(FX_SUB, "fx-", arguments);
+}
+
+object* fx_mul_proc(object* arguments) {
+    return typed_arith_list(FX_MUL, "fx*", arguments);
+}
+
+object* fx_quotient_proc(object* arguments) {
+    return typed_arith_list(FX_QUOTIENT, "fxquotient", arguments);
+}
+
+object* fx_lt_proc(object* arguments) {
+    return typed_arith_list(FX_LT, "fx<", arguments);
+}
+
+object* fx_eq_proc(object* arguments) {
+    return typed_arith_list(FX_EQ, "fx=", arguments);
+}
+
+object* fl_add_proc(object* arguments) {
+    return typed_arith_list(FL_ADD, "fl+", arguments);
+}
+
+object* fl_sub_proc(object* arguments) {
+    return typed_arith_list(FL_SUB, "fl-", arguments);
+}
+
+object* fl_mul_proc(object* arguments) {
+    return typed_arith_list(FL_MUL, "fl*", arguments);
+}
+
+object* fl_div_proc(object* arguments) {
+    return typed_arith_list(FL_DIV, "fl/", arguments);
+}
+
+object* fl_lt_proc(object* arguments) {
+    return typed_arith_list(FL_LT, "fl<", arguments);
+}
+
+object* fl_sqrt_proc(object* arguments) {
+    return typed_arith_list(FL_SQRT, "flsqrt", arguments);
+}
+
+/* bitwise operations on fixnums (two's complement) */
+
+object* bitwise_and_proc(object* arguments) {
+    long result = -1;
+
+    while (!is_nil(arguments)) {
+        result &= fixnum_argument(car(arguments));
+        arguments = cdr(arguments);
+    }
+    return make_fixnum(result);
+}
+
+object* bitwise_or_proc(object* arguments) {
+    long result = 0;
+
+    while (!is_nil(arguments)) {
+        result |= fixnum_argument(car(arguments));
+        arguments = cdr(arguments);
+    }
+    return make_fixnum(result);
+}
+
+object* bitwise_xor_proc(object* arguments) {
+    long result = 0;
+
+    while (!is_nil(arguments)) {
+        result ^= fixnum_argument(car(arguments));
+        arguments = cdr(arguments);
+    }
+    return make_fixnum(result);
+}
+
+object* bitwise_not_proc(object* arguments) {
+    return make_fixnum(~fixnum_argument(car(arguments)));
+}
+
+/* left for positive counts, arithmetic (sign filling) right otherwise */
+object* arithmetic_shift_proc(object* arguments) {
+    long n;
+    long count;
+    long bits = (long)(sizeof(long) * CHAR_BIT);
+
+    n = fixnum_argument(car(arguments));
+    count = fixnum_argument(cadr(arguments));
+    if (count >= 0) {
+        if (count >= bits || (n != 0 &&
+            (n > (LONG_MAX >> count) || n < (LONG_MIN >> count)))) {
+            diagnostic("*** arithmetic-shift overflow\n");
+            exit(1);
+        }
+        return make_fixnum((long)((unsigned long)n << count));
+    }
+    count = -count;
+    if (count >= bits) {
+        return make_fixnum(n < 0 ? -1 : 0);
+    }
+    return make_fixnum(n < 0 ? ~(~n >> count) : n >> count);
+}
+
+/* ones of a non-negative integer, zeros of a negative one */
+object* bit_count_proc(object* arguments) {
+    long n;
+
+    n = fixnum_argument(car(arguments));
+    return make_fixnum(popcount64((uint64_t)(unsigned long)(n < 0 ? ~n : n)));
+}
+
+object* cons_proc(object* arguments) {
+    return cons(car(arguments), cadr(arguments));
+}
+
+object* car_proc(object* arguments) {
+    return caar(arguments);
+}
+
+object* cdr_proc(object* arguments) {
+    return cdar(arguments);
+}
+
+object* set_car_proc(object* arguments) {
+    set_car(car(arguments), cadr(arguments));
+    return ok_symbol;
+}
+
+object* set_cdr_proc(object* arguments) {
+    set_cdr(car(arguments), cadr(arguments));
+    return ok_symbol;
+}
+
+object* list_proc(object* arguments) {
+    return arguments;
+}
+
+/* vectors: the items follow the object header in one allocation */
+
+object* make_vector(long length, object* fill) {
+    object* obj;
+    long i;
+
+    if (length < 0) {
+        diagnostic("*** invalid vector length %ld\n", length);
+        exit(1);
+    }
+    obj = alloc_object_sized(offsetof(object, data.vector.items) +
+        length * sizeof(object*));
+    obj->type = VECTOR;
+    obj->data.vector.length = length;
+    for (i = 0; i < length; i++) {
+        obj->data.vector.items[i] = fill;
+    }
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_vector(object* obj) {
+    return obj->type == VECTOR;
+}
+
+object* vector_argument(object* obj) {
+    if (!is_vector(obj)) {
+        diagnostic("*** expected a vector\n");
+        exit(1);
+    }
+    return obj;
+}
+
+long vector_index(object* vec, object* index) {
+    long i;
+
+    i = fixnum_argument(index);
+    if (i < 0 || i >= vec->data.vector.length) {
+        diagnostic("*** vector index %ld out of range\n", i);
+        exit(1);
+    }
+    return i;
+}
+
+/* optional [start [end]] arguments of the vector operations */
+void vector_range(object* vec, object* arguments, long* start, long* end) {
+    *start = 0;
+    *end = vec->data.vector.length;
+    if (!is_nil(arguments)) {
+        *start = fixnum_argument(car(arguments));
+        if (!is_nil(cdr(arguments))) {
+            *end = fixnum_argument(cadr(arguments));
+        }
+    }
+    if (*start < 0 || *end > vec->data.vector.length || *start > *end) {
+        diagnostic("*** vector range %ld..%ld out of bounds\n",
+            *start, *end);
+        exit(1);
+    }
+}
+
+object* list_to_vector(object* list) {
+    object* vec;
+    object* elem;
+    long length = 0;
+    long i;
+
+    for (elem = list; !is_nil(elem); elem = cdr(elem)) {
+        length++;
+    }
+    vec = make_vector(length, nil);
+    for (i = 0; i < length; i++) {
+        vec->data.vector.items[i] = car(list);
+        list = cdr(list);
+    }
+    return vec;
+}
+
+object* is_vector_proc(object* arguments) {
+    return is_vector(car(arguments)) ? true : false;
+}
+
+object* make_vector_proc(object* arguments) {
+    return make_vector(fixnum_argument(car(arguments)),
+        is_nil(cdr(arguments)) ? false : cadr(arguments));
+}
+
+object* vector_proc(object* arguments) {
+    return list_to_vector(arguments);
+}
+
+object* vector_length_proc(object* arguments) {
+    return make_fixnum(vector_argument(car(arguments))->data.vector.length);
+}
+
+object* vector_ref_proc(object* arguments) {
+    object* vec;
+
+    vec = vector_argument(car(arguments));
+    return vec->data.vector.items[vector_index(vec, cadr(arguments))];
+}
+
+object* vector_set_proc(object* arguments) {
+    object* vec;
+
+    vec = vector_argument(car(arguments));
+    vec->data.vector.items[vector_index(vec, cadr(arguments))] =
+        caddr(arguments);
+    return ok_symbol;
+}
+
+object* vector_to_list_proc(object* arguments) {
+    object* vec;
+    object* result = nil;
+    long start;
+    long end;
+
+    vec = vector_argument(car(arguments));
+    vector_range(vec, cdr(arguments), &start, &end);
+    while (end > start) {
+        result = cons(vec->data.vector.items[--end], result);
+    }
+    return result;
+}
+
+object* list_to_vector_proc(object* arguments) {
+    return list_to_vector(car(arguments));
+}
+
+object* vector_fill_proc(object* arguments) {
+    object* vec;
+    object* fill;
+    long start;
+    long end;
+
+    vec = vector_argument(car(arguments));
+    fill = cadr(arguments);
+    vector_range(vec, cddr(arguments), &start, &end);
+    while (start < end) {
+        vec->data.vector.items[start++] = fill;
+    }
+    return ok_symbol;
+}
+
+object* apply_procedure(object* proc, object* args);
+
+/* fills result from vec in one batch pass, or returns 0 when an item
+ * is not a real in the domain of b; sqrt keeps the exact roots of
+ * fixnums, so those take the general path */
+char vector_map_batch(batch_elementary* b, object* vec, object* result) {
+    object* item;
+    double* x;
+    long n;
+    long i;
+    int frame;
+
+    n = result->data.vector.length;
+    x = malloc((n ? n : 1) * sizeof(double));
+    if (x == NULL) {
+        diagnostic("*** vector-map - out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        item = vec->data.vector.items[i];
+        if (is_flonum(item)) {
+            x[i] = item->data.flonum.value;
+        }
+        else if (is_fixnum(item) && b->proc != sqrt_proc) {
+            x[i] = (double)item->data.fixnum.value;
+        }
+        else {
+            free(x);
+            return 0;
+        }
+    }
+    if (!batch_in_domain(b, x, n)) {
+        free(x);
+        return 0;
+    }
+    batch_apply(b, x, n);
+    frame = the_vm->stackSize;
+    for (i = 0; i < n; i++) {
+        result->data.vector.items[i] = make_flonum(x[i]);
+        the_vm->stackSize = frame;
+    }
+    free(x);
+    return 1;
+}
+
+/* (vector-map proc v1 v2 ...) stops at the shortest vector */
+object* vector_map_proc(object* arguments) {
+    batch_elementary* b;
+    object* proc;
+    object* vectors;
+    object* result;
+    object* items;
+    object* last;
+    object* cell;
+    long length = -1;
+    long i;
+    int frame;
+
+    proc = car(arguments);
+    for (vectors = cdr(arguments); !is_nil(vectors);
+         vectors = cdr(vectors)) {
+        i = vector_argument(car(vectors))->data.vector.length;
+        if (length < 0 || i < length) {
+            length = i;
+        }
+    }
+    if (length < 0) {
+        diagnostic("*** vector-map: expected a vector\n");
+        exit(1);
+    }
+    result = make_vector(length, nil);
+    b = find_batch_elementary(proc);
+    if (b != NULL && is_nil(cddr(arguments)) &&
+        vector_map_batch(b, cadr(arguments), result)) {
+        return result;
+    }
+    frame = the_vm->stackSize;
+    for (i = 0; i < length; i++) {
+        items = nil;
+        last = NULL;
+        for (vectors = cdr(arguments); !is_nil(vectors);
+             vectors = cdr(vectors)) {
+            cell = cons(car(vectors)->data.vector.items[i], nil);
+            if (last == NULL) {
+                items = cell;
+            }
+            else {
+                set_cdr(last, cell);
+            }
+            last = cell;
+        }
+        result->data.vector.items[i] = apply_procedure(proc, items);
+        the_vm->stackSize = frame;
+    }
+    return result;
+}
+
+object* vector_copy_proc(object* arguments) {
+    object* vec;
+    object* copy;
+    long start;
+    long end;
+
+    vec = vector_argument(car(arguments));
+    vector_range(vec, cdr(arguments), &start, &end);
+    copy = make_vector(end - start, nil);
+    memcpy(copy->data.vector.items, vec->data.vector.items + start,
+        (end - start) * sizeof(object*));
+    return copy;
+}
+
+/* (vector-copy! to at from [start [end]]) handles overlapping ranges */
+object* vector_copy_to_proc(object* arguments) {
+    object* to;
+    object* from;
+    long at;
+    long start;
+    long end;
+
+    to = vector_argument(car(arguments));
+    at = fixnum_argument(cadr(arguments));
+    from = vector_argument(caddr(arguments));
+    vector_range(from, cdddr(arguments), &start, &end);
+    if (at < 0 || at + (end - start) > to->data.vector.length) {
+        diagnostic("*** vector-copy! destination too small\n");
+        exit(1);
+    }
+    memmove(to->data.vector.items + at, from->data.vector.items + start,
+        (end - start) * sizeof(object*));
+    return ok_symbol;
+}
+
+object* vector_append_proc(object* arguments) {
+    object* result;
+    object* args;
+    long length = 0;
+    long at = 0;
+
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        length += vector_argument(car(args))->data.vector.length;
+    }
+    result = make_vector(length, nil);
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        memcpy(result->data.vector.items + at,
+            car(args)->data.vector.items,
+            car(args)->data.vector.length * sizeof(object*));
+        at += car(args)->data.vector.length;
+    }
+    return result;
+}
+
+/* bytevectors: the bytes follow the object header like vector items */
+
+object* make_bytevector(long length, int fill) {
+    object* obj;
+
+    if (length < 0) {
+        diagnostic("*** invalid bytevector length %ld\n", length);
+        exit(1);
+    }
+    obj = alloc_object_sized(offsetof(object, data.bytevector.bytes) +
+        length);
+    obj->type = BYTEVECTOR;
+    obj->data.bytevector.length = length;
+    memset(obj->data.bytevector.bytes, fill, length);
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_bytevector(object* obj) {
+    return obj->type == BYTEVECTOR;
+}
+
+object* bytevector_argument(object* obj) {
+    if (!is_bytevector(obj)) {
+        diagnostic("*** expected a bytevector\n");
+        exit(1);
+    }
+    return obj;
+}
+
+int byte_argument(object* obj) {
+    long byte;
+
+    byte = fixnum_argument(obj);
+    if (byte < 0 || byte > 255) {
+        diagnostic("*** %ld is not a byte\n", byte);
+        exit(1);
+    }
+    return (int)byte;
+}
+
+/* checks that size bytes at index fit in the bytevector */
+long bytevector_index(object* bv, object* index, long size) {
+    long i;
+
+    i = fixnum_argument(index);
+    if (i < 0 || i > bv->data.bytevector.length - size) {
+        diagnostic("*** bytevector index %ld out of range\n", i);
+        exit(1);
+    }
+    return i;
+}
+
+void bytevector_range(object* bv, object* arguments, long* start,
+    long* end) {
+    *start = 0;
+    *end = bv->data.bytevector.length;
+    if (!is_nil(arguments)) {
+        *start = fixnum_argument(car(arguments));
+        if (!is_nil(cdr(arguments))) {
+            *end = fixnum_argument(cadr(arguments));
+        }
+    }
+    if (*start < 0 || *end > bv->data.bytevector.length || *start > *end) {
+        diagnostic("*** bytevector range %ld..%ld out of bounds\n",
+            *start, *end);
+        exit(1);
+    }
+}
+
+object* list_to_bytevector(object* list) {
+    object* bv;
+    object* elem;
+    long length = 0;
+    long i;
+
+    for (elem = list; !is_nil(elem); elem = cdr(elem)) {
+        length++;
+    }
+    bv = make_bytevector(length, 0);
+    for (i = 0; i < length; i++) {
+        bv->data.bytevector.bytes[i] = (unsigned char)byte_argument(car(list));
+        list = cdr(list);
+    }
+    return bv;
+}
+
+object* is_bytevector_proc(object* arguments) {
+    return is_bytevector(car(arguments)) ? true : false;
+}
+
+object* make_bytevector_proc(object* arguments) {
+    return make_bytevector(fixnum_argument(car(arguments)),
+        is_nil(cdr(arguments)) ? 0 : byte_argument(cadr(arguments)));
+}
+
+object* bytevector_proc(object* arguments) {
+    return list_to_bytevector(arguments);
+}
+
+object* bytevector_length_proc(object* arguments) {
+    return make_fixnum(
+        bytevector_argument(car(arguments))->data.bytevector.length);
+}
+
+object* bytevector_u8_ref_proc(object* arguments) {
+    object* bv;
+
+    bv = bytevector_argument(car(arguments));
+    return make_fixnum(
+        bv->data.bytevector.bytes[bytevector_index(bv, cadr(arguments), 1)]);
+}
+
+object* bytevector_u8_set_proc(object* arguments) {
+    object* bv;
+
+    bv = bytevector_argument(car(arguments));
+    bv->data.bytevector.bytes[bytevector_index(bv, cadr(arguments), 1)] =
+        (unsigned char)byte_argument(caddr(arguments));
+    return ok_symbol;
+}
+
+object* bytevector_copy_proc(object* arguments) {
+    object* bv;
+    object* copy;
+    long start;
+    long end;
+
+    bv = bytevector_argument(car(arguments));
+    bytevector_range(bv, cdr(arguments), &start, &end);
+    copy = make_bytevector(end - start, 0);
+    memcpy(copy->data.bytevector.bytes, bv->data.bytevector.bytes + start,
+        end - start);
+    return copy;
+}
+
+/* (bytevector-copy! to at from [start [end]]) */
+object* bytevector_copy_to_proc(object* arguments) {
+    object* to;
+    object* from;
+    long at;
+    long start;
+    long end;
+
+    to = bytevector_argument(car(arguments));
+    at = fixnum_argument(cadr(arguments));
+    from = bytevector_argument(caddr(arguments));
+    bytevector_range(from, cdddr(arguments), &start, &end);
+    if (at < 0 || at + (end - start) > to->data.bytevector.length) {
+        diagnostic("*** bytevector-copy! destination too small\n");
+        exit(1);
+    }
+    memmove(to->data.bytevector.bytes + at,
+        from->data.bytevector.bytes + start, end - start);
+    return ok_symbol;
+}
+
+object* bytevector_append_proc(object* arguments) {
+    object* result;
+    object* args;
+    long length = 0;
+    long at = 0;
+
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        length += bytevector_argument(car(args))->data.bytevector.length;
+    }
+    result = make_bytevector(length, 0);
+    for (args = arguments; !is_nil(args); args = cdr(args)) {
+        memcpy(result->data.bytevector.bytes + at,
+            car(args)->data.bytevector.bytes,
+            car(args)->data.bytevector.length);
+        at += car(args)->data.bytevector.length;
+    }
+    return result;
+}
+
+/* strings hold raw bytes, so the utf8 conversions are copies */
+object* utf8_to_string_proc(object* arguments) {
+    object* bv;
+    long start;
+    long end;
+
+    bv = bytevector_argument(car(arguments));
+    bytevector_range(bv, cdr(arguments), &start, &end);
+    return make_string_n((char*)bv->data.bytevector.bytes + start,
+        end - start);
+}
+
+object* string_to_utf8_proc(object* arguments) {
+    object* str;
+    object* bv;
+
+    str = string_argument(car(arguments));
+    bv = make_bytevector(str->data.string.length, 0);
+    memcpy(bv->data.bytevector.bytes, str->data.string.value,
+        str->data.string.length);
+    return bv;
+}
+
+/* multi-byte accessors take an optional 'big or 'little endianness,
+ * defaulting to the byte order of the host */
+
+char big_endian_argument(object* arguments) {
+    static const uint16_t probe = 1;
+
+    if (is_nil(arguments)) {
+        return *(const unsigned char*)&probe == 0;
+    }
+    if (car(arguments) == big_symbol) {
+        return 1;
+    }
+    if (car(arguments) == little_symbol) {
+        return 0;
+    }
+    diagnostic("*** endianness must be big or little\n");
+    exit(1);
+}
+
+uint64_t load_bytes(unsigned char* p, int size, char big) {
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        value = (value << 8) | p[big ? i : size - 1 - i];
+    }
+    return value;
+}
+
+void store_bytes(unsigned char* p, int size, char big, uint64_t value) {
+    int i;
+
+    for (i = size - 1; i >= 0; i--) {
+        p[big ? i : size - 1 - i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+/* (bytevector-uN-ref bv index [endianness]) and the signed forms */
+object* bytevector_int_ref(object* arguments, int size, char is_signed) {
+    object* bv;
+    uint64_t bits;
+    long index;
+
+    bv = bytevector_argument(car(arguments));
+    index = bytevector_index(bv, cadr(arguments), size);
+    bits = load_bytes(bv->data.bytevector.bytes + index, size,
+        big_endian_argument(cddr(arguments)));
+    if (is_signed && (bits >> (size * 8 - 1)) != 0) {
+        return make_fixnum((long)((int64_t)bits - ((int64_t)1 << (size * 8))));
+    }
+    if (bits > LONG_MAX) {
+        diagnostic("*** %llu does not fit in a fixnum\n",
+            (unsigned long long)bits);
+        exit(1);
+    }
+    return make_fixnum((long)bits);
+}
+
+/* (bytevector-uN-set! bv index value [endianness]) */
+object* bytevector_int_set(object* arguments, int size, char is_signed) {
+    object* bv;
+    long index;
+    int64_t value;
+    int64_t low;
+    int64_t high;
+
+    bv = bytevector_argument(car(arguments));
+    index = bytevector_index(bv, cadr(arguments), size);
+    value = fixnum_argument(caddr(arguments));
+    low = is_signed ? -((int64_t)1 << (size * 8 - 1)) : 0;
+    high = is_signed ? ((int64_t)1 << (size * 8 - 1)) - 1 :
+        ((int64_t)1 << (size * 8)) - 1;
+    if (value < low || value > high) {
+        diagnostic("*** %lld does not fit in %d bytes\n",
+            (long long)value, size);
+        exit(1);
+    }
+    store_bytes(bv->data.bytevector.bytes + index, size,
+        big_endian_argument(cdddr(arguments)), (uint64_t)value);
+    return ok_symbol;
+}
+
+object* bytevector_u16_ref_proc(object* arguments) {
+    return bytevector_int_ref(arguments, 2, 0);
+}
+
+object* bytevector_s16_ref_proc(object* arguments) {
+    return bytevector_int_ref(arguments, 2, 1);
+}
+
+object* bytevector_u32_ref_proc(object* arguments) {
+    return bytevector_int_ref(arguments, 4, 0);
+}
+
+object* bytevector_s32_ref_proc(object* arguments) {
+    return bytevector_int_ref(arguments, 4, 1);
+}
+
+object* bytevector_u16_set_proc(object* arguments) {
+    return bytevector_int_set(arguments, 2, 0);
+}
+
+object* bytevector_s16_set_proc(object* arguments) {
+    return bytevector_int_set(arguments, 2, 1);
+}
+
+object* bytevector_u32_set_proc(object* arguments) {
+    return bytevector_int_set(arguments, 4, 0);
+}
+
+object* bytevector_s32_set_proc(object* arguments) {
+    return bytevector_int_set(arguments, 4, 1);
+}
+
+object* bytevector_ieee_single_ref_proc(object* arguments) {
+    object* bv;
+    uint32_t bits;
+    float value;
+
+    bv = bytevector_argument(car(arguments));
+    bits = (uint32_t)load_bytes(bv->data.bytevector.bytes +
+        bytevector_index(bv, cadr(arguments), 4), 4,
+        big_endian_argument(cddr(arguments)));
+    memcpy(&value, &bits, sizeof(value));
+    return make_flonum(value);
+}
+
+object* bytevector_ieee_double_ref_proc(object* arguments) {
+    object* bv;
+    uint64_t bits;
+    double value;
+
+    bv = bytevector_argument(car(arguments));
+    bits = load_bytes(bv->data.bytevector.bytes +
+        bytevector_index(bv, cadr(arguments), 8), 8,
+        big_endian_argument(cddr(arguments)));
+    memcpy(&value, &bits, sizeof(value));
+    return make_flonum(value);
+}
+
+object* bytevector_ieee_single_set_proc(object* arguments) {
+    object* bv;
+    uint32_t bits;
+    float value;
+    long index;
+
+    bv = bytevector_argument(car(arguments));
+    index = bytevector_index(bv, cadr(arguments), 4);
+    value = (float)real_value(caddr(arguments));
+    memcpy(&bits, &value, sizeof(bits));
+    store_bytes(bv->data.bytevector.bytes + index, 4,
+        big_endian_argument(cdddr(arguments)), bits);
+    return ok_symbol;
+}
+
+object* bytevector_ieee_double_set_proc(object* arguments) {
+    object* bv;
+    uint64_t bits;
+    double value;
+    long index;
+
+    bv = bytevector_argument(car(arguments));
+    index = bytevector_index(bv, cadr(arguments), 8);
+    value = real_value(caddr(arguments));
+    memcpy(&bits, &value, sizeof(bits));
+    store_bytes(bv->data.bytevector.bytes + index, 8,
+        big_endian_argument(cdddr(arguments)), bits);
+    return ok_symbol;
+}
+
+/* eq? is object identity; numbers and characters need eqv? */
+object* is_eq_proc(object* arguments) {
+    return (car(arguments) == cadr(arguments)) ? true : false;
+}
+
+/* eqv? rules: identical, or the same number or character */
+char is_eqv(object* obj1, object* obj2) {
+    if (obj1 == obj2) {
+        return 1;
+    }
+    if (obj1->type != obj2->type) {
+        return 0;
+    }
+    switch (obj1->type) {
+    case FIXNUM:
+        return obj1->data.fixnum.value == obj2->data.fixnum.value;
+    case FLONUM:
+        /* bitwise, so 0.0 and -0.0 differ and a NaN matches itself */
+        return memcmp(&obj1->data.flonum.value, &obj2->data.flonum.value,
+            sizeof(double)) == 0;
+    case CPXNUM:
+        return memcmp(&obj1->data.cpxnum.value, &obj2->data.cpxnum.value,
+            sizeof(sComplex)) == 0;
+    case CHARACTER:
+        return obj1->data.character.value == obj2->data.character.value;
+    default:
+        return 0;
+    }
+}
+
+/* equal? walks both objects with an explicit stack of pending pairs.
+ * After EQUAL_FUEL nodes it starts recording the pairs of containers
+ * already under comparison; meeting one again means the walk has gone
+ * round a cycle, and that branch is assumed equal. */
+
+#define EQUAL_STACK_INIT 64
+#define EQUAL_FUEL 1024
+
+typedef struct equal_task {
+    object* a;
+    object* b;
+} equal_task;
+
+typedef struct equal_seen {
+    equal_task* slots;
+    long capacity;
+    long count;
+} equal_seen;
+
+/* returns 1 if the pair was already recorded */
+char equal_seen_add(equal_seen* seen, object* a, object* b) {
+    equal_task* old_slots;
+    long old_capacity;
+    long i;
+    long j;
+
+    if (seen->count * 2 >= seen->capacity) {
+        old_slots = seen->slots;
+        old_capacity = seen->capacity;
+        seen->capacity = old_capacity ? old_capacity * 2 : 256;
+        seen->slots = calloc(seen->capacity, sizeof(equal_task));
+        if (seen->slots == NULL) {
+            diagnostic("*** equal? - out of memory\n");
+            exit(1);
+        }
+        seen->count = 0;
+        for (i = 0; i < old_capacity; i++) {
+            if (old_slots[i].a != NULL) {
+                equal_seen_add(seen, old_slots[i].a, old_slots[i].b);
+            }
+        }
+        free(old_slots);
+    }
+    i = (long)(((uintptr_t)a * 31 + (uintptr_t)b) >> 4) &
+        (seen->capacity - 1);
+    for (j = i; seen->slots[j].a != NULL;
+         j = (j + 1) & (seen->capacity - 1)) {
+        if (seen->slots[j].a == a && seen->slots[j].b == b) {
+            return 1;
+        }
+    }
+    seen->slots[j].a = a;
+    seen->slots[j].b = b;
+    seen->count++;
+    return 0;
+}
+
+char is_equal(object* obj1, object* obj2) {
+    equal_task local[EQUAL_STACK_INIT];
+    equal_task* stack;
+    equal_seen seen;
+    long capacity;
+    long top;
+    long fuel;
+    long i;
+    char result;
+
+    stack = local;
+    capacity = EQUAL_STACK_INIT;
+    top = 0;
+    fuel = EQUAL_FUEL;
+    seen.slots = NULL;
+    seen.capacity = 0;
+    seen.count = 0;
+    result = 1;
+    stack[top].a = obj1;
+    stack[top++].b = obj2;
+    while (top > 0 && result) {
+        obj1 = stack[--top].a;
+        obj2 = stack[top].b;
+        if (is_eqv(obj1, obj2)) {
+            continue;
+        }
+        if (obj1->type != obj2->type) {
+            result = 0;
+            break;
+        }
+        switch (obj1->type) {
+        case STRING:
+            result = obj1->data.string.length == obj2->data.string.length &&
+                memcmp(obj1->data.string.value, obj2->data.string.value,
+                       obj1->data.string.length) == 0;
+            continue;
+        case BYTEVECTOR:
+            result = obj1->data.bytevector.length ==
+                obj2->data.bytevector.length &&
+                memcmp(obj1->data.bytevector.bytes,
+                       obj2->data.bytevector.bytes,
+                       obj1->data.bytevector.length) == 0;
+            continue;
+        case PAIR:
+        case VECTOR:
+            break;
+        default:
+            result = 0;
+            continue;
+        }
+        if (--fuel < 0 && equal_seen_add(&seen, obj1, obj2)) {
+            continue;
+        }
+        /* room for a vector's items or a pair's car and cdr */
+        i = (obj1->type == VECTOR) ? obj1->data.vector.length : 2;
+        if (top + i > capacity) {
+            while (top + i > capacity) {
+                capacity *= 2;
+            }
+            if (stack == local) {
+                stack = malloc(capacity * sizeof(equal_task));
+                if (stack != NULL) {
+                    memcpy(stack, local, top * sizeof(equal_task));
+                }
+            }
+            else {
+                stack = realloc(stack, capacity * sizeof(equal_task));
+            }
+            if (stack == NULL) {
+                diagnostic("*** equal? - out of memory\n");
+                exit(1);
+            }
+        }
+        if (obj1->type == PAIR) {
+            stack[top].a = cdr(obj1);
+            stack[top++].b = cdr(obj2);
+            stack[top].a = car(obj1);
+            stack[top++].b = car(obj2);
+        }
+        else if (obj1->data.vector.length != obj2->data.vector.length) {
+            result = 0;
+        }
+        else {
+            for (i = obj1->data.vector.length - 1; i >= 0; i--) {
+                stack[top].a = obj1->data.vector.items[i];
+                stack[top++].b = obj2->data.vector.items[i];
+            }
+        }
+    }
+    if (stack != local) {
+        free(stack);
+    }
+    free(seen.slots);
+    return result;
+}
+
+object* is_eqv_proc(object* arguments) {
+    return is_eqv(car(arguments), cadr(arguments)) ? true : false;
+}
+
+object* is_equal_proc(object* arguments) {
+    return is_equal(car(arguments), cadr(arguments)) ? true : false;
+}
+
+/* lists: every walk is a loop so long lists cost no C stack */
+
+object* apply_procedure(object* proc, object* args);
+
+#define CXR_PROC(name) \
+    object* name##_proc(object* arguments) { return name(car(arguments)); }
+
+CXR_PROC(caar)   CXR_PROC(cadr)   CXR_PROC(cdar)   CXR_PROC(cddr)
+CXR_PROC(caaar)  CXR_PROC(caadr)  CXR_PROC(cadar)  CXR_PROC(caddr)
+CXR_PROC(cdaar)  CXR_PROC(cdadr)  CXR_PROC(cddar)  CXR_PROC(cdddr)
+CXR_PROC(caaaar) CXR_PROC(caaadr) CXR_PROC(caadar) CXR_PROC(caaddr)
+CXR_PROC(cadaar) CXR_PROC(cadadr) CXR_PROC(caddar) CXR_PROC(cadddr)
+CXR_PROC(cdaaar) CXR_PROC(cdaadr) CXR_PROC(cdadar) CXR_PROC(cdaddr)
+CXR_PROC(cddaar) CXR_PROC(cddadr) CXR_PROC(cdddar) CXR_PROC(cddddr)
+
+object* list_argument(object* obj) {
+    object* tail;
+
+    for (tail = obj; is_pair(tail); tail = cdr(tail)) {
+    }
+    if (!is_nil(tail)) {
+        diagnostic("*** expected a proper list\n");
+        exit(1);
+    }
+    return obj;
+}
+
+/* copies list onto the front of tail */
+object* copy_list_onto(object* list, object* tail) {
+    object* head;
+    object* last;
+    object* cell;
+
+    head = tail;
+    last = NULL;
+    for (; is_pair(list); list = cdr(list)) {
+        cell = cons(car(list), tail);
+        if (last == NULL) {
+            head = cell;
+        }
+        else {
+            set_cdr(last, cell);
+        }
+        last = cell;
+    }
+    return head;
+}
+
+/* takes the next item of each list, advancing the lists in place;
+ * returns NULL as soon as any list runs out */
+object* next_items(object* lists, object* tail) {
+    object* l;
+    object* items;
+    object* last;
+    object* cell;
+
+    for (l = lists; !is_nil(l); l = cdr(l)) {
+        if (!is_pair(car(l))) {
+            return NULL;
+        }
+    }
+    items = tail;
+    last = NULL;
+    for (l = lists; !is_nil(l); l = cdr(l)) {
+        cell = cons(caar(l), tail);
+        if (last == NULL) {
+            items = cell;
+        }
+        else {
+            set_cdr(last, cell);
+        }
+        last = cell;
+        set_car(l, cdar(l));
+    }
+    return items;
+}
+
+object* length_proc(object* arguments) {
+    object* list;
+    long length;
+
+    length = 0;
+    for (list = list_argument(car(arguments)); !is_nil(list);
+         list = cdr(list)) {
+        length++;
+    }
+    return make_fixnum(length);
+}
+
+object* append_proc(object* arguments) {
+    object* result;
+    object* rest;
+
+    if (is_nil(arguments)) {
+        return nil;
+    }
+    /* copy each list, back to front, onto the shared last argument */
+    rest = nil;
+    for (; !is_nil(cdr(arguments)); arguments = cdr(arguments)) {
+        rest = cons(car(arguments), rest);
+    }
+    result = car(arguments);
+    for (; !is_nil(rest); rest = cdr(rest)) {
+        result = copy_list_onto(list_argument(car(rest)), result);
+    }
+    return result;
+}
+
+object* reverse_proc(object* arguments) {
+    object* list;
+    object* result;
+
+    result = nil;
+    for (list = list_argument(car(arguments)); !is_nil(list);
+         list = cdr(list)) {
+        result = cons(car(list), result);
+    }
+    return result;
+}
+
+object* list_tail(object* list, long k) {
+    for (; k > 0; k--) {
+        if (!is_pair(list)) {
+            diagnostic("*** list index out of range\n");
+            exit(1);
+        }
+        list = cdr(list);
+    }
+    return list;
+}
+
+object* list_tail_proc(object* arguments) {
+    return list_tail(car(arguments), fixnum_argument(cadr(arguments)));
+}
+
+object* list_ref_proc(object* arguments) {
+    object* tail;
+
+    tail = list_tail(car(arguments), fixnum_argument(cadr(arguments)));
+    if (!is_pair(tail)) {
+        diagnostic("*** list index out of range\n");
+        exit(1);
+    }
+    return car(tail);
+}
+
+object* list_copy_proc(object* arguments) {
+    return copy_list_onto(car(arguments), nil);
+}
+
+object* last_pair_proc(object* arguments) {
+    object* list;
+
+    list = car(arguments);
+    if (!is_pair(list)) {
+        diagnostic("*** last-pair expects a pair\n");
+        exit(1);
+    }
+    while (is_pair(cdr(list))) {
+        list = cdr(list);
+    }
+    return list;
+}
+
+typedef enum { MATCH_EQ, MATCH_EQV, MATCH_EQUAL } match_kind;
+
+char items_match(match_kind kind, object* obj1, object* obj2) {
+    switch (kind) {
+    case MATCH_EQ:
+        return obj1 == obj2;
+    case MATCH_EQV:
+        return is_eqv(obj1, obj2);
+    default:
+        return is_equal(obj1, obj2);
+    }
+}
+
+object* member(match_kind kind, object* obj, object* list) {
+    for (; is_pair(list); list = cdr(list)) {
+        if (items_match(kind, obj, car(list))) {
+            return list;
+        }
+    }
+    return false;
+}
+
+object* assoc(match_kind kind, object* obj, object* alist) {
+    for (; is_pair(alist); alist = cdr(alist)) {
+        if (is_pair(car(alist)) && items_match(kind, obj, caar(alist))) {
+            return car(alist);
+        }
+    }
+    return false;
+}
+
+object* memq_proc(object* arguments) {
+    return member(MATCH_EQ, car(arguments), cadr(arguments));
+}
+
+object* memv_proc(object* arguments) {
+    return member(MATCH_EQV, car(arguments), cadr(arguments));
+}
+
+object* member_proc(object* arguments) {
+    return member(MATCH_EQUAL, car(arguments), cadr(arguments));
+}
+
+object* assq_proc(object* arguments) {
+    return assoc(MATCH_EQ, car(arguments), cadr(arguments));
+}
+
+object* assv_proc(object* arguments) {
+    return assoc(MATCH_EQV, car(arguments), cadr(arguments));
+}
+
+object* assoc_proc(object* arguments) {
+    return assoc(MATCH_EQUAL, car(arguments), cadr(arguments));
+}
+
+/* (map proc list1 list2 ...) stops at the shortest list */
+object* map_proc(object* arguments) {
+    object* proc;
+    object* lists;
+    object* items;
+    object* result;
+    object* last;
+    object* cell;
+
+    proc = car(arguments);
+    lists = copy_list_onto(cdr(arguments), nil);
+    result = nil;
+    last = NULL;
+    while ((items = next_items(lists, nil)) != NULL) {
+        cell = cons(apply_procedure(proc, items), nil);
+        if (last == NULL) {
+            result = cell;
+        }
+        else {
+            set_cdr(last, cell);
+        }
+        last = cell;
+    }
+    return result;
+}
+
+object* for_each_proc(object* arguments) {
+    object* proc;
+    object* lists;
+    object* items;
+
+    proc = car(arguments);
+    lists = copy_list_onto(cdr(arguments), nil);
+    while ((items = next_items(lists, nil)) != NULL) {
+        apply_procedure(proc, items);
+    }
+    return true;
+}
+
+object* filter_proc(object* arguments) {
+    object* pred;
+    object* list;
+    object* result;
+    object* last;
+    object* cell;
+
+    pred = car(arguments);
+    result = nil;
+    last = NULL;
+    for (list = list_argument(cadr(arguments)); !is_nil(list);
+         list = cdr(list)) {
+        if (is_false(apply_procedure(pred, cons(car(list), nil)))) {
+            continue;
+        }
+        cell = cons(car(list), nil);
+        if (last == NULL) {
+            result = cell;
+        }
+        else {
+            set_cdr(last, cell);
+        }
+        last = cell;
+    }
+    return result;
+}
+
+/* (fold-left proc init list1 ...) calls (proc acc item1 ...) */
+object* fold_left_proc(object* arguments) {
+    object* proc;
+    object* acc;
+    object* lists;
+    object* items;
+
+    proc = car(arguments);
+    acc = cadr(arguments);
+    lists = copy_list_onto(cddr(arguments), nil);
+    while ((items = next_items(lists, nil)) != NULL) {
+        acc = apply_procedure(proc, cons(acc, items));
+    }
+    return acc;
+}
+
+/* (fold-right proc init list1 ...) calls (proc item1 ... acc), last
+ * items first; the rows are gathered up front instead of recursing */
+object* fold_right_proc(object* arguments) {
+    object* proc;
+    object* acc;
+    object* lists;
+    object* items;
+    object* rows;
+    object* cell;
+
+    proc = car(arguments);
+    acc = cadr(arguments);
+    lists = copy_list_onto(cddr(arguments), nil);
+    rows = nil;
+    while (1) {
+        cell = cons(nil, nil);
+        if ((items = next_items(lists, cell)) == NULL) {
+            break;
+        }
+        rows = cons(cons(items, cell), rows);
+    }
+    for (; !is_nil(rows); rows = cdr(rows)) {
+        set_car(cdar(rows), acc);
+        acc = apply_procedure(proc, caar(rows));
+    }
+    return acc;
+}
+
+/*
+ * Sorting: a natural merge sort over an array of the items. Existing
+ * ascending runs are kept and strictly descending ones reversed, short
+ * runs are extended with binary insertion, and neighbouring runs are
+ * merged bottom up. Sorted input is a single O(n) pass, and equal items
+ * keep their order. With < on numbers or string<? on strings the
+ * items are compared in C instead of calling the procedure.
+ */
+
+#define SORT_MIN_RUN 32
+
+typedef enum {
+    ORDER_PROCEDURE, ORDER_FIXNUM, ORDER_REAL, ORDER_STRING
+} sort_order_kind;
+
+typedef struct sort_order {
+    sort_order_kind kind;
+    char descending;        /* fast paths for > and string>? */
+    object* proc;
+} sort_order;
+
+char sort_less(sort_order* order, object* a, object* b) {
+    object* tmp;
+
+    if (order->descending) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    switch (order->kind) {
+    case ORDER_FIXNUM:
+        return a->data.fixnum.value < b->data.fixnum.value;
+    case ORDER_REAL:
+        return real_value(a) < real_value(b);
+    case ORDER_STRING:
+        return string_compare(a, b) < 0;
+    default:
+        return is_true(apply_procedure(order->proc,
+            cons(a, cons(b, nil))));
+    }
+}
+
+/* picks a fast path when proc is a known order and the items suit it */
+void sort_order_init(sort_order* order, object* proc, object** items,
+    long n) {
+    object* (*fn)(struct object* args);
+    char fixnums = 1;
+    char reals = 1;
+    char strings = 1;
+    long i;
+
+    order->kind = ORDER_PROCEDURE;
+    order->descending = 0;
+    order->proc = proc;
+    if (!is_primitive(proc)) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        fixnums = fixnums && is_fixnum(items[i]);
+        reals = reals && (is_fixnum(items[i]) || is_flonum(items[i]));
+        strings = strings && is_string(items[i]);
+    }
+    fn = proc->data.primitive_proc.fn;
+    if (fn == is_lessthan_proc || fn == is_greatthan_proc) {
+        order->descending = (fn == is_greatthan_proc);
+        if (fixnums) {
+            order->kind = ORDER_FIXNUM;
+        }
+        else if (reals) {
+            order->kind = ORDER_REAL;
+        }
+    }
+    else if (fn == string_lessthan_proc || fn == string_greatthan_proc) {
+        order->descending = (fn == string_greatthan_proc);
+        if (strings) {
+            order->kind = ORDER_STRING;
+        }
+    }
+}
+
+/* sorts items[start..end) where items[start..sorted) is in order */
+void binary_insertion_sort(sort_order* order, object** items, long start,
+    long sorted, long end) {
+    object* item;
+    long low;
+    long high;
+    long mid;
+
+    for (; sorted < end; sorted++) {
+        item = items[sorted];
+        low = start;
+        high = sorted;
+        while (low < high) {
+            mid = low + (high - low) / 2;
+            if (sort_less(order, item, items[mid])) {
+                high = mid;
+            }
+            else {
+                low = mid + 1;
+            }
+        }
+        memmove(items + low + 1, items + low,
+            (sorted - low) * sizeof(object*));
+        items[low] = item;
+    }
+}
+
+/* length of the run at start, reversing it if strictly descending */
+long find_run(sort_order* order, object** items, long start, long n) {
+    object* tmp;
+    long end;
+    long i;
+    long j;
+
+    end = start + 1;
+    if (end == n) {
+        return 1;
+    }
+    if (sort_less(order, items[end], items[start])) {
+        while (end < n && sort_less(order, items[end], items[end - 1])) {
+            end++;
+        }
+        for (i = start, j = end - 1; i < j; i++, j--) {
+            tmp = items[i];
+            items[i] = items[j];
+            items[j] = tmp;
+        }
+    }
+    else {
+        while (end < n && !sort_less(order, items[end], items[end - 1])) {
+            end++;
+        }
+    }
+    return end - start;
+}
+
+/* merges items[start..mid) and items[mid..end) through scratch */
+void merge_runs(sort_order* order, object** items, object** scratch,
+    long start, long mid, long end) {
+    long i;
+    long j;
+    long k;
+
+    /* already in order: the runs only touch */
+    if (!sort_less(order, items[mid], items[mid - 1])) {
+        return;
+    }
+    memcpy(scratch + start, items + start, (mid - start) * sizeof(object*));
+    i = start;
+    j = mid;
+    k = start;
+    while (i < mid && j < end) {
+        if (sort_less(order, items[j], scratch[i])) {
+            items[k++] = items[j++];
+        }
+        else {
+            items[k++] = scratch[i++];
+        }
+    }
+    memcpy(items + k, scratch + i, (mid - i) * sizeof(object*));
+}
+
+void sort_items(object** items, long n, object* proc) {
+    sort_order order;
+    object** scratch;
+    long* runs;
+    long nruns;
+    long start;
+    long length;
+    long i;
+    long j;
+
+    if (n < 2) {
+        return;
+    }
+    sort_order_init(&order, proc, items, n);
+    scratch = malloc(n * sizeof(object*));
+    runs = malloc((n / SORT_MIN_RUN + 2) * sizeof(long));
+    if (scratch == NULL || runs == NULL) {
+        diagnostic("*** sort - out of memory\n");
+        exit(1);
+    }
+    /* runs[i] is where run i starts; runs[nruns] is n */
+    nruns = 0;
+    for (start = 0; start < n; start += length) {
+        length = find_run(&order, items, start, n);
+        if (length < SORT_MIN_RUN && start + length < n) {
+            j = (start + SORT_MIN_RUN < n) ? start + SORT_MIN_RUN : n;
+            binary_insertion_sort(&order, items, start, start + length, j);
+            length = j - start;
+        }
+        runs[nruns++] = start;
+    }
+    runs[nruns] = n;
+    while (nruns > 1) {
+        for (i = 0, j = 0; i + 1 < nruns; i += 2) {
+            merge_runs(&order, items, scratch, runs[i], runs[i + 1],
+                runs[i + 2]);
+            runs[j++] = runs[i];
+        }
+        if (i < nruns) {
+            runs[j++] = runs[i];
+        }
+        runs[j] = n;
+        nruns = j;
+    }
+    free(runs);
+    free(scratch);
+}
+
+/* the items of a proper list in a malloc'ed array */
+object** list_items(object* list, long* n) {
+    object** items;
+    object* l;
+    long i;
+
+    *n = length_proc(cons(list, nil))->data.fixnum.value;
+    items = malloc((*n + 1) * sizeof(object*));
+    if (items == NULL) {
+        diagnostic("*** sort - out of memory\n");
+        exit(1);
+    }
+    for (i = 0, l = list; i < *n; i++, l = cdr(l)) {
+        items[i] = car(l);
+    }
+    return items;
+}
+
+/* (sort seq proc) as in SRFI 95, or (proc seq) as in SRFI 132 */
+void sort_arguments(object* arguments, object** seq, object** proc) {
+    if (is_nil(arguments) || is_nil(cdr(arguments))) {
+        diagnostic("*** sort expects a sequence and a procedure\n");
+        exit(1);
+    }
+    *seq = car(arguments);
+    *proc = cadr(arguments);
+    if (is_pair(*proc) || is_nil(*proc) || is_vector(*proc)) {
+        *seq = cadr(arguments);
+        *proc = car(arguments);
+    }
+}
+
+/* sorts seq in place: a vector directly, a list by refilling its cars */
+object* sort_in_place(object* seq, object* proc) {
+    object** items;
+    object* l;
+    long n;
+    long i;
+
+    if (is_vector(seq)) {
+        sort_items(seq->data.vector.items, seq->data.vector.length, proc);
+        return seq;
+    }
+    items = list_items(seq, &n);
+    sort_items(items, n, proc);
+    for (i = 0, l = seq; i < n; i++, l = cdr(l)) {
+        set_car(l, items[i]);
+    }
+    free(items);
+    return seq;
+}
+
+object* sort_proc(object* arguments) {
+    object* seq;
+    object* proc;
+
+    sort_arguments(arguments, &seq, &proc);
+    if (is_vector(seq)) {
+        seq = vector_copy_proc(cons(seq, nil));
+    }
+    else {
+        seq = copy_list_onto(list_argument(seq), nil);
+    }
+    return sort_in_place(seq, proc);
+}
+
+object* sort_to_proc(object* arguments) {
+    object* seq;
+    object* proc;
+
+    sort_arguments(arguments, &seq, &proc);
+    if (!is_vector(seq)) {
+        list_argument(seq);
+    }
+    return sort_in_place(seq, proc);
+}
+
+/* (merge list1 list2 proc) keeps items of list1 first among equals */
+object* merge_proc(object* arguments) {
+    sort_order order;
+    object* a;
+    object* b;
+    object* result;
+    object* last;
+    object* cell;
+    object* item;
+
+    a = list_argument(car(arguments));
+    b = list_argument(cadr(arguments));
+    order.kind = ORDER_PROCEDURE;
+    order.descending = 0;
+    order.proc = caddr(arguments);
+    result = nil;
+    last = NULL;
+    while (!is_nil(a) || !is_nil(b)) {
+        if (is_nil(a) || (!is_nil(b) && sort_less(&order, car(b), car(a)))) {
+            item = car(b);
+            b = cdr(b);
+        }
+        else {
+            item = car(a);
+            a = cdr(a);
+        }
+        cell = cons(item, nil);
+        if (last == NULL) {
+            result = cell;
+        }
+        else {
+            set_cdr(last, cell);
+        }
+        last = cell;
+    }
+    return result;
+}
+
+object* apply_proc(object* arguments) {
+    diagnostic("*** illegal state: The body of the apply "
+        "primitive procedure should not execute.\n");
+    exit(1);
+}
+
+object* interaction_environment_proc(object* arguments) {
+    return the_global;
+}
+
+object* setup_env(void);
+
+object* null_environment_proc(object* arguments) {
+    return setup_env();
+}
+
+object* make_environment(void);
+
+object* environment_proc(object* arguments) {
+    return make_environment();
+}
+
+object* eval_proc(object* arguments) {
+    diagnostic("*** illegal state: The body of the eval "
+        "primitive procedure should not execute.\n");
+    exit(1);
+}
+
+object* sread(reader* in);
+
+object* eval(object* exp, object* env);
+
+#define LOAD_CACHE_KEY_MAX 160
+
+char load_cache_key(char* filename, char* key);
+object* load_cached_forms(char* filename, char* key);
+void save_cached_forms(char* filename, char* key, FILE* staged);
+void fasl_write(writer* out, object* obj);
+
+/* evaluates the forms of a file; a library keeps a cache of them, a
+ * script run from the command line does not. Without a cache, each
+ * form is evaluated as soon as it is read, and the cache is written
+ * only once the whole file has read cleanly */
+object* load_file(char* filename, char cache) {
+    char key[LOAD_CACHE_KEY_MAX];
+    char cacheable;
+    FILE* stream;
+    FILE* staged;
+    reader* in;
+    writer* out;
+    object* forms = NULL;
+    object* exp;
+    object* result;
+    int frame;
+
+    result = ok_symbol;
+    cacheable = cache && load_cache_key(filename, key);
+    if (cacheable) {
+        forms = load_cached_forms(filename, key);
+    }
+    if (forms != NULL) {
+        push(the_vm, forms);
+        frame = the_vm->stackSize;
+        for (; !is_nil(forms); forms = cdr(forms)) {
+            result = eval(car(forms), the_global);
+            /* only the last result outlives its expression */
+            the_vm->stackSize = frame;
+            push(the_vm, result);
+        }
+    }
+    else {
+        stream = fopen(filename, "r");
+        if (stream == NULL) {
+            diagnostic("*** could not load file \"%s\"", filename);
+            exit(1);
+        }
+        in = open_reader(stream);
+        staged = cacheable ? tmpfile() : NULL;
+        out = (staged != NULL) ? open_writer(staged, BUFFER_BLOCK) : NULL;
+        frame = the_vm->stackSize;
+        while ((exp = sread(in)) != NULL) {
+            /* staged before evaluating it can change a quoted datum */
+            if (out != NULL) {
+                fasl_write(out, exp);
+            }
+            result = eval(exp, the_global);
+            the_vm->stackSize = frame;
+            push(the_vm, result);
+        }
+        release_reader(in);
+        free(in);
+        fclose(stream);
+        if (out != NULL) {
+            if (release_writer(out)) {
+                save_cached_forms(filename, key, staged);
+            }
+            free(out);
+            fclose(staged);
+        }
+    }
+    if (interactive) {
+        writer_puts(stdout_writer, "program-loaded\n");
+        writer_done(stdout_writer);
+    }
+    return result;
+}
+
+object* load_proc(object* arguments) {
+    return load_file(car(arguments)->data.string.value, 1);
+}
+
+object* make_input_port(reader* in);
+
+/* the port argument, or standard input when there is none */
+reader* input_port_argument(object* arguments) {
+    return is_nil(arguments) ?
+        stdin_reader :
+        car(arguments)->data.input_port.reader;
+}
+
+object* open_input_port_proc(object* arguments) {
+    char* filename;
+    FILE* in;
+
+    filename = car(arguments)->data.string.value;
+    in = fopen(filename, "r");
+    if (in == NULL) {
+        diagnostic("*** could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    return make_input_port(open_reader(in));
+}
+
+object* close_input_port_proc(object* arguments) {
+    reader* in;
+    int result;
+
+    in = car(arguments)->data.input_port.reader;
+    if (in->stream == NULL) {
+        return ok_symbol;
+    }
+    result = fclose(in->stream);
+    release_reader(in);
+    if (result == EOF) {
+        diagnostic("*** could not close input port\n");
+        exit(1);
+    }
+    return ok_symbol;
+}
+
+char is_input_port(object* obj);
+
+object* is_input_port_proc(object* arguments) {
+    return is_input_port(car(arguments)) ? true : false;
+}
+
+object* read_proc(object* arguments) {
+    object* result;
+
+    result = sread(input_port_argument(arguments));
+    return (result == NULL) ? eof_object : result;
+}
+
+object* read_char_proc(object* arguments) {
+    int result;
+
+    result = next_char(input_port_argument(arguments));
+    return (result == EOF) ? eof_object : make_character(result);
+}
+
+object* peek_char_proc(object* arguments) {
+    int result;
+
+    result = peek(input_port_argument(arguments));
+    return (result == EOF) ? eof_object : make_character(result);
+}
+
+/* the next line without its end, or NULL at the end of the input. A
+ * line that lies within the buffer is copied straight out of it */
+object* read_line(reader* in) {
+    unsigned char* start;
+    unsigned char* end;
+    unsigned char* p;
+    object* result;
+    strbuf line;
+    long n;
+
+    if (in->pos == in->end && reader_fill(in) == 0) {
+        return NULL;
+    }
+    strbuf_init(&line);
+    while (1) {
+        start = in->buf + in->pos;
+        end = in->buf + in->end;
+        p = memchr(start, '\n', end - start);
+        if (p != NULL) {
+            in->pos = p + 1 - in->buf;
+            n = (long)(p - start);
+            if (line.length == 0) {
+                if (n > 0 && start[n - 1] == '\r') {
+                    n--;
+                }
+                free(line.data);
+                return make_string_n((char*)start, n);
+            }
+            strbuf_add(&line, (char*)start, n);
+            break;
+        }
+        strbuf_add(&line, (char*)start, (long)(end - start));
+        in->pos = in->end;
+        if (reader_fill(in) == 0) {
+            break;
+        }
+    }
+    if (line.length > 0 && line.data[line.length - 1] == '\r') {
+        line.length--;
+    }
+    result = make_string_n(line.data, line.length);
+    free(line.data);
+    return result;
+}
+
+/* (read-line [port]) */
+object* read_line_proc(object* arguments) {
+    object* result;
+
+    result = read_line(input_port_argument(arguments));
+    return (result == NULL) ? eof_object : result;
+}
+
+/* (read-string k [port]) */
+object* read_string_proc(object* arguments) {
+    object* str;
+    strbuf text;
+    reader* in;
+    long k;
+    size_t avail;
+
+    k = fixnum_argument(car(arguments));
+    if (k < 0) {
+        diagnostic("*** read-string count %ld is negative\n", k);
+        exit(1);
+    }
+    in = input_port_argument(cdr(arguments));
+    /* a buffer at a time, so a large k costs only what is there */
+    strbuf_init(&text);
+    while (text.length < k) {
+        if (in->pos == in->end && reader_fill(in) == 0) {
+            break;
+        }
+        avail = in->end - in->pos;
+        if (avail > (size_t)(k - text.length)) {
+            avail = (size_t)(k - text.length);
+        }
+        strbuf_add(&text, (char*)in->buf + in->pos, (long)avail);
+        in->pos += avail;
+    }
+    if (text.length == 0 && k > 0) {
+        return eof_object;
+    }
+    str = make_string_n(text.data, text.length);
+    free(text.data);
+    return str;
+}
+
+/* (read-string! str [port [start [end]]]) returns the count read */
+object* read_string_to_proc(object* arguments) {
+    object* str;
+    reader* in;
+    long start = 0;
+    long end;
+    size_t n;
+
+    str = string_argument(car(arguments));
+    arguments = cdr(arguments);
+    in = input_port_argument(arguments);
+    end = str->data.string.length;
+    if (!is_nil(arguments) && !is_nil(cdr(arguments))) {
+        start = fixnum_argument(cadr(arguments));
+        if (!is_nil(cddr(arguments))) {
+            end = fixnum_argument(caddr(arguments));
+        }
+    }
+    if (start < 0 || end > str->data.string.length || start > end) {
+        diagnostic("*** string range %ld..%ld out of bounds\n",
+            start, end);
+        exit(1);
+    }
+    n = reader_read(in, (unsigned char*)str->data.string.value + start,
+        end - start);
+    if (n == 0 && end > start) {
+        return eof_object;
+    }
+    return make_fixnum((long)n);
+}
+
+/* (char-ready? [port]) is true when read-char would not block */
+object* char_ready_proc(object* arguments) {
+    reader* in;
+
+    in = input_port_argument(arguments);
+    if (in->pos < in->end || in->whole || in->stream == NULL) {
+        return true;
+    }
+#if defined(HAVE_MMAP)
+    {
+        struct pollfd fd;
+
+        /* an error or a hangup does not block either */
+        fd.fd = fileno(in->stream);
+        fd.events = POLLIN;
+        fd.revents = 0;
+        return (poll(&fd, 1, 0) != 0) ? true : false;
+    }
+#else
+    return true;
+#endif
+}
+
+/* (port-fold-lines proc seed [port]) calls (proc line acc) for each
+ * line in turn, without keeping the lines read before */
+object* port_fold_lines_proc(object* arguments) {
+    object* proc;
+    object* acc;
+    object* line;
+    reader* in;
+    int frame;
+
+    proc = car(arguments);
+    acc = cadr(arguments);
+    in = input_port_argument(cddr(arguments));
+    frame = the_vm->stackSize;
+    while ((line = read_line(in)) != NULL) {
+        acc = apply_procedure(proc, cons(line, cons(acc, nil)));
+        the_vm->stackSize = frame;
+        push(the_vm, acc);
+    }
+    return acc;
+}
+
+char is_eof_object(object* obj);
+
+object* is_eof_object_proc(object* arguments) {
+    return is_eof_object(car(arguments)) ? true : false;
+}
+
+object* make_output_port(writer* out);
+
+/* the port argument, or standard output when there is none */
+writer* output_port_argument(object* arguments) {
+    return is_nil(arguments) ?
+        stdout_writer :
+        car(arguments)->data.output_port.writer;
+}
+
+object* open_output_port_proc(object* arguments) {
+    char* filename;
+    FILE* out;
+
+    filename = car(arguments)->data.string.value;
+    out = fopen(filename, "w");
+    if (out == NULL) {
+        diagnostic("*** could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    return make_output_port(open_writer(out, BUFFER_BLOCK));
+}
+
+/* flushes what is buffered before closing the stream */
+object* close_output_port_proc(object* arguments) {
+    writer* out;
+    FILE* stream;
+    char flushed;
+
+    out = car(arguments)->data.output_port.writer;
+    stream = out->stream;
+    if (stream == NULL) {
+        return ok_symbol;
+    }
+    if (out == stdout_writer || out == stderr_writer) {
+        /* the standard streams stay open for the rest of the program */
+        writer_flush_or_die(out);
+        return ok_symbol;
+    }
+    flushed = release_writer(out);
+    if (fclose(stream) == EOF || !flushed) {
+        diagnostic("*** could not close output port\n");
+        exit(1);
+    }
+    return ok_symbol;
+}
+
+/* (flush-output-port [port]) */
+object* flush_output_port_proc(object* arguments) {
+    writer_flush_or_die(output_port_argument(arguments));
+    return ok_symbol;
+}
+
+buffer_mode buffer_mode_argument(object* obj) {
+    if (obj->type == SYMBOL) {
+        if (strcmp(obj->data.symbol.value, "none") == 0) {
+            return BUFFER_NONE;
+        }
+        if (strcmp(obj->data.symbol.value, "line") == 0) {
+            return BUFFER_LINE;
+        }
+        if (strcmp(obj->data.symbol.value, "block") == 0) {
+            return BUFFER_BLOCK;
+        }
+    }
+    diagnostic("*** buffering must be none, line or block\n");
+    exit(1);
+}
+
+/* (current-output-port) is standard output, so its buffering can be
+ * set like that of any other port */
+object* current_output_port_proc(object* arguments) {
+    return make_output_port(stdout_writer);
+}
+
+object* current_error_port_proc(object* arguments) {
+    return make_output_port(stderr_writer);
+}
+
+/* (output-port-buffering [port]) answers none, line or block */
+object* output_port_buffering_proc(object* arguments) {
+    switch (output_port_argument(arguments)->mode) {
+    case BUFFER_NONE:
+        return make_symbol("none");
+    case BUFFER_LINE:
+        return make_symbol("line");
+    default:
+        return make_symbol("block");
+    }
+}
+
+/* (set-output-port-buffering! [port] mode) flushes, then buffers as
+ * mode says: none after every write, line at each newline, block
+ * when the buffer fills. Without a port it sets standard output */
+object* set_output_port_buffering_proc(object* arguments) {
+    writer* out;
+
+    if (is_nil(cdr(arguments))) {
+        out = stdout_writer;
+    }
+    else {
+        out = car(arguments)->data.output_port.writer;
+        arguments = cdr(arguments);
+    }
+    writer_flush_or_die(out);
+    out->mode = buffer_mode_argument(car(arguments));
+    return ok_symbol;
+}
+
+char is_output_port(object* obj);
+
+object* is_output_port_proc(object* arguments) {
+    return is_output_port(car(arguments)) ? true : false;
+}
+
+object* write_char_proc(object* arguments) {
+    object* character;
+    writer* out;
+
+    character = car(arguments);
+    out = output_port_argument(cdr(arguments));
+    writer_putc(out, character->data.character.value);
+    writer_done(out);
+    return ok_symbol;
+}
+
+void swrite(writer* out, object* obj);
+
+typedef enum { LABEL_NONE, LABEL_CYCLES, LABEL_SHARED } label_mode;
+
+void write_datum(writer* out, object* obj, label_mode mode);
+
+/* write labels cycles, write-shared all shared structure and
+ * write-simple nothing */
+object* write_proc(object* arguments) {
+    object* exp;
+    writer* out;
+
+    exp = car(arguments);
+    out = output_port_argument(cdr(arguments));
+    swrite(out, exp);
+    writer_done(out);
+    return ok_symbol;
+}
+
+object* write_shared_proc(object* arguments) {
+    writer* out;
+
+    out = output_port_argument(cdr(arguments));
+    write_datum(out, car(arguments), LABEL_SHARED);
+    writer_done(out);
+    return ok_symbol;
+}
+
+object* write_simple_proc(object* arguments) {
+    writer* out;
+
+    out = output_port_argument(cdr(arguments));
+    write_datum(out, car(arguments), LABEL_NONE);
+    writer_done(out);
+    return ok_symbol;
+}
+
+/* binary ports are ordinary ports opened in binary mode; the bulk
+ * operations move whole ranges with one memcpy through the port's
+ * buffer */
+
+object* open_binary_input_file_proc(object* arguments) {
+    char* filename;
+    FILE* in;
+
+    filename = string_argument(car(arguments))->data.string.value;
+    in = fopen(filename, "rb");
+    if (in == NULL) {
+        diagnostic("*** could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    return make_input_port(open_reader(in));
+}
+
+object* open_binary_output_file_proc(object* arguments) {
+    char* filename;
+    FILE* out;
+
+    filename = string_argument(car(arguments))->data.string.value;
+    out = fopen(filename, "wb");
+    if (out == NULL) {
+        diagnostic("*** could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    return make_output_port(open_writer(out, BUFFER_BLOCK));
+}
+
+object* read_u8_proc(object* arguments) {
+    int result;
+
+    result = next_char(input_port_argument(arguments));
+    return (result == EOF) ? eof_object : make_fixnum(result);
+}
+
+object* peek_u8_proc(object* arguments) {
+    int result;
+
+    result = peek(input_port_argument(arguments));
+    return (result == EOF) ? eof_object : make_fixnum(result);
+}
+
+object* write_u8_proc(object* arguments) {
+    int byte;
+    writer* out;
+
+    byte = byte_argument(car(arguments));
+    out = output_port_argument(cdr(arguments));
+    writer_putc(out, (char)byte);
+    writer_done(out);
+    return ok_symbol;
+}
+
+/* (read-bytevector k [port]) */
+object* read_bytevector_proc(object* arguments) {
+    object* bv;
+    object* result;
+    reader* in;
+    long k;
+    size_t n;
+
+    k = fixnum_argument(car(arguments));
+    arguments = cdr(arguments);
+    in = input_port_argument(arguments);
+    bv = make_bytevector(k, 0);
+    n = reader_read(in, bv->data.bytevector.bytes, k);
+    if (n == 0 && k > 0) {
+        return eof_object;
+    }
+    if ((long)n == k) {
+        return bv;
+    }
+    result = make_bytevector((long)n, 0);
+    memcpy(result->data.bytevector.bytes, bv->data.bytevector.bytes, n);
+    return result;
+}
+
+/* (read-bytevector! bv [port [start [end]]]) returns the count read */
+object* read_bytevector_to_proc(object* arguments) {
+    object* bv;
+    reader* in;
+    long start;
+    long end;
+    size_t n;
+
+    bv = bytevector_argument(car(arguments));
+    arguments = cdr(arguments);
+    in = input_port_argument(arguments);
+    bytevector_range(bv, is_nil(arguments) ? nil : cdr(arguments),
+        &start, &end);
+    n = reader_read(in, bv->data.bytevector.bytes + start, end - start);
+    if (n == 0 && end > start) {
+        return eof_object;
+    }
+    return make_fixnum((long)n);
+}
+
+/* (write-bytevector bv [port [start [end]]]) */
+object* write_bytevector_proc(object* arguments) {
+    object* bv;
+    writer* out;
+    long start;
+    long end;
+
+    bv = bytevector_argument(car(arguments));
+    arguments = cdr(arguments);
+    out = output_port_argument(arguments);
+    bytevector_range(bv, is_nil(arguments) ? nil : cdr(arguments),
+        &start, &end);
+    writer_write(out, (char*)bv->data.bytevector.bytes + start, end - start);
+    writer_done(out);
+    return ok_symbol;
+}
+
+object* error_proc(object* arguments) {
+    writer_flush(stdout_writer);
+    while (!is_nil(arguments)) {
+        swrite(stderr_writer, car(arguments));
+        writer_putc(stderr_writer, ' ');
+        arguments = cdr(arguments);
+    };
+    writer_flush(stderr_writer);
+    writer_puts(stdout_writer, "\n*** exiting\n");
+    exit(1);
+}
+
+/* (exit [code]) where #t means success and #f failure */
+object* exit_proc(object* arguments) {
+    int code = 0;
+
+    if (!is_nil(arguments)) {
+        if (is_fixnum(car(arguments))) {
+            code = (int)car(arguments)->data.fixnum.value;
+        }
+        else if (car(arguments) == false) {
+            code = 1;
+        }
+    }
+    exit(code);
+}
+
+/* the script and its arguments, or just the interpreter without one */
+object* command_line_proc(object* arguments) {
+    object* result = nil;
+    int i;
+
+    for (i = command_argc - 1; i >= 0; i--) {
+        result = cons(make_string(command_argv[i]), result);
+    }
+    return result;
+}
+
+object* make_compound_proc(object* params, object* body,
+    object* env) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = COMPOUND_PROC;
+    obj->data.compound_proc.params = params;
+    obj->data.compound_proc.body = body;
+    obj->data.compound_proc.env = env;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_compound_proc(object* obj) {
+    return obj->type == COMPOUND_PROC;
+}
+
+object* make_input_port(reader* in) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = INPUT_PORT;
+    obj->data.input_port.reader = in;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_input_port(object* obj) {
+    return obj->type == INPUT_PORT;
+}
+
+object* make_output_port(writer* out) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = OUTPUT_PORT;
+    obj->data.output_port.writer = out;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_output_port(object* obj) {
+    return obj->type == OUTPUT_PORT;
+}
+
+char is_eof_object(object* obj) {
+    return obj == eof_object;
+}
+
+
+/*************************** MATRICES ****************************/
+
+#define MATRIX_BLOCK 64            /* tile edge for blocked multiply */
+
+#define matrix_of(obj) ((obj)->data.matrix.m)
+
+/* address of element (i, j); complex elements are (re, im) pairs */
+#define matrix_at(mx, i, j) \
+    ((mx)->elems + ((mx)->is_complex ? 2 : 1) * ((i) * (mx)->stride + (j)))
+
+object* make_matrix(long rows, long cols, char is_complex) {
+    object* obj;
+    matrix* mx;
+
+    if (rows < 0 || cols < 0) {
+        diagnostic("*** invalid matrix dimensions\n");
+        exit(1);
+    }
+    mx = malloc(sizeof(matrix));
+    if (mx != NULL) {
+        mx->elems = calloc((rows * cols > 0) ? rows * cols : 1,
+            (is_complex ? 2 : 1) * sizeof(double));
+    }
+    if (mx == NULL || mx->elems == NULL) {
+        diagnostic("*** cannot create matrix - out of memory\n");
+        exit(1);
+    }
+    mx->rows = rows;
+    mx->cols = cols;
+    mx->stride = cols;
+    mx->is_complex = is_complex;
+
+    obj = alloc_object();
+    obj->type = MATRIX;
+    obj->data.matrix.m = mx;
+    obj->data.matrix.base = NULL;
+    push(the_vm, obj);
+    return obj;
+}
+
+/* a view shares the storage of base and keeps it alive */
+object* make_matrix_view(object* base, long row, long col,
+    long rows, long cols, long stride) {
+    object* obj;
+    matrix* from;
+    matrix* mx;
+
+    from = matrix_of(base);
+    mx = malloc(sizeof(matrix));
+    if (mx == NULL) {
+        diagnostic("*** cannot create matrix - out of memory\n");
+        exit(1);
+    }
+    mx->rows = rows;
+    mx->cols = cols;
+    mx->stride = stride;
+    mx->is_complex = from->is_complex;
+    mx->elems = matrix_at(from, row, col);
+
+    obj = alloc_object();
+    obj->type = MATRIX;
+    obj->data.matrix.m = mx;
+    obj->data.matrix.base =
+        (base->data.matrix.base != NULL) ? base->data.matrix.base : base;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_matrix(object* obj) {
+    return obj->type == MATRIX;
+}
+
+matrix* matrix_argument(object* obj) {
+    if (!is_matrix(obj)) {
+        diagnostic("*** expected a matrix\n");
+        exit(1);
+    }
+    return matrix_of(obj);
+}
+
+void matrix_check_index(matrix* mx, long i, long j) {
+    if (i < 0 || i >= mx->rows || j < 0 || j >= mx->cols) {
+        diagnostic("*** matrix index (%ld %ld) out of range\n", i, j);
+        exit(1);
+    }
+}
+
+object* matrix_element(matrix* mx, long i, long j) {
+    double* e;
+
+    e = matrix_at(mx, i, j);
+    return mx->is_complex ? make_cpxnum(e[0], e[1]) : make_flonum(e[0]);
+}
+
+void matrix_store(matrix* mx, long i, long j, object* value) {
+    double* e;
+
+    e = matrix_at(mx, i, j);
+    if (is_cpxnum(value)) {
+        if (!mx->is_complex) {
+            diagnostic("*** cannot store a complex number "
+                "in a real matrix\n");
+            exit(1);
+        }
+        e[0] = creal(value->data.cpxnum.value);
+        e[1] = cimag(value->data.cpxnum.value);
+    }
+    else {
+        e[0] = real_value(value);
+        if (mx->is_complex) {
+            e[1] = 0.0;
+        }
+    }
+}
+
+/* contiguous copy of any matrix or view */
+object* matrix_copy(matrix* from) {
+    object* obj;
+    matrix* to;
+    long width;
+    long i;
+
+    obj = make_matrix(from->rows, from->cols, from->is_complex);
+    to = matrix_of(obj);
+    width = (from->is_complex ? 2 : 1) * from->cols;
+    for (i = 0; i < from->rows; i++) {
+        memcpy(matrix_at(to, i, 0), matrix_at(from, i, 0),
+            width * sizeof(double));
+    }
+    return obj;
+}
+
+/* a contiguous copy that is complex when is_complex asks, so real and
+ * complex operands can meet in one kernel */
+object* matrix_copy_as(matrix* from, char is_complex) {
+    object* obj;
+    matrix* to;
+    long i, j;
+
+    if (from->is_complex || !is_complex) {
+        return matrix_copy(from);
+    }
+    obj = make_matrix(from->rows, from->cols, 1);
+    to = matrix_of(obj);
+    for (i = 0; i < from->rows; i++) {
+        for (j = 0; j < from->cols; j++) {
+            *matrix_at(to, i, j) = *matrix_at(from, i, j);
+        }
+    }
+    return obj;
+}
+
+/* y += a * x, the inner kernel of the real multiply */
+void axpy(double* y, double* x, double a, long n) {
+    long j = 0;
+#if defined(HAVE_SSE2)
+    __m128d va = _mm_set1_pd(a);
+
+    for (; j + 4 <= n; j += 4) {
+        _mm_storeu_pd(y + j, _mm_add_pd(_mm_loadu_pd(y + j),
+            _mm_mul_pd(va, _mm_loadu_pd(x + j))));
+        _mm_storeu_pd(y + j + 2, _mm_add_pd(_mm_loadu_pd(y + j + 2),
+            _mm_mul_pd(va, _mm_loadu_pd(x + j + 2))));
+    }
+#endif
+    for (; j < n; j++) {
+        y[j] += a * x[j];
+    }
+}
+
+/* complex y += a * x on interleaved (re, im) pairs */
+void caxpy(double* y, double* x, double are, double aim, long n) {
+    long j;
+
+    for (j = 0; j < n; j++) {
+        y[2 * j] += are * x[2 * j] - aim * x[2 * j + 1];
+        y[2 * j + 1] += are * x[2 * j + 1] + aim * x[2 * j];
+    }
+}
+
+/*
+ * c = a * b, tiled so that a MATRIX_BLOCK square of each operand
+ * stays in cache. The i-k-j order streams rows of b and c through
+ * the vectorised axpy kernel.
+ */
+void matrix_multiply(matrix* a, matrix* b, matrix* c) {
+    long ii, kk, jj;
+    long i, k;
+    long iend, kend, jlen;
+    double* e;
+
+    for (ii = 0; ii < a->rows; ii += MATRIX_BLOCK) {
+        iend = (ii + MATRIX_BLOCK < a->rows) ? ii + MATRIX_BLOCK : a->rows;
+        for (kk = 0; kk < a->cols; kk += MATRIX_BLOCK) {
+            kend = (kk + MATRIX_BLOCK < a->cols) ?
+                kk + MATRIX_BLOCK : a->cols;
+            for (jj = 0; jj < b->cols; jj += MATRIX_BLOCK) {
+                jlen = (jj + MATRIX_BLOCK < b->cols) ?
+                    MATRIX_BLOCK : b->cols - jj;
+                for (i = ii; i < iend; i++) {
+                    for (k = kk; k < kend; k++) {
+                        if (c->is_complex) {
+                            e = matrix_at(a, i, k);
+                            caxpy(matrix_at(c, i, jj), matrix_at(b, k, jj),
+                                e[0], a->is_complex ? e[1] : 0.0, jlen);
+                        }
+                        else {
+                            axpy(matrix_at(c, i, jj), matrix_at(b, k, jj),
+                                *matrix_at(a, i, k), jlen);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+object* is_matrix_proc(object* arguments) {
+    return is_matrix(car(arguments)) ? true : false;
+}
+
+object* make_matrix_proc(object* arguments) {
+    object* obj;
+    object* fill;
+    matrix* mx;
+    long i, j;
+
+    fill = is_nil(cddr(arguments)) ? NULL : caddr(arguments);
+    obj = make_matrix(car(arguments)->data.fixnum.value,
+        cadr(arguments)->data.fixnum.value,
+        fill != NULL && is_cpxnum(fill));
+    if (fill != NULL) {
+        mx = matrix_of(obj);
+        for (i = 0; i < mx->rows; i++) {
+            for (j = 0; j < mx->cols; j++) {
+                matrix_store(mx, i, j, fill);
+            }
+        }
+    }
+    return obj;
+}
+
+object* matrix_rows_proc(object* arguments) {
+    return make_fixnum(matrix_argument(car(arguments))->rows);
+}
+
+object* matrix_cols_proc(object* arguments) {
+    return make_fixnum(matrix_argument(car(arguments))->cols);
+}
+
+object* matrix_ref_proc(object* arguments) {
+    matrix* mx;
+    long i, j;
+
+    mx = matrix_argument(car(arguments));
+    i = cadr(arguments)->data.fixnum.value;
+    j = caddr(arguments)->data.fixnum.value;
+    matrix_check_index(mx, i, j);
+    return matrix_element(mx, i, j);
+}
+
+object* matrix_set_proc(object* arguments) {
+    matrix* mx;
+    long i, j;
+
+    mx = matrix_argument(car(arguments));
+    i = cadr(arguments)->data.fixnum.value;
+    j = caddr(arguments)->data.fixnum.value;
+    matrix_check_index(mx, i, j);
+    matrix_store(mx, i, j, cadddr(arguments));
+    return ok_symbol;
+}
+
+/* (list->matrix '((1 2) (3 4))) */
+object* list_to_matrix_proc(object* arguments) {
+    object* rows;
+    object* row;
+    object* obj;
+    matrix* mx;
+    long nrows = 0;
+    long ncols = -1;
+    long n;
+    long i, j;
+    char is_complex = 0;
+
+    for (rows = car(arguments); !is_nil(rows); rows = cdr(rows)) {
+        n = 0;
+        for (row = car(rows); !is_nil(row); row = cdr(row)) {
+            is_complex |= is_cpxnum(car(row));
+            n++;
+        }
+        if (ncols >= 0 && n != ncols) {
+            diagnostic("*** list->matrix: rows of different length\n");
+            exit(1);
+        }
+        ncols = n;
+        nrows++;
+    }
+    obj = make_matrix(nrows, ncols < 0 ? 0 : ncols, is_complex);
+    mx = matrix_of(obj);
+    for (rows = car(arguments), i = 0; !is_nil(rows); rows = cdr(rows), i++) {
+        for (row = car(rows), j = 0; !is_nil(row); row = cdr(row), j++) {
+            matrix_store(mx, i, j, car(row));
+        }
+    }
+    return obj;
+}
+
+object* matrix_to_list_proc(object* arguments) {
+    matrix* mx;
+    object* rows = nil;
+    object* row;
+    long i, j;
+
+    mx = matrix_argument(car(arguments));
+    for (i = mx->rows - 1; i >= 0; i--) {
+        row = nil;
+        for (j = mx->cols - 1; j >= 0; j--) {
+            row = cons(matrix_element(mx, i, j), row);
+        }
+        rows = cons(row, rows);
+    }
+    return rows;
+}
+
+/* a rows x cols matrix of the items row by row, complex when any
+ * item is */
+object* matrix_of_items(object** items, long rows, long cols) {
+    object* obj;
+    matrix* mx;
+    long i;
+    char is_complex = 0;
+
+    for (i = 0; i < rows * cols; i++) {
+        is_complex |= is_cpxnum(items[i]);
+    }
+    obj = make_matrix(rows, cols, is_complex);
+    mx = matrix_of(obj);
+    for (i = 0; i < rows * cols; i++) {
+        matrix_store(mx, i / cols, i % cols, items[i]);
+    }
+    return obj;
+}
+
+/* (vector->matrix v rows cols) copies v, row by row, into a matrix
+ * that is complex when any element is */
+object* vector_to_matrix_proc(object* arguments) {
+    object* vec;
+    long rows, cols;
+
+    vec = vector_argument(car(arguments));
+    rows = fixnum_argument(cadr(arguments));
+    cols = fixnum_argument(caddr(arguments));
+    if (rows < 0 || cols < 0 || rows * cols != vec->data.vector.length) {
+        diagnostic("*** vector->matrix: %ld elements cannot be "
+            "%ldx%ld\n", vec->data.vector.length, rows, cols);
+        exit(1);
+    }
+    return matrix_of_items(vec->data.vector.items, rows, cols);
+}
+
+/* (matrix->vector m) copies the elements out row by row */
+object* matrix_to_vector_proc(object* arguments) {
+    object* vec;
+    matrix* mx;
+    long i, j;
+    int frame;
+
+    mx = matrix_argument(car(arguments));
+    vec = make_vector(mx->rows * mx->cols, nil);
+    frame = the_vm->stackSize;
+    for (i = 0; i < mx->rows; i++) {
+        for (j = 0; j < mx->cols; j++) {
+            vec->data.vector.items[i * mx->cols + j] =
+                matrix_element(mx, i, j);
+            the_vm->stackSize = frame;
+        }
+    }
+    return vec;
+}
+
+object* matrix_copy_proc(object* arguments) {
+    return matrix_copy(matrix_argument(car(arguments)));
+}
+
+/* (matrix-slice m row col rows cols) shares storage with m */
+object* matrix_slice_proc(object* arguments) {
+    object* base;
+    matrix* mx;
+    long row, col, rows, cols;
+
+    base = car(arguments);
+    mx = matrix_argument(base);
+    row = cadr(arguments)->data.fixnum.value;
+    col = caddr(arguments)->data.fixnum.value;
+    rows = cadddr(arguments)->data.fixnum.value;
+    cols = car(cddddr(arguments))->data.fixnum.value;
+    if (row < 0 || col < 0 || rows < 0 || cols < 0 ||
+        row + rows > mx->rows || col + cols > mx->cols) {
+        diagnostic("*** matrix-slice out of range\n");
+        exit(1);
+    }
+    return make_matrix_view(base, row, col, rows, cols, mx->stride);
+}
+
+/* (matrix-reshape m rows cols) views contiguous storage with a new shape */
+object* matrix_reshape_proc(object* arguments) {
+    object* base;
+    matrix* mx;
+    long rows, cols;
+
+    base = car(arguments);
+    mx = matrix_argument(base);
+    rows = cadr(arguments)->data.fixnum.value;
+    cols = caddr(arguments)->data.fixnum.value;
+    if (rows < 0 || cols < 0 || rows * cols != mx->rows * mx->cols) {
+        diagnostic("*** matrix-reshape: size mismatch\n");
+        exit(1);
+    }
+    if (mx->stride != mx->cols && mx->rows > 1) {
+        base = matrix_copy(mx);
+    }
+    return make_matrix_view(base, 0, 0, rows, cols, cols);
+}
+
+object* matrix_transpose_proc(object* arguments) {
+    object* obj;
+    matrix* mx;
+    matrix* t;
+    long ii, jj, i, j;
+    long width;
+
+    mx = matrix_argument(car(arguments));
+    obj = make_matrix(mx->cols, mx->rows, mx->is_complex);
+    t = matrix_of(obj);
+    width = mx->is_complex ? 2 : 1;
+    for (ii = 0; ii < mx->rows; ii += MATRIX_BLOCK) {
+        for (jj = 0; jj < mx->cols; jj += MATRIX_BLOCK) {
+            for (i = ii; i < mx->rows && i < ii + MATRIX_BLOCK; i++) {
+                for (j = jj; j < mx->cols && j < jj + MATRIX_BLOCK; j++) {
+                    memcpy(matrix_at(t, j, i), matrix_at(mx, i, j),
+                        width * sizeof(double));
+                }
+            }
+        }
+    }
+    return obj;
+}
+
+/*
+ * (matrix-map proc m) applies proc to every element. An elementary
+ * primitive runs over a contiguous copy in one pass, complex when m is
+ * or when an element is outside its real domain; any other procedure
+ * is called per element and the results gathered as vector->matrix
+ * does.
+ */
+object* matrix_map_proc(object* arguments) {
+    batch_elementary* b;
+    object* proc;
+    object* obj;
+    object* results;
+    matrix* mx;
+    long n;
+    long i, j;
+    int frame;
+
+    proc = car(arguments);
+    mx = matrix_argument(cadr(arguments));
+    n = mx->rows * mx->cols;
+    b = find_batch_elementary(proc);
+    if (b != NULL) {
+        obj = matrix_copy(mx);
+        if (!mx->is_complex &&
+            batch_in_domain(b, matrix_of(obj)->elems, n)) {
+            batch_apply(b, matrix_of(obj)->elems, n);
+            return obj;
+        }
+        obj = matrix_copy_as(matrix_of(obj), 1);
+        batch_apply_complex(b, matrix_of(obj)->elems, n);
+        return obj;
+    }
+    results = make_vector(n, nil);
+    frame = the_vm->stackSize;
+    for (i = 0; i < mx->rows; i++) {
+        for (j = 0; j < mx->cols; j++) {
+            results->data.vector.items[i * mx->cols + j] =
+                apply_procedure(proc, cons(matrix_element(mx, i, j), nil));
+            the_vm->stackSize = frame;
+        }
+    }
+    return matrix_of_items(results->data.vector.items, mx->rows, mx->cols);
+}
+
+object* matrix_mul_proc(object* arguments) {
+    object* obj;
+    matrix* a;
+    matrix* b;
+
+    a = matrix_argument(car(arguments));
+    b = matrix_argument(cadr(arguments));
+    if (a->cols != b->rows) {
+        diagnostic("*** matrix-mul: %ldx%ld times %ldx%ld\n",
+            a->rows, a->cols, b->rows, b->cols);
+        exit(1);
+    }
+    if (a->is_complex && !b->is_complex) {
+        /* the kernel wants the complex operand on the right */
+        b = matrix_of(matrix_copy_as(b, 1));
+    }
+    obj = make_matrix(a->rows, b->cols, a->is_complex || b->is_complex);
+    matrix_multiply(a, b, matrix_of(obj));
+    return obj;
+}
+
+void check_solve_operands(matrix* a, matrix* b, char* who) {
+    if (a->rows != b->rows) {
+        diagnostic("*** %s: right hand side has %ld rows, "
+            "expected %ld\n", who, b->rows, a->rows);
+        exit(1);
+    }
+}
+
+/*
+ * The solvers take real or complex matrices. An element is reached as
+ * a double*, one double when real and a (re, im) pair when complex,
+ * and a real operand meeting a complex one is copied as complex.
+ */
+
+/* y -= a * x over n elements */
+void matrix_row_sub(char is_complex, double* y, double* x, double* a,
+    long n) {
+    if (is_complex) {
+        caxpy(y, x, -a[0], -a[1], n);
+    }
+    else {
+        axpy(y, x, -a[0], n);
+    }
+}
+
+/* z /= d */
+void element_divide(char is_complex, double* z, double* d) {
+    double m;
+    double re;
+
+    if (!is_complex) {
+        z[0] /= d[0];
+        return;
+    }
+    m = d[0] * d[0] + d[1] * d[1];
+    re = (z[0] * d[0] + z[1] * d[1]) / m;
+    z[1] = (z[1] * d[0] - z[0] * d[1]) / m;
+    z[0] = re;
+}
+
+double element_modulus(char is_complex, double* z) {
+    return is_complex ? hypot(z[0], z[1]) : fabs(z[0]);
+}
+
+/* solves a x = b by LU decomposition with partial pivoting */
+object* matrix_lu_solve_proc(object* arguments) {
+    object* lu_obj;
+    object* x_obj;
+    matrix* a;
+    matrix* b;
+    matrix* lu;
+    matrix* x;
+    double* tmp;
+    double* e;
+    double best;
+    double f;
+    long n, i, j, k, p;
+    long width;
+    char cpx;
+
+    a = matrix_argument(car(arguments));
+    b = matrix_argument(cadr(arguments));
+    if (a->rows != a->cols) {
+        diagnostic("*** matrix-lu-solve: matrix is not square\n");
+        exit(1);
+    }
+    check_solve_operands(a, b, "matrix-lu-solve");
+    cpx = a->is_complex || b->is_complex;
+    width = cpx ? 2 : 1;
+    n = a->rows;
+    lu_obj = matrix_copy_as(a, cpx);
+    lu = matrix_of(lu_obj);
+    x_obj = matrix_copy_as(b, cpx);
+    x = matrix_of(x_obj);
+
+    for (k = 0; k < n; k++) {
+        p = k;
+        best = element_modulus(cpx, matrix_at(lu, k, k));
+        for (i = k + 1; i < n; i++) {
+            if (element_modulus(cpx, matrix_at(lu, i, k)) > best) {
+                p = i;
+                best = element_modulus(cpx, matrix_at(lu, i, k));
+            }
+        }
+        if (best == 0.0) {
+            diagnostic("*** matrix-lu-solve: matrix is singular\n");
+            exit(1);
+        }
+        if (p != k) {
+            /* swap whole rows of both the factor and the rhs */
+            for (j = 0; j < width * n; j++) {
+                f = matrix_at(lu, k, 0)[j];
+                matrix_at(lu, k, 0)[j] = matrix_at(lu, p, 0)[j];
+                matrix_at(lu, p, 0)[j] = f;
+            }
+            for (j = 0; j < width * x->cols; j++) {
+                f = matrix_at(x, k, 0)[j];
+                matrix_at(x, k, 0)[j] = matrix_at(x, p, 0)[j];
+                matrix_at(x, p, 0)[j] = f;
+            }
+        }
+        for (i = k + 1; i < n; i++) {
+            e = matrix_at(lu, i, k);
+            element_divide(cpx, e, matrix_at(lu, k, k));
+            matrix_row_sub(cpx, matrix_at(lu, i, k + 1),
+                matrix_at(lu, k, k + 1), e, n - k - 1);
+            matrix_row_sub(cpx, matrix_at(x, i, 0), matrix_at(x, k, 0), e,
+                x->cols);
+        }
+    }
+    /* back substitution, one row of the rhs at a time */
+    for (i = n - 1; i >= 0; i--) {
+        tmp = matrix_at(x, i, 0);
+        for (k = i + 1; k < n; k++) {
+            matrix_row_sub(cpx, tmp, matrix_at(x, k, 0), matrix_at(lu, i, k),
+                x->cols);
+        }
+        for (j = 0; j < x->cols; j++) {
+            element_divide(cpx, tmp + width * j, matrix_at(lu, i, i));
+        }
+    }
+    return x_obj;
+}
+
+/* lower triangular l with a = l l^H for hermitian positive definite
+ * a, which for a real a is l l^T; only the lower triangle is read */
+object* cholesky(matrix* a, char* who) {
+    object* l_obj;
+    matrix* l;
+    double* p;
+    double* q;
+    double sr, si;
+    long n, i, j, k;
+    char cpx;
+
+    if (a->rows != a->cols) {
+        diagnostic("*** %s: matrix is not square\n", who);
+        exit(1);
+    }
+    cpx = a->is_complex;
+    n = a->rows;
+    l_obj = make_matrix(n, n, cpx);
+    l = matrix_of(l_obj);
+    for (j = 0; j < n; j++) {
+        sr = *matrix_at(a, j, j);
+        for (k = 0; k < j; k++) {
+            p = matrix_at(l, j, k);
+            sr -= p[0] * p[0] + (cpx ? p[1] * p[1] : 0.0);
+        }
+        if (sr <= 0.0) {
+            diagnostic("*** %s: matrix is not positive definite\n",
+                who);
+            exit(1);
+        }
+        *matrix_at(l, j, j) = sqrt(sr);
+        for (i = j + 1; i < n; i++) {
+            p = matrix_at(a, i, j);
+            sr = p[0];
+            si = cpx ? p[1] : 0.0;
+            /* less l[i][k] conj(l[j][k]) */
+            for (k = 0; k < j; k++) {
+                p = matrix_at(l, i, k);
+                q = matrix_at(l, j, k);
+                if (cpx) {
+                    sr -= p[0] * q[0] + p[1] * q[1];
+                    si -= p[1] * q[0] - p[0] * q[1];
+                }
+                else {
+                    sr -= p[0] * q[0];
+                }
+            }
+            p = matrix_at(l, i, j);
+            p[0] = sr / *matrix_at(l, j, j);
+            if (cpx) {
+                p[1] = si / *matrix_at(l, j, j);
+            }
+        }
+    }
+    return l_obj;
+}
+
+object* matrix_cholesky_proc(object* arguments) {
+    return cholesky(matrix_argument(car(arguments)), "matrix-cholesky");
+}
+
+object* matrix_cholesky_solve_proc(object* arguments) {
+    object* x_obj;
+    matrix* a;
+    matrix* b;
+    matrix* l;
+    matrix* x;
+    double* row;
+    double c[2];
+    long n, i, j, k;
+    long width;
+    char cpx;
+
+    a = matrix_argument(car(arguments));
+    b = matrix_argument(cadr(arguments));
+    check_solve_operands(a, b, "matrix-cholesky-solve");
+    cpx = a->is_complex || b->is_complex;
+    width = cpx ? 2 : 1;
+    if (cpx && !a->is_complex) {
+        a = matrix_of(matrix_copy_as(a, 1));
+    }
+    l = matrix_of(cholesky(a, "matrix-cholesky-solve"));
+    n = l->rows;
+    x_obj = matrix_copy_as(b, cpx);
+    x = matrix_of(x_obj);
+    /* l y = b */
+    for (i = 0; i < n; i++) {
+        row = matrix_at(x, i, 0);
+        for (k = 0; k < i; k++) {
+            matrix_row_sub(cpx, row, matrix_at(x, k, 0), matrix_at(l, i, k),
+                x->cols);
+        }
+        for (j = 0; j < x->cols; j++) {
+            element_divide(cpx, row + width * j, matrix_at(l, i, i));
+        }
+    }
+    /* l^H x = y */
+    for (i = n - 1; i >= 0; i--) {
+        row = matrix_at(x, i, 0);
+        for (k = i + 1; k < n; k++) {
+            c[0] = matrix_at(l, k, i)[0];
+            c[1] = cpx ? -matrix_at(l, k, i)[1] : 0.0;
+            matrix_row_sub(cpx, row, matrix_at(x, k, 0), c, x->cols);
+        }
+        for (j = 0; j < x->cols; j++) {
+            element_divide(cpx, row + width * j, matrix_at(l, i, i));
+        }
+    }
+    return x_obj;
+}
+
+/* applies h = i - 2 v v^H / vnorm to column j of mx below row k */
+void householder_apply(char cpx, double* v, double vnorm, matrix* mx,
+    long k, long j) {
+    double* e;
+    double sr = 0.0;
+    double si = 0.0;
+    long i;
+
+    for (i = k; i < mx->rows; i++) {
+        e = matrix_at(mx, i, j);
+        if (cpx) {
+            sr += v[2 * i] * e[0] + v[2 * i + 1] * e[1];
+            si += v[2 * i] * e[1] - v[2 * i + 1] * e[0];
+        }
+        else {
+            sr += v[i] * e[0];
+        }
+    }
+    sr = 2.0 * sr / vnorm;
+    si = 2.0 * si / vnorm;
+    for (i = k; i < mx->rows; i++) {
+        e = matrix_at(mx, i, j);
+        if (cpx) {
+            e[0] -= sr * v[2 * i] - si * v[2 * i + 1];
+            e[1] -= sr * v[2 * i + 1] + si * v[2 * i];
+        }
+        else {
+            e[0] -= sr * v[i];
+        }
+    }
+}
+
+/*
+ * Least squares solution of a x = b for a with at least as many rows
+ * as columns, by Householder QR. The reflectors are applied to b as
+ * they are built so q is never formed.
+ */
+object* matrix_qr_solve_proc(object* arguments) {
+    object* r_obj;
+    object* b_obj;
+    object* x_obj;
+    matrix* r;
+    matrix* b;
+    matrix* x;
+    double norm;
+    double modulus;
+    double ar, ai;
+    double vnorm;
+    double* e;
+    double* v;
+    long m, n, i, j, k;
+    long width;
+    char cpx;
+
+    r = matrix_argument(car(arguments));
+    b = matrix_argument(cadr(arguments));
+    check_solve_operands(r, b, "matrix-qr-solve");
+    m = r->rows;
+    n = r->cols;
+    if (m < n) {
+        diagnostic("*** matrix-qr-solve: fewer rows than columns\n");
+        exit(1);
+    }
+    cpx = r->is_complex || b->is_complex;
+    width = cpx ? 2 : 1;
+    r_obj = matrix_copy_as(r, cpx);
+    r = matrix_of(r_obj);
+    b_obj = matrix_copy_as(b, cpx);
+    b = matrix_of(b_obj);
+    v = malloc((m ? m : 1) * width * sizeof(double));
+    if (v == NULL) {
+        diagnostic("*** matrix-qr-solve - out of memory\n");
+        exit(1);
+    }
+
+    for (k = 0; k < n; k++) {
+        norm = 0.0;
+        for (i = k; i < m; i++) {
+            e = matrix_at(r, i, k);
+            norm += e[0] * e[0] + (cpx ? e[1] * e[1] : 0.0);
+        }
+        norm = sqrt(norm);
+        if (norm == 0.0) {
+            free(v);
+            diagnostic("*** matrix-qr-solve: matrix is rank deficient\n");
+            exit(1);
+        }
+        /* alpha has the opposite phase to r[k][k], so v does not
+         * cancel */
+        e = matrix_at(r, k, k);
+        modulus = element_modulus(cpx, e);
+        if (modulus == 0.0 || (!cpx && e[0] <= 0.0)) {
+            ar = norm;
+            ai = 0.0;
+        }
+        else {
+            ar = -norm * e[0] / modulus;
+            ai = cpx ? -norm * e[1] / modulus : 0.0;
+        }
+        vnorm = 0.0;
+        for (i = k; i < m; i++) {
+            e = matrix_at(r, i, k);
+            v[width * i] = e[0] - ((i == k) ? ar : 0.0);
+            vnorm += v[width * i] * v[width * i];
+            if (cpx) {
+                v[2 * i + 1] = e[1] - ((i == k) ? ai : 0.0);
+                vnorm += v[2 * i + 1] * v[2 * i + 1];
+            }
+        }
+        for (j = k; j < n; j++) {
+            householder_apply(cpx, v, vnorm, r, k, j);
+        }
+        for (j = 0; j < b->cols; j++) {
+            householder_apply(cpx, v, vnorm, b, k, j);
+        }
+    }
+    free(v);
+
+    /* r x = (q^H b), upper n rows */
+    x_obj = make_matrix(n, b->cols, cpx);
+    x = matrix_of(x_obj);
+    for (i = n - 1; i >= 0; i--) {
+        memcpy(matrix_at(x, i, 0), matrix_at(b, i, 0),
+            width * b->cols * sizeof(double));
+        for (k = i + 1; k < n; k++) {
+            matrix_row_sub(cpx, matrix_at(x, i, 0), matrix_at(x, k, 0),
+                matrix_at(r, i, k), x->cols);
+        }
+        for (j = 0; j < x->cols; j++) {
+            element_divide(cpx, matrix_at(x, i, j), matrix_at(r, i, i));
+        }
+    }
+    return x_obj;
+}
+
+/**************************** BITSETS ****************************/
+
+#define BITSET_WORDS(nbits) (((nbits) + 63) / 64)
+#define RANK_BLOCK 8                /* words per rank directory entry */
+#define RANK_BLOCKS(nbits) \
+    ((BITSET_WORDS(nbits) + RANK_BLOCK - 1) / RANK_BLOCK)
+
+object* make_bitset(long nbits) {
+    object* obj;
+    uint64_t* words;
+
+    if (nbits < 0) {
+        diagnostic("*** invalid bitset size\n");
+        exit(1);
+    }
+    words = calloc(BITSET_WORDS(nbits) ? BITSET_WORDS(nbits) : 1,
+        sizeof(uint64_t));
+    if (words == NULL) {
+        diagnostic("*** cannot create bitset - out of memory\n");
+        exit(1);
+    }
+    obj = alloc_object();
+    obj->type = BITSET;
+    obj->data.bitset.nbits = nbits;
+    obj->data.bitset.words = words;
+    obj->data.bitset.ranks = NULL;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_bitset(object* obj) {
+    return obj->type == BITSET;
+}
+
+object* bitset_argument(object* obj) {
+    if (!is_bitset(obj)) {
+        diagnostic("*** expected a bitset\n");
+        exit(1);
+    }
+    return obj;
+}
+
+/* every mutation drops the rank directory; it is rebuilt on demand */
+void bitset_touch(object* set) {
+    free(set->data.bitset.ranks);
+    set->data.bitset.ranks = NULL;
+}
+
+long bitset_index(object* set, object* index) {
+    long i;
+
+    i = fixnum_argument(index);
+    if (i < 0 || i >= set->data.bitset.nbits) {
+        diagnostic("*** bitset index %ld out of range\n", i);
+        exit(1);
+    }
+    return i;
+}
+
+/* ranks[b] = members in the blocks before b; the last entry is the total */
+uint64_t* bitset_ranks(object* set) {
+    uint64_t* words;
+    uint64_t* ranks;
+    uint64_t total = 0;
+    long nwords;
+    long w;
+
+    if (set->data.bitset.ranks != NULL) {
+        return set->data.bitset.ranks;
+    }
+    nwords = BITSET_WORDS(set->data.bitset.nbits);
+    words = set->data.bitset.words;
+    ranks = malloc((RANK_BLOCKS(set->data.bitset.nbits) + 1) *
+        sizeof(uint64_t));
+    if (ranks == NULL) {
+        diagnostic("*** bitset rank - out of memory\n");
+        exit(1);
+    }
+    for (w = 0; w < nwords; w++) {
+        if (w % RANK_BLOCK == 0) {
+            ranks[w / RANK_BLOCK] = total;
+        }
+        total += popcount64(words[w]);
+    }
+    ranks[RANK_BLOCKS(set->data.bitset.nbits)] = total;
+    set->data.bitset.ranks = ranks;
+    return ranks;
+}
+
+typedef enum {
+    BITSET_UNION, BITSET_INTERSECTION, BITSET_DIFFERENCE
+} bitset_op;
+
+/* dst = dst op src over n words, two words per SSE2 step */
+void bitset_combine(uint64_t* dst, uint64_t* src, long n, bitset_op op) {
+    long i = 0;
+#if defined(HAVE_SSE2)
+    __m128i a;
+    __m128i b;
+
+    for (; i + 2 <= n; i += 2) {
+        a = _mm_loadu_si128((__m128i*)(dst + i));
+        b = _mm_loadu_si128((__m128i*)(src + i));
+        switch (op) {
+        case BITSET_UNION:
+            a = _mm_or_si128(a, b);
+            break;
+        case BITSET_INTERSECTION:
+            a = _mm_and_si128(a, b);
+            break;
+        default:
+            a = _mm_andnot_si128(b, a);
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), a);
+    }
+#endif
+    for (; i < n; i++) {
+        switch (op) {
+        case BITSET_UNION:
+            dst[i] |= src[i];
+            break;
+        case BITSET_INTERSECTION:
+            dst[i] &= src[i];
+            break;
+        default:
+            dst[i] &= ~src[i];
+        }
+    }
+}
+
+object* bitset_combine_proc(object* arguments, bitset_op op) {
+    object* dst;
+    object* src;
+    long n;
+    long m;
+
+    dst = bitset_argument(car(arguments));
+    src = bitset_argument(cadr(arguments));
+    n = BITSET_WORDS(dst->data.bitset.nbits);
+    m = BITSET_WORDS(src->data.bitset.nbits);
+    /* bits past the end of the shorter set count as clear */
+    bitset_combine(dst->data.bitset.words, src->data.bitset.words,
+        (n < m) ? n : m, op);
+    if (op == BITSET_INTERSECTION && m < n) {
+        memset(dst->data.bitset.words + m, 0, (n - m) * sizeof(uint64_t));
+    }
+    if (op == BITSET_UNION && (dst->data.bitset.nbits % 64) != 0) {
+        dst->data.bitset.words[n - 1] &=
+            ((uint64_t)1 << (dst->data.bitset.nbits % 64)) - 1;
+    }
+    bitset_touch(dst);
+    return dst;
+}
+
+object* is_bitset_proc(object* arguments) {
+    return is_bitset(car(arguments)) ? true : false;
+}
+
+object* make_bitset_proc(object* arguments) {
+    return make_bitset(fixnum_argument(car(arguments)));
+}
+
+object* bitset_size_proc(object* arguments) {
+    return make_fixnum(bitset_argument(car(arguments))->data.bitset.nbits);
+}
+
+object* bitset_copy_proc(object* arguments) {
+    object* from;
+    object* to;
+
+    from = bitset_argument(car(arguments));
+    to = make_bitset(from->data.bitset.nbits);
+    memcpy(to->data.bitset.words, from->data.bitset.words,
+        BITSET_WORDS(from->data.bitset.nbits) * sizeof(uint64_t));
+    return to;
+}
+
+object* bitset_set_proc(object* arguments) {
+    object* set;
+    long i;
+
+    set = bitset_argument(car(arguments));
+    i = bitset_index(set, cadr(arguments));
+    set->data.bitset.words[i / 64] |= (uint64_t)1 << (i % 64);
+    bitset_touch(set);
+    return ok_symbol;
+}
+
+object* bitset_clear_proc(object* arguments) {
+    object* set;
+    long i;
+
+    set = bitset_argument(car(arguments));
+    i = bitset_index(set, cadr(arguments));
+    set->data.bitset.words[i / 64] &= ~((uint64_t)1 << (i % 64));
+    bitset_touch(set);
+    return ok_symbol;
+}
+
+object* bitset_test_proc(object* arguments) {
+    object* set;
+    long i;
+
+    set = bitset_argument(car(arguments));
+    i = bitset_index(set, cadr(arguments));
+    return (set->data.bitset.words[i / 64] >> (i % 64)) & 1 ? true : false;
+}
+
+object* bitset_count_proc(object* arguments) {
+    object* set;
+
+    set = bitset_argument(car(arguments));
+    return make_fixnum((long)bitset_ranks(set)
+        [RANK_BLOCKS(set->data.bitset.nbits)]);
+}
+
+object* bitset_union_proc(object* arguments) {
+    return bitset_combine_proc(arguments, BITSET_UNION);
+}
+
+object* bitset_intersection_proc(object* arguments) {
+    return bitset_combine_proc(arguments, BITSET_INTERSECTION);
+}
+
+object* bitset_difference_proc(object* arguments) {
+    return bitset_combine_proc(arguments, BITSET_DIFFERENCE);
+}
+
+/* (bitset-rank set i) counts the members below i */
+object* bitset_rank_proc(object* arguments) {
+    object* set;
+    uint64_t* words;
+    uint64_t rank;
+    long i;
+    long w;
+
+    set = bitset_argument(car(arguments));
+    i = fixnum_argument(cadr(arguments));
+    if (i < 0 || i > set->data.bitset.nbits) {
+        diagnostic("*** bitset index %ld out of range\n", i);
+        exit(1);
+    }
+    words = set->data.bitset.words;
+    rank = bitset_ranks(set)[(i / 64) / RANK_BLOCK];
+    for (w = (i / 64) / RANK_BLOCK * RANK_BLOCK; w < i / 64; w++) {
+        rank += popcount64(words[w]);
+    }
+    if (i % 64 != 0) {
+        rank += popcount64(words[i / 64] & (((uint64_t)1 << (i % 64)) - 1));
+    }
+    return make_fixnum((long)rank);
+}
+
+/* (bitset-select set k) is the index of member k (from 0), or #f */
+object* bitset_select_proc(object* arguments) {
+    object* set;
+    uint64_t* ranks;
+    uint64_t* words;
+    uint64_t word;
+    long k;
+    long lo;
+    long hi;
+    long mid;
+    long w;
+    long nblocks;
+
+    set = bitset_argument(car(arguments));
+    k = fixnum_argument(cadr(arguments));
+    nblocks = RANK_BLOCKS(set->data.bitset.nbits);
+    ranks = bitset_ranks(set);
+    if (k < 0 || (uint64_t)k >= ranks[nblocks]) {
+        return false;
+    }
+    /* last directory block whose rank is <= k */
+    lo = 0;
+    hi = nblocks - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (ranks[mid] <= (uint64_t)k) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    k -= (long)ranks[lo];
+    words = set->data.bitset.words;
+    for (w = lo * RANK_BLOCK; k >= popcount64(words[w]); w++) {
+        k -= popcount64(words[w]);
+    }
+    word = words[w];
+    while (k-- > 0) {
+        word &= word - 1; /* drop the lowest member */
+    }
+    return make_fixnum(w * 64 + ctz64(word));
+}
+
+object* bitset_to_list_proc(object* arguments) {
+    object* set;
+    object* result = nil;
+    uint64_t word;
+    long w;
+
+    set = bitset_argument(car(arguments));
+    for (w = BITSET_WORDS(set->data.bitset.nbits) - 1; w >= 0; w--) {
+        word = set->data.bitset.words[w];
+        while (word != 0) {
+            /* highest member first so the list comes out ascending */
+            result = cons(make_fixnum(w * 64 + 63 - clz64(word)), result);
+            word &= ~((uint64_t)1 << (63 - clz64(word)));
+        }
+    }
+    return result;
+}
+
+/************************** HASH TABLES **************************/
+
+/*
+ * Open addressing with robin hood probing: an entry that is further
+ * from its home slot takes the place of a closer one, which keeps
+ * probe sequences short at high load and lets lookups stop early.
+ *
+ * Growing is incremental. The old array is kept as a read-only
+ * snapshot and a few of its slots move to the new array on every
+ * operation, so a big table never rehashes all at once. Deleting
+ * from the snapshot leaves a tombstone instead of shifting entries.
+ */
+
+#define HASH_INITIAL_CAPACITY 8
+#define HASH_MIGRATE_STEP 16       /* old slots moved per operation */
+
+object hash_tombstone;             /* key of a deleted snapshot entry */
+hash_table* weak_tables;           /* weak tables seen by the last mark */
+
+uint32_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+/* FNV-1a continued over more bytes, from FNV_OFFSET to start */
+uint64_t fnv1a(uint64_t h, char* str, long length) {
+    while (length-- > 0) {
+        h ^= (unsigned char)*str++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint32_t hash_bytes(char* str, long length) {
+    return hash_mix(fnv1a(FNV_OFFSET, str, length));
+}
+
+uint32_t eq_hash(object* obj) {
+    return hash_mix((uint64_t)(uintptr_t)obj);
+}
+
+uint32_t eqv_hash(object* obj) {
+    uint64_t bits;
+    uint64_t im_bits;
+    double part;
+
+    switch (obj->type) {
+    case FIXNUM:
+        return hash_mix((uint64_t)obj->data.fixnum.value);
+    case FLONUM:
+        memcpy(&bits, &obj->data.flonum.value, sizeof(bits));
+        return hash_mix(bits);
+    case CPXNUM:
+        /* the bits of both parts, as eqv? compares them */
+        part = creal(obj->data.cpxnum.value);
+        memcpy(&bits, &part, sizeof(bits));
+        part = cimag(obj->data.cpxnum.value);
+        memcpy(&im_bits, &part, sizeof(im_bits));
+        return hash_mix(bits * 31 + im_bits);
+    case CHARACTER:
+        return hash_mix((uint64_t)(unsigned char)obj->data.character.value);
+    default:
+        return eq_hash(obj);
+    }
+}
+
+/* looks at a bounded number of nodes, so cyclic data still hashes */
+uint32_t equal_hash_bounded(object* obj, int* budget) {
+    uint64_t h;
+    long i;
+
+    if (--*budget <= 0) {
+        return 0;
+    }
+    switch (obj->type) {
+    case STRING:
+        return hash_bytes(obj->data.string.value, obj->data.string.length);
+    case BYTEVECTOR:
+        return hash_bytes((char*)obj->data.bytevector.bytes,
+            obj->data.bytevector.length);
+    case PAIR:
+        h = equal_hash_bounded(car(obj), budget);
+        return hash_mix(h * 31 + equal_hash_bounded(cdr(obj), budget));
+    case VECTOR:
+        h = (uint64_t)obj->data.vector.length;
+        for (i = 0; i < obj->data.vector.length && *budget > 0; i++) {
+            h = h * 31 + equal_hash_bounded(obj->data.vector.items[i],
+                budget);
+        }
+        return hash_mix(h);
+    default:
+        return eqv_hash(obj);
+    }
+}
+
+uint32_t equal_hash(object* obj) {
+    int budget = 64;
+
+    return equal_hash_bounded(obj, &budget);
+}
+
+uint32_t hash_key(hash_table* t, object* key) {
+    switch (t->kind) {
+    case HASH_EQ:
+        return eq_hash(key);
+    case HASH_EQV:
+        return eqv_hash(key);
+    case HASH_STRING:
+        if (!is_string(key)) {
+            diagnostic("*** string hash table key is not a string\n");
+            exit(1);
+        }
+        return hash_bytes(key->data.string.value, key->data.string.length);
+    default:
+        return equal_hash(key);
+    }
+}
+
+char hash_keys_match(hash_table* t, object* a, object* b) {
+    switch (t->kind) {
+    case HASH_EQ:
+        return a == b;
+    case HASH_EQV:
+        return is_eqv(a, b);
+    case HASH_STRING:
+        return string_compare(a, b) == 0;
+    default:
+        return is_equal(a, b);
+    }
+}
+
+hash_entry* hash_alloc_entries(long capacity) {
+    hash_entry* entries;
+
+    entries = calloc(capacity, sizeof(hash_entry));
+    if (entries == NULL) {
+        diagnostic("*** hash table - out of memory\n");
+        exit(1);
+    }
+    return entries;
+}
+
+void robin_hood_insert(hash_entry* entries, long capacity, hash_entry e) {
+    hash_entry tmp;
+    long mask = capacity - 1;
+    long i;
+
+    e.dist = 0;
+    i = e.hash & mask;
+    for (;;) {
+        if (entries[i].key == NULL) {
+            entries[i] = e;
+            return;
+        }
+        if (entries[i].dist < e.dist) {
+            tmp = entries[i];
+            entries[i] = e;
+            e = tmp;
+        }
+        i = (i + 1) & mask;
+        e.dist++;
+    }
+}
+
+/* index of key in entries, or -1; slots below skip are ignored */
+long robin_hood_find(hash_table* t, hash_entry* entries, long capacity,
+    long skip, object* key, uint32_t hash) {
+    long mask = capacity - 1;
+    uint32_t dist = 0;
+    long i;
+
+    i = hash & mask;
+    for (;;) {
+        if (entries[i].key == NULL || entries[i].dist < dist) {
+            return -1;
+        }
+        if (i >= skip && entries[i].hash == hash &&
+            entries[i].key != &hash_tombstone &&
+            hash_keys_match(t, entries[i].key, key)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
+
+/* backward shift deletion: no tombstones in the live array */
+void robin_hood_remove(hash_entry* entries, long capacity, long i) {
+    long mask = capacity - 1;
+    long j;
+
+    j = (i + 1) & mask;
+    while (entries[j].key != NULL && entries[j].dist > 0) {
+        entries[i] = entries[j];
+        entries[i].dist--;
+        i = j;
+        j = (j + 1) & mask;
+    }
+    entries[i].key = NULL;
+    entries[i].value = NULL;
+}
+
+/* moves up to n slots of the snapshot into the live array */
+void hash_table_migrate(hash_table* t, long n) {
+    hash_entry e;
+
+    while (t->old_entries != NULL && n-- > 0) {
+        if (t->migrated == t->old_capacity) {
+            free(t->old_entries);
+            t->old_entries = NULL;
+            t->old_capacity = 0;
+            t->migrated = 0;
+            return;
+        }
+        e = t->old_entries[t->migrated++];
+        if (e.key != NULL && e.key != &hash_tombstone) {
+            robin_hood_insert(t->entries, t->capacity, e);
+        }
+    }
+}
+
+void hash_table_grow(hash_table* t) {
+    /* a previous resize must be complete before the next starts */
+    hash_table_migrate(t, LONG_MAX);
+    t->old_entries = t->entries;
+    t->old_capacity = t->capacity;
+    t->migrated = 0;
+    t->capacity *= 2;
+    t->entries = hash_alloc_entries(t->capacity);
+}
+
+hash_entry* hash_table_lookup(hash_table* t, object* key) {
+    uint32_t hash;
+    long i;
+
+    hash_table_migrate(t, HASH_MIGRATE_STEP);
+    hash = hash_key(t, key);
+    i = robin_hood_find(t, t->entries, t->capacity, 0, key, hash);
+    if (i >= 0) {
+        return &t->entries[i];
+    }
+    if (t->old_entries != NULL) {
+        i = robin_hood_find(t, t->old_entries, t->old_capacity,
+            t->migrated, key, hash);
+        if (i >= 0) {
+            return &t->old_entries[i];
+        }
+    }
+    return NULL;
+}
+
+void hash_table_put(hash_table* t, object* key, object* value) {
+    hash_entry* found;
+    hash_entry e;
+
+    found = hash_table_lookup(t, key);
+    if (found != NULL) {
+        found->value = value;
+        return;
+    }
+    /* robin hood stays fast up to about 85% load */
+    if ((t->count + 1) * 20 > t->capacity * 17) {
+        hash_table_grow(t);
+    }
+    e.key = key;
+    e.value = value;
+    e.hash = hash_key(t, key);
+    robin_hood_insert(t->entries, t->capacity, e);
+    t->count++;
+}
+
+char hash_table_remove(hash_table* t, object* key) {
+    uint32_t hash;
+    long i;
+
+    hash_table_migrate(t, HASH_MIGRATE_STEP);
+    hash = hash_key(t, key);
+    i = robin_hood_find(t, t->entries, t->capacity, 0, key, hash);
+    if (i >= 0) {
+        robin_hood_remove(t->entries, t->capacity, i);
+        t->count--;
+        return 1;
+    }
+    if (t->old_entries != NULL) {
+        i = robin_hood_find(t, t->old_entries, t->old_capacity,
+            t->migrated, key, hash);
+        if (i >= 0) {
+            t->old_entries[i].key = &hash_tombstone;
+            t->old_entries[i].value = NULL;
+            t->count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* calls fn on every live entry of both arrays */
+void hash_table_for_each(hash_table* t,
+    void (*fn)(hash_entry* e, void* data), void* data) {
+    long i;
+
+    for (i = 0; i < t->capacity; i++) {
+        if (t->entries[i].key != NULL) {
+            fn(&t->entries[i], data);
+        }
+    }
+    if (t->old_entries != NULL) {
+        for (i = t->migrated; i < t->old_capacity; i++) {
+            if (t->old_entries[i].key != NULL &&
+                t->old_entries[i].key != &hash_tombstone) {
+                fn(&t->old_entries[i], data);
+            }
+        }
+    }
+}
+
+void mark_hash_entry(hash_entry* e, void* weak) {
+    if (!*(char*)weak) {
+        mark(e->key);
+    }
+    mark(e->value);
+}
+
+void mark_hash_table(hash_table* t) {
+    if (t->weak) {
+        t->next_weak = weak_tables;
+        weak_tables = t;
+    }
+    hash_table_for_each(t, mark_hash_entry, &t->weak);
+}
+
+/* after marking: drop the entries of weak tables whose key is garbage */
+void clear_weak_tables(void) {
+    hash_table* t;
+    long i;
+
+    for (t = weak_tables; t != NULL; t = t->next_weak) {
+        i = 0;
+        while (i < t->capacity) {
+            if (t->entries[i].key != NULL && !is_marked(t->entries[i].key)) {
+                /* the shift may move a later entry into slot i */
+                robin_hood_remove(t->entries, t->capacity, i);
+                t->count--;
+            }
+            else {
+                i++;
+            }
+        }
+        if (t->old_entries != NULL) {
+            for (i = t->migrated; i < t->old_capacity; i++) {
+                if (t->old_entries[i].key != NULL &&
+                    t->old_entries[i].key != &hash_tombstone &&
+                    !is_marked(t->old_entries[i].key)) {
+                    t->old_entries[i].key = &hash_tombstone;
+                    t->old_entries[i].value = NULL;
+                    t->count--;
+                }
+            }
+        }
+    }
+    weak_tables = NULL;
+}
+
+hash_table* new_hash_table(hash_kind kind, char weak) {
+    hash_table* t;
+
+    t = malloc(sizeof(hash_table));
+    if (t == NULL) {
+        diagnostic("*** hash table - out of memory\n");
+        exit(1);
+    }
+    t->kind = kind;
+    t->weak = weak;
+    t->count = 0;
+    t->capacity = HASH_INITIAL_CAPACITY;
+    t->entries = hash_alloc_entries(t->capacity);
+    t->old_entries = NULL;
+    t->old_capacity = 0;
+    t->migrated = 0;
+    t->next_weak = NULL;
+    return t;
+}
+
+object* make_hash_table(hash_kind kind, char weak) {
+    object* obj;
+    hash_table* t;
+
+    t = new_hash_table(kind, weak);
+    obj = alloc_object();
+    obj->type = HASH_TABLE;
+    obj->data.hash_table.t = t;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_hash_table(object* obj) {
+    return obj->type == HASH_TABLE;
+}
+
+hash_table* hash_table_argument(object* obj) {
+    if (!is_hash_table(obj)) {
+        diagnostic("*** expected a hash table\n");
+        exit(1);
+    }
+    return obj->data.hash_table.t;
+}
+
+/* (make-hash-table [equality]) with eq?, eqv?, equal? or string=? */
+object* make_hash_table_proc(object* arguments) {
+    object* (*fn)(struct object* args);
+
+    if (is_nil(arguments)) {
+        return make_hash_table(HASH_EQUAL, 0);
+    }
+    if (!is_primitive(car(arguments))) {
+        diagnostic("*** make-hash-table: unsupported equality\n");
+        exit(1);
+    }
+    fn = car(arguments)->data.primitive_proc.fn;
+    if (fn == is_eq_proc) {
+        return make_hash_table(HASH_EQ, 0);
+    }
+    if (fn == is_eqv_proc) {
+        return make_hash_table(HASH_EQV, 0);
+    }
+    if (fn == is_equal_proc) {
+        return make_hash_table(HASH_EQUAL, 0);
+    }
+    if (fn == string_equal_proc) {
+        return make_hash_table(HASH_STRING, 0);
+    }
+    diagnostic("*** make-hash-table: unsupported equality\n");
+    exit(1);
+}
+
+object* make_eq_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_EQ, 0);
+}
+
+object* make_eqv_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_EQV, 0);
+}
+
+object* make_equal_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_EQUAL, 0);
+}
+
+object* make_string_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_STRING, 0);
+}
+
+object* make_key_weak_eq_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_EQ, 1);
+}
+
+object* make_key_weak_eqv_hash_table_proc(object* arguments) {
+    return make_hash_table(HASH_EQV, 1);
+}
+
+object* is_hash_table_proc(object* arguments) {
+    return is_hash_table(car(arguments)) ? true : false;
+}
+
+/* (hash-table-ref table key [failure]) */
+object* hash_table_ref_proc(object* arguments) {
+    hash_entry* e;
+
+    e = hash_table_lookup(hash_table_argument(car(arguments)),
+        cadr(arguments));
+    if (e != NULL) {
+        return e->value;
+    }
+    if (!is_nil(cddr(arguments))) {
+        return apply_procedure(caddr(arguments), nil);
+    }
+    diagnostic("*** hash-table-ref: key not found\n");
+    exit(1);
+}
+
+object* hash_table_ref_default_proc(object* arguments) {
+    hash_entry* e;
+
+    e = hash_table_lookup(hash_table_argument(car(arguments)),
+        cadr(arguments));
+    return (e != NULL) ? e->value : caddr(arguments);
+}
+
+object* hash_table_set_proc(object* arguments) {
+    hash_table_put(hash_table_argument(car(arguments)),
+        cadr(arguments), caddr(arguments));
+    return ok_symbol;
+}
+
+object* hash_table_delete_proc(object* arguments) {
+    hash_table_remove(hash_table_argument(car(arguments)),
+        cadr(arguments));
+    return ok_symbol;
+}
+
+object* hash_table_contains_proc(object* arguments) {
+    return (hash_table_lookup(hash_table_argument(car(arguments)),
+        cadr(arguments)) != NULL) ? true : false;
+}
+
+object* hash_table_count_proc(object* arguments) {
+    return make_fixnum(hash_table_argument(car(arguments))->count);
+}
+
+/* (hash-table-update!/default table key proc default) */
+object* hash_table_update_default_proc(object* arguments) {
+    hash_table* t;
+    hash_entry* e;
+    object* key;
+    object* value;
+
+    t = hash_table_argument(car(arguments));
+    key = cadr(arguments);
+    e = hash_table_lookup(t, key);
+    value = apply_procedure(caddr(arguments),
+        cons((e != NULL) ? e->value : cadddr(arguments), nil));
+    hash_table_put(t, key, value);
+    return ok_symbol;
+}
+
+object* hash_table_clear_proc(object* arguments) {
+    hash_table* t;
+
+    t = hash_table_argument(car(arguments));
+    free(t->old_entries);
+    t->old_entries = NULL;
+    t->old_capacity = 0;
+    t->migrated = 0;
+    memset(t->entries, 0, t->capacity * sizeof(hash_entry));
+    t->count = 0;
+    return ok_symbol;
+}
+
+void collect_key(hash_entry* e, void* list) {
+    *(object**)list = cons(e->key, *(object**)list);
+}
+
+void collect_value(hash_entry* e, void* list) {
+    *(object**)list = cons(e->value, *(object**)list);
+}
+
+void collect_association(hash_entry* e, void* list) {
+    *(object**)list = cons(cons(e->key, e->value), *(object**)list);
+}
+
+object* hash_table_keys_proc(object* arguments) {
+    object* result = nil;
+
+    hash_table_for_each(hash_table_argument(car(arguments)),
+        collect_key, &result);
+    return result;
+}
+
+object* hash_table_values_proc(object* arguments) {
+    object* result = nil;
+
+    hash_table_for_each(hash_table_argument(car(arguments)),
+        collect_value, &result);
+    return result;
+}
+
+object* hash_table_to_alist_proc(object* arguments) {
+    object* result = nil;
+
+    hash_table_for_each(hash_table_argument(car(arguments)),
+        collect_association, &result);
+    return result;
+}
+
+/* (hash-table-walk table proc) calls (proc key value) for each entry */
+object* hash_table_walk_proc(object* arguments) {
+    object* entries;
+
+    /* snapshot first: proc may modify the table */
+    entries = hash_table_to_alist_proc(arguments);
+    while (!is_nil(entries)) {
+        apply_procedure(cadr(arguments),
+            cons(caar(entries), cons(cdar(entries), nil)));
+        entries = cdr(entries);
+    }
+    return ok_symbol;
+}
+
+object* hash_proc(object* arguments) {
+    return make_fixnum((long)(equal_hash(car(arguments)) & 0x7FFFFFFF));
+}
+
+object* string_hash_proc(object* arguments) {
+    return make_fixnum((long)(hash_bytes(car(arguments)->data.string.value,
+        car(arguments)->data.string.length) & 0x7FFFFFFF));
+}
+
+object* hash_by_identity_proc(object* arguments) {
+    return make_fixnum((long)(eq_hash(car(arguments)) & 0x7FFFFFFF));
+}
+
+/* a table from objects, by identity, to longs, for the walks that
+ * must know which objects they have met: patching datum labels,
+ * printing shared structure and serializing */
+typedef struct object_table {
+    object** keys;
+    long* values;
+    long capacity;
+    long count;
+} object_table;
+
+void object_table_init(object_table* t) {
+    t->keys = NULL;
+    t->values = NULL;
+    t->capacity = 0;
+    t->count = 0;
+}
+
+void object_table_free(object_table* t) {
+    free(t->keys);
+    free(t->values);
+    object_table_init(t);
+}
+
+/* answers the value slot of key, adding it with value 0 if missing;
+ * added tells which */
+long* object_table_find(object_table* t, object* key, char* added) {
+    object** old_keys;
+    long* old_values;
+    long old_capacity;
+    long* value;
+    long i;
+    long j;
+
+    if (t->count * 2 >= t->capacity) {
+        old_keys = t->keys;
+        old_values = t->values;
+        old_capacity = t->capacity;
+        t->capacity = old_capacity ? old_capacity * 2 : 256;
+        t->keys = calloc(t->capacity, sizeof(object*));
+        t->values = calloc(t->capacity, sizeof(long));
+        if (t->keys == NULL || t->values == NULL) {
+            diagnostic("*** object table - out of memory\n");
+            exit(1);
+        }
+        t->count = 0;
+        for (i = 0; i < old_capacity; i++) {
+            if (old_keys[i] != NULL) {
+                value = object_table_find(t, old_keys[i], added);
+                *value = old_values[i];
+            }
+        }
+        free(old_keys);
+        free(old_values);
+    }
+    i = (long)eq_hash(key) & (t->capacity - 1);
+    for (j = i; t->keys[j] != NULL; j = (j + 1) & (t->capacity - 1)) {
+        if (t->keys[j] == key) {
+            *added = 0;
+            return &t->values[j];
+        }
+    }
+    t->keys[j] = key;
+    t->count++;
+    *added = 1;
+    return &t->values[j];
+}
+
+/*********************** PERSISTENT MAPS *************************/
+
+/*
+ * Hash array mapped tries. Each node has a 32 bit bitmap of occupied
+ * branches and stores only those, so the slot of a branch is the
+ * popcount of the bitmap bits below it. A branch is a key and value
+ * pair, or a NULL key and a child node one level (5 hash bits) down.
+ * Below the last hash bits, keys whose hashes collide share a
+ * collision node that is searched linearly.
+ *
+ * Updates copy the path from the root to the changed leaf and share
+ * everything else, so older versions stay valid. A transient map owns
+ * the nodes it has created, tagged with its edit number, and changes
+ * them in place; nodes it does not own are still copied.
+ *
+ * Keys are compared with equal?.
+ */
+
+#define PMAP_BITS 5
+#define PMAP_MAX_SHIFT 30          /* deeper levels are collision nodes */
+#define PMAP_TRANSIENT_SPARE 8     /* extra slots in transient nodes */
+
+uint32_t pmap_next_edit = 1;       /* 0 means persistent */
+
+object* make_pmap_node(uint32_t bitmap, long length, long capacity,
+    uint32_t edit) {
+    object* obj;
+    long i;
+
+    obj = alloc_object_sized(offsetof(object, data.pmap_node.slots) +
+        capacity * sizeof(object*));
+    obj->type = PMAP_NODE;
+    /* callers fill the slots after allocating more, which may collect */
+    for (i = 0; i < capacity; i++) {
+        obj->data.pmap_node.slots[i] = NULL;
+    }
+    obj->data.pmap_node.bitmap = bitmap;
+    obj->data.pmap_node.edit = edit;
+    obj->data.pmap_node.length = length;
+    obj->data.pmap_node.capacity = capacity;
+    push(the_vm, obj);
+    return obj;
+}
+
+object* make_pmap(object* root, long count, uint32_t edit, char is_set) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = PMAP;
+    obj->data.pmap.root = root;
+    obj->data.pmap.count = count;
+    obj->data.pmap.edit = edit;
+    obj->data.pmap.is_set = is_set;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_pmap(object* obj) {
+    return obj->type == PMAP;
+}
+
+object* pmap_argument(object* obj) {
+    if (!is_pmap(obj)) {
+        diagnostic("*** expected a persistent map\n");
+        exit(1);
+    }
+    return obj;
+}
+
+object* transient_argument(object* obj) {
+    if (pmap_argument(obj)->data.pmap.edit == 0) {
+        diagnostic("*** expected a transient map\n");
+        exit(1);
+    }
+    return obj;
+}
+
+/* a node with room for length slots that edit may change in place */
+object* pmap_node_copy(object* node, long length, uint32_t edit) {
+    object* copy;
+    long n;
+
+    copy = make_pmap_node(node->data.pmap_node.bitmap, length,
+        edit ? length + PMAP_TRANSIENT_SPARE : length, edit);
+    n = (node->data.pmap_node.length < length) ?
+        node->data.pmap_node.length : length;
+    memcpy(copy->data.pmap_node.slots, node->data.pmap_node.slots,
+        n * sizeof(object*));
+    return copy;
+}
+
+/* node itself if edit owns it, otherwise a copy edit will own */
+object* pmap_node_editable(object* node, uint32_t edit) {
+    if (edit != 0 && node->data.pmap_node.edit == edit) {
+        return node;
+    }
+    return pmap_node_copy(node, node->data.pmap_node.length, edit);
+}
+
+/* opens a slot pair at index, growing the node when it is full */
+object* pmap_node_insert(object* node, long index, object* key,
+    object* value, uint32_t edit) {
+    object* result;
+    object** slots;
+    long length;
+
+    length = node->data.pmap_node.length;
+    if (edit != 0 && node->data.pmap_node.edit == edit &&
+        length + 2 <= node->data.pmap_node.capacity) {
+        result = node;
+        result->data.pmap_node.length = length + 2;
+    }
+    else {
+        result = pmap_node_copy(node, length + 2, edit);
+    }
+    slots = result->data.pmap_node.slots;
+    memmove(slots + index + 2, slots + index,
+        (length - index) * sizeof(object*));
+    slots[index] = key;
+    slots[index + 1] = value;
+    return result;
+}
+
+object* pmap_node_remove(object* node, long index, uint32_t edit) {
+    object* result;
+    object** slots;
+    long length;
+
+    length = node->data.pmap_node.length;
+    result = pmap_node_editable(node, edit);
+    slots = result->data.pmap_node.slots;
+    memmove(slots + index, slots + index + 2,
+        (length - index - 2) * sizeof(object*));
+    result->data.pmap_node.length = length - 2;
+    return result;
+}
+
+long pmap_index(uint32_t bitmap, uint32_t bit) {
+    return 2 * (long)popcount64((uint64_t)(bitmap & (bit - 1)));
+}
+
+uint32_t pmap_bit(uint32_t hash, int shift) {
+    return (uint32_t)1 << ((hash >> shift) & 31);
+}
+
+/* a node holding two keys that first differ at shift */
+object* pmap_pair_node(int shift, object* key1, object* value1,
+    uint32_t hash1, object* key2, object* value2, uint32_t hash2,
+    uint32_t edit) {
+    object* node;
+    uint32_t bit1;
+    uint32_t bit2;
+    long first;
+
+    if (shift > PMAP_MAX_SHIFT) {
+        node = make_pmap_node(0, 4, edit ? 4 + PMAP_TRANSIENT_SPARE : 4,
+            edit);
+        first = 0;
+    }
+    else {
+        bit1 = pmap_bit(hash1, shift);
+        bit2 = pmap_bit(hash2, shift);
+        if (bit1 == bit2) {
+            node = make_pmap_node(bit1, 2,
+                edit ? 2 + PMAP_TRANSIENT_SPARE : 2, edit);
+            node->data.pmap_node.slots[0] = NULL;
+            node->data.pmap_node.slots[1] = pmap_pair_node(shift + PMAP_BITS,
+                key1, value1, hash1, key2, value2, hash2, edit);
+            return node;
+        }
+        node = make_pmap_node(bit1 | bit2, 4,
+            edit ? 4 + PMAP_TRANSIENT_SPARE : 4, edit);
+        first = (bit1 < bit2) ? 0 : 2;
+    }
+    node->data.pmap_node.slots[first] = key1;
+    node->data.pmap_node.slots[first + 1] = value1;
+    node->data.pmap_node.slots[2 - first] = key2;
+    node->data.pmap_node.slots[3 - first] = value2;
+    return node;
+}
+
+object* pmap_node_set(object* node, int shift, uint32_t hash, object* key,
+    object* value, uint32_t edit, char* added) {
+    object** slots;
+    object* child;
+    uint32_t bitmap;
+    uint32_t bit;
+    long index;
+
+    slots = node->data.pmap_node.slots;
+    if (shift > PMAP_MAX_SHIFT) {
+        for (index = 0; index < node->data.pmap_node.length; index += 2) {
+            if (is_equal(slots[index], key)) {
+                break;
+            }
+        }
+        if (index == node->data.pmap_node.length) {
+            *added = 1;
+            return pmap_node_insert(node, index, key, value, edit);
+        }
+    }
+    else {
+        bitmap = node->data.pmap_node.bitmap;
+        bit = pmap_bit(hash, shift);
+        index = pmap_index(bitmap, bit);
+        if ((bitmap & bit) == 0) {
+            *added = 1;
+            node = pmap_node_insert(node, index, key, value, edit);
+            node->data.pmap_node.bitmap = bitmap | bit;
+            return node;
+        }
+        if (slots[index] == NULL) {
+            child = pmap_node_set(slots[index + 1], shift + PMAP_BITS, hash,
+                key, value, edit, added);
+            if (child == slots[index + 1]) {
+                return node;
+            }
+            node = pmap_node_editable(node, edit);
+            node->data.pmap_node.slots[index + 1] = child;
+            return node;
+        }
+        if (!is_equal(slots[index], key)) {
+            *added = 1;
+            child = pmap_pair_node(shift + PMAP_BITS,
+                slots[index], slots[index + 1], equal_hash(slots[index]),
+                key, value, hash, edit);
+            node = pmap_node_editable(node, edit);
+            node->data.pmap_node.slots[index] = NULL;
+            node->data.pmap_node.slots[index + 1] = child;
+            return node;
+        }
+    }
+    /* the key is present at index */
+    if (slots[index + 1] == value) {
+        return node;
+    }
+    node = pmap_node_editable(node, edit);
+    node->data.pmap_node.slots[index + 1] = value;
+    return node;
+}
+
+/* returns NULL when the node becomes empty */
+object* pmap_node_delete(object* node, int shift, uint32_t hash,
+    object* key, uint32_t edit, char* removed) {
+    object** slots;
+    object* child;
+    uint32_t bitmap;
+    uint32_t bit;
+    long index;
+
+    slots = node->data.pmap_node.slots;
+    if (shift > PMAP_MAX_SHIFT) {
+        for (index = 0; index < node->data.pmap_node.length; index += 2) {
+            if (is_equal(slots[index], key)) {
+                *removed = 1;
+                if (node->data.pmap_node.length == 2) {
+                    return NULL;
+                }
+                return pmap_node_remove(node, index, edit);
+            }
+        }
+        return node;
+    }
+    bitmap = node->data.pmap_node.bitmap;
+    bit = pmap_bit(hash, shift);
+    if ((bitmap & bit) == 0) {
+        return node;
+    }
+    index = pmap_index(bitmap, bit);
+    if (slots[index] == NULL) {
+        child = pmap_node_delete(slots[index + 1], shift + PMAP_BITS, hash,
+            key, edit, removed);
+        if (child == slots[index + 1]) {
+            return node;
+        }
+        if (child != NULL) {
+            node = pmap_node_editable(node, edit);
+            node->data.pmap_node.slots[index + 1] = child;
+            return node;
+        }
+    }
+    else if (!is_equal(slots[index], key)) {
+        return node;
+    }
+    else {
+        *removed = 1;
+    }
+    if (bitmap == bit) {
+        return NULL;
+    }
+    node = pmap_node_remove(node, index, edit);
+    node->data.pmap_node.bitmap = bitmap & ~bit;
+    return node;
+}
+
+/* returns the slot holding the value of key, or NULL */
+object** pmap_node_lookup(object* node, uint32_t hash, object* key) {
+    object** slots;
+    uint32_t bit;
+    long index;
+    int shift;
+
+    for (shift = 0; node != NULL; shift += PMAP_BITS) {
+        slots = node->data.pmap_node.slots;
+        if (shift > PMAP_MAX_SHIFT) {
+            for (index = 0; index < node->data.pmap_node.length;
+                 index += 2) {
+                if (is_equal(slots[index], key)) {
+                    return slots + index + 1;
+                }
+            }
+            return NULL;
+        }
+        bit = pmap_bit(hash, shift);
+        if ((node->data.pmap_node.bitmap & bit) == 0) {
+            return NULL;
+        }
+        index = pmap_index(node->data.pmap_node.bitmap, bit);
+        if (slots[index] != NULL) {
+            return is_equal(slots[index], key) ? slots + index + 1 : NULL;
+        }
+        node = slots[index + 1];
+    }
+    return NULL;
+}
+
+object** pmap_lookup(object* map, object* key) {
+    return pmap_node_lookup(map->data.pmap.root, equal_hash(key), key);
+}
+
+/* sets key in map, in place for transients, else in a new version */
+object* pmap_set(object* map, object* key, object* value) {
+    object* root;
+    uint32_t edit;
+    char added = 0;
+
+    edit = map->data.pmap.edit;
+    root = map->data.pmap.root;
+    if (root == NULL) {
+        root = make_pmap_node(0, 0, edit ? PMAP_TRANSIENT_SPARE : 0, edit);
+    }
+    root = pmap_node_set(root, 0, equal_hash(key), key, value, edit,
+        &added);
+    if (edit != 0) {
+        map->data.pmap.root = root;
+        map->data.pmap.count += added;
+        return map;
+    }
+    if (root == map->data.pmap.root) {
+        return map;
+    }
+    return make_pmap(root, map->data.pmap.count + added, 0,
+        map->data.pmap.is_set);
+}
+
+object* pmap_delete(object* map, object* key) {
+    object* root;
+    uint32_t edit;
+    char removed = 0;
+
+    edit = map->data.pmap.edit;
+    root = map->data.pmap.root;
+    if (root == NULL) {
+        return map;
+    }
+    root = pmap_node_delete(root, 0, equal_hash(key), key, edit,
+        &removed);
+    if (edit != 0) {
+        map->data.pmap.root = root;
+        map->data.pmap.count -= removed;
+        return map;
+    }
+    if (!removed) {
+        return map;
+    }
+    return make_pmap(root, map->data.pmap.count - 1, 0,
+        map->data.pmap.is_set);
+}
+
+/* (proc key value acc) over every entry, depth first */
+object* pmap_node_fold(object* node, object* proc, object* acc) {
+    object** slots;
+    long i;
+
+    slots = node->data.pmap_node.slots;
+    for (i = 0; i < node->data.pmap_node.length; i += 2) {
+        if (slots[i] == NULL) {
+            acc = pmap_node_fold(slots[i + 1], proc, acc);
+        }
+        else {
+            acc = apply_procedure(proc,
+                cons(slots[i], cons(slots[i + 1], cons(acc, nil))));
+        }
+    }
+    return acc;
+}
+
+object* pmap_node_to_list(object* node, object* list, char keys_only) {
+    object** slots;
+    long i;
+
+    slots = node->data.pmap_node.slots;
+    for (i = 0; i < node->data.pmap_node.length; i += 2) {
+        if (slots[i] == NULL) {
+            list = pmap_node_to_list(slots[i + 1], list, keys_only);
+        }
+        else {
+            list = cons(keys_only ? slots[i] : cons(slots[i], slots[i + 1]),
+                list);
+        }
+    }
+    return list;
+}
+
+object* make_pmap_proc(object* arguments) {
+    return make_pmap(NULL, 0, 0, 0);
+}
+
+object* is_pmap_proc(object* arguments) {
+    return is_pmap(car(arguments)) ? true : false;
+}
+
+object* pmap_count_proc(object* arguments) {
+    return make_fixnum(pmap_argument(car(arguments))->data.pmap.count);
+}
+
+/* (pmap-ref map key [default]) */
+object* pmap_ref_proc(object* arguments) {
+    object** value;
+
+    value = pmap_lookup(pmap_argument(car(arguments)), cadr(arguments));
+    if (value != NULL) {
+        return *value;
+    }
+    if (is_nil(cddr(arguments))) {
+        diagnostic("*** pmap-ref: key not found\n");
+        exit(1);
+    }
+    return caddr(arguments);
+}
+
+object* pmap_contains_proc(object* arguments) {
+    return (pmap_lookup(pmap_argument(car(arguments)),
+        cadr(arguments)) != NULL) ? true : false;
+}
+
+object* persistent_argument(object* obj) {
+    if (pmap_argument(obj)->data.pmap.edit != 0) {
+        diagnostic("*** use pmap-set! and pmap-delete! on a "
+            "transient map\n");
+        exit(1);
+    }
+    return obj;
+}
+
+object* pmap_set_proc(object* arguments) {
+    return pmap_set(persistent_argument(car(arguments)), cadr(arguments),
+        caddr(arguments));
+}
+
+object* pmap_delete_proc(object* arguments) {
+    return pmap_delete(persistent_argument(car(arguments)),
+        cadr(arguments));
+}
+
+/* (pmap-fold proc init map) calls (proc key value acc) */
+object* pmap_fold_proc(object* arguments) {
+    object* map;
+
+    map = pmap_argument(caddr(arguments));
+    if (map->data.pmap.root == NULL) {
+        return cadr(arguments);
+    }
+    return pmap_node_fold(map->data.pmap.root, car(arguments),
+        cadr(arguments));
+}
+
+object* pmap_to_alist_proc(object* arguments) {
+    object* map;
+
+    map = pmap_argument(car(arguments));
+    if (map->data.pmap.root == NULL) {
+        return nil;
+    }
+    return pmap_node_to_list(map->data.pmap.root, nil, 0);
+}
+
+object* pmap_keys_proc(object* arguments) {
+    object* map;
+
+    map = pmap_argument(car(arguments));
+    if (map->data.pmap.root == NULL) {
+        return nil;
+    }
+    return pmap_node_to_list(map->data.pmap.root, nil, 1);
+}
+
+/* (pmap-transient map) starts a batch of in-place updates */
+object* pmap_transient_proc(object* arguments) {
+    object* map;
+
+    map = persistent_argument(car(arguments));
+    return make_pmap(map->data.pmap.root, map->data.pmap.count,
+        pmap_next_edit++, map->data.pmap.is_set);
+}
+
+object* pmap_set_transient_proc(object* arguments) {
+    pmap_set(transient_argument(car(arguments)), cadr(arguments),
+        caddr(arguments));
+    return ok_symbol;
+}
+
+object* pmap_delete_transient_proc(object* arguments) {
+    pmap_delete(transient_argument(car(arguments)), cadr(arguments));
+    return ok_symbol;
+}
+
+/* (pmap-persistent! transient) ends the batch; the transient is dead */
+object* pmap_persistent_proc(object* arguments) {
+    object* map;
+
+    map = transient_argument(car(arguments));
+    map->data.pmap.edit = 0;
+    return make_pmap(map->data.pmap.root, map->data.pmap.count, 0,
+        map->data.pmap.is_set);
+}
+
+/* sets are maps whose values are all #t */
+
+object* make_pset_proc(object* arguments) {
+    return make_pmap(NULL, 0, 0, 1);
+}
+
+object* pset_add_proc(object* arguments) {
+    return pmap_set(persistent_argument(car(arguments)), cadr(arguments),
+        true);
+}
+
+object* pset_add_transient_proc(object* arguments) {
+    pmap_set(transient_argument(car(arguments)), cadr(arguments), true);
+    return ok_symbol;
+}
+
+/**************************** RECORDS ****************************/
+
+/*
+ * define-record-type makes a record type descriptor and one record
+ * procedure per constructor, predicate, accessor and modifier. A
+ * record is the descriptor followed by its slots in one allocation,
+ * and a record procedure knows its descriptor and slot, so accessing
+ * a field is a type check and an indexed load.
+ */
+
+typedef enum {
+    RECORD_CONSTRUCTOR, RECORD_PREDICATE, RECORD_ACCESSOR, RECORD_MODIFIER
+} record_proc_kind;
+
+object* make_record_type(object* name, object* fields) {
+    object* obj;
+    long nfields = 0;
+    object* f;
+
+    for (f = fields; !is_nil(f); f = cdr(f)) {
+        nfields++;
+    }
+    obj = alloc_object();
+    obj->type = RECORD_TYPE;
+    obj->data.record_type.name = name;
+    obj->data.record_type.fields = fields;
+    obj->data.record_type.nfields = nfields;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_record_type(object* obj) {
+    return obj->type == RECORD_TYPE;
+}
+
+object* make_record(object* rtd) {
+    object* obj;
+    long i;
+
+    obj = alloc_object_sized(offsetof(object, data.record.slots) +
+        rtd->data.record_type.nfields * sizeof(object*));
+    obj->type = RECORD;
+    obj->data.record.rtd = rtd;
+    for (i = 0; i < rtd->data.record_type.nfields; i++) {
+        obj->data.record.slots[i] = false;
+    }
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_record(object* obj) {
+    return obj->type == RECORD;
+}
+
+object* make_record_proc(record_proc_kind kind, object* rtd, long slot,
+    object* slots) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = RECORD_PROC;
+    obj->data.record_proc.kind = kind;
+    obj->data.record_proc.rtd = rtd;
+    obj->data.record_proc.slot = slot;
+    obj->data.record_proc.slots = slots;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_record_procedure(object* obj) {
+    return obj->type == RECORD_PROC;
+}
+
+/* slot of the field named field in rtd */
+long record_field_slot(object* rtd, object* field) {
+    object* f;
+    long slot = 0;
+
+    for (f = rtd->data.record_type.fields; !is_nil(f); f = cdr(f)) {
+        if (car(f) == field) {
+            return slot;
+        }
+        slot++;
+    }
+    diagnostic("*** %s is not a field of record type %s\n",
+        field->data.symbol.value,
+        rtd->data.record_type.name->data.symbol.value);
+    exit(1);
+}
+
+object* record_argument(object* proc, object* obj) {
+    if (!is_record(obj) || obj->data.record.rtd != proc->data.record_proc.rtd) {
+        diagnostic("*** expected a record of type %s\n",
+            proc->data.record_proc.rtd->data.record_type.name->
+                data.symbol.value);
+        exit(1);
+    }
+    return obj;
+}
+
+object* apply_record_proc(object* proc, object* arguments) {
+    object* record;
+    object* slots;
+    long i;
+
+    switch (proc->data.record_proc.kind) {
+    case RECORD_CONSTRUCTOR:
+        record = make_record(proc->data.record_proc.rtd);
+        slots = proc->data.record_proc.slots;
+        for (i = 0; i < slots->data.vector.length; i++) {
+            if (is_nil(arguments)) {
+                diagnostic("*** too few arguments to record "
+                    "constructor\n");
+                exit(1);
+            }
+            record->data.record.slots[
+                slots->data.vector.items[i]->data.fixnum.value] =
+                car(arguments);
+            arguments = cdr(arguments);
+        }
+        return record;
+    case RECORD_PREDICATE:
+        record = car(arguments);
+        return (is_record(record) &&
+            record->data.record.rtd == proc->data.record_proc.rtd) ?
+            true : false;
+    case RECORD_ACCESSOR:
+        record = record_argument(proc, car(arguments));
+        return record->data.record.slots[proc->data.record_proc.slot];
+    default:
+        record = record_argument(proc, car(arguments));
+        record->data.record.slots[proc->data.record_proc.slot] =
+            cadr(arguments);
+        return ok_symbol;
+    }
+}
+
+object* is_record_proc(object* arguments) {
+    return is_record(car(arguments)) ? true : false;
+}
+
+object* record_type_descriptor_proc(object* arguments) {
+    if (!is_record(car(arguments))) {
+        diagnostic("*** expected a record\n");
+        exit(1);
+    }
+    return car(arguments)->data.record.rtd;
+}
+
+object* record_type_name_proc(object* arguments) {
+    if (!is_record_type(car(arguments))) {
+        diagnostic("*** expected a record type\n");
+        exit(1);
+    }
+    return car(arguments)->data.record_type.name;
+}
+
+/********************* PROMISES AND STREAMS **********************/
+
+/*
+ * A promise is forced in a loop. Forcing a delay-force promise yields
+ * another promise, whose state the first one takes over; the second
+ * is left forwarding to the first, so both share the result as R7RS
+ * asks, and a long chain of delay-forces needs no C stack.
+ *
+ * A stream is a promise of either the empty list or a pair of a
+ * promise of the first item and the stream of the rest. The stream
+ * procedures below build their results from native promises, which
+ * run a C step function on a state object instead of evaluating an
+ * expression, and the consumers walk a stream with a cursor so the
+ * cells already visited can be collected.
+ */
+
+typedef enum {
+    PROMISE_DELAY,          /* value is an expression to evaluate */
+    PROMISE_DELAY_FORCE,    /* value is an expression giving a promise */
+    PROMISE_NATIVE,         /* value is the state passed to step */
+    PROMISE_DONE,           /* value is the result */
+    PROMISE_FORWARD         /* value is the promise sharing our result */
+} promise_state;
+
+object* make_promise(promise_state state, object* value, object* env,
+    object* (*step)(struct object* state)) {
+    object* obj;
+
+    obj = alloc_object();
+    obj->type = PROMISE;
+    obj->data.promise.state = state;
+    obj->data.promise.value = value;
+    obj->data.promise.env = env;
+    obj->data.promise.step = step;
+    push(the_vm, obj);
+    return obj;
+}
+
+char is_promise(object* obj) {
+    return obj->type == PROMISE;
 }
 
-object* integer_to_char_proc(object* arguments) {
-    return make_character((char)(car(arguments))->data.fixnum.value);
+object* promise_argument(object* obj) {
+    if (!is_promise(obj)) {
+        diagnostic("*** expected a promise\n");
+        exit(1);
+    }
+    return obj;
+}
+
+object* promise_target(object* promise) {
+    while (promise->data.promise.state == PROMISE_FORWARD) {
+        promise = promise->data.promise.value;
+    }
+    return promise;
+}
+
+object* force(object* promise) {
+    object* result;
+    object* next;
+    int frame;
+
+    frame = the_vm->stackSize;
+    promise = promise_target(promise);
+    while (promise->data.promise.state != PROMISE_DONE) {
+        /* earlier links of the chain are no longer needed */
+        the_vm->stackSize = frame;
+        push(the_vm, promise);
+        switch (promise->data.promise.state) {
+        case PROMISE_NATIVE:
+            result = promise->data.promise.step(promise->data.promise.value);
+            break;
+        default:
+            result = eval(promise->data.promise.value,
+                promise->data.promise.env);
+            break;
+        }
+        /* forcing the expression may have forced this promise too */
+        promise = promise_target(promise);
+        if (promise->data.promise.state == PROMISE_DONE) {
+            break;
+        }
+        if (promise->data.promise.state != PROMISE_DELAY_FORCE ||
+            !is_promise(result)) {
+            promise->data.promise.state = PROMISE_DONE;
+            promise->data.promise.value = result;
+            promise->data.promise.env = NULL;
+            break;
+        }
+        next = promise_target(result);
+        if (next != promise) {
+            promise->data.promise.state = next->data.promise.state;
+            promise->data.promise.value = next->data.promise.value;
+            promise->data.promise.env = next->data.promise.env;
+            promise->data.promise.step = next->data.promise.step;
+            next->data.promise.state = PROMISE_FORWARD;
+            next->data.promise.value = promise;
+            next->data.promise.env = NULL;
+        }
+    }
+    return promise->data.promise.value;
+}
+
+object* force_proc(object* arguments) {
+    return is_promise(car(arguments)) ? force(car(arguments)) :
+        car(arguments);
+}
+
+object* make_promise_proc(object* arguments) {
+    if (is_promise(car(arguments))) {
+        return car(arguments);
+    }
+    return make_promise(PROMISE_DONE, car(arguments), NULL, NULL);
+}
+
+object* is_promise_proc(object* arguments) {
+    return is_promise(car(arguments)) ? true : false;
+}
+
+/* streams */
+
+object* make_stream_pair(object* first, object* rest) {
+    return make_promise(PROMISE_DONE,
+        cons(make_promise(PROMISE_DONE, first, NULL, NULL), rest),
+        NULL, NULL);
+}
+
+/* the forced cell of stream: the empty list or a pair */
+object* stream_cell(object* stream) {
+    object* cell;
+
+    cell = force(promise_argument(stream));
+    if (!is_nil(cell) && !is_pair(cell)) {
+        diagnostic("*** expected a stream\n");
+        exit(1);
+    }
+    return cell;
+}
+
+object* stream_first(object* cell) {
+    return force(car(cell));
+}
+
+/* consumers drop the stream from a fresh argument list they own, so
+ * only their cursor keeps the unvisited part of the stream alive */
+object* take_stream_argument(object* arguments) {
+    object* stream;
+
+    stream = car(arguments);
+    if (fresh_arguments) {
+        set_car(arguments, nil);
+    }
+    return stream;
+}
+
+object* is_stream_proc(object* arguments) {
+    return is_promise(car(arguments)) ? true : false;
+}
+
+object* is_stream_null_proc(object* arguments) {
+    return (is_promise(car(arguments)) &&
+        is_nil(stream_cell(car(arguments)))) ? true : false;
+}
+
+object* is_stream_pair_proc(object* arguments) {
+    return (is_promise(car(arguments)) &&
+        is_pair(stream_cell(car(arguments)))) ? true : false;
+}
+
+object* stream_car_proc(object* arguments) {
+    object* cell;
+
+    cell = stream_cell(car(arguments));
+    if (is_nil(cell)) {
+        diagnostic("*** stream-car of the empty stream\n");
+        exit(1);
+    }
+    return stream_first(cell);
+}
+
+object* stream_cdr_proc(object* arguments) {
+    object* cell;
+
+    cell = stream_cell(car(arguments));
+    if (is_nil(cell)) {
+        diagnostic("*** stream-cdr of the empty stream\n");
+        exit(1);
+    }
+    return cdr(cell);
+}
+
+object* list_stream_step(object* list) {
+    if (is_nil(list)) {
+        return nil;
+    }
+    return cons(make_promise(PROMISE_DONE, car(list), NULL, NULL),
+        make_promise(PROMISE_NATIVE, cdr(list), NULL, list_stream_step));
+}
+
+object* list_to_stream_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE, list_argument(car(arguments)),
+        NULL, list_stream_step);
+}
+
+object* stream_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE, arguments, NULL, list_stream_step);
+}
+
+/* state: (port) */
+object* port_stream_step(object* state) {
+    int c;
+
+    c = next_char(car(state)->data.input_port.reader);
+    if (c == EOF) {
+        return nil;
+    }
+    return cons(make_promise(PROMISE_DONE, make_character(c), NULL, NULL),
+        make_promise(PROMISE_NATIVE, state, NULL, port_stream_step));
+}
+
+/* (port->stream [port]) streams the characters of port */
+object* port_to_stream_proc(object* arguments) {
+    object* port;
+
+    port = is_nil(arguments) ? make_input_port(stdin_reader) :
+        car(arguments);
+    return make_promise(PROMISE_NATIVE, cons(port, nil), NULL,
+        port_stream_step);
+}
+
+/* state: (next step . proc) counting from next by step, or applying
+ * proc to get the next item when step is #f */
+object* iterate_stream_step(object* state) {
+    object* item;
+    object* next;
+
+    item = car(state);
+    if (is_false(cadr(state))) {
+        next = apply_procedure(cddr(state), cons(item, nil));
+    }
+    else {
+        next = add_proc(cons(item, cons(cadr(state), nil)));
+    }
+    return cons(make_promise(PROMISE_DONE, item, NULL, NULL),
+        make_promise(PROMISE_NATIVE, cons(next, cdr(state)), NULL,
+            iterate_stream_step));
+}
+
+/* (stream-from first [step]) */
+object* stream_from_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE,
+        cons(car(arguments), cons(is_nil(cdr(arguments)) ?
+            make_fixnum(1) : cadr(arguments), nil)),
+        NULL, iterate_stream_step);
+}
+
+/* (stream-iterate proc base) */
+object* stream_iterate_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE,
+        cons(cadr(arguments), cons(false, car(arguments))),
+        NULL, iterate_stream_step);
+}
+
+/* state: (next past step) */
+object* range_stream_step(object* state) {
+    object* item;
+    object* past;
+    object* step;
+
+    item = car(state);
+    past = cadr(state);
+    step = caddr(state);
+    if (is_true(is_lessthan_proc(cons(step, cons(make_fixnum(0), nil)))) ?
+        is_false(is_greatthan_proc(cons(item, cons(past, nil)))) :
+        is_false(is_lessthan_proc(cons(item, cons(past, nil))))) {
+        return nil;
+    }
+    return cons(make_promise(PROMISE_DONE, item, NULL, NULL),
+        make_promise(PROMISE_NATIVE,
+            cons(add_proc(cons(item, cons(step, nil))), cdr(state)),
+            NULL, range_stream_step));
+}
+
+/* (stream-range first past [step]) */
+object* stream_range_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE,
+        cons(car(arguments), cons(cadr(arguments),
+            cons(is_nil(cddr(arguments)) ?
+                make_fixnum(1) : caddr(arguments), nil))),
+        NULL, range_stream_step);
+}
+
+/* advances every stream in the list streams; NULL when one is empty,
+ * else the list of their first items */
+object* next_stream_items(object* streams) {
+    object* s;
+    object* cell;
+    object* items;
+    object* last;
+    object* item;
+
+    items = nil;
+    last = NULL;
+    for (s = streams; !is_nil(s); s = cdr(s)) {
+        cell = stream_cell(car(s));
+        if (is_nil(cell)) {
+            return NULL;
+        }
+        item = cons(stream_first(cell), nil);
+        if (last == NULL) {
+            items = item;
+        }
+        else {
+            set_cdr(last, item);
+        }
+        last = item;
+        set_car(s, cdr(cell));
+    }
+    return items;
+}
+
+/* state: (proc stream ...) */
+object* map_stream_step(object* state) {
+    object* streams;
+    object* items;
+
+    streams = copy_list_onto(cdr(state), nil);
+    items = next_stream_items(streams);
+    if (items == NULL) {
+        return nil;
+    }
+    return cons(make_promise(PROMISE_DONE,
+            apply_procedure(car(state), items), NULL, NULL),
+        make_promise(PROMISE_NATIVE, cons(car(state), streams), NULL,
+            map_stream_step));
+}
+
+/* (stream-map proc stream ...) */
+object* stream_map_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE, copy_list_onto(arguments, nil),
+        NULL, map_stream_step);
+}
+
+/* state: (pred . stream); skips in a loop, without nesting promises */
+object* filter_stream_step(object* state) {
+    object* stream;
+    object* cell;
+    int frame;
+
+    stream = cdr(state);
+    frame = the_vm->stackSize;
+    while (1) {
+        cell = stream_cell(stream);
+        if (is_nil(cell)) {
+            return nil;
+        }
+        if (is_true(apply_procedure(car(state),
+                cons(stream_first(cell), nil)))) {
+            return cons(car(cell),
+                make_promise(PROMISE_NATIVE, cons(car(state), cdr(cell)),
+                    NULL, filter_stream_step));
+        }
+        stream = cdr(cell);
+        the_vm->stackSize = frame;
+        push(the_vm, stream);
+    }
+}
+
+/* (stream-filter pred stream) */
+object* stream_filter_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE,
+        cons(car(arguments), cadr(arguments)), NULL, filter_stream_step);
+}
+
+/* state: (count . stream) */
+object* take_stream_step(object* state) {
+    object* cell;
+    long count;
+
+    count = car(state)->data.fixnum.value;
+    if (count <= 0) {
+        return nil;
+    }
+    cell = stream_cell(cdr(state));
+    if (is_nil(cell)) {
+        return nil;
+    }
+    return cons(car(cell), make_promise(PROMISE_NATIVE,
+        cons(make_fixnum(count - 1), cdr(cell)), NULL, take_stream_step));
+}
+
+/* (stream-take n stream) */
+object* stream_take_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE,
+        cons(make_fixnum(fixnum_argument(car(arguments))), cadr(arguments)),
+        NULL, take_stream_step);
+}
+
+/* state: (stream ...) appended in order */
+object* append_stream_step(object* state) {
+    object* cell;
+
+    while (!is_nil(state)) {
+        cell = stream_cell(car(state));
+        if (is_pair(cell)) {
+            return cons(car(cell), make_promise(PROMISE_NATIVE,
+                cons(cdr(cell), cdr(state)), NULL, append_stream_step));
+        }
+        state = cdr(state);
+    }
+    return nil;
+}
+
+/* (stream-append stream ...) */
+object* stream_append_proc(object* arguments) {
+    return make_promise(PROMISE_NATIVE, copy_list_onto(arguments, nil),
+        NULL, append_stream_step);
+}
+
+/* drops count items, releasing them as it goes */
+object* stream_drop(object* stream, long count) {
+    object* cell;
+    int frame;
+
+    frame = the_vm->stackSize;
+    for (; count > 0; count--) {
+        cell = stream_cell(stream);
+        if (is_nil(cell)) {
+            break;
+        }
+        stream = cdr(cell);
+        the_vm->stackSize = frame;
+        push(the_vm, stream);
+    }
+    return stream;
+}
+
+/* (stream-drop n stream) */
+object* stream_drop_proc(object* arguments) {
+    long count;
+
+    count = fixnum_argument(car(arguments));
+    return stream_drop(take_stream_argument(cdr(arguments)), count);
+}
+
+/* (stream-ref stream n) */
+object* stream_ref_proc(object* arguments) {
+    object* cell;
+    long n;
+
+    n = fixnum_argument(cadr(arguments));
+    cell = stream_cell(stream_drop(take_stream_argument(arguments), n));
+    if (is_nil(cell)) {
+        diagnostic("*** stream-ref index %ld out of range\n", n);
+        exit(1);
+    }
+    return stream_first(cell);
+}
+
+/* (stream->list [n] stream) */
+object* stream_to_list_proc(object* arguments) {
+    object* stream;
+    object* cell;
+    object* result;
+    object* last;
+    object* item;
+    long count;
+
+    count = -1;
+    if (!is_nil(cdr(arguments))) {
+        count = fixnum_argument(car(arguments));
+        arguments = cdr(arguments);
+    }
+    stream = take_stream_argument(arguments);
+    result = nil;
+    last = NULL;
+    for (; count != 0; count--) {
+        cell = stream_cell(stream);
+        if (is_nil(cell)) {
+            break;
+        }
+        item = cons(stream_first(cell), nil);
+        if (last == NULL) {
+            result = item;
+        }
+        else {
+            set_cdr(last, item);
+        }
+        last = item;
+        stream = cdr(cell);
+    }
+    return result;
+}
+
+/* (stream-for-each proc stream ...) runs in constant space */
+object* stream_for_each_proc(object* arguments) {
+    object* proc;
+    object* streams;
+    object* items;
+    int frame;
+
+    proc = car(arguments);
+    streams = copy_list_onto(cdr(arguments), nil);
+    if (fresh_arguments) {
+        set_cdr(arguments, nil);
+    }
+    frame = the_vm->stackSize;
+    while ((items = next_stream_items(streams)) != NULL) {
+        apply_procedure(proc, items);
+        the_vm->stackSize = frame;
+    }
+    return ok_symbol;
+}
+
+/* (stream-fold proc base stream) calls (proc acc item) */
+object* stream_fold_proc(object* arguments) {
+    object* proc;
+    object* acc;
+    object* stream;
+    object* cell;
+    int frame;
+
+    proc = car(arguments);
+    acc = cadr(arguments);
+    stream = take_stream_argument(cddr(arguments));
+    frame = the_vm->stackSize;
+    while (!is_nil(cell = stream_cell(stream))) {
+        acc = apply_procedure(proc, cons(acc, cons(stream_first(cell), nil)));
+        stream = cdr(cell);
+        the_vm->stackSize = frame;
+        push(the_vm, acc);
+        push(the_vm, stream);
+    }
+    return acc;
+}
+
+object* stream_length_proc(object* arguments) {
+    object* stream;
+    object* cell;
+    long length = 0;
+    int frame;
+
+    stream = take_stream_argument(arguments);
+    frame = the_vm->stackSize;
+    while (!is_nil(cell = stream_cell(stream))) {
+        length++;
+        stream = cdr(cell);
+        the_vm->stackSize = frame;
+        push(the_vm, stream);
+    }
+    return make_fixnum(length);
+}
+
+/****************************** CSV ******************************/
+
+/*
+ * read-csv-row and csv-fold read delimited text from an input port,
+ * a row at a time, as a vector of fields. A field in double quotes
+ * may hold delimiters and line ends, with "" standing for one quote.
+ * The delimiter defaults to a comma, so a tab gives TSV. A list of
+ * column types, string, number, fixnum or flonum, converts fields
+ * with the reader's number parser; an empty typed field is #f. The
+ * scan for the bytes that end a plain field takes 16 at a time with
+ * SSE2.
+ */
+
+typedef enum {
+    CSV_STRING, CSV_NUMBER, CSV_FIXNUM, CSV_FLONUM
+} csv_type;
+
+typedef struct csv_reader {
+    reader* in;
+    unsigned char delimiter;
+    csv_type* types;
+    long ntypes;
+    strbuf field;       /* the field being read, reused */
+    object** fields;    /* of the row so far, also on the VM stack */
+    long nfields;
+    long capacity;
+} csv_reader;
+
+/* the first byte from p on that may end or quote a field */
+unsigned char* csv_scan(unsigned char* p, unsigned char* end,
+    unsigned char delimiter) {
+#if defined(HAVE_SSE2)
+    __m128i d = _mm_set1_epi8((char)delimiter);
+    __m128i q = _mm_set1_epi8('"');
+    __m128i n = _mm_set1_epi8('\n');
+    __m128i r = _mm_set1_epi8('\r');
+    __m128i x;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        x = _mm_loadu_si128((__m128i*)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, d), _mm_cmpeq_epi8(x, q)),
+            _mm_or_si128(_mm_cmpeq_epi8(x, n), _mm_cmpeq_epi8(x, r))));
+        if (mask != 0) {
+            return p + ctz64((uint64_t)mask);
+        }
+    }
+#endif
+    while (p < end && *p != delimiter && *p != '"' && *p != '\n' &&
+           *p != '\r') {
+        p++;
+    }
+    return p;
+}
+
+/* the rest of a field up to a delimiter or line end, which is left */
+void csv_read_plain(csv_reader* c) {
+    reader* in;
+    unsigned char* p;
+    unsigned char* end;
+    unsigned char* q;
+
+    in = c->in;
+    while (1) {
+        p = in->buf + in->pos;
+        end = in->buf + in->end;
+        q = csv_scan(p, end, c->delimiter);
+        strbuf_add(&c->field, (char*)p, (long)(q - p));
+        in->pos = q - in->buf;
+        if (q < end) {
+            if (*q != '"') {
+                return;
+            }
+            /* a quote inside a plain field is part of it */
+            strbuf_add(&c->field, "\"", 1);
+            in->pos++;
+        }
+        else if (reader_fill(in) == 0) {
+            return;
+        }
+    }
+}
+
+/* a quoted field after its opening quote, through the closing one */
+void csv_read_quoted(csv_reader* c) {
+    reader* in;
+    unsigned char* p;
+    unsigned char* end;
+    unsigned char* q;
+
+    in = c->in;
+    while (1) {
+        p = in->buf + in->pos;
+        end = in->buf + in->end;
+        q = memchr(p, '"', end - p);
+        if (q == NULL) {
+            strbuf_add(&c->field, (char*)p, (long)(end - p));
+            in->pos = in->end;
+            if (reader_fill(in) == 0) {
+                return;
+            }
+            continue;
+        }
+        strbuf_add(&c->field, (char*)p, (long)(q - p));
+        in->pos = q + 1 - in->buf;
+        if (peek(in) != '"') {
+            return;
+        }
+        strbuf_add(&c->field, "\"", 1);
+        next_char(in);
+    }
+}
+
+void csv_add_field(csv_reader* c) {
+    csv_type type;
+    object* value;
+    char* text;
+
+    type = (c->nfields < c->ntypes) ? c->types[c->nfields] : CSV_STRING;
+    text = (c->field.data != NULL) ? c->field.data : "";
+    if (type == CSV_STRING) {
+        value = make_string_n(text, c->field.length);
+    }
+    else if (c->field.length == 0) {
+        value = false;
+    }
+    else {
+        value = parse_number(text, 10);
+        if (value == NULL || (type == CSV_FIXNUM && !is_fixnum(value))) {
+            diagnostic("*** csv: \"%s\" in column %ld is not a %s\n",
+                text, c->nfields,
+                (type == CSV_FIXNUM) ? "fixnum" : "number");
+            exit(1);
+        }
+        if (type == CSV_FLONUM && is_fixnum(value)) {
+            value = make_flonum((double)value->data.fixnum.value);
+        }
+    }
+    if (c->nfields == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->fields = realloc(c->fields, c->capacity * sizeof(object*));
+        if (c->fields == NULL) {
+            diagnostic("*** csv - out of memory\n");
+            exit(1);
+        }
+    }
+    c->fields[c->nfields++] = value;
+}
+
+/* the next row as a vector, or NULL at the end of the input; a blank
+ * line is a row without fields */
+object* csv_read_row(csv_reader* c) {
+    object* row;
+    int frame;
+    int ch;
+    long i;
+
+    frame = the_vm->stackSize;
+    c->nfields = 0;
+    ch = peek(c->in);
+    if (ch == EOF) {
+        return NULL;
+    }
+    if (ch != '\n' && ch != '\r') {
+        do {
+            c->field.length = 0;
+            if (peek(c->in) == '"') {
+                next_char(c->in);
+                csv_read_quoted(c);
+            }
+            csv_read_plain(c);
+            csv_add_field(c);
+            ch = next_char(c->in);
+        } while (ch == c->delimiter);
+    }
+    else {
+        ch = next_char(c->in);
+    }
+    if (ch == '\r' && peek(c->in) == '\n') {
+        next_char(c->in);
+    }
+    row = make_vector(c->nfields, nil);
+    for (i = 0; i < c->nfields; i++) {
+        row->data.vector.items[i] = c->fields[i];
+    }
+    the_vm->stackSize = frame;
+    push(the_vm, row);
+    return row;
+}
+
+/* takes [port [delimiter [types]]] */
+void csv_open(csv_reader* c, object* arguments) {
+    object* types;
+    object* delimiter;
+    char* name;
+    long i;
+
+    c->in = input_port_argument(arguments);
+    c->delimiter = ',';
+    c->types = NULL;
+    c->ntypes = 0;
+    strbuf_init(&c->field);
+    c->fields = NULL;
+    c->nfields = 0;
+    c->capacity = 0;
+    if (is_nil(arguments) || is_nil(cdr(arguments))) {
+        return;
+    }
+    delimiter = cadr(arguments);
+    if (!is_character(delimiter) || delimiter->data.character.value == '"' ||
+        delimiter->data.character.value == '\n' ||
+        delimiter->data.character.value == '\r') {
+        diagnostic("*** csv: bad delimiter\n");
+        exit(1);
+    }
+    c->delimiter = (unsigned char)delimiter->data.character.value;
+    if (is_nil(cddr(arguments)) || caddr(arguments) == false) {
+        return;
+    }
+    for (types = caddr(arguments); is_pair(types); types = cdr(types)) {
+        c->ntypes++;
+    }
+    c->types = malloc((c->ntypes ? c->ntypes : 1) * sizeof(csv_type));
+    if (c->types == NULL) {
+        diagnostic("*** csv - out of memory\n");
+        exit(1);
+    }
+    types = caddr(arguments);
+    for (i = 0; i < c->ntypes; i++, types = cdr(types)) {
+        name = is_symbol(car(types)) ? car(types)->data.symbol.value : "";
+        if (strcmp(name, "string") == 0) {
+            c->types[i] = CSV_STRING;
+        }
+        else if (strcmp(name, "number") == 0) {
+            c->types[i] = CSV_NUMBER;
+        }
+        else if (strcmp(name, "fixnum") == 0) {
+            c->types[i] = CSV_FIXNUM;
+        }
+        else if (strcmp(name, "flonum") == 0) {
+            c->types[i] = CSV_FLONUM;
+        }
+        else {
+            diagnostic("*** csv: unknown column type\n");
+            exit(1);
+        }
+    }
+}
+
+void csv_close(csv_reader* c) {
+    free(c->field.data);
+    free(c->fields);
+    free(c->types);
+}
+
+/* (read-csv-row [port [delimiter [types]]]) */
+object* read_csv_row_proc(object* arguments) {
+    csv_reader c;
+    object* row;
+
+    csv_open(&c, arguments);
+    row = csv_read_row(&c);
+    csv_close(&c);
+    return (row == NULL) ? eof_object : row;
 }
 
-object* number_to_string_proc(object* arguments) {
-    char buffer[100];
+/* (csv-fold proc seed [port [delimiter [types]]]) calls (proc row acc)
+ * for each row in turn */
+object* csv_fold_proc(object* arguments) {
+    csv_reader c;
+    object* proc;
+    object* acc;
+    object* row;
+    int frame;
+
+    proc = car(arguments);
+    acc = cadr(arguments);
+    csv_open(&c, cddr(arguments));
+    frame = the_vm->stackSize;
+    while ((row = csv_read_row(&c)) != NULL) {
+        acc = apply_procedure(proc, cons(row, cons(acc, nil)));
+        the_vm->stackSize = frame;
+        push(the_vm, acc);
+    }
+    csv_close(&c);
+    return acc;
+}
+
+/***************************** FASL ******************************/
+
+/*
+ * fasl-write and fasl-read save and load data in a binary format.
+ * A record is the magic "SFSL" and a version byte, the symbols of the
+ * datum, each written once, and then the datum as a tree of tagged
+ * nodes. Fixnums are zigzag varints, flonums and complex parts raw
+ * little endian IEEE doubles, and runs of pairs one FASL_LIST node.
+ * Objects met more than once are written once after FASL_DEFINE and
+ * referred to by FASL_REF after, so shared and cyclic structure loads
+ * back as it was. Both directions use explicit stacks.
+ */
+
+#define FASL_VERSION 1
 
-    sprintf(buffer, "%ld", (car(arguments))->data.fixnum.value);
-    return make_string(buffer);
+typedef enum {
+    FASL_NIL, FASL_FALSE, FASL_TRUE, FASL_EOF,
+    FASL_FIXNUM, FASL_FLONUM, FASL_CPXNUM, FASL_CHARACTER, FASL_SYMBOL,
+    FASL_STRING, FASL_BYTEVECTOR, FASL_LIST, FASL_VECTOR, FASL_MATRIX,
+    FASL_BITSET, FASL_HASH_TABLE, FASL_PMAP, FASL_RECORD_TYPE,
+    FASL_RECORD, FASL_STRING_BUILDER, FASL_PROMISE,
+    FASL_DEFINE, FASL_REF
+} fasl_tag;
+
+/* growable stack of objects for the walks */
+typedef struct fasl_stack {
+    object** items;
+    long top;
+    long capacity;
+} fasl_stack;
+
+void fasl_stack_reserve(fasl_stack* stack, long n) {
+    if (stack->top + n <= stack->capacity) {
+        return;
+    }
+    while (stack->top + n > stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 256;
+    }
+    stack->items = realloc(stack->items, stack->capacity * sizeof(object*));
+    if (stack->items == NULL) {
+        diagnostic("*** fasl - out of memory\n");
+        exit(1);
+    }
 }
 
-object* string_to_number_proc(object* arguments) {
-    /* TODO: Adding FLONUM support */
-    return make_fixnum(atoi((car(arguments))->data.string.value));
+void fasl_push(fasl_stack* stack, object* obj) {
+    fasl_stack_reserve(stack, 1);
+    stack->items[stack->top++] = obj;
 }
 
-object* symbol_to_string_proc(object* arguments) {
-    return make_string((car(arguments))->data.symbol.value);
+void fasl_push_pmap_node(fasl_stack* stack, object* node) {
+    object** slots;
+    long i;
+
+    slots = node->data.pmap_node.slots;
+    for (i = 0; i < node->data.pmap_node.length; i += 2) {
+        if (slots[i] == NULL) {
+            fasl_push_pmap_node(stack, slots[i + 1]);
+        }
+        else {
+            fasl_push(stack, slots[i + 1]);
+            fasl_push(stack, slots[i]);
+        }
+    }
 }
 
-object* string_to_symbol_proc(object* arguments) {
-    return make_symbol((car(arguments))->data.string.value);
+void fasl_push_entry(hash_entry* e, void* stack) {
+    fasl_push(stack, e->value);
+    fasl_push(stack, e->key);
 }
 
-object* add_proc(object* args) {
-    long result = 0;
-    double dresult = 0;
-    double re = 0.0;
-    double im = 0.0;
-    short op_type = 0;
+/* pushes what obj holds so the first child is on top */
+void fasl_push_children(fasl_stack* stack, object* obj) {
+    long i;
 
-    while (!is_nil(args)) {
-        if (is_fixnum(car(args))) {
-            result += (car(args))->data.fixnum.value;
-        }
-        else if (is_flonum(car(args))) {
-            dresult += (car(args))->data.flonum.value;
-            op_type = 1;
+    switch (obj->type) {
+    case PAIR:
+        fasl_push(stack, obj->data.pair.cdr);
+        fasl_push(stack, obj->data.pair.car);
+        break;
+    case VECTOR:
+        fasl_stack_reserve(stack, obj->data.vector.length);
+        for (i = obj->data.vector.length - 1; i >= 0; i--) {
+            stack->items[stack->top++] = obj->data.vector.items[i];
         }
-        else if (is_cpxnum(car(args))) {
-            re += creal((car(args))->data.cpxnum.value);
-            im += cimag((car(args))->data.cpxnum.value);
-            op_type = 2;
+        break;
+    case HASH_TABLE:
+        hash_table_for_each(obj->data.hash_table.t, fasl_push_entry, stack);
+        break;
+    case PMAP:
+        if (obj->data.pmap.root != NULL) {
+            fasl_push_pmap_node(stack, obj->data.pmap.root);
         }
-        args = cdr(args);
-    }
-    switch (op_type) {
-    case 0:
-        return make_fixnum(result);
         break;
-    case 1:
-        dresult += (double)result;
-        return make_flonum(dresult);
+    case RECORD_TYPE:
+        fasl_push(stack, obj->data.record_type.fields);
+        fasl_push(stack, obj->data.record_type.name);
         break;
-    case 2:
-        re += (double)result;
-        re += dresult;
-        return make_cpxnum(re, im);
+    case RECORD:
+        for (i = obj->data.record.rtd->data.record_type.nfields - 1;
+             i >= 0; i--) {
+            fasl_push(stack, obj->data.record.slots[i]);
+        }
+        fasl_push(stack, obj->data.record.rtd);
+        break;
+    case PROMISE:
+        fasl_push(stack, obj->data.promise.value);
         break;
     default:
-        return nil;
+        break;
     }
 }
 
-object* sub_proc(object* args) {
-    long result = 0;
-    double dresult = 0;
-    double re = 0.0;
-    double im = 0.0;
-    short op_type = 0;
+/* objects with an identity of their own, which may be shared */
+char fasl_has_identity(object* obj) {
+    switch (obj->type) {
+    case PAIR: case VECTOR: case STRING: case BYTEVECTOR: case MATRIX:
+    case BITSET: case HASH_TABLE: case PMAP: case RECORD_TYPE:
+    case RECORD: case STRING_BUILDER: case PROMISE:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-    if (is_fixnum(car(args))) {
-        result = (car(args))->data.fixnum.value;
+typedef struct fasl_writer {
+    writer* out;
+    object_table seen;      /* 1 if shared, plus (label + 1) << 1 */
+    object_table symbols;   /* symbol to its index */
+    fasl_stack symbol_list; /* the symbols in index order */
+    long next_label;
+} fasl_writer;
+
+/* finds the symbols and the shared objects, and checks that
+ * everything can be written before a byte goes out */
+void fasl_scan(fasl_writer* w, object* obj) {
+    fasl_stack stack = { NULL, 0, 0 };
+    long* value;
+    char added;
+
+    fasl_push(&stack, obj);
+    while (stack.top > 0) {
+        obj = stack.items[--stack.top];
+        switch (obj->type) {
+        case SYMBOL:
+            value = object_table_find(&w->symbols, obj, &added);
+            if (added) {
+                *value = w->symbol_list.top;
+                fasl_push(&w->symbol_list, obj);
+            }
+            continue;
+        case COMPOUND_PROC: case PRIMITIVE_PROC: case RECORD_PROC:
+        case INPUT_PORT: case OUTPUT_PORT: case PMAP_NODE:
+            diagnostic("*** fasl-write: cannot write a procedure, "
+                "port or environment\n");
+            exit(1);
+        case PROMISE:
+            if (obj->data.promise.state != PROMISE_DONE) {
+                diagnostic("*** fasl-write: cannot write a promise "
+                    "not forced yet\n");
+                exit(1);
+            }
+            break;
+        default:
+            break;
+        }
+        if (!fasl_has_identity(obj)) {
+            continue;
+        }
+        value = object_table_find(&w->seen, obj, &added);
+        if (!added) {
+            *value = 1;
+            continue;
+        }
+        fasl_push_children(&stack, obj);
     }
-    else if (is_flonum(car(args))) {
-        dresult = (car(args))->data.flonum.value;
-        op_type = 1;
+    free(stack.items);
+}
+
+void fasl_byte(fasl_writer* w, int byte) {
+    writer_putc(w->out, (char)byte);
+}
+
+void fasl_varint(fasl_writer* w, unsigned long long n) {
+    char bytes[10];
+    int i = 0;
+
+    while (n >= 0x80) {
+        bytes[i++] = (char)((n & 0x7f) | 0x80);
+        n >>= 7;
     }
-    else if (is_cpxnum(car(args))) {
-        re = creal((car(args))->data.cpxnum.value);
-        im = cimag((car(args))->data.cpxnum.value);
-        op_type = 2;
+    bytes[i++] = (char)n;
+    writer_write(w->out, bytes, i);
+}
+
+/* eight bytes, little endian */
+void fasl_u64(fasl_writer* w, uint64_t bits) {
+    char bytes[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        bytes[i] = (char)(bits >> (8 * i));
     }
-    while (!is_nil(args = cdr(args))) {
-        if (is_fixnum(car(args))) {
-            result -= (car(args))->data.fixnum.value;
-        }
-        else if (is_flonum(car(args))) {
-            dresult -= (car(args))->data.flonum.value;
-            op_type = 1;
+    writer_write(w->out, bytes, 8);
+}
+
+void fasl_double(fasl_writer* w, double d) {
+    uint64_t bits;
+
+    memcpy(&bits, &d, sizeof(bits));
+    fasl_u64(w, bits);
+}
+
+void fasl_emit(fasl_writer* w, object* obj) {
+    fasl_stack stack = { NULL, 0, 0 };
+    object* pair;
+    long* value;
+    long base;
+    long n;
+    long i;
+    long r;
+    long c;
+    double* elems;
+    char added;
+
+    fasl_push(&stack, obj);
+    while (stack.top > 0) {
+        obj = stack.items[--stack.top];
+        if (fasl_has_identity(obj)) {
+            value = object_table_find(&w->seen, obj, &added);
+            if (*value >> 1) {
+                fasl_byte(w, FASL_REF);
+                fasl_varint(w, (*value >> 1) - 1);
+                continue;
+            }
+            if (*value & 1) {
+                *value |= (w->next_label + 1) << 1;
+                fasl_byte(w, FASL_DEFINE);
+                fasl_varint(w, w->next_label++);
+            }
         }
-        else if (is_cpxnum(car(args))) {
-            re -= creal((car(args))->data.cpxnum.value);
-            im -= cimag((car(args))->data.cpxnum.value);
-            op_type = 2;
+        switch (obj->type) {
+        case THE_NIL:
+            fasl_byte(w, FASL_NIL);
+            break;
+        case BOOLEAN:
+            fasl_byte(w, is_false(obj) ? FASL_FALSE : FASL_TRUE);
+            break;
+        case EOF_OBJECT:
+            fasl_byte(w, FASL_EOF);
+            break;
+        case FIXNUM:
+            fasl_byte(w, FASL_FIXNUM);
+            /* zigzag, so small negative numbers stay short */
+            fasl_varint(w,
+                ((unsigned long long)(long long)obj->data.fixnum.value << 1) ^
+                (unsigned long long)((long long)obj->data.fixnum.value >> 63));
+            break;
+        case FLONUM:
+            fasl_byte(w, FASL_FLONUM);
+            fasl_double(w, obj->data.flonum.value);
+            break;
+        case CPXNUM:
+            fasl_byte(w, FASL_CPXNUM);
+            fasl_double(w, creal(obj->data.cpxnum.value));
+            fasl_double(w, cimag(obj->data.cpxnum.value));
+            break;
+        case CHARACTER:
+            fasl_byte(w, FASL_CHARACTER);
+            fasl_byte(w, (unsigned char)obj->data.character.value);
+            break;
+        case SYMBOL:
+            fasl_byte(w, FASL_SYMBOL);
+            fasl_varint(w, *object_table_find(&w->symbols, obj, &added));
+            break;
+        case STRING:
+            fasl_byte(w, FASL_STRING);
+            fasl_varint(w, obj->data.string.length);
+            writer_write(w->out, obj->data.string.value,
+                obj->data.string.length);
+            break;
+        case STRING_BUILDER:
+            fasl_byte(w, FASL_STRING_BUILDER);
+            fasl_varint(w, obj->data.builder.length);
+            writer_write(w->out, obj->data.builder.data,
+                obj->data.builder.length);
+            break;
+        case BYTEVECTOR:
+            fasl_byte(w, FASL_BYTEVECTOR);
+            fasl_varint(w, obj->data.bytevector.length);
+            writer_write(w->out, (char*)obj->data.bytevector.bytes,
+                obj->data.bytevector.length);
+            break;
+        case PAIR:
+            /* the run of pairs up to one that is shared or not a pair,
+             * which is written as the tail */
+            n = 1;
+            pair = obj;
+            while (pair->data.pair.cdr->type == PAIR &&
+                !(*object_table_find(&w->seen, pair->data.pair.cdr,
+                    &added) & 1)) {
+                pair = pair->data.pair.cdr;
+                n++;
+            }
+            fasl_byte(w, FASL_LIST);
+            fasl_varint(w, n);
+            /* the tail goes under the cars, the first car on top */
+            fasl_stack_reserve(&stack, n + 1);
+            base = stack.top;
+            pair = obj;
+            for (i = 0; i < n; i++) {
+                stack.items[base + n - i] = pair->data.pair.car;
+                if (i == n - 1) {
+                    stack.items[base] = pair->data.pair.cdr;
+                }
+                pair = pair->data.pair.cdr;
+            }
+            stack.top = base + n + 1;
+            break;
+        case VECTOR:
+            fasl_byte(w, FASL_VECTOR);
+            fasl_varint(w, obj->data.vector.length);
+            fasl_push_children(&stack, obj);
+            break;
+        case MATRIX:
+            fasl_byte(w, FASL_MATRIX);
+            fasl_varint(w, obj->data.matrix.m->rows);
+            fasl_varint(w, obj->data.matrix.m->cols);
+            fasl_byte(w, obj->data.matrix.m->is_complex);
+            n = obj->data.matrix.m->is_complex ? 2 : 1;
+            for (r = 0; r < obj->data.matrix.m->rows; r++) {
+                elems = obj->data.matrix.m->elems +
+                    r * obj->data.matrix.m->stride * n;
+                for (c = 0; c < obj->data.matrix.m->cols * n; c++) {
+                    fasl_double(w, elems[c]);
+                }
+            }
+            break;
+        case BITSET:
+            fasl_byte(w, FASL_BITSET);
+            fasl_varint(w, obj->data.bitset.nbits);
+            for (i = 0; i < BITSET_WORDS(obj->data.bitset.nbits); i++) {
+                fasl_u64(w, obj->data.bitset.words[i]);
+            }
+            break;
+        case HASH_TABLE:
+            fasl_byte(w, FASL_HASH_TABLE);
+            fasl_byte(w, obj->data.hash_table.t->kind);
+            fasl_byte(w, obj->data.hash_table.t->weak);
+            fasl_varint(w, obj->data.hash_table.t->count);
+            fasl_push_children(&stack, obj);
+            break;
+        case PMAP:
+            fasl_byte(w, FASL_PMAP);
+            fasl_byte(w, obj->data.pmap.is_set);
+            fasl_varint(w, obj->data.pmap.count);
+            fasl_push_children(&stack, obj);
+            break;
+        case RECORD_TYPE:
+            fasl_byte(w, FASL_RECORD_TYPE);
+            fasl_push_children(&stack, obj);
+            break;
+        case RECORD:
+            fasl_byte(w, FASL_RECORD);
+            fasl_push_children(&stack, obj);
+            break;
+        case PROMISE:
+            fasl_byte(w, FASL_PROMISE);
+            fasl_push_children(&stack, obj);
+            break;
+        default:
+            diagnostic("*** fasl-write: cannot write this object\n");
+            exit(1);
         }
     }
-    switch (op_type) {
-    case 0:
-        return make_fixnum(result);
-        break;
-    case 1:
-        dresult += (double)result;
-        return make_flonum(dresult);
-        break;
-    case 2:
-        re += (double)result;
-        re += dresult;
-        return make_cpxnum(re, im);
-        break;
-    default:
-        return nil;
+    free(stack.items);
+}
+
+/* (fasl-write obj [port]) */
+void fasl_write(writer* out, object* obj) {
+    fasl_writer w;
+    char* name;
+    long i;
+    long n;
+
+    w.out = out;
+    object_table_init(&w.seen);
+    object_table_init(&w.symbols);
+    w.symbol_list.items = NULL;
+    w.symbol_list.top = 0;
+    w.symbol_list.capacity = 0;
+    w.next_label = 0;
+    fasl_scan(&w, obj);
+
+    writer_write(w.out, "SFSL", 4);
+    fasl_byte(&w, FASL_VERSION);
+    fasl_varint(&w, w.symbol_list.top);
+    for (i = 0; i < w.symbol_list.top; i++) {
+        name = w.symbol_list.items[i]->data.symbol.value;
+        n = (long)strlen(name);
+        fasl_varint(&w, n);
+        writer_write(w.out, name, n);
     }
+    fasl_emit(&w, obj);
+
+    free(w.symbol_list.items);
+    object_table_free(&w.seen);
+    object_table_free(&w.symbols);
 }
 
-object* mul_proc(object* args) {
-    long result = 1;
-    double dresult = 1;
-    double re = 1.0;
-    double im = 1.0;
-    sComplex cresult;
-    short op_type = 0;
-    short full_cpx = 1;
+object* fasl_write_proc(object* arguments) {
+    writer* out;
 
-    cresult = _Cbuild(1.0, 0.0);
+    out = output_port_argument(cdr(arguments));
+    fasl_write(out, car(arguments));
+    writer_done(out);
+    return ok_symbol;
+}
 
-    while (!is_nil(args)) {
-        if (is_fixnum(car(args))) {
-            result *= (car(args))->data.fixnum.value;
-            full_cpx &= 0;
-        }
-        else if (is_flonum(car(args))) {
-            dresult *= (car(args))->data.flonum.value;
-            op_type = 1;
-            full_cpx &= 0;
-        }
-        else if (is_cpxnum(car(args))) {
-#if defined(_MSC_VER)
-            cresult = _Cmulcc(cresult, (car(args))->data.cpxnum.value);
-#else
-            cresult *= (car(args))->data.cpxnum.value;
-#endif
-            op_type = 2;
-            full_cpx &= 1;
-        }
-        args = cdr(args);
+/* a container being filled while a datum is read */
+typedef enum {
+    FASL_FILL_LIST, FASL_FILL_VECTOR, FASL_FILL_TABLE, FASL_FILL_PMAP,
+    FASL_FILL_RECORD_TYPE, FASL_FILL_RTD, FASL_FILL_RECORD,
+    FASL_FILL_PROMISE
+} fasl_fill;
+
+typedef struct fasl_frame {
+    fasl_fill kind;
+    object* obj;
+    object* cursor;  /* the pair whose car comes next */
+    object* key;     /* a table key or record type name read already */
+    long index;
+    long count;
+    long label;      /* of a record or record type, -1 if none */
+    int base;        /* VM stack size with obj on it */
+} fasl_frame;
+
+typedef struct fasl_reader {
+    reader* in;
+    fasl_stack symbols;
+    fasl_stack labels;
+    fasl_frame* frames;
+    long depth;
+    long capacity;
+} fasl_reader;
+
+void fasl_truncated(void) {
+    diagnostic("*** fasl-read: truncated or damaged data\n");
+    exit(1);
+}
+
+int fasl_read_byte(fasl_reader* r) {
+    int c;
+
+    c = next_char(r->in);
+    if (c == EOF) {
+        fasl_truncated();
     }
-    switch (op_type) {
-    case 0:
-        return make_fixnum(result);
-        break;
-    case 1:
-        dresult *= (double)result;
-        return make_flonum(dresult);
-        break;
-    case 2:
-        if (full_cpx) {
-            return make_cpxnum2(cresult);
-        }
-        else {
-            re *= (double)result;
-            re *= dresult;
-#if defined(_MSC_VER)
-            cresult = _Cmulcr(cresult, re);
-#else
-            cresult *= re;
-#endif
-            return make_cpxnum2(cresult);
+    return c;
+}
+
+unsigned long long fasl_read_varint(fasl_reader* r) {
+    unsigned long long n;
+    int shift;
+    int c;
+
+    n = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        c = fasl_read_byte(r);
+        n |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return n;
         }
-        break;
-    default:
-        return nil;
     }
+    fasl_truncated();
+    return 0;
 }
 
-object* quotient_proc(object* arguments) {
-    return make_fixnum(
-        ((car(arguments))->data.fixnum.value) /
-        ((cadr(arguments))->data.fixnum.value));
-}
+/* a count or length, which must fit in the rest of memory */
+long fasl_read_length(fasl_reader* r) {
+    unsigned long long n;
 
-object* remainder_proc(object* arguments) {
-    return make_fixnum(
-        ((car(arguments))->data.fixnum.value) %
-        ((cadr(arguments))->data.fixnum.value));
+    n = fasl_read_varint(r);
+    if (n > (unsigned long long)LONG_MAX / 16) {
+        fasl_truncated();
+    }
+    return (long)n;
 }
 
-sComplex cinv(sComplex z1) {
-    return _Cmulcr(conj(z1), 1.0/pow(cabs(z1),2));
+uint64_t fasl_read_u64(fasl_reader* r) {
+    unsigned char bytes[8];
+    uint64_t bits;
+    int i;
+
+    if (reader_read(r->in, bytes, 8) != 8) {
+        fasl_truncated();
+    }
+    bits = 0;
+    for (i = 7; i >= 0; i--) {
+        bits = (bits << 8) | bytes[i];
+    }
+    return bits;
 }
 
-object* div_proc(object* args) {
-    double result = 1.0;
-    double dresult = 1.0;
-    double re = 1.0;
-    double im = 1.0;
-    sComplex cresult;
-    short op_type = 0;
-    short full_cpx = 1;
+double fasl_read_double(fasl_reader* r) {
+    uint64_t bits;
+    double d;
 
-    cresult = _Cbuild(1.0, 0.0);
+    bits = fasl_read_u64(r);
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
 
-    if (is_fixnum(car(args))) {
-        result = (double)(car(args))->data.fixnum.value;
-        full_cpx &= 0;
+void fasl_read_bytes(fasl_reader* r, void* dest, long n) {
+    if ((long)reader_read(r->in, dest, n) != n) {
+        fasl_truncated();
+    }
+}
+
+/* labels are numbered in the order they were written, which for a
+ * record type is before the labels inside it */
+void fasl_define(fasl_reader* r, long label, object* obj) {
+    if (label < 0) {
+        return;
     }
-    else if (is_flonum(car(args))) {
-        dresult = (car(args))->data.flonum.value;
-        op_type = 1;
-        full_cpx &= 0;
+    if (label > r->labels.top + (1L << 20)) {
+        fasl_truncated();
     }
-    else if (is_cpxnum(car(args))) {
-        cresult = (car(args))->data.cpxnum.value;
-        op_type = 2;
-        full_cpx &= 1;
+    fasl_stack_reserve(&r->labels, label + 1 - r->labels.top);
+    while (r->labels.top <= label) {
+        r->labels.items[r->labels.top++] = NULL;
     }
+    r->labels.items[label] = obj;
+}
 
-    while (!is_nil(args = cdr(args))) {
-        if (is_fixnum(car(args))) {
-            result /= (double)(car(args))->data.fixnum.value;
-            full_cpx &= 0;
-        }
-        else if (is_flonum(car(args))) {
-            dresult /= (car(args))->data.flonum.value;
-            op_type = 1;
-            full_cpx &= 0;
+void fasl_open(fasl_reader* r, fasl_fill kind, object* obj, long count,
+    long label) {
+    fasl_frame* frame;
+
+    if (r->depth == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 64;
+        r->frames = realloc(r->frames, r->capacity * sizeof(fasl_frame));
+        if (r->frames == NULL) {
+            diagnostic("*** fasl - out of memory\n");
+            exit(1);
         }
-        else if (is_cpxnum(car(args))) {
-            cresult = _Cmulcc(cresult, cinv((car(args))->data.cpxnum.value));
-            op_type = 2;
-            full_cpx &= 1;
+    }
+    frame = &r->frames[r->depth++];
+    frame->kind = kind;
+    frame->obj = obj;
+    frame->cursor = obj;
+    frame->key = NULL;
+    frame->index = 0;
+    frame->count = count;
+    frame->label = label;
+    frame->base = the_vm->stackSize;
+}
+
+object* first_frame(object* env);
+object* frame_var(object* frame);
+object* frame_val(object* frame);
+object* enclosing_env(object* env);
+
+/* a record type comes back as the one its name is bound to globally
+ * when the fields agree, so the program's accessors work on it */
+object* fasl_record_type(object* name, object* fields) {
+    object* env;
+    object* vars;
+    object* vals;
+
+    for (env = the_global; !is_nil(env); env = enclosing_env(env)) {
+        vars = frame_var(first_frame(env));
+        vals = frame_val(first_frame(env));
+        for (; !is_nil(vars); vars = cdr(vars), vals = cdr(vals)) {
+            if (car(vars) != name) {
+                continue;
+            }
+            if (is_record_type(car(vals)) &&
+                is_equal(car(vals)->data.record_type.name, name) &&
+                is_equal(car(vals)->data.record_type.fields, fields)) {
+                return car(vals);
+            }
+            return make_record_type(name, fields);
         }
     }
+    return make_record_type(name, fields);
+}
 
-    switch (op_type) {
-    case 0:
-        return make_fixnum((long)result);
-        break;
-    case 1:
-        dresult *= result;
-        return make_flonum(dresult);
-        break;
-    case 2:
-        if (full_cpx) {
-            return make_cpxnum2(cresult);
+/* reads one node, answering NULL when it opened a container that the
+ * nodes after it fill */
+object* fasl_read_node(fasl_reader* r) {
+    unsigned long long u;
+    long long v;
+    object* obj;
+    object* pair;
+    long label;
+    long rows;
+    long cols;
+    long n;
+    long i;
+    int tag;
+    int kind;
+    double re;
+
+    label = -1;
+    tag = fasl_read_byte(r);
+    if (tag == FASL_DEFINE) {
+        label = fasl_read_length(r);
+        tag = fasl_read_byte(r);
+    }
+    switch (tag) {
+    case FASL_NIL:
+        return nil;
+    case FASL_FALSE:
+        return false;
+    case FASL_TRUE:
+        return true;
+    case FASL_EOF:
+        return eof_object;
+    case FASL_FIXNUM:
+        u = fasl_read_varint(r);
+        v = (long long)(u >> 1) ^ -(long long)(u & 1);
+        if (v < LONG_MIN || v > LONG_MAX) {
+            diagnostic("*** fasl-read: fixnum too large for this "
+                "machine\n");
+            exit(1);
         }
-        else {
-            re *= result;
-            re *= dresult;
-#if defined(_MSC_VER)
-            cresult = _Cmulcr(cresult, re);
-#else
-            cresult *= re;
-#endif
-            return make_cpxnum2(cresult);
+        return make_fixnum((long)v);
+    case FASL_FLONUM:
+        return make_flonum(fasl_read_double(r));
+    case FASL_CPXNUM:
+        re = fasl_read_double(r);
+        return make_cpxnum(re, fasl_read_double(r));
+    case FASL_CHARACTER:
+        return make_character((char)fasl_read_byte(r));
+    case FASL_SYMBOL:
+        n = fasl_read_length(r);
+        if (n >= r->symbols.top) {
+            fasl_truncated();
         }
-        break;
+        return r->symbols.items[n];
+    case FASL_REF:
+        n = fasl_read_length(r);
+        if (n >= r->labels.top || r->labels.items[n] == NULL) {
+            diagnostic("*** fasl-read: reference to an object "
+                "not complete yet\n");
+            exit(1);
+        }
+        return r->labels.items[n];
+    case FASL_STRING:
+        n = fasl_read_length(r);
+        obj = make_string_n(NULL, n);
+        fasl_read_bytes(r, obj->data.string.value, n);
+        fasl_define(r, label, obj);
+        return obj;
+    case FASL_STRING_BUILDER:
+        n = fasl_read_length(r);
+        obj = make_string_builder();
+        strbuf_reserve(&obj->data.builder, n);
+        fasl_read_bytes(r, obj->data.builder.data, n);
+        obj->data.builder.length = n;
+        obj->data.builder.data[n] = '\0';
+        fasl_define(r, label, obj);
+        return obj;
+    case FASL_BYTEVECTOR:
+        n = fasl_read_length(r);
+        obj = make_bytevector(n, 0);
+        fasl_read_bytes(r, obj->data.bytevector.bytes, n);
+        fasl_define(r, label, obj);
+        return obj;
+    case FASL_LIST:
+        /* all the pairs of the run are made up front, so a label on
+         * the first refers to the whole list while it fills */
+        n = fasl_read_length(r);
+        if (n == 0) {
+            fasl_truncated();
+        }
+        obj = cons(nil, nil);
+        fasl_define(r, label, obj);
+        fasl_open(r, FASL_FILL_LIST, obj, n, -1);
+        pair = obj;
+        for (i = 1; i < n; i++) {
+            pair->data.pair.cdr = cons(nil, nil);
+            pair = pair->data.pair.cdr;
+            the_vm->stackSize = r->frames[r->depth - 1].base;
+        }
+        return NULL;
+    case FASL_VECTOR:
+        n = fasl_read_length(r);
+        obj = make_vector(n, nil);
+        fasl_define(r, label, obj);
+        if (n == 0) {
+            return obj;
+        }
+        fasl_open(r, FASL_FILL_VECTOR, obj, n, -1);
+        return NULL;
+    case FASL_MATRIX:
+        rows = fasl_read_length(r);
+        cols = fasl_read_length(r);
+        if (cols != 0 && rows > LONG_MAX / 16 / cols) {
+            fasl_truncated();
+        }
+        obj = make_matrix(rows, cols, (char)fasl_read_byte(r));
+        n = rows * cols * (obj->data.matrix.m->is_complex ? 2 : 1);
+        for (i = 0; i < n; i++) {
+            obj->data.matrix.m->elems[i] = fasl_read_double(r);
+        }
+        fasl_define(r, label, obj);
+        return obj;
+    case FASL_BITSET:
+        n = fasl_read_length(r);
+        obj = make_bitset(n);
+        for (i = 0; i < BITSET_WORDS(n); i++) {
+            obj->data.bitset.words[i] = fasl_read_u64(r);
+        }
+        if (n % 64 != 0) {
+            obj->data.bitset.words[n / 64] &= ((uint64_t)1 << (n % 64)) - 1;
+        }
+        fasl_define(r, label, obj);
+        return obj;
+    case FASL_HASH_TABLE:
+        kind = fasl_read_byte(r);
+        if (kind > HASH_STRING) {
+            fasl_truncated();
+        }
+        obj = make_hash_table((hash_kind)kind, (char)fasl_read_byte(r));
+        n = fasl_read_length(r);
+        fasl_define(r, label, obj);
+        if (n == 0) {
+            return obj;
+        }
+        fasl_open(r, FASL_FILL_TABLE, obj, n, -1);
+        return NULL;
+    case FASL_PMAP:
+        /* filled as a transient, then frozen */
+        kind = fasl_read_byte(r);
+        obj = make_pmap(NULL, 0, pmap_next_edit++, (char)kind);
+        n = fasl_read_length(r);
+        fasl_define(r, label, obj);
+        if (n == 0) {
+            obj->data.pmap.edit = 0;
+            return obj;
+        }
+        fasl_open(r, FASL_FILL_PMAP, obj, n, -1);
+        return NULL;
+    case FASL_RECORD_TYPE:
+        fasl_open(r, FASL_FILL_RECORD_TYPE, NULL, 2, label);
+        return NULL;
+    case FASL_RECORD:
+        fasl_open(r, FASL_FILL_RTD, NULL, 1, label);
+        return NULL;
+    case FASL_PROMISE:
+        fasl_open(r, FASL_FILL_PROMISE, NULL, 1, label);
+        return NULL;
     default:
-        return nil;
+        fasl_truncated();
+        return NULL;
     }
 }
 
-object* is_numbeq_proc(object* arguments) {
-    long value = 0;
-    double dvalue = 0.0;
-    double re = 0.0;
-    double im = 0.0;
-    object_type type;
-    
-    type = (car(arguments))->type;
+object* fasl_read_datum(fasl_reader* r) {
+    fasl_frame* frame;
+    object* value;
 
-    switch (type) {
-    case FIXNUM:
-        value = (car(arguments))->data.fixnum.value;
-        break;
-    case FLONUM:
-        dvalue = (car(arguments))->data.flonum.value;
-        break;
-    default:
-        re = creal((car(arguments))->data.cpxnum.value);
-        im = cimag((car(arguments))->data.cpxnum.value);
-    }
-    
-    while (!is_nil(arguments = cdr(arguments))) {
-        if (type != (car(arguments))->type) {
-            /* cannot compare different number types */
-            return false;
-        }
-        switch (type) {
-        case FIXNUM:
-            if (value != ((car(arguments))->data.fixnum.value)) {
-                return false;
+    while (1) {
+        value = fasl_read_node(r);
+        /* hand the value to the frames it completes */
+        while (value != NULL) {
+            if (r->depth == 0) {
+                return value;
             }
-            break;
-        case FLONUM:
-            if (dvalue != ((car(arguments))->data.flonum.value)) {
-                return false;
+            frame = &r->frames[r->depth - 1];
+            switch (frame->kind) {
+            case FASL_FILL_LIST:
+                if (frame->index++ < frame->count) {
+                    frame->cursor->data.pair.car = value;
+                    if (frame->index < frame->count) {
+                        frame->cursor = frame->cursor->data.pair.cdr;
+                    }
+                    value = NULL;
+                }
+                else {
+                    frame->cursor->data.pair.cdr = value;
+                    value = frame->obj;
+                }
+                break;
+            case FASL_FILL_VECTOR:
+                frame->obj->data.vector.items[frame->index++] = value;
+                value = (frame->index == frame->count) ? frame->obj : NULL;
+                break;
+            case FASL_FILL_TABLE:
+            case FASL_FILL_PMAP:
+                if (frame->key == NULL) {
+                    /* the key stays on the VM stack until its value */
+                    frame->key = value;
+                    value = NULL;
+                    continue;
+                }
+                if (frame->kind == FASL_FILL_TABLE) {
+                    hash_table_put(frame->obj->data.hash_table.t,
+                        frame->key, value);
+                }
+                else {
+                    pmap_set(frame->obj, frame->key, value);
+                }
+                frame->key = NULL;
+                value = NULL;
+                if (++frame->index == frame->count) {
+                    if (frame->kind == FASL_FILL_PMAP) {
+                        frame->obj->data.pmap.edit = 0;
+                    }
+                    value = frame->obj;
+                }
+                break;
+            case FASL_FILL_RECORD_TYPE:
+                if (frame->key == NULL) {
+                    frame->key = value;
+                    value = NULL;
+                    continue;
+                }
+                for (frame->cursor = value; is_pair(frame->cursor);
+                     frame->cursor = cdr(frame->cursor)) {
+                }
+                if (!is_nil(frame->cursor)) {
+                    fasl_truncated();
+                }
+                value = fasl_record_type(frame->key, value);
+                fasl_define(r, frame->label, value);
+                break;
+            case FASL_FILL_RTD:
+                if (value->type != RECORD_TYPE) {
+                    fasl_truncated();
+                }
+                value = make_record(value);
+                fasl_define(r, frame->label, value);
+                if (value->data.record.rtd->data.record_type.nfields == 0) {
+                    break;
+                }
+                the_vm->stackSize = frame->base;
+                push(the_vm, value);
+                frame->kind = FASL_FILL_RECORD;
+                frame->obj = value;
+                frame->count =
+                    value->data.record.rtd->data.record_type.nfields;
+                frame->base = the_vm->stackSize;
+                value = NULL;
+                continue;
+            case FASL_FILL_RECORD:
+                frame->obj->data.record.slots[frame->index++] = value;
+                value = (frame->index == frame->count) ? frame->obj : NULL;
+                break;
+            case FASL_FILL_PROMISE:
+                value = make_promise(PROMISE_DONE, value, NULL, NULL);
+                fasl_define(r, frame->label, value);
+                break;
             }
-            break;
-        default:
-            if ((re != creal((car(arguments))->data.cpxnum.value)) &&
-                (im != cimag((car(arguments))->data.cpxnum.value))) {
-                return false;
+            /* what is stored is reachable from the frame's object */
+            the_vm->stackSize = frame->base;
+            if (value != NULL) {
+                r->depth--;
+                push(the_vm, value);
             }
         }
     }
-    return true;
 }
 
-object* is_lessthan_proc(object* arguments) {
-    double previous;
-    double next;
-    object_type type;
-
-    type = (car(arguments))->type;
-
-    switch (type) {
-    case FIXNUM:
-        previous = (double)(car(arguments))->data.fixnum.value;
-        break;
-    case FLONUM:
-        previous = (car(arguments))->data.flonum.value;
-        break;
-    default:
-        fprintf(stderr, "*** comparison is not defined for this type\n");
+/* answers the eof object at the end of the input */
+object* fasl_read(reader* in) {
+    fasl_reader r;
+    object* result;
+    char magic[4];
+    char* name;
+    long count;
+    long n;
+    long i;
+    int version;
+
+    r.in = in;
+    if (peek(r.in) == EOF) {
+        return eof_object;
+    }
+    if (reader_read(r.in, (unsigned char*)magic, 4) != 4 ||
+        memcmp(magic, "SFSL", 4) != 0) {
+        diagnostic("*** fasl-read: not fasl data\n");
         exit(1);
     }
-    
-    while (!is_nil(arguments = cdr(arguments))) {
-        type = (car(arguments))->type;
-
-        switch (type) {
-        case FIXNUM:
-            next = (double)(car(arguments))->data.fixnum.value;
-            break;
-        case FLONUM:
-            next = (car(arguments))->data.fixnum.value;
-            break;
-        default:
-            fprintf(stderr, "*** comparison is not defined for this type\n");
+    version = fasl_read_byte(&r);
+    if (version != FASL_VERSION) {
+        diagnostic("*** fasl-read: unsupported fasl version %d\n",
+            version);
+        exit(1);
+    }
+    r.symbols.items = NULL;
+    r.symbols.top = 0;
+    r.symbols.capacity = 0;
+    r.labels = r.symbols;
+    r.frames = NULL;
+    r.depth = 0;
+    r.capacity = 0;
+
+    /* symbols are interned, and so stay alive through symtab */
+    count = fasl_read_length(&r);
+    for (i = 0; i < count; i++) {
+        n = fasl_read_length(&r);
+        name = malloc(n + 1);
+        if (name == NULL) {
+            diagnostic("*** fasl - out of memory\n");
             exit(1);
         }
-        
-        if (previous < next) {
-            previous = next;
-        }
-        else {
-            return false;
-        }
+        fasl_read_bytes(&r, name, n);
+        name[n] = '\0';
+        fasl_push(&r.symbols, make_symbol(name));
+        free(name);
     }
-    return true;
+    result = fasl_read_datum(&r);
+
+    free(r.symbols.items);
+    free(r.labels.items);
+    free(r.frames);
+    return result;
 }
 
-object* is_greatthan_proc(object* arguments) {
-    double previous;
-    double next;
-    object_type type;
+object* fasl_read_proc(object* arguments) {
+    return fasl_read(input_port_argument(arguments));
+}
 
-    type = (car(arguments))->type;
+/*
+ * load keeps the forms it read from a library in a fasl cache next
+ * to it, so later loads skip the reader. The script named on the
+ * command line is read afresh each time and leaves no cache behind.
+ * The cache starts with a line naming the cache and fasl versions and
+ * the size, modification time, inode and a hash of the contents of
+ * the source, and is used only while that line still matches. The
+ * hash catches an edit that keeps the size within the clock's
+ * resolution. Bump LOAD_CACHE_VERSION when the reader changes what it
+ * produces.
+ */
 
-    switch (type) {
-    case FIXNUM:
-        previous = (double)(car(arguments))->data.fixnum.value;
-        break;
-    case FLONUM:
-        previous = (car(arguments))->data.flonum.value;
-        break;
-    default:
-        fprintf(stderr, "*** comparison is not defined for this type\n");
-        exit(1);
+#define LOAD_CACHE_VERSION 2
+
+/* the hash of a whole file, answering 0 when it cannot be read */
+char load_cache_hash(char* filename, uint64_t* hash) {
+    char buf[READER_CHUNK];
+    FILE* stream;
+    size_t n;
+    char ok;
+
+    stream = fopen(filename, "rb");
+    if (stream == NULL) {
+        return 0;
+    }
+    *hash = FNV_OFFSET;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
+        *hash = fnv1a(*hash, buf, (long)n);
     }
+    ok = !ferror(stream);
+    fclose(stream);
+    return ok;
+}
 
-    while (!is_nil(arguments = cdr(arguments))) {
-        type = (car(arguments))->type;
+/* answers 0 when the source cannot be examined */
+char load_cache_key(char* filename, char* key) {
+    uint64_t hash;
+    long nanoseconds;
+#if defined(_MSC_VER)
+    struct _stat64 st;
 
-        switch (type) {
-        case FIXNUM:
-            next = (double)(car(arguments))->data.fixnum.value;
-            break;
-        case FLONUM:
-            next = (car(arguments))->data.fixnum.value;
-            break;
-        default:
-            fprintf(stderr, "*** comparison is not defined for this type\n");
-            exit(1);
-        }
+    if (_stat64(filename, &st) != 0) {
+        return 0;
+    }
+    nanoseconds = 0;
+#else
+    struct stat st;
 
-        if (previous > next) {
-            previous = next;
+    if (stat(filename, &st) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    nanoseconds = (long)st.st_mtimespec.tv_nsec;
+#else
+    nanoseconds = (long)st.st_mtim.tv_nsec;
+#endif
+#endif
+    if (!load_cache_hash(filename, &hash)) {
+        return 0;
+    }
+    snprintf(key, LOAD_CACHE_KEY_MAX,
+        "sch-load-cache %d %d %lld %lld %ld %llu %016llx\n",
+        LOAD_CACHE_VERSION, FASL_VERSION, (long long)st.st_size,
+        (long long)st.st_mtime, nanoseconds,
+        (unsigned long long)st.st_ino, (unsigned long long)hash);
+    return 1;
+}
+
+char* load_cache_name(char* filename, char* suffix) {
+    char* name;
+
+    name = malloc(strlen(filename) + strlen(suffix) + 1);
+    if (name == NULL) {
+        diagnostic("*** load - out of memory\n");
+        exit(1);
+    }
+    strcpy(name, filename);
+    strcat(name, suffix);
+    return name;
+}
+
+/* the cached forms, or NULL when there is no cache up to date. The
+ * fasl data is decoded only once its length and hash check out, so a
+ * damaged cache is read again from the source instead of stopping
+ * the program */
+object* load_cached_forms(char* filename, char* key) {
+    char line[LOAD_CACHE_KEY_MAX];
+    unsigned long long hash;
+    unsigned char* body;
+    char* name;
+    FILE* stream;
+    reader* in;
+    object* forms = nil;
+    object* tail = NULL;
+    object* pair;
+    object* exp;
+    long length;
+    int frame;
+
+    name = load_cache_name(filename, ".fasl");
+    stream = fopen(name, "rb");
+    free(name);
+    if (stream == NULL) {
+        return NULL;
+    }
+    body = NULL;
+    if (fgets(line, sizeof(line), stream) != NULL &&
+        strcmp(line, key) == 0 &&
+        fgets(line, sizeof(line), stream) != NULL &&
+        sscanf(line, "%ld %llx", &length, &hash) == 2 && length > 0) {
+        body = malloc(length);
+    }
+    if (body != NULL &&
+        (fread(body, 1, length, stream) != (size_t)length ||
+         fgetc(stream) != EOF ||
+         fnv1a(FNV_OFFSET, (char*)body, length) != hash)) {
+        free(body);
+        body = NULL;
+    }
+    fclose(stream);
+    if (body == NULL) {
+        return NULL;
+    }
+    /* one fasl datum per form */
+    in = open_buffer_reader(body, length);
+    frame = the_vm->stackSize;
+    while ((exp = fasl_read(in)) != eof_object) {
+        pair = cons(exp, nil);
+        if (tail == NULL) {
+            forms = pair;
         }
         else {
-            return false;
+            tail->data.pair.cdr = pair;
         }
+        tail = pair;
+        the_vm->stackSize = frame;
+        push(the_vm, forms);
     }
-    return true;
+    release_reader(in);
+    free(in);
+    return forms;
+}
+
+/* copies the fasl data staged in a temporary file into the cache,
+ * after a line with its length and hash. The cache is written under
+ * another name and renamed, so that a load running at the same time
+ * never sees half of it; failing to write is fine */
+void save_cached_forms(char* filename, char* key, FILE* staged) {
+    char suffix[64];
+    char* name;
+    char* temporary;
+    char* body;
+    FILE* stream;
+    long length;
+    char ok;
+
+    if (fflush(staged) != 0 || (length = ftell(staged)) <= 0) {
+        return;
+    }
+    body = malloc(length);
+    if (body == NULL) {
+        return;
+    }
+    rewind(staged);
+    if (fread(body, 1, length, staged) != (size_t)length) {
+        free(body);
+        return;
+    }
+#if defined(_MSC_VER)
+    snprintf(suffix, sizeof(suffix), ".fasl.%d", _getpid());
+#elif defined(HAVE_MMAP)
+    snprintf(suffix, sizeof(suffix), ".fasl.%ld", (long)getpid());
+#else
+    snprintf(suffix, sizeof(suffix), ".fasl.tmp");
+#endif
+    temporary = load_cache_name(filename, suffix);
+    stream = fopen(temporary, "wb");
+    if (stream == NULL) {
+        free(temporary);
+        free(body);
+        return;
+    }
+    ok = fputs(key, stream) != EOF &&
+        fprintf(stream, "%ld %016llx\n", length,
+            (unsigned long long)fnv1a(FNV_OFFSET, body, length)) > 0 &&
+        fwrite(body, 1, length, stream) == (size_t)length;
+    ok = (fclose(stream) == 0) && ok;
+    name = load_cache_name(filename, ".fasl");
+#if !defined(HAVE_MMAP)
+    remove(name);
+#endif
+    if (!ok || rename(temporary, name) != 0) {
+        remove(temporary);
+    }
+    free(name);
+    free(temporary);
+    free(body);
 }
 
-object* cons_proc(object* arguments) {
-    return cons(car(arguments), cadr(arguments));
-}
+/**************************** IMAGES *****************************/
+
+/*
+ * save-image writes every object reachable from the global
+ * environment and the symbol table to one file, laid out as it is to
+ * sit in memory at IMAGE_BASE. sch --image maps the file copy on write
+ * at that address when it is free, so processes started from the same
+ * image share its pages, and otherwise adds the difference to every
+ * pointer; --relocate-image takes the second way even when the base is
+ * free. Functions are saved as indices into a table of their offsets
+ * from alloc_object, which holds only for the build that wrote the
+ * image. Hash tables and string builders, whose storage is
+ * reallocated as they grow, get fresh storage at restore, and
+ * persistent maps are rebuilt since their keys now hash differently.
+ */
+
+#define IMAGE_MAGIC "SCHIMG1"
+#define IMAGE_ROOTS 7
+
+#if UINTPTR_MAX > 0xffffffffu
+#define IMAGE_BASE 0x200000000000ULL
+#else
+#define IMAGE_BASE 0x40000000ULL
+#endif
 
-object* car_proc(object* arguments) {
-    return caar(arguments);
-}
+#define image_align(n) \
+    (((n) + IMAGE_ALIGN - 1) & ~(uint64_t)(IMAGE_ALIGN - 1))
 
-object* cdr_proc(object* arguments) {
-    return cdar(arguments);
-}
+typedef object* (*image_function)(object* arguments);
 
-object* set_car_proc(object* arguments) {
-    set_car(car(arguments), cadr(arguments));
-    return ok_symbol;
-}
+/*
+ * An image holds function offsets that only the build which wrote it
+ * can resolve, so it carries a stamp of what it depends on: the image
+ * format, the object size, and the name, offset and inline operation
+ * of every primitive and stream step function. Bump
+ * IMAGE_FORMAT_VERSION when the layout of an image changes.
+ */
 
-object* set_cdr_proc(object* arguments) {
-    set_cdr(car(arguments), cadr(arguments));
-    return ok_symbol;
-}
+#define IMAGE_FORMAT_VERSION 1
 
-object* list_proc(object* arguments) {
-    return arguments;
-}
+uint64_t image_stamp;
 
-object* is_eq_proc(object* arguments) {
-    object* obj1;
-    object* obj2;
+void image_stamp_function(char* name, image_function fn, int op) {
+    uint64_t offset;
 
-    obj1 = car(arguments);
-    obj2 = cadr(arguments);
+    offset = (uint64_t)((intptr_t)fn - (intptr_t)alloc_object);
+    image_stamp = fnv1a(image_stamp, name, (long)strlen(name) + 1);
+    image_stamp = fnv1a(image_stamp, (char*)&offset, sizeof(offset));
+    image_stamp = fnv1a(image_stamp, (char*)&op, sizeof(op));
+}
 
-    if (obj1->type != obj2->type) {
-        return false;
+void populate_environment(object* env);
+
+/* run once at start, before an image is checked or written */
+void compute_image_stamp(void) {
+    image_function steps[] = {
+        list_stream_step, port_stream_step, iterate_stream_step,
+        range_stream_step, map_stream_step, filter_stream_step,
+        take_stream_step, append_stream_step
+    };
+    uint64_t n;
+    size_t i;
+
+    image_stamp = FNV_OFFSET;
+    n = IMAGE_FORMAT_VERSION;
+    image_stamp = fnv1a(image_stamp, (char*)&n, sizeof(n));
+    n = sizeof(object);
+    image_stamp = fnv1a(image_stamp, (char*)&n, sizeof(n));
+    /* without an environment it only stamps the primitives */
+    populate_environment(NULL);
+    for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        image_stamp_function("", steps[i], 0);
     }
-    switch (obj1->type) {
-    case FIXNUM:
-        return (obj1->data.fixnum.value ==
-            obj2->data.fixnum.value) ?
-            true : false;
+}
+
+typedef struct image_header {
+    char magic[8];
+    uint64_t stamp;         /* image_stamp of the writer */
+    uint64_t object_size;   /* sizeof(object) of the writer */
+    uint64_t base;          /* where the pointers in the file point */
+    uint64_t size;          /* of the whole file */
+    uint64_t heap_end;      /* objects and their storage end here */
+    uint64_t objects;       /* offsets of all the objects */
+    uint64_t nobjects;
+    uint64_t fixups;        /* object offset and function index pairs */
+    uint64_t nfixups;
+    uint64_t functions;     /* function offsets from alloc_object */
+    uint64_t nfunctions;
+    uint64_t rebuilds;      /* offsets of the objects renewed at start */
+    uint64_t nrebuilds;
+    uint64_t roots[IMAGE_ROOTS];
+    uint64_t pmap_next_edit;
+} image_header;
+
+/* a hash table is saved as its live entries */
+typedef struct image_table {
+    long kind;
+    long weak;
+    long count;
+    object* entries[1];     /* really count keys and values */
+} image_table;
+
+typedef struct image_writer {
+    object_table index;     /* object to its position in objects */
+    fasl_stack objects;
+    uint64_t* offsets;      /* of each object */
+    uint64_t* payloads;     /* of the storage it owns */
+    image_function* functions;
+    long nfunctions;
+    long capacity;
+    char* buf;
+} image_writer;
+
+void image_push_children(fasl_stack* stack, object* obj) {
+    long i;
+
+    switch (obj->type) {
+    case PAIR:
+        fasl_push(stack, obj->data.pair.cdr);
+        fasl_push(stack, obj->data.pair.car);
         break;
-    case FLONUM:
-        return (obj1->data.flonum.value ==
-            obj2->data.flonum.value) ?
-            true : false;
+    case COMPOUND_PROC:
+        fasl_push(stack, obj->data.compound_proc.params);
+        fasl_push(stack, obj->data.compound_proc.body);
+        fasl_push(stack, obj->data.compound_proc.env);
         break;
-    case CPXNUM:
-        return ((creal(obj1->data.cpxnum.value) == 
-                 creal(obj2->data.cpxnum.value))   &&
-                (cimag(obj1->data.cpxnum.value) ==
-                 cimag(obj2->data.cpxnum.value)))
-            ? true : false;
+    case PROMISE:
+        fasl_push(stack, obj->data.promise.value);
+        fasl_push(stack, obj->data.promise.env);
         break;
-    case CHARACTER:
-        return (obj1->data.character.value ==
-            obj2->data.character.value) ?
-            true : false;
+    case MATRIX:
+        fasl_push(stack, obj->data.matrix.base);
         break;
-    case STRING:
-        return (strcmp(obj1->data.string.value,
-            obj2->data.string.value) == 0) ?
-            true : false;
+    case VECTOR:
+        for (i = obj->data.vector.length - 1; i >= 0; i--) {
+            fasl_push(stack, obj->data.vector.items[i]);
+        }
+        break;
+    case HASH_TABLE:
+        hash_table_for_each(obj->data.hash_table.t, fasl_push_entry, stack);
+        break;
+    case PMAP:
+        fasl_push(stack, obj->data.pmap.root);
+        break;
+    case PMAP_NODE:
+        for (i = 0; i < obj->data.pmap_node.length; i++) {
+            fasl_push(stack, obj->data.pmap_node.slots[i]);
+        }
+        break;
+    case RECORD_TYPE:
+        fasl_push(stack, obj->data.record_type.fields);
+        fasl_push(stack, obj->data.record_type.name);
+        break;
+    case RECORD:
+        fasl_push(stack, obj->data.record.rtd);
+        for (i = 0; i < obj->data.record.rtd->data.record_type.nfields;
+             i++) {
+            fasl_push(stack, obj->data.record.slots[i]);
+        }
+        break;
+    case RECORD_PROC:
+        fasl_push(stack, obj->data.record_proc.rtd);
+        fasl_push(stack, obj->data.record_proc.slots);
         break;
     default:
-        return (obj1 == obj2) ? true : false;
+        break;
     }
 }
 
-object* apply_proc(object* arguments) {
-    fprintf(stderr, "*** illegal state: The body of the apply "
-        "primitive procedure should not execute.\n");
-    exit(1);
-}
-
-object* interaction_environment_proc(object* arguments) {
-    return the_global;
-}
-
-object* setup_env(void);
+/* as allocated, see the make functions */
+uint64_t image_object_size(object* obj) {
+    size_t size;
 
-object* null_environment_proc(object* arguments) {
-    return setup_env();
+    switch (obj->type) {
+    case VECTOR:
+        size = offsetof(object, data.vector.items) +
+            obj->data.vector.length * sizeof(object*);
+        break;
+    case BYTEVECTOR:
+        size = offsetof(object, data.bytevector.bytes) +
+            obj->data.bytevector.length;
+        break;
+    case PMAP_NODE:
+        size = offsetof(object, data.pmap_node.slots) +
+            obj->data.pmap_node.capacity * sizeof(object*);
+        break;
+    case RECORD:
+        size = offsetof(object, data.record.slots) +
+            obj->data.record.rtd->data.record_type.nfields * sizeof(object*);
+        break;
+    default:
+        size = sizeof(object);
+        break;
+    }
+    return image_align(size < sizeof(object) ? sizeof(object) : size);
 }
 
-object* make_environment(void);
-
-object* environment_proc(object* arguments) {
-    return make_environment();
-}
+uint64_t image_matrix_elems(object* obj) {
+    matrix* m;
 
-object* eval_proc(object* arguments) {
-    fprintf(stderr, "*** illegal state: The body of the eval "
-        "primitive procedure should not execute.\n");
-    exit(1);
+    m = obj->data.matrix.m;
+    return (uint64_t)(m->rows * m->cols > 0 ? m->rows * m->cols : 1) *
+        (m->is_complex ? 2 : 1);
 }
 
-object* sread(FILE* in);
-
-object* eval(object* exp, object* env);
-
-object* load_proc(object* arguments) {
-    char* filename;
-    FILE* in;
-    object* exp;
-    object* result;
+/* the storage an object owns outside itself */
+uint64_t image_payload_size(object* obj) {
+    long n;
 
-    result = alloc_object();
-    filename = car(arguments)->data.string.value;
-    in = fopen(filename, "r");
-    if (in == NULL) {
-        fprintf(stderr, "*** could not load file \"%s\"", filename);
-        exit(1);
-    }
-    while ((exp = sread(in)) != NULL) {
-        result = eval(exp, the_global);
+    switch (obj->type) {
+    case SYMBOL:
+        return image_align(strlen(obj->data.symbol.value) + 1);
+    case STRING:
+        return image_align((uint64_t)obj->data.string.length + 1);
+    case MATRIX:
+        return image_align(sizeof(matrix)) +
+            (obj->data.matrix.base == NULL ?
+                image_matrix_elems(obj) * sizeof(double) : 0);
+    case BITSET:
+        n = BITSET_WORDS(obj->data.bitset.nbits);
+        return (uint64_t)(n ? n : 1) * sizeof(uint64_t);
+    case HASH_TABLE:
+        n = obj->data.hash_table.t->count;
+        return image_align(offsetof(image_table, entries) +
+            (n ? 2 * n : 1) * sizeof(object*));
+    case STRING_BUILDER:
+        return obj->data.builder.data == NULL ? 0 :
+            image_align((uint64_t)obj->data.builder.length + 1);
+    default:
+        return 0;
     }
-    fclose(in);
-    printf("program-loaded\n");
-    return result;
 }
 
-object* make_input_port(FILE* in);
-
-object* open_input_port_proc(object* arguments) {
-    char* filename;
-    FILE* in;
+long image_position(image_writer* w, object* obj) {
+    char added;
 
-    filename = car(arguments)->data.string.value;
-    in = fopen(filename, "r");
-    if (in == NULL) {
-        fprintf(stderr, "*** could not open file \"%s\"\n", filename);
-        exit(1);
-    }
-    return make_input_port(in);
+    return *object_table_find(&w->index, obj, &added);
 }
 
-object* close_input_port_proc(object* arguments) {
-    int result;
-
-    result = fclose(car(arguments)->data.input_port.stream);
-    if (result == EOF) {
-        fprintf(stderr, "*** could not close input port\n");
-        exit(1);
+/* where obj is to be in the image */
+void* image_pointer(image_writer* w, object* obj) {
+    if (obj == NULL) {
+        return NULL;
     }
-    return ok_symbol;
+    return (void*)(uintptr_t)(IMAGE_BASE +
+        w->offsets[image_position(w, obj)]);
 }
 
-char is_input_port(object* obj);
+long image_function_index(image_writer* w, image_function fn) {
+    long i;
 
-object* is_input_port_proc(object* arguments) {
-    return is_input_port(car(arguments)) ? true : false;
+    for (i = 0; i < w->nfunctions; i++) {
+        if (w->functions[i] == fn) {
+            return i;
+        }
+    }
+    if (w->nfunctions == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 256;
+        w->functions = realloc(w->functions,
+            w->capacity * sizeof(image_function));
+        if (w->functions == NULL) {
+            diagnostic("*** save-image - out of memory\n");
+            exit(1);
+        }
+    }
+    w->functions[w->nfunctions] = fn;
+    return w->nfunctions++;
 }
 
-object* read_proc(object* arguments) {
-    FILE* in;
-    object* result;
+void image_copy_entry(hash_entry* e, void* data) {
+    image_writer* w;
+    image_table* copy;
 
-    in = is_nil(arguments) ?
-        stdin :
-        car(arguments)->data.input_port.stream;
-    result = sread(in);
-    return (result == NULL) ? eof_object : result;
+    w = ((void**)data)[0];
+    copy = ((void**)data)[1];
+    copy->entries[2 * copy->count] = image_pointer(w, e->key);
+    copy->entries[2 * copy->count + 1] = image_pointer(w, e->value);
+    copy->count++;
 }
 
-object* read_char_proc(object* arguments) {
-    FILE* in;
-    int result;
+/* copies the i-th object and its storage into the buffer, with the
+ * pointers it holds moved to their places in the image */
+void image_copy(image_writer* w, long i) {
+    object* obj;
+    object* copy;
+    object* owner;
+    char* payload;
+    uint64_t at;
+    void* data[2];
+    long n;
+    long j;
+
+    obj = w->objects.items[i];
+    copy = (object*)(w->buf + w->offsets[i]);
+    memcpy(copy, obj, sizeof(object));
+    copy->next = NULL;
+    copy->marked = 0;
+    payload = w->buf + w->payloads[i];
+    at = IMAGE_BASE + w->payloads[i];
 
-    in = is_nil(arguments) ?
-        stdin :
-        car(arguments)->data.input_port.stream;
-    result = getc(in);
-    return (result == EOF) ? eof_object : make_character(result);
+    switch (obj->type) {
+    case SYMBOL:
+        strcpy(payload, obj->data.symbol.value);
+        copy->data.symbol.value = (char*)(uintptr_t)at;
+        break;
+    case STRING:
+        memcpy(payload, obj->data.string.value, obj->data.string.length + 1);
+        copy->data.string.value = (char*)(uintptr_t)at;
+        break;
+    case PAIR:
+        copy->data.pair.car = image_pointer(w, obj->data.pair.car);
+        copy->data.pair.cdr = image_pointer(w, obj->data.pair.cdr);
+        break;
+    case PRIMITIVE_PROC:
+        copy->data.primitive_proc.fn = NULL;
+        break;
+    case COMPOUND_PROC:
+        copy->data.compound_proc.params =
+            image_pointer(w, obj->data.compound_proc.params);
+        copy->data.compound_proc.body =
+            image_pointer(w, obj->data.compound_proc.body);
+        copy->data.compound_proc.env =
+            image_pointer(w, obj->data.compound_proc.env);
+        break;
+    case MATRIX:
+        memcpy(payload, obj->data.matrix.m, sizeof(matrix));
+        copy->data.matrix.m = (matrix*)(uintptr_t)at;
+        owner = obj->data.matrix.base;
+        if (owner == NULL) {
+            memcpy(payload + image_align(sizeof(matrix)),
+                obj->data.matrix.m->elems,
+                image_matrix_elems(obj) * sizeof(double));
+            ((matrix*)payload)->elems =
+                (double*)(uintptr_t)(at + image_align(sizeof(matrix)));
+        }
+        else {
+            /* a view points into the storage of its owner */
+            ((matrix*)payload)->elems = (double*)(uintptr_t)(IMAGE_BASE +
+                w->payloads[image_position(w, owner)] +
+                image_align(sizeof(matrix)) +
+                (uint64_t)((char*)obj->data.matrix.m->elems -
+                    (char*)owner->data.matrix.m->elems));
+        }
+        copy->data.matrix.base = image_pointer(w, owner);
+        break;
+    case BITSET:
+        n = BITSET_WORDS(obj->data.bitset.nbits);
+        memcpy(payload, obj->data.bitset.words, n * sizeof(uint64_t));
+        copy->data.bitset.words = (uint64_t*)(uintptr_t)at;
+        copy->data.bitset.ranks = NULL;
+        break;
+    case VECTOR:
+        for (j = 0; j < obj->data.vector.length; j++) {
+            copy->data.vector.items[j] =
+                image_pointer(w, obj->data.vector.items[j]);
+        }
+        break;
+    case HASH_TABLE:
+        ((image_table*)payload)->kind = obj->data.hash_table.t->kind;
+        ((image_table*)payload)->weak = obj->data.hash_table.t->weak;
+        ((image_table*)payload)->count = 0;
+        data[0] = w;
+        data[1] = payload;
+        hash_table_for_each(obj->data.hash_table.t, image_copy_entry, data);
+        copy->data.hash_table.t = (hash_table*)(uintptr_t)at;
+        break;
+    case STRING_BUILDER:
+        if (obj->data.builder.data != NULL) {
+            memcpy(payload, obj->data.builder.data,
+                obj->data.builder.length + 1);
+            copy->data.builder.data = (char*)(uintptr_t)at;
+            copy->data.builder.capacity = obj->data.builder.length + 1;
+        }
+        break;
+    case BYTEVECTOR:
+        memcpy(copy, obj, offsetof(object, data.bytevector.bytes) +
+            obj->data.bytevector.length);
+        copy->next = NULL;
+        copy->marked = 0;
+        break;
+    case PMAP:
+        copy->data.pmap.root = image_pointer(w, obj->data.pmap.root);
+        break;
+    case PMAP_NODE:
+        for (j = 0; j < obj->data.pmap_node.capacity; j++) {
+            copy->data.pmap_node.slots[j] =
+                (j < obj->data.pmap_node.length) ?
+                    image_pointer(w, obj->data.pmap_node.slots[j]) : NULL;
+        }
+        break;
+    case RECORD_TYPE:
+        copy->data.record_type.name =
+            image_pointer(w, obj->data.record_type.name);
+        copy->data.record_type.fields =
+            image_pointer(w, obj->data.record_type.fields);
+        break;
+    case RECORD:
+        copy->data.record.rtd = image_pointer(w, obj->data.record.rtd);
+        for (j = 0; j < obj->data.record.rtd->data.record_type.nfields;
+             j++) {
+            copy->data.record.slots[j] =
+                image_pointer(w, obj->data.record.slots[j]);
+        }
+        break;
+    case RECORD_PROC:
+        copy->data.record_proc.rtd =
+            image_pointer(w, obj->data.record_proc.rtd);
+        copy->data.record_proc.slots =
+            image_pointer(w, obj->data.record_proc.slots);
+        break;
+    case PROMISE:
+        copy->data.promise.value =
+            image_pointer(w, obj->data.promise.value);
+        copy->data.promise.env = image_pointer(w, obj->data.promise.env);
+        copy->data.promise.step = NULL;
+        break;
+    default:
+        break;
+    }
 }
 
-int peek(FILE* in);
-
-object* peek_char_proc(object* arguments) {
-    FILE* in;
-    int result;
-
-    in = is_nil(arguments) ?
-        stdin :
-        car(arguments)->data.input_port.stream;
-    result = peek(in);
-    return (result == EOF) ? eof_object : make_character(result);
+char image_needs_function(object* obj) {
+    return obj->type == PRIMITIVE_PROC ||
+        (obj->type == PROMISE && obj->data.promise.step != NULL);
 }
 
-char is_eof_object(object* obj);
-
-object* is_eof_object_proc(object* arguments) {
-    return is_eof_object(car(arguments)) ? true : false;
+char image_needs_rebuild(object* obj) {
+    return obj->type == HASH_TABLE || obj->type == STRING_BUILDER ||
+        obj->type == PMAP;
 }
 
-object* make_output_port(FILE* in);
-
-object* open_output_port_proc(object* arguments) {
-    char* filename;
+/* (save-image filename) */
+object* save_image_proc(object* arguments) {
+    object* roots[IMAGE_ROOTS] = { nil, false, true, eof_object, symtab,
+                                   stream_null, the_global };
+    image_writer w;
+    image_header* h;
+    fasl_stack stack = { NULL, 0, 0 };
+    uint64_t* table;
+    uint64_t size;
+    object* obj;
     FILE* out;
+    char* filename;
+    long* position;
+    char added;
+    long nfixups = 0;
+    long nrebuilds = 0;
+    long i;
 
     filename = car(arguments)->data.string.value;
-    out = fopen(filename, "w");
-    if (out == NULL) {
-        fprintf(stderr, "*** could not open file \"%s\"\n", filename);
-        exit(1);
+    object_table_init(&w.index);
+    w.objects.items = NULL;
+    w.objects.top = 0;
+    w.objects.capacity = 0;
+    w.functions = NULL;
+    w.nfunctions = 0;
+    w.capacity = 0;
+
+    for (i = IMAGE_ROOTS - 1; i >= 0; i--) {
+        fasl_push(&stack, roots[i]);
     }
-    return make_output_port(out);
-}
-
-object* close_output_port_proc(object* arguments) {
-    int result;
+    while (stack.top > 0) {
+        obj = stack.items[--stack.top];
+        if (obj == NULL) {
+            continue;
+        }
+        position = object_table_find(&w.index, obj, &added);
+        if (!added) {
+            continue;
+        }
+        *position = w.objects.top;
+        if (obj->type == INPUT_PORT || obj->type == OUTPUT_PORT) {
+            diagnostic("*** save-image: cannot save a port\n");
+            exit(1);
+        }
+        fasl_push(&w.objects, obj);
+        nfixups += image_needs_function(obj);
+        nrebuilds += image_needs_rebuild(obj);
+        image_push_children(&stack, obj);
+    }
+    free(stack.items);
 
-    result = fclose(car(arguments)->data.output_port.stream);
-    if (result == EOF) {
-        fprintf(stderr, "*** could not close output port\n");
+    /* lay out the objects, each followed by its storage */
+    w.offsets = malloc(w.objects.top * sizeof(uint64_t) + 1);
+    w.payloads = malloc(w.objects.top * sizeof(uint64_t) + 1);
+    if (w.offsets == NULL || w.payloads == NULL) {
+        diagnostic("*** save-image - out of memory\n");
         exit(1);
     }
-    return ok_symbol;
-}
+    size = image_align(sizeof(image_header));
+    for (i = 0; i < w.objects.top; i++) {
+        w.offsets[i] = size;
+        size += image_object_size(w.objects.items[i]);
+        w.payloads[i] = size;
+        size += image_payload_size(w.objects.items[i]);
+    }
+    for (i = 0; i < w.objects.top; i++) {
+        if (image_needs_function(w.objects.items[i])) {
+            obj = w.objects.items[i];
+            image_function_index(&w, obj->type == PRIMITIVE_PROC ?
+                obj->data.primitive_proc.fn : obj->data.promise.step);
+        }
+    }
 
-char is_output_port(object* obj);
+    w.buf = calloc(size + (w.objects.top + 2 * nfixups + w.nfunctions +
+        nrebuilds) * sizeof(uint64_t), 1);
+    if (w.buf == NULL) {
+        diagnostic("*** save-image - out of memory\n");
+        exit(1);
+    }
+    h = (image_header*)w.buf;
+    memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+    h->stamp = image_stamp;
+    h->object_size = sizeof(object);
+    h->base = IMAGE_BASE;
+    h->heap_end = size;
+    for (i = 0; i < IMAGE_ROOTS; i++) {
+        h->roots[i] = (uint64_t)(uintptr_t)image_pointer(&w, roots[i]);
+    }
+    h->pmap_next_edit = pmap_next_edit;
+    for (i = 0; i < w.objects.top; i++) {
+        image_copy(&w, i);
+    }
 
-object* is_output_port_proc(object* arguments) {
-    return is_output_port(car(arguments)) ? true : false;
-}
+    h->objects = size;
+    h->nobjects = w.objects.top;
+    table = (uint64_t*)(w.buf + size);
+    for (i = 0; i < w.objects.top; i++) {
+        *table++ = w.offsets[i];
+    }
+    h->fixups = (char*)table - w.buf;
+    h->nfixups = nfixups;
+    for (i = 0; i < w.objects.top; i++) {
+        obj = w.objects.items[i];
+        if (image_needs_function(obj)) {
+            *table++ = w.offsets[i];
+            *table++ = image_function_index(&w, obj->type == PRIMITIVE_PROC ?
+                obj->data.primitive_proc.fn : obj->data.promise.step);
+        }
+    }
+    h->functions = (char*)table - w.buf;
+    h->nfunctions = w.nfunctions;
+    for (i = 0; i < w.nfunctions; i++) {
+        *table++ = (uint64_t)((intptr_t)w.functions[i] -
+            (intptr_t)alloc_object);
+    }
+    h->rebuilds = (char*)table - w.buf;
+    h->nrebuilds = nrebuilds;
+    for (i = 0; i < w.objects.top; i++) {
+        if (image_needs_rebuild(w.objects.items[i])) {
+            *table++ = w.offsets[i];
+        }
+    }
+    h->size = (char*)table - w.buf;
 
-object* write_char_proc(object* arguments) {
-    object* character;
-    FILE* out;
+    out = fopen(filename, "wb");
+    if (out == NULL || fwrite(w.buf, 1, h->size, out) != h->size ||
+        fclose(out) != 0) {
+        diagnostic("*** could not write image \"%s\"\n", filename);
+        exit(1);
+    }
 
-    character = car(arguments);
-    arguments = cdr(arguments);
-    out = is_nil(arguments) ?
-        stdout :
-        car(arguments)->data.output_port.stream;
-    putc(character->data.character.value, out);
-    fflush(out);
+    free(w.buf);
+    free(w.offsets);
+    free(w.payloads);
+    free(w.functions);
+    free(w.objects.items);
+    object_table_free(&w.index);
     return ok_symbol;
 }
 
-void swrite(FILE* out, object* obj);
-
-object* write_proc(object* arguments) {
-    object* exp;
-    FILE* out;
+#define image_relocate(p, delta) \
+    ((p) = ((p) == NULL) ? NULL : (void*)((char*)(p) + (delta)))
 
-    exp = car(arguments);
-    arguments = cdr(arguments);
-    out = is_nil(arguments) ?
-        stdout :
-        car(arguments)->data.output_port.stream;
-    swrite(out, exp);
-    fflush(out);
-    return ok_symbol;
-}
+/* the image could not be mapped where its pointers point */
+void image_relocate_object(object* obj, ptrdiff_t delta) {
+    image_table* t;
+    long i;
 
-object* error_proc(object* arguments) {
-    while (!is_nil(arguments)) {
-        swrite(stderr, car(arguments));
-        fprintf(stderr, " ");
-        arguments = cdr(arguments);
-    };
-    printf("\n*** exiting\n");
-    exit(1);
+    switch (obj->type) {
+    case SYMBOL:
+        image_relocate(obj->data.symbol.value, delta);
+        break;
+    case STRING:
+        image_relocate(obj->data.string.value, delta);
+        break;
+    case PAIR:
+        image_relocate(obj->data.pair.car, delta);
+        image_relocate(obj->data.pair.cdr, delta);
+        break;
+    case COMPOUND_PROC:
+        image_relocate(obj->data.compound_proc.params, delta);
+        image_relocate(obj->data.compound_proc.body, delta);
+        image_relocate(obj->data.compound_proc.env, delta);
+        break;
+    case MATRIX:
+        image_relocate(obj->data.matrix.m, delta);
+        image_relocate(obj->data.matrix.m->elems, delta);
+        image_relocate(obj->data.matrix.base, delta);
+        break;
+    case BITSET:
+        image_relocate(obj->data.bitset.words, delta);
+        break;
+    case VECTOR:
+        for (i = 0; i < obj->data.vector.length; i++) {
+            image_relocate(obj->data.vector.items[i], delta);
+        }
+        break;
+    case HASH_TABLE:
+        image_relocate(obj->data.hash_table.t, delta);
+        t = (image_table*)obj->data.hash_table.t;
+        for (i = 0; i < 2 * t->count; i++) {
+            image_relocate(t->entries[i], delta);
+        }
+        break;
+    case STRING_BUILDER:
+        image_relocate(obj->data.builder.data, delta);
+        break;
+    case PMAP:
+        image_relocate(obj->data.pmap.root, delta);
+        break;
+    case PMAP_NODE:
+        for (i = 0; i < obj->data.pmap_node.length; i++) {
+            image_relocate(obj->data.pmap_node.slots[i], delta);
+        }
+        break;
+    case RECORD_TYPE:
+        image_relocate(obj->data.record_type.name, delta);
+        image_relocate(obj->data.record_type.fields, delta);
+        break;
+    case RECORD:
+        image_relocate(obj->data.record.rtd, delta);
+        for (i = 0; i < obj->data.record.rtd->data.record_type.nfields;
+             i++) {
+            image_relocate(obj->data.record.slots[i], delta);
+        }
+        break;
+    case RECORD_PROC:
+        image_relocate(obj->data.record_proc.rtd, delta);
+        image_relocate(obj->data.record_proc.slots, delta);
+        break;
+    case PROMISE:
+        image_relocate(obj->data.promise.value, delta);
+        image_relocate(obj->data.promise.env, delta);
+        break;
+    default:
+        break;
+    }
 }
 
-object* make_compound_proc(object* params, object* body,
-    object* env) {
-    object* obj;
-
-    obj = alloc_object();
-    obj->type = COMPOUND_PROC;
-    obj->data.compound_proc.params = params;
-    obj->data.compound_proc.body = body;
-    obj->data.compound_proc.env = env;
-    return obj;
-}
+/* gives growable storage back to the allocator, and rehashes what was
+ * hashed by the addresses the objects had before the image */
+void image_rebuild(object* obj) {
+    image_table* saved;
+    hash_table* t;
+    strbuf builder;
+    object* fresh;
+    fasl_stack entries = { NULL, 0, 0 };
+    long i;
 
-char is_compound_proc(object* obj) {
-    return obj->type == COMPOUND_PROC;
+    switch (obj->type) {
+    case HASH_TABLE:
+        saved = (image_table*)obj->data.hash_table.t;
+        t = new_hash_table((hash_kind)saved->kind, (char)saved->weak);
+        for (i = 0; i < saved->count; i++) {
+            hash_table_put(t, saved->entries[2 * i],
+                saved->entries[2 * i + 1]);
+        }
+        obj->data.hash_table.t = t;
+        break;
+    case STRING_BUILDER:
+        if (obj->data.builder.data != NULL) {
+            strbuf_init(&builder);
+            strbuf_add(&builder, obj->data.builder.data,
+                obj->data.builder.length);
+            obj->data.builder = builder;
+        }
+        break;
+    case PMAP:
+        if (obj->data.pmap.root == NULL) {
+            break;
+        }
+        fasl_push_pmap_node(&entries, obj->data.pmap.root);
+        fresh = make_pmap(NULL, 0, pmap_next_edit++, obj->data.pmap.is_set);
+        for (i = 0; i < entries.top; i += 2) {
+            pmap_set(fresh, entries.items[i + 1], entries.items[i]);
+        }
+        obj->data.pmap.root = fresh->data.pmap.root;
+        if (obj->data.pmap.edit != 0) {
+            obj->data.pmap.edit = fresh->data.pmap.edit;
+        }
+        free(entries.items);
+        break;
+    default:
+        break;
+    }
 }
 
-object* make_input_port(FILE* stream) {
+/* maps the image and sets the roots from it, in place of building
+ * the heap in init */
+void load_image(char* filename) {
+    image_header h;
+    FILE* stream;
+    char* start;
+    uint64_t* table;
+    ptrdiff_t delta;
+    image_function fn;
     object* obj;
+    long size;
+    uint64_t i;
+    int frame;
 
-    obj = alloc_object();
-    obj->type = INPUT_PORT;
-    obj->data.input_port.stream = stream;
-    return obj;
-}
-
-char is_input_port(object* obj) {
-    return obj->type == INPUT_PORT;
-}
-
-object* make_output_port(FILE* stream) {
-    object* obj;
+    stream = fopen(filename, "rb");
+    if (stream == NULL) {
+        diagnostic("*** could not open image \"%s\"\n", filename);
+        exit(1);
+    }
+    if (fread(&h, sizeof(h), 1, stream) != 1 ||
+        memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic)) != 0) {
+        diagnostic("*** \"%s\" is not an image\n", filename);
+        exit(1);
+    }
+    if (h.stamp != image_stamp ||
+        h.object_size != sizeof(object)) {
+        diagnostic("*** image \"%s\" was saved by another build\n",
+            filename);
+        exit(1);
+    }
+    if (fseek(stream, 0, SEEK_END) != 0 ||
+        (size = ftell(stream)) < 0 || (uint64_t)size != h.size) {
+        diagnostic("*** image \"%s\" is truncated\n", filename);
+        exit(1);
+    }
+#if defined(HAVE_MMAP)
+    start = mmap(relocate_image ? NULL : (void*)(uintptr_t)h.base, h.size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(stream), 0);
+    if (start == MAP_FAILED) {
+        diagnostic("*** could not map image \"%s\"\n", filename);
+        exit(1);
+    }
+#else
+    start = malloc(h.size);
+    if (start == NULL || fseek(stream, 0, SEEK_SET) != 0 ||
+        fread(start, 1, h.size, stream) != h.size) {
+        diagnostic("*** could not read image \"%s\"\n", filename);
+        exit(1);
+    }
+#endif
+    fclose(stream);
 
-    obj = alloc_object();
-    obj->type = OUTPUT_PORT;
-    obj->data.output_port.stream = stream;
-    return obj;
-}
+    image_start = start;
+    image_end = start + h.heap_end;
+    image_marks = calloc(h.heap_end / IMAGE_ALIGN / 8 + 1, 1);
+    if (image_marks == NULL) {
+        diagnostic("*** image - out of memory\n");
+        exit(1);
+    }
+    delta = start - (char*)(uintptr_t)h.base;
+    if (delta != 0) {
+        table = (uint64_t*)(start + h.objects);
+        for (i = 0; i < h.nobjects; i++) {
+            image_relocate_object((object*)(start + table[i]), delta);
+        }
+    }
+    nil = (object*)(start + (h.roots[0] - h.base));
+    false = (object*)(start + (h.roots[1] - h.base));
+    true = (object*)(start + (h.roots[2] - h.base));
+    eof_object = (object*)(start + (h.roots[3] - h.base));
+    symtab = (object*)(start + (h.roots[4] - h.base));
+    stream_null = (object*)(start + (h.roots[5] - h.base));
+    the_global = (object*)(start + (h.roots[6] - h.base));
+    if (pmap_next_edit < h.pmap_next_edit) {
+        pmap_next_edit = (uint32_t)h.pmap_next_edit;
+    }
 
-char is_output_port(object* obj) {
-    return obj->type == OUTPUT_PORT;
-}
+    /* functions move with the executable; only their pages are written
+     * when they did */
+    table = (uint64_t*)(start + h.fixups);
+    for (i = 0; i < h.nfixups; i++) {
+        obj = (object*)(start + table[2 * i]);
+        fn = (image_function)((intptr_t)alloc_object +
+            (intptr_t)((uint64_t*)(start + h.functions))[table[2 * i + 1]]);
+        if (obj->type == PRIMITIVE_PROC) {
+            if (obj->data.primitive_proc.fn != fn) {
+                obj->data.primitive_proc.fn = fn;
+            }
+        }
+        else if (obj->data.promise.step != fn) {
+            obj->data.promise.step = fn;
+        }
+    }
 
-char is_eof_object(object* obj) {
-    return obj == eof_object;
+    /* the tables first, since maps allocate and so may collect */
+    frame = the_vm->stackSize;
+    table = (uint64_t*)(start + h.rebuilds);
+    for (i = 0; i < h.nrebuilds; i++) {
+        if (((object*)(start + table[i]))->type != PMAP) {
+            image_rebuild((object*)(start + table[i]));
+        }
+    }
+    for (i = 0; i < h.nrebuilds; i++) {
+        if (((object*)(start + table[i]))->type == PMAP) {
+            image_rebuild((object*)(start + table[i]));
+            the_vm->stackSize = frame;
+        }
+    }
 }
 
-
 /****** FINISH PROCS *********/
 
 object* enclosing_env(object* env) {
@@ -1292,7 +10939,7 @@ object* lookup_var_val(object* var, object* env) {
         }
         env = enclosing_env(env);
     }
-    fprintf(stderr, "*** unbound variable, %s\n", var->data.symbol.value);
+    diagnostic("*** unbound variable, %s\n", var->data.symbol.value);
     exit(1);
 }
 
@@ -1315,7 +10962,7 @@ void set_var_val(object* var, object* val, object* env) {
         }
         env = enclosing_env(env);
     }
-    fprintf(stderr, "*** unbound variable, %s\n", var->data.symbol.value);
+    diagnostic("*** unbound variable, %s\n", var->data.symbol.value);
     exit(1);
 }
 
@@ -1349,6 +10996,16 @@ object* setup_env(void) {
     return initial_env;
 }
 
+/* binds a primitive in env; without one, only stamps it for images */
+void add_primitive(object* env, char* name,
+    object* (*fn)(struct object* args), int op) {
+    if (env == NULL) {
+        image_stamp_function(name, fn, op);
+        return;
+    }
+    define_var(make_symbol(name), make_inline_primitive(fn, op), env);
+}
+
 void populate_environment(object* env) {
 
     /* Primitive functions */
@@ -1370,6 +11027,22 @@ void populate_environment(object* env) {
     add_procedure("symbol->string", symbol_to_string_proc);
     add_procedure("string->symbol", string_to_symbol_proc);
 
+    add_procedure("make-string", make_string_proc);
+    add_procedure("string", string_proc);
+    add_procedure("string-length", string_length_proc);
+    add_procedure("string-ref", string_ref_proc);
+    add_procedure("string-set!", string_set_proc);
+    add_procedure("substring", substring_proc);
+    add_procedure("string-copy", substring_proc);
+    add_procedure("string-append", string_append_proc);
+    add_procedure("string=?", string_equal_proc);
+    add_procedure("string<?", string_lessthan_proc);
+    add_procedure("string>?", string_greatthan_proc);
+    add_procedure("string-builder", string_builder_proc);
+    add_procedure("builder-add!", builder_add_proc);
+    add_procedure("builder-length", builder_length_proc);
+    add_procedure("builder->string", builder_to_string_proc);
+
     add_procedure("+", add_proc);
     add_procedure("-", sub_proc);
     add_procedure("*", mul_proc);
@@ -1380,14 +11053,158 @@ void populate_environment(object* env) {
     add_procedure("<", is_lessthan_proc);
     add_procedure(">", is_greatthan_proc);
 
+    add_procedure("abs", abs_proc);
+    add_procedure("floor", floor_proc);
+    add_procedure("ceiling", ceiling_proc);
+    add_procedure("truncate", truncate_proc);
+    add_procedure("round", round_proc);
+    add_procedure("min", min_proc);
+    add_procedure("max", max_proc);
+    add_procedure("square", square_proc);
+    add_procedure("sqrt", sqrt_proc);
+    add_procedure("exact-integer-sqrt", exact_integer_sqrt_proc);
+    add_procedure("expt", expt_proc);
+    add_procedure("exp", exp_proc);
+    add_procedure("log", log_proc);
+    add_procedure("sin", sin_proc);
+    add_procedure("cos", cos_proc);
+    add_procedure("tan", tan_proc);
+    add_procedure("asin", asin_proc);
+    add_procedure("acos", acos_proc);
+    add_procedure("atan", atan_proc);
+    add_procedure("magnitude", magnitude_proc);
+    add_procedure("angle", angle_proc);
+    add_procedure("real-part", real_part_proc);
+    add_procedure("imag-part", imag_part_proc);
+    add_procedure("make-rectangular", make_rectangular_proc);
+    add_procedure("make-polar", make_polar_proc);
+    add_procedure("exact", exact_proc);
+    add_procedure("inexact", inexact_proc);
+
+    add_inline_procedure("fx+", fx_add_proc, FX_ADD);
+    add_inline_procedure("fx-", fx_sub_proc, FX_SUB);
+    add_inline_procedure("fx*", fx_mul_proc, FX_MUL);
+    add_inline_procedure("fxquotient", fx_quotient_proc, FX_QUOTIENT);
+    add_inline_procedure("fx<", fx_lt_proc, FX_LT);
+    add_inline_procedure("fx=", fx_eq_proc, FX_EQ);
+    add_inline_procedure("fl+", fl_add_proc, FL_ADD);
+    add_inline_procedure("fl-", fl_sub_proc, FL_SUB);
+    add_inline_procedure("fl*", fl_mul_proc, FL_MUL);
+    add_inline_procedure("fl/", fl_div_proc, FL_DIV);
+    add_inline_procedure("fl<", fl_lt_proc, FL_LT);
+    add_inline_procedure("flsqrt", fl_sqrt_proc, FL_SQRT);
+
+    add_procedure("bitwise-and", bitwise_and_proc);
+    add_procedure("bitwise-or", bitwise_or_proc);
+    add_procedure("bitwise-xor", bitwise_xor_proc);
+    add_procedure("bitwise-not", bitwise_not_proc);
+    add_procedure("arithmetic-shift", arithmetic_shift_proc);
+    add_procedure("bit-count", bit_count_proc);
+
     add_procedure("cons", cons_proc);
     add_procedure("car", car_proc);
     add_procedure("cdr", cdr_proc);
     add_procedure("set-car!", set_car_proc);
     add_procedure("set-cdr!", set_cdr_proc);
     add_procedure("list", list_proc);
+    add_procedure("caar", caar_proc);
+    add_procedure("cadr", cadr_proc);
+    add_procedure("cdar", cdar_proc);
+    add_procedure("cddr", cddr_proc);
+    add_procedure("caaar", caaar_proc);
+    add_procedure("caadr", caadr_proc);
+    add_procedure("cadar", cadar_proc);
+    add_procedure("caddr", caddr_proc);
+    add_procedure("cdaar", cdaar_proc);
+    add_procedure("cdadr", cdadr_proc);
+    add_procedure("cddar", cddar_proc);
+    add_procedure("cdddr", cdddr_proc);
+    add_procedure("caaaar", caaaar_proc);
+    add_procedure("caaadr", caaadr_proc);
+    add_procedure("caadar", caadar_proc);
+    add_procedure("caaddr", caaddr_proc);
+    add_procedure("cadaar", cadaar_proc);
+    add_procedure("cadadr", cadadr_proc);
+    add_procedure("caddar", caddar_proc);
+    add_procedure("cadddr", cadddr_proc);
+    add_procedure("cdaaar", cdaaar_proc);
+    add_procedure("cdaadr", cdaadr_proc);
+    add_procedure("cdadar", cdadar_proc);
+    add_procedure("cdaddr", cdaddr_proc);
+    add_procedure("cddaar", cddaar_proc);
+    add_procedure("cddadr", cddadr_proc);
+    add_procedure("cdddar", cdddar_proc);
+    add_procedure("cddddr", cddddr_proc);
+    add_procedure("length", length_proc);
+    add_procedure("append", append_proc);
+    add_procedure("reverse", reverse_proc);
+    add_procedure("list-tail", list_tail_proc);
+    add_procedure("list-ref", list_ref_proc);
+    add_procedure("list-copy", list_copy_proc);
+    add_procedure("last-pair", last_pair_proc);
+    add_procedure("memq", memq_proc);
+    add_procedure("memv", memv_proc);
+    add_procedure("member", member_proc);
+    add_procedure("assq", assq_proc);
+    add_procedure("assv", assv_proc);
+    add_procedure("assoc", assoc_proc);
+    add_procedure("map", map_proc);
+    add_procedure("for-each", for_each_proc);
+    add_procedure("filter", filter_proc);
+    add_procedure("fold-left", fold_left_proc);
+    add_procedure("fold-right", fold_right_proc);
+    add_procedure("sort", sort_proc);
+    add_procedure("sort!", sort_to_proc);
+    add_procedure("list-sort", sort_proc);
+    add_procedure("vector-sort", sort_proc);
+    add_procedure("vector-sort!", sort_to_proc);
+    add_procedure("merge", merge_proc);
+
+    add_procedure("vector?", is_vector_proc);
+    add_procedure("make-vector", make_vector_proc);
+    add_procedure("vector", vector_proc);
+    add_procedure("vector-length", vector_length_proc);
+    add_procedure("vector-ref", vector_ref_proc);
+    add_procedure("vector-set!", vector_set_proc);
+    add_procedure("vector->list", vector_to_list_proc);
+    add_procedure("list->vector", list_to_vector_proc);
+    add_procedure("vector-fill!", vector_fill_proc);
+    add_procedure("vector-map", vector_map_proc);
+    add_procedure("vector-copy", vector_copy_proc);
+    add_procedure("vector-copy!", vector_copy_to_proc);
+    add_procedure("vector-append", vector_append_proc);
+
+    add_procedure("bytevector?", is_bytevector_proc);
+    add_procedure("make-bytevector", make_bytevector_proc);
+    add_procedure("bytevector", bytevector_proc);
+    add_procedure("bytevector-length", bytevector_length_proc);
+    add_procedure("bytevector-u8-ref", bytevector_u8_ref_proc);
+    add_procedure("bytevector-u8-set!", bytevector_u8_set_proc);
+    add_procedure("bytevector-copy", bytevector_copy_proc);
+    add_procedure("bytevector-copy!", bytevector_copy_to_proc);
+    add_procedure("bytevector-append", bytevector_append_proc);
+    add_procedure("utf8->string", utf8_to_string_proc);
+    add_procedure("string->utf8", string_to_utf8_proc);
+    add_procedure("bytevector-u16-ref", bytevector_u16_ref_proc);
+    add_procedure("bytevector-s16-ref", bytevector_s16_ref_proc);
+    add_procedure("bytevector-u32-ref", bytevector_u32_ref_proc);
+    add_procedure("bytevector-s32-ref", bytevector_s32_ref_proc);
+    add_procedure("bytevector-u16-set!", bytevector_u16_set_proc);
+    add_procedure("bytevector-s16-set!", bytevector_s16_set_proc);
+    add_procedure("bytevector-u32-set!", bytevector_u32_set_proc);
+    add_procedure("bytevector-s32-set!", bytevector_s32_set_proc);
+    add_procedure("bytevector-ieee-single-ref",
+        bytevector_ieee_single_ref_proc);
+    add_procedure("bytevector-ieee-double-ref",
+        bytevector_ieee_double_ref_proc);
+    add_procedure("bytevector-ieee-single-set!",
+        bytevector_ieee_single_set_proc);
+    add_procedure("bytevector-ieee-double-set!",
+        bytevector_ieee_double_set_proc);
 
     add_procedure("eq?", is_eq_proc);
+    add_procedure("eqv?", is_eqv_proc);
+    add_procedure("equal?", is_equal_proc);
 
     add_procedure("apply", apply_proc);
 
@@ -1404,17 +11221,164 @@ void populate_environment(object* env) {
     add_procedure("read", read_proc);
     add_procedure("read-char", read_char_proc);
     add_procedure("peek-char", peek_char_proc);
+    add_procedure("read-line", read_line_proc);
+    add_procedure("read-string", read_string_proc);
+    add_procedure("read-string!", read_string_to_proc);
+    add_procedure("char-ready?", char_ready_proc);
+    add_procedure("port-fold-lines", port_fold_lines_proc);
+    add_procedure("read-csv-row", read_csv_row_proc);
+    add_procedure("csv-fold", csv_fold_proc);
     add_procedure("eof-object?", is_eof_object_proc);
     add_procedure("open-output-port", open_output_port_proc);
     add_procedure("close-output-port", close_output_port_proc);
     add_procedure("output-port?", is_output_port_proc);
+    add_procedure("flush-output-port", flush_output_port_proc);
+    add_procedure("current-output-port", current_output_port_proc);
+    add_procedure("current-error-port", current_error_port_proc);
+    add_procedure("output-port-buffering", output_port_buffering_proc);
+    add_procedure("set-output-port-buffering!",
+        set_output_port_buffering_proc);
     add_procedure("write-char", write_char_proc);
+    add_procedure("open-binary-input-file", open_binary_input_file_proc);
+    add_procedure("open-binary-output-file",
+        open_binary_output_file_proc);
+    add_procedure("read-u8", read_u8_proc);
+    add_procedure("peek-u8", peek_u8_proc);
+    add_procedure("write-u8", write_u8_proc);
+    add_procedure("read-bytevector", read_bytevector_proc);
+    add_procedure("read-bytevector!", read_bytevector_to_proc);
+    add_procedure("write-bytevector", write_bytevector_proc);
     add_procedure("write", write_proc);
+    add_procedure("write-shared", write_shared_proc);
+    add_procedure("write-simple", write_simple_proc);
 
     add_procedure("error", error_proc);
+    add_procedure("exit", exit_proc);
+    add_procedure("command-line", command_line_proc);
+
+    add_procedure("matrix?", is_matrix_proc);
+    add_procedure("make-matrix", make_matrix_proc);
+    add_procedure("matrix-rows", matrix_rows_proc);
+    add_procedure("matrix-cols", matrix_cols_proc);
+    add_procedure("matrix-ref", matrix_ref_proc);
+    add_procedure("matrix-set!", matrix_set_proc);
+    add_procedure("list->matrix", list_to_matrix_proc);
+    add_procedure("matrix->list", matrix_to_list_proc);
+    add_procedure("vector->matrix", vector_to_matrix_proc);
+    add_procedure("matrix->vector", matrix_to_vector_proc);
+    add_procedure("matrix-copy", matrix_copy_proc);
+    add_procedure("matrix-slice", matrix_slice_proc);
+    add_procedure("matrix-reshape", matrix_reshape_proc);
+    add_procedure("matrix-transpose", matrix_transpose_proc);
+    add_procedure("matrix-map", matrix_map_proc);
+    add_procedure("matrix-mul", matrix_mul_proc);
+    add_procedure("matrix-lu-solve", matrix_lu_solve_proc);
+    add_procedure("matrix-cholesky", matrix_cholesky_proc);
+    add_procedure("matrix-cholesky-solve", matrix_cholesky_solve_proc);
+    add_procedure("matrix-qr-solve", matrix_qr_solve_proc);
+
+    add_procedure("bitset?", is_bitset_proc);
+    add_procedure("make-bitset", make_bitset_proc);
+    add_procedure("bitset-size", bitset_size_proc);
+    add_procedure("bitset-copy", bitset_copy_proc);
+    add_procedure("bitset-set!", bitset_set_proc);
+    add_procedure("bitset-clear!", bitset_clear_proc);
+    add_procedure("bitset-test", bitset_test_proc);
+    add_procedure("bitset-count", bitset_count_proc);
+    add_procedure("bitset-union!", bitset_union_proc);
+    add_procedure("bitset-intersection!", bitset_intersection_proc);
+    add_procedure("bitset-difference!", bitset_difference_proc);
+    add_procedure("bitset-rank", bitset_rank_proc);
+    add_procedure("bitset-select", bitset_select_proc);
+    add_procedure("bitset->list", bitset_to_list_proc);
+
+    add_procedure("make-hash-table", make_hash_table_proc);
+    add_procedure("make-eq-hash-table", make_eq_hash_table_proc);
+    add_procedure("make-eqv-hash-table", make_eqv_hash_table_proc);
+    add_procedure("make-equal-hash-table", make_equal_hash_table_proc);
+    add_procedure("make-string-hash-table", make_string_hash_table_proc);
+    add_procedure("make-key-weak-eq-hash-table",
+        make_key_weak_eq_hash_table_proc);
+    add_procedure("make-key-weak-eqv-hash-table",
+        make_key_weak_eqv_hash_table_proc);
+    add_procedure("hash-table?", is_hash_table_proc);
+    add_procedure("hash-table-ref", hash_table_ref_proc);
+    add_procedure("hash-table-ref/default", hash_table_ref_default_proc);
+    add_procedure("hash-table-set!", hash_table_set_proc);
+    add_procedure("hash-table-delete!", hash_table_delete_proc);
+    add_procedure("hash-table-contains?", hash_table_contains_proc);
+    add_procedure("hash-table-count", hash_table_count_proc);
+    add_procedure("hash-table-update!/default",
+        hash_table_update_default_proc);
+    add_procedure("hash-table-clear!", hash_table_clear_proc);
+    add_procedure("hash-table-keys", hash_table_keys_proc);
+    add_procedure("hash-table-values", hash_table_values_proc);
+    add_procedure("hash-table->alist", hash_table_to_alist_proc);
+    add_procedure("hash-table-walk", hash_table_walk_proc);
+
+    add_procedure("record?", is_record_proc);
+    add_procedure("record-type-descriptor", record_type_descriptor_proc);
+    add_procedure("record-type-name", record_type_name_proc);
+
+    add_procedure("force", force_proc);
+    add_procedure("make-promise", make_promise_proc);
+    add_procedure("promise?", is_promise_proc);
+    if (env != NULL) {
+        define_var(make_symbol("stream-null"), stream_null, env);
+    }
+    add_procedure("stream?", is_stream_proc);
+    add_procedure("stream-null?", is_stream_null_proc);
+    add_procedure("stream-pair?", is_stream_pair_proc);
+    add_procedure("stream-car", stream_car_proc);
+    add_procedure("stream-cdr", stream_cdr_proc);
+    add_procedure("stream", stream_proc);
+    add_procedure("list->stream", list_to_stream_proc);
+    add_procedure("port->stream", port_to_stream_proc);
+    add_procedure("stream-from", stream_from_proc);
+    add_procedure("stream-iterate", stream_iterate_proc);
+    add_procedure("stream-range", stream_range_proc);
+    add_procedure("stream-map", stream_map_proc);
+    add_procedure("stream-filter", stream_filter_proc);
+    add_procedure("stream-take", stream_take_proc);
+    add_procedure("stream-append", stream_append_proc);
+    add_procedure("stream-drop", stream_drop_proc);
+    add_procedure("stream-ref", stream_ref_proc);
+    add_procedure("stream->list", stream_to_list_proc);
+    add_procedure("stream-for-each", stream_for_each_proc);
+    add_procedure("stream-fold", stream_fold_proc);
+    add_procedure("stream-length", stream_length_proc);
+
+    add_procedure("fasl-write", fasl_write_proc);
+    add_procedure("fasl-read", fasl_read_proc);
+
+    add_procedure("make-pmap", make_pmap_proc);
+    add_procedure("pmap?", is_pmap_proc);
+    add_procedure("pmap-count", pmap_count_proc);
+    add_procedure("pmap-ref", pmap_ref_proc);
+    add_procedure("pmap-contains?", pmap_contains_proc);
+    add_procedure("pmap-set", pmap_set_proc);
+    add_procedure("pmap-delete", pmap_delete_proc);
+    add_procedure("pmap-fold", pmap_fold_proc);
+    add_procedure("pmap->alist", pmap_to_alist_proc);
+    add_procedure("pmap-keys", pmap_keys_proc);
+    add_procedure("pmap-transient", pmap_transient_proc);
+    add_procedure("pmap-set!", pmap_set_transient_proc);
+    add_procedure("pmap-delete!", pmap_delete_transient_proc);
+    add_procedure("pmap-persistent!", pmap_persistent_proc);
+    add_procedure("make-pset", make_pset_proc);
+    add_procedure("pset-add", pset_add_proc);
+    add_procedure("pset-add!", pset_add_transient_proc);
+    add_procedure("pset-remove", pmap_delete_proc);
+    add_procedure("pset-remove!", pmap_delete_transient_proc);
+    add_procedure("pset-contains?", pmap_contains_proc);
+    add_procedure("pset->list", pmap_keys_proc);
+    add_procedure("hash", hash_proc);
+    add_procedure("string-hash", string_hash_proc);
+    add_procedure("hash-by-identity", hash_by_identity_proc);
 
     add_procedure("gc", gc_proc);
     add_procedure("gc-stats", gc_stats_proc);
+    add_procedure("save-image", save_image_proc);
 }
 
 object* make_environment(void) {
@@ -1425,22 +11389,35 @@ object* make_environment(void) {
     return env;
 }
 
-void init(void) {
+void init_char_classes(void);
+
+/* the heap comes from the image when there is one */
+void init(char* image) {
+
+    stdout_writer = open_writer(stdout, BUFFER_LINE);
+    stderr_writer = open_writer(stderr, BUFFER_NONE);
+    atexit(flush_open_writers);
 
     the_vm = newVM();
+    compute_image_stamp();
 
-    nil = alloc_object();
-    nil->type = THE_NIL;
+    if (image != NULL) {
+        load_image(image);
+    }
+    else {
+        nil = alloc_object();
+        nil->type = THE_NIL;
 
-    false = alloc_object();
-    false->type = BOOLEAN;
-    false->data.boolean.value = 0;
+        false = alloc_object();
+        false->type = BOOLEAN;
+        false->data.boolean.value = 0;
 
-    true = alloc_object();
-    true->type = BOOLEAN;
-    true->data.boolean.value = 1;
+        true = alloc_object();
+        true->type = BOOLEAN;
+        true->data.boolean.value = 1;
 
-    symtab = nil;
+        symtab = nil;
+    }
     quote_symbol = make_symbol("quote");
     define_symbol = make_symbol("define");
     set_symbol = make_symbol("set!");
@@ -1453,79 +11430,138 @@ void init(void) {
     let_symbol = make_symbol("let");
     and_symbol = make_symbol("and");
     or_symbol = make_symbol("or");
+    big_symbol = make_symbol("big");
+    little_symbol = make_symbol("little");
+    define_record_type_symbol = make_symbol("define-record-type");
+    delay_symbol = make_symbol("delay");
+    delay_force_symbol = make_symbol("delay-force");
+    stream_cons_symbol = make_symbol("stream-cons");
 
-    eof_object = alloc_object();
-    eof_object->type = EOF_OBJECT;
+    init_char_classes();
+    stdin_reader = open_reader(stdin);
 
     the_empty = nil;
+    if (image != NULL) {
+        return;
+    }
+
+    stream_null = make_promise(PROMISE_DONE, nil, NULL, NULL);
+
+    eof_object = alloc_object();
+    eof_object->type = EOF_OBJECT;
 
     the_global = make_environment();
 }
 
 /***************************** READ ******************************/
 
+/* character classes for the reader, independent of the locale */
+#define CHAR_SPACE     0x01
+#define CHAR_DELIMITER 0x02
+#define CHAR_INITIAL   0x04
+#define CHAR_DIGIT     0x08
+#define CHAR_SYMBOL    0x10  /* may follow the start of a symbol */
+
+unsigned char char_class[256];
+
+void init_char_classes(void) {
+    int c;
+
+    for (c = 'a'; c <= 'z'; c++) {
+        char_class[c] |= CHAR_INITIAL | CHAR_SYMBOL;
+        char_class[c - 'a' + 'A'] |= CHAR_INITIAL | CHAR_SYMBOL;
+    }
+    for (c = '0'; c <= '9'; c++) {
+        char_class[c] |= CHAR_DIGIT | CHAR_SYMBOL;
+    }
+    for (c = 0; "*/><=?!"[c] != '\0'; c++) {
+        char_class[(unsigned char)"*/><=?!"[c]] |= CHAR_INITIAL | CHAR_SYMBOL;
+    }
+    char_class['+'] |= CHAR_SYMBOL;
+    char_class['-'] |= CHAR_SYMBOL;
+    for (c = 0; " \t\n\v\f\r"[c] != '\0'; c++) {
+        char_class[(unsigned char)" \t\n\v\f\r"[c]] |=
+            CHAR_SPACE | CHAR_DELIMITER;
+    }
+    char_class['('] |= CHAR_DELIMITER;
+    char_class[')'] |= CHAR_DELIMITER;
+    char_class['"'] |= CHAR_DELIMITER;
+    char_class[';'] |= CHAR_DELIMITER;
+}
+
 char is_delimiter(int c) {
-    return isspace(c) || c == EOF ||
-        c == '(' || c == ')' ||
-        c == '"' || c == ';';
+    return c == EOF || (char_class[(unsigned char)c] & CHAR_DELIMITER);
 }
 
 char is_initial(int c) {
-    return isalpha(c) || c == '*' || c == '/' || c == '>' ||
-        c == '<' || c == '=' || c == '?' || c == '!';
+    return c != EOF && (char_class[(unsigned char)c] & CHAR_INITIAL);
 }
 
-int peek(FILE* in) {
-    int c;
-
-    c = getc(in);
-    ungetc(c, in);
-    return c;
+char is_digit(int c) {
+    return c != EOF && (char_class[(unsigned char)c] & CHAR_DIGIT);
 }
 
-void eat_whitespace(FILE* in) {
-    int c;
+/* skips whitespace and comments a buffer at a time */
+void eat_whitespace(reader* in) {
+    unsigned char* p;
+    unsigned char* end;
+    char comment;
 
-    while ((c = getc(in)) != EOF) {
-        if (isspace(c)) {
-            continue;
+    comment = 0;
+    while (in->pos < in->end || reader_fill(in) > 0) {
+        p = in->buf + in->pos;
+        end = in->buf + in->end;
+        while (p < end) {
+            if (comment) { /* comments are whitespace also */
+                p = memchr(p, '\n', end - p);
+                if (p == NULL) {
+                    p = end;
+                    break;
+                }
+                comment = 0;
+            }
+            else if (*p == ';') {
+                comment = 1;
+            }
+            else if (!(char_class[*p] & CHAR_SPACE)) {
+                break;
+            }
+            p++;
         }
-        else if (c == ';') { /* comments are whitespace also */
-            while (((c = getc(in)) != EOF) && (c != '\n'));
-            continue;
+        in->pos = p - in->buf;
+        if (p < end) {
+            return;
         }
-        ungetc(c, in);
-        break;
     }
 }
 
-void eat_expected_string(FILE* in, char* str) {
+void eat_expected_string(reader* in, char* str) {
     int c;
 
     while (*str != '\0') {
-        c = getc(in);
+        c = next_char(in);
         if (c != *str) {
-            fprintf(stderr, "unexpected character '%c'\n", c);
+            diagnostic("unexpected character '%c'\n", c);
             exit(1);
         }
         str++;
     }
 }
 
-void peek_expected_delimiter(FILE* in) {
+void peek_expected_delimiter(reader* in) {
     if (!is_delimiter(peek(in))) {
-        fprintf(stderr, "character not followed by delimiter\n");
+        diagnostic("character not followed by delimiter\n");
         exit(1);
     }
 }
 
-object* read_character(FILE* in) {
+object* read_character(reader* in) {
     int c;
 
-    c = getc(in);
+    c = next_char(in);
     switch (c) {
     case EOF:
-        fprintf(stderr, "incomplete character literal\n");
+        diagnostic("incomplete character literal\n");
         exit(1);
     case 's':
         if (peek(in) == 'p') {
@@ -1546,69 +11582,65 @@ object* read_character(FILE* in) {
     return make_character(c);
 }
 
-object* read_number(FILE* in) {
-    int c;
-    short sign = 1;
-    short isflo = 0;
-    short mant_length = 1;
-    double mant = 0.0;
-    double dnum = 0.0;
-    long num = 0;
+/* reads the rest of a token that starts with c */
+void read_token(reader* in, int c, char* buffer, int size) {
+    unsigned char* p;
+    unsigned char* end;
+    int i = 0;
 
-    c = getc(in);
-    
-    /* read a fixnum */
-    if (c == '-') {
-        sign = -1;
-    }
-    else {
-        ungetc(c, in);
-    }
-    while (isdigit(c = getc(in))) {
-        num = (num * 10) + (c - '0');
+    if (is_delimiter(c)) {
+        unread_char(in, c);
+        buffer[0] = '\0';
+        return;
     }
-
-    if (c == '.') {
-        /* flonum */
-        while (isdigit(c = getc(in))) {
-            double m = (double)(c)-'0';
-            mant += m / pow(10.0, mant_length);
-            mant_length++;
+    buffer[i++] = (char)c;
+    do {
+        p = in->buf + in->pos;
+        end = in->buf + in->end;
+        while (p < end && !(char_class[*p] & CHAR_DELIMITER)) {
+            if (i == size - 1) {
+                diagnostic("*** token too long. "
+                    "Maximum length is %d\n", BUFFER_MAX);
+                exit(1);
+            }
+            buffer[i++] = (char)*p++;
         }
-        isflo = 1;
-        dnum = sign * ((double)num + mant);
-    }
+        in->pos = p - in->buf;
+    } while (p == end && reader_fill(in) > 0);
+    buffer[i] = '\0';
+}
 
-    num *= sign;
+object* number_literal(char* buffer) {
+    object* num;
 
-    if (is_delimiter(c)) {
-        ungetc(c, in);
-        if (isflo) {
-            return make_flonum(dnum);
-        }
-        else {
-            return make_fixnum(num);
-        }
-    }
-    else {
-        fprintf(stderr, "number not followed by delimiter\n");
+    num = parse_number(buffer, 10);
+    if (num == NULL) {
+        diagnostic("*** bad number literal \"%s\"\n", buffer);
         exit(1);
     }
+    return num;
+}
+
+object* read_number(reader* in, int c) {
+    char buffer[BUFFER_MAX];
+
+    read_token(in, c, buffer, BUFFER_MAX);
+    return number_literal(buffer);
 }
 
-object* read_complex(FILE* in) {
+object* read_complex(reader* in) {
     int c;
     object* num;
     double re;
     double im;
 
-    c = getc(in);
+    c = next_char(in);
     if (c == '(') {
         /* Complex number */
         eat_whitespace(in);
-        if (isdigit(peek(in))) {
-            num = alloc_object();
-            num = read_number(in);
+        c = next_char(in);
+        if (c != ')' && c != EOF) {
+            num = read_number(in, c);
             if (num->type == FIXNUM) {
                 re = (double)num->data.fixnum.value;
             }
@@ -1616,229 +11648,515 @@ object* read_complex(FILE* in) {
                 re = num->data.flonum.value;
             }
             else {
-                fprintf(stderr, "*** invalid number type for real part\n");
+                diagnostic("*** invalid number type for real part\n");
                 exit(1);
             }
         }
         else {
-            fprintf(stderr, "*** there must be a real part\n");
+            diagnostic("*** there must be a real part\n");
             exit(1);
         }
         eat_whitespace(in);
-        if (isdigit(peek(in))) {
-            num = alloc_object();
-            num = read_number(in);
+        c = next_char(in);
+        if (c != ')' && c != EOF) {
+            num = read_number(in, c);
             if (num->type == FIXNUM) {
                 im = (double)num->data.fixnum.value;
             }
-            else if (num->type == FLONUM) {
-                im = num->data.flonum.value;
+            else if (num->type == FLONUM) {
+                im = num->data.flonum.value;
+            }
+            else {
+                diagnostic("*** invalid number type for imaginary part\n");
+                exit(1);
+            }
+        }
+        else {
+            diagnostic("*** invalid complex number. No imaginary part\n");
+            exit(1);
+        }
+        c = next_char(in);
+        if (c != ')') {
+            diagnostic("*** missing parens closing the complex number\n");
+            exit(1);
+        }
+    }
+    else {
+        diagnostic("*** invalid complex number\n");
+        exit(1);
+    }
+    return make_cpxnum(re, im);
+}
+
+#define READ_DEPTH_MAX 10000       /* deepest nesting of data read */
+
+/* an open list, vector, quotation or labelled datum while a datum
+ * is read */
+typedef enum {
+    READ_LIST, READ_VECTOR, READ_BYTEVECTOR, READ_QUOTE, READ_LABEL
+} read_kind;
+
+typedef struct read_level {
+    read_kind kind;
+    object* head;
+    object* tail;   /* last pair, so items are appended in place */
+    int base;       /* VM stack size when the level opened */
+    char dotted;    /* 1 after the dot, 2 once the cdr is read */
+    long label;     /* the n of #n= */
+} read_level;
+
+read_level* read_levels = NULL;
+int read_levels_capacity = 0;
+
+/* datum labels #n= and #n# of the datum being read. A reference made
+ * before its datum is complete gets a placeholder, which is patched
+ * out once the datum is done. */
+#define READ_LABEL_MAX 1000000
+
+typedef struct read_label {
+    object* value;        /* NULL until the datum is complete */
+    object* placeholder;  /* outside the heap, created on first use */
+    char open;            /* between #n= and the end of its datum */
+} read_label;
+
+read_label* read_labels = NULL;
+long read_labels_capacity = 0;
+long read_labels_used = 0;
+
+read_label* find_read_label(long n) {
+    long capacity;
+
+    if (n >= read_labels_capacity) {
+        capacity = (read_labels_capacity == 0) ? 16 : read_labels_capacity;
+        while (capacity <= n) {
+            capacity *= 2;
+        }
+        read_labels = realloc(read_labels, capacity * sizeof(read_label));
+        if (read_labels == NULL) {
+            diagnostic("*** reader - out of memory\n");
+            exit(1);
+        }
+        memset(read_labels + read_labels_capacity, 0,
+            (capacity - read_labels_capacity) * sizeof(read_label));
+        read_labels_capacity = capacity;
+    }
+    if (n >= read_labels_used) {
+        read_labels_used = n + 1;
+    }
+    return &read_labels[n];
+}
+
+void clear_read_labels(void) {
+    long i;
+
+    for (i = 0; i < read_labels_used; i++) {
+        free(read_labels[i].placeholder);
+        read_labels[i].placeholder = NULL;
+        read_labels[i].value = NULL;
+        read_labels[i].open = 0;
+    }
+    read_labels_used = 0;
+}
+
+/* the value of #n#, or the placeholder of a datum still being read */
+object* read_label_reference(long n) {
+    read_label* label;
+
+    label = (n < read_labels_used) ? &read_labels[n] : NULL;
+    if (label != NULL && label->value != NULL) {
+        return label->value;
+    }
+    if (label == NULL || !label->open) {
+        diagnostic("*** undefined datum label #%ld#\n", n);
+        exit(1);
+    }
+    if (label->placeholder == NULL) {
+        label->placeholder = malloc(sizeof(object));
+        if (label->placeholder == NULL) {
+            diagnostic("*** reader - out of memory\n");
+            exit(1);
+        }
+        /* marked, so the collector passes it by */
+        label->placeholder->type = EOF_OBJECT;
+        label->placeholder->marked = 1;
+        label->placeholder->next = NULL;
+    }
+    return label->placeholder;
+}
+
+/* replaces placeholder by value in the pairs and vectors of value */
+void patch_read_label(object* placeholder, object* value) {
+    object_table seen;
+    object** stack;
+    object* obj;
+    long capacity;
+    long need;
+    long top;
+    long i;
+    char added;
+
+    if (value == placeholder) {
+        diagnostic("*** datum label refers to itself\n");
+        exit(1);
+    }
+    object_table_init(&seen);
+    capacity = 64;
+    stack = malloc(capacity * sizeof(object*));
+    if (stack == NULL) {
+        diagnostic("*** reader - out of memory\n");
+        exit(1);
+    }
+    top = 0;
+    stack[top++] = value;
+    while (top > 0) {
+        obj = stack[--top];
+        if (obj->type != PAIR && obj->type != VECTOR) {
+            continue;
+        }
+        object_table_find(&seen, obj, &added);
+        if (!added) {
+            continue;
+        }
+        need = (obj->type == PAIR) ? 2 : obj->data.vector.length;
+        if (top + need > capacity) {
+            while (top + need > capacity) {
+                capacity *= 2;
+            }
+            stack = realloc(stack, capacity * sizeof(object*));
+            if (stack == NULL) {
+                diagnostic("*** reader - out of memory\n");
+                exit(1);
+            }
+        }
+        if (obj->type == PAIR) {
+            if (obj->data.pair.car == placeholder) {
+                obj->data.pair.car = value;
+            }
+            if (obj->data.pair.cdr == placeholder) {
+                obj->data.pair.cdr = value;
+            }
+            stack[top++] = obj->data.pair.cdr;
+            stack[top++] = obj->data.pair.car;
+        }
+        else {
+            for (i = 0; i < obj->data.vector.length; i++) {
+                if (obj->data.vector.items[i] == placeholder) {
+                    obj->data.vector.items[i] = value;
+                }
+                stack[top++] = obj->data.vector.items[i];
+            }
+        }
+    }
+    free(stack);
+    object_table_free(&seen);
+}
+
+/* reads the n of #n= or #n# after the first digit c */
+long read_label_number(reader* in, int c) {
+    long n;
+
+    n = 0;
+    while (is_digit(c)) {
+        n = n * 10 + (c - '0');
+        if (n > READ_LABEL_MAX) {
+            diagnostic("*** datum label too large\n");
+            exit(1);
+        }
+        c = next_char(in);
+    }
+    unread_char(in, c);
+    return n;
+}
+
+object* read_hash_literal(reader* in, int c) {
+    char buffer[BUFFER_MAX];
+
+    switch (c) {
+    case 't':
+        return true;
+    case 'f':
+        return false;
+    case '\\':
+        return read_character(in);
+    case 'c': /* LISP STYLE: not so SCHEME */
+    case 'C':
+        return read_complex(in);
+    case 'x': case 'X': case 'b': case 'B':
+    case 'o': case 'O': case 'd': case 'D':
+    case 'e': case 'E': case 'i': case 'I':
+        /* radix and exactness prefixes */
+        buffer[0] = '#';
+        buffer[1] = (char)c;
+        read_token(in, next_char(in), buffer + 2, BUFFER_MAX - 2);
+        return number_literal(buffer);
+    default:
+        diagnostic("unknown boolean or character literal\n");
+        exit(1);
+    }
+}
+
+/* reads a number, symbol or string that starts with c */
+object* read_atom(reader* in, int c) {
+    unsigned char* p;
+    unsigned char* end;
+    strbuf text;
+    object* result;
+
+    /* a sign then a dot can only begin a number such as -.5, since a
+     * dot does not go in symbols */
+    if (is_digit(c) ||
+        ((c == '-' || c == '+' || c == '.') && is_digit(peek(in))) ||
+        ((c == '-' || c == '+') &&
+            (peek(in) == 'i' || peek(in) == 'n' || peek(in) == '.'))) {
+        return read_number(in, c);
+    }
+    else if (is_initial(c) ||
+        ((c == '+' || c == '-') &&
+            is_delimiter(peek(in)))) {
+        /* reading a symbol */
+        strbuf_init(&text);
+        strbuf_add_char(&text, (char)c);
+        do {
+            p = in->buf + in->pos;
+            end = in->buf + in->end;
+            while (p < end && (char_class[*p] & CHAR_SYMBOL)) {
+                p++;
+            }
+            strbuf_add(&text, (char*)in->buf + in->pos,
+                (long)(p - (in->buf + in->pos)));
+            in->pos = p - in->buf;
+        } while (p == end && reader_fill(in) > 0);
+        c = peek(in);
+        if (is_delimiter(c)) {
+            result = make_symbol(text.data);
+            free(text.data);
+            return result;
+        }
+        else {
+            diagnostic("*** symbol not followed by delimiter. "
+                "Found '%c'\n", c);
+            exit(1);
+        }
+    }
+    else if (c == '"') {
+        /* read string, copying the runs between escapes whole */
+        strbuf_init(&text);
+        strbuf_reserve(&text, 0);
+        while (1) {
+            if (in->pos == in->end && reader_fill(in) == 0) {
+                diagnostic("*** non-terminated string literal\n");
+                exit(1);
+            }
+            p = in->buf + in->pos;
+            end = in->buf + in->end;
+            while (p < end && *p != '"' && *p != '\\') {
+                p++;
+            }
+            strbuf_add(&text, (char*)in->buf + in->pos,
+                (long)(p - (in->buf + in->pos)));
+            in->pos = p - in->buf;
+            if (p == end) {
+                continue;
+            }
+            if (next_char(in) == '"') {
+                break;
             }
-            else {
-                fprintf(stderr, "*** invalid number type for imaginary part\n");
+            c = next_char(in);
+            if (c == 'n') {
+                c = '\n';
+            }
+            if (c == EOF) {
+                diagnostic("*** non-terminated string literal\n");
                 exit(1);
             }
+            strbuf_add_char(&text, (char)c);
         }
-        else {
-            fprintf(stderr, "*** invalid complex number. No imaginary part\n");
-            exit(1);
-        }
-        c = getc(in);
-        if (c != ')') {
-            fprintf(stderr, "*** missing parens closing the complex number\n");
-            exit(1);
-        }
+        result = make_string_n(text.data, text.length);
+        free(text.data);
+        return result;
     }
     else {
-        fprintf(stderr, "*** invalid complex number\n");
+        diagnostic("bad input. Unexpected '%c'\n", c);
         exit(1);
     }
-    return make_cpxnum(re, im);
+    diagnostic("read illegal state\n");
+    exit(1);
 }
 
-object* read_pair(FILE* in) {
-    int c;
-    object* car_obj;
-    object* cdr_obj;
-
-    eat_whitespace(in);
+void open_read_level(int depth, read_kind kind) {
+    read_level* level;
 
-    c = getc(in);
-    if (c == ')') {
-        /* the nil */
-        return nil;
+    if (depth == READ_DEPTH_MAX) {
+        diagnostic("*** data nested deeper than %d levels\n",
+            READ_DEPTH_MAX);
+        exit(1);
     }
-    ungetc(c, in);
-
-    car_obj = sread(in);
-
-    eat_whitespace(in);
-
-    c = getc(in);
-    if (c == '.') {
-        /* read improper list */
-        c = peek(in);
-        if (!is_delimiter(c)) {
-            fprintf(stderr, "*** do not followed by delimiter\n");
-            exit(1);
-        }
-        cdr_obj = sread(in);
-        eat_whitespace(in);
-        c = getc(in);
-        if (c != ')') {
-            fprintf(stderr, "*** where was the trailing right paren?\n");
+    if (depth == read_levels_capacity) {
+        read_levels_capacity =
+            (read_levels_capacity == 0) ? 64 : read_levels_capacity * 2;
+        read_levels = realloc(read_levels,
+            read_levels_capacity * sizeof(read_level));
+        if (read_levels == NULL) {
+            diagnostic("*** reader - out of memory\n");
             exit(1);
         }
-        return cons(car_obj, cdr_obj);
-    }
-    else {
-        ungetc(c, in);
-        cdr_obj = read_pair(in);
-        return cons(car_obj, cdr_obj);
     }
-}
-
-object* sread(FILE* in) {
+    level = &read_levels[depth];
+    level->kind = kind;
+    level->head = nil;
+    level->tail = nil;
+    level->base = the_vm->stackSize;
+    level->dotted = 0;
+}
+
+/* Reads one datum, or answers NULL at the end of input. Lists are
+ * built front to back through a tail pointer and nesting is kept in
+ * read_levels, so neither long nor deep data use the C stack. Only
+ * the head of each open list stays on the VM stack. */
+object* sread(reader* in) {
+    read_level* level;
+    read_label* label;
+    object* value;
+    object* pair;
+    long n;
+    int depth;
     int c;
-    short sign = 1;
-    short isflo = 0;
-    short mant_length = 1;
-    double mant = 0.0;
-    double dnum = 0.0;
-    long num = 0;
-    char buffer[BUFFER_MAX];
 
-    eat_whitespace(in);
-
-    c = getc(in);
+    depth = 0;
+    while (1) {
+        eat_whitespace(in);
+        c = next_char(in);
+        level = (depth > 0) ? &read_levels[depth - 1] : NULL;
 
-    if (c == '#') { /* read a boolean or character or complex number */
-        c = getc(in);
-        switch (c) {
-        case 't':
-            return true;
-        case 'f':
-            return false;
-        case '\\':
-            return read_character(in);
-        case 'c': /* LISP STYLE: not so SCHEME */
-            return read_complex(in);
-        default:
-            fprintf(stderr,
-                "unknown boolean or character literal\n");
+        if (level != NULL && level->dotted == 2 && c != ')') {
+            diagnostic("*** where was the trailing right paren?\n");
             exit(1);
         }
-    }
-    else if (isdigit(c) || (c == '-' && (isdigit(peek(in))))) {
-        /* read a fixnum */
-        if (c == '-') {
-            sign = -1;
+        if (c == EOF) {
+            if (depth > 0) {
+                diagnostic("*** end of input inside a list\n");
+                exit(1);
+            }
+            return NULL;
         }
-        else {
-            ungetc(c, in);
+        if (c == ')' && level != NULL && level->kind != READ_QUOTE &&
+            level->kind != READ_LABEL) {
+            if (level->dotted == 1) {
+                diagnostic("*** missing the datum after the dot\n");
+                exit(1);
+            }
+            the_vm->stackSize = level->base;
+            value = level->head;
+            push(the_vm, value);
+            if (level->kind == READ_VECTOR) {
+                value = list_to_vector(value);
+            }
+            else if (level->kind == READ_BYTEVECTOR) {
+                value = list_to_bytevector(value);
+            }
+            depth--;
         }
-        while (isdigit(c = getc(in))) {
-            num = (num * 10) + (c - '0');
+        else if (c == '.' && level != NULL && level->kind == READ_LIST &&
+            level->dotted == 0 && !is_nil(level->head) &&
+            is_delimiter(peek(in))) {
+            /* read improper list */
+            level->dotted = 1;
+            continue;
         }
-        
-        if (c == '.') {
-            /* flonum */
-            while (isdigit(c = getc(in))) {
-                double m = (double)(c) - '0';
-                mant += m / pow(10.0,mant_length);
-                mant_length++;
-            }
-            isflo = 1;
-            dnum = sign * ((double)num + mant);
+        else if (c == '(') {
+            open_read_level(depth++, READ_LIST);
+            continue;
         }
-
-        num *= sign;
-
-        if (is_delimiter(c)) {
-            ungetc(c, in);
-            if (isflo) {
-                return make_flonum(dnum);
+        else if (c == '\'') {
+            open_read_level(depth++, READ_QUOTE);
+            continue;
+        }
+        else if (c == '#') {
+            c = next_char(in);
+            if (c == '(') {
+                open_read_level(depth++, READ_VECTOR);
+                continue;
+            }
+            if (c == 'u') {
+                if (next_char(in) != '8' || next_char(in) != '(') {
+                    diagnostic("*** expected #u8( bytevector literal\n");
+                    exit(1);
+                }
+                open_read_level(depth++, READ_BYTEVECTOR);
+                continue;
+            }
+            if (is_digit(c)) {
+                n = read_label_number(in, c);
+                c = next_char(in);
+                if (c == '=') {
+                    if (n < read_labels_used && (read_labels[n].open ||
+                        read_labels[n].value != NULL)) {
+                        diagnostic("*** datum label #%ld= defined "
+                            "twice\n", n);
+                        exit(1);
+                    }
+                    find_read_label(n)->open = 1;
+                    open_read_level(depth++, READ_LABEL);
+                    read_levels[depth - 1].label = n;
+                    continue;
+                }
+                if (c != '#') {
+                    diagnostic("*** expected = or # after #%ld\n", n);
+                    exit(1);
+                }
+                value = read_label_reference(n);
             }
             else {
-                return make_fixnum(num);
+                value = read_hash_literal(in, c);
             }
         }
         else {
-            fprintf(stderr, "number not followed by delimiter\n");
-            exit(1);
+            value = read_atom(in, c);
         }
-    }
-    else if (is_initial(c) ||
-        ((c == '+' || c == '-') &&
-            is_delimiter(peek(in)))) {
-        /* reading a symbol */
-        int i = 0;
-        while (is_initial(c) || isdigit(c) ||
-            c == '+' || c == '-') {
-            if (i < BUFFER_MAX - 1) {
-                buffer[i++] = c;
+
+        /* hand the datum to the levels it completes */
+        while (depth > 0 && (read_levels[depth - 1].kind == READ_QUOTE ||
+            read_levels[depth - 1].kind == READ_LABEL)) {
+            level = &read_levels[--depth];
+            if (level->kind == READ_QUOTE) {
+                value = cons(quote_symbol, cons(value, nil));
             }
             else {
-                fprintf(stderr, "*** symbol too long. "
-                    "Maximum length is %d\n", BUFFER_MAX);
-                exit(1);
+                label = &read_labels[level->label];
+                if (label->placeholder != NULL) {
+                    patch_read_label(label->placeholder, value);
+                }
+                label->value = value;
+                label->open = 0;
             }
-            c = getc(in);
+            the_vm->stackSize = level->base;
+            push(the_vm, value);
         }
-        if (is_delimiter(c)) {
-            buffer[i] = '\0';
-            ungetc(c, in);
-            return make_symbol(buffer);
+        if (depth == 0) {
+            if (read_labels_used > 0) {
+                clear_read_labels();
+            }
+            return value;
         }
-        else {
-            fprintf(stderr, "*** symbol not followed by delimiter. "
-                "Found '%c'\n", c);
-            exit(1);
+        level = &read_levels[depth - 1];
+        if (level->dotted == 1) {
+            level->tail->data.pair.cdr = value;
+            level->dotted = 2;
         }
-    }
-    else if (c == '"') {
-        /* read string */
-        int i = 0;
-        while ((c = getc(in)) != '"') {
-            if (c == '\\') {
-                c = getc(in);
-                if (c == 'n') {
-                    c = '\n';
-                }
-            }
-            if (c == EOF) {
-                fprintf(stderr, "*** non-terminated string literal\n");
-                exit(1);
-            }
-            /* save space for string terminator */
-            if (i < BUFFER_MAX - 1) {
-                buffer[i++] = c;
+        else {
+            pair = cons(value, nil);
+            if (is_nil(level->head)) {
+                level->head = pair;
             }
             else {
-                fprintf(stderr,
-                    "*** string too long. Maximum length is %d\n",
-                    BUFFER_MAX);
-                exit(1);
+                level->tail->data.pair.cdr = pair;
             }
+            level->tail = pair;
         }
-        buffer[i] = '\0';
-        return make_string(buffer);
-    }
-    else if (c == '(') {
-        return read_pair(in);
+        /* everything read so far is reachable from the head */
+        the_vm->stackSize = level->base;
+        push(the_vm, level->head);
     }
-    else if (c == '\'') {
-        return cons(quote_symbol, cons(sread(in), nil));
-    }
-    else if (c == EOF) {
-        return NULL;
-    }
-    else {
-        fprintf(stderr, "bad input. Unexpected '%c'\n", c);
-        exit(1);
-    }
-    fprintf(stderr, "read illegal state\n");
-    exit(1);
 }
 
 /*************************** EVALUATE ****************************/
@@ -1849,7 +12167,9 @@ char is_self_eval(object* exp) {
         is_flonum(exp) ||
         is_cpxnum(exp) ||
         is_character(exp) ||
-        is_string(exp);
+        is_string(exp) ||
+        is_vector(exp) ||
+        is_bytevector(exp);
 }
 
 char is_variable(object* exp) {
@@ -2020,7 +12340,7 @@ object* expand_clauses(object* clauses) {
                 return sequence_to_exp(cond_actions(first));
             }
             else {
-                fprintf(stderr, "*** else clause isn't last cond->if");
+                diagnostic("*** else clause isn't last cond->if");
                 exit(1);
             }
         }
@@ -2183,13 +12503,99 @@ object* eval_def(object* exp, object* env) {
     return ok_symbol;
 }
 
-/* Tail call recursion */
-object* eval(object* exp, object* env) {
+char is_record_definition(object* exp) {
+    return is_tagged_list(exp, define_record_type_symbol);
+}
+
+/* (define-record-type name (constructor field ...) predicate
+ *     (field accessor [modifier]) ...) */
+object* eval_define_record_type(object* exp, object* env) {
+    object* name;
+    object* spec;
+    object* clauses;
+    object* fields = nil;
+    object* rtd;
+    object* slots;
+    object* f;
+    long i;
+
+    name = cadr(exp);
+    if (is_pair(name)) {
+        name = car(name);
+    }
+    clauses = cddddr(exp);
+    for (f = clauses; !is_nil(f); f = cdr(f)) {
+        fields = cons(caar(f), fields);
+    }
+    rtd = make_record_type(name, reverse_proc(cons(fields, nil)));
+    define_var(name, rtd, env);
+
+    spec = caddr(exp);
+    if (is_pair(spec)) {
+        i = 0;
+        for (f = cdr(spec); !is_nil(f); f = cdr(f)) {
+            i++;
+        }
+        slots = make_vector(i, nil);
+        for (i = 0, f = cdr(spec); !is_nil(f); i++, f = cdr(f)) {
+            slots->data.vector.items[i] =
+                make_fixnum(record_field_slot(rtd, car(f)));
+        }
+        define_var(car(spec),
+            make_record_proc(RECORD_CONSTRUCTOR, rtd, 0, slots), env);
+    }
+    define_var(cadddr(exp),
+        make_record_proc(RECORD_PREDICATE, rtd, 0, nil), env);
+    for (i = 0; !is_nil(clauses); i++, clauses = cdr(clauses)) {
+        if (!is_nil(cdar(clauses))) {
+            define_var(cadar(clauses),
+                make_record_proc(RECORD_ACCESSOR, rtd, i, nil), env);
+            if (!is_nil(cddar(clauses))) {
+                define_var(caddar(clauses),
+                    make_record_proc(RECORD_MODIFIER, rtd, i, nil), env);
+            }
+        }
+    }
+    return ok_symbol;
+}
+
+char is_delay(object* exp) {
+    return is_tagged_list(exp, delay_symbol);
+}
+
+char is_delay_force(object* exp) {
+    return is_tagged_list(exp, delay_force_symbol);
+}
+
+char is_stream_cons(object* exp) {
+    return is_tagged_list(exp, stream_cons_symbol);
+}
+
+/* (stream-cons first rest) delays both; rest must give a stream */
+object* eval_stream_cons(object* exp, object* env) {
+    return make_promise(PROMISE_DONE,
+        cons(make_promise(PROMISE_DELAY, cadr(exp), env, NULL),
+            make_promise(PROMISE_DELAY_FORCE, caddr(exp), env, NULL)),
+        NULL, NULL);
+}
+
+/*
+ * Tail call recursion. Everything a call of eval allocates stays on
+ * the VM stack until it returns, except that a tail call drops all
+ * but the next expression and environment, and a primitive is called
+ * with only itself and its arguments kept; the result is pushed on
+ * the caller's part of the stack.
+ */
+object* eval_in_frame(object* exp, object* env, int frame) {
     object* proc;
     object* args;
     object* result;
+    char fresh;
 
 tailcall:
+    the_vm->stackSize = frame;
+    push(the_vm, exp);
+    push(the_vm, env);
     if (is_self_eval(exp)) {
         return exp;
     }
@@ -2205,6 +12611,18 @@ tailcall:
     else if (is_definition(exp)) {
         return eval_def(exp, env);
     }
+    else if (is_record_definition(exp)) {
+        return eval_define_record_type(exp, env);
+    }
+    else if (is_delay(exp)) {
+        return make_promise(PROMISE_DELAY, cadr(exp), env, NULL);
+    }
+    else if (is_delay_force(exp)) {
+        return make_promise(PROMISE_DELAY_FORCE, cadr(exp), env, NULL);
+    }
+    else if (is_stream_cons(exp)) {
+        return eval_stream_cons(exp, env);
+    }
     else if (is_if(exp)) {
         exp = is_true(eval(if_pred(exp), env)) ?
             if_cons(exp) :
@@ -2264,7 +12682,35 @@ tailcall:
     }
     else if (is_application(exp)) {
         proc = eval(operator(exp), env);
+
+        /* typed arithmetic runs in place, without an argument list */
+        /* so do record field reads */
+        if (is_record_procedure(proc) &&
+            proc->data.record_proc.kind == RECORD_ACCESSOR &&
+            is_pair(operands(exp)) && is_nil(rest_operands(operands(exp)))) {
+            result = record_argument(proc,
+                eval(first_operand(operands(exp)), env));
+            return result->data.record.slots[proc->data.record_proc.slot];
+        }
+        if (is_primitive(proc) && proc->data.primitive_proc.inline_op &&
+            !is_no_operands(operands(exp))) {
+            args = operands(exp);
+            if (proc->data.primitive_proc.inline_op == FL_SQRT) {
+                if (is_nil(rest_operands(args))) {
+                    result = eval(first_operand(args), env);
+                    return typed_arith(FL_SQRT, result, result);
+                }
+            }
+            else if (!is_nil(rest_operands(args)) &&
+                is_nil(rest_operands(rest_operands(args)))) {
+                result = eval(first_operand(args), env);
+                return typed_arith(proc->data.primitive_proc.inline_op,
+                    result, eval(first_operand(rest_operands(args)), env));
+            }
+        }
+
         args = list_of_values(operands(exp), env);
+        fresh = 1;
 
         /* handle eval specially for tail call requirement */
         if (is_primitive(proc) &&
@@ -2279,11 +12725,19 @@ tailcall:
             proc->data.primitive_proc.fn == apply_proc) {
             proc = apply_operator(args);
             args = apply_operands(args);
+            fresh = 0;
         }
         
         if (is_primitive(proc)) {
+            the_vm->stackSize = frame;
+            push(the_vm, proc);
+            push(the_vm, args);
+            fresh_arguments = fresh;
             return (proc->data.primitive_proc.fn)(args);
         }
+        else if (is_record_procedure(proc)) {
+            return apply_record_proc(proc, args);
+        }
         else if (is_compound_proc(proc)) {
             env = extend_env(proc->data.compound_proc.params,
                 args,
@@ -2293,146 +12747,535 @@ tailcall:
         }
     }
     else {
-        fprintf(stderr, "*** cannot eval unknown expression type\n");
+        diagnostic("*** cannot eval unknown expression type\n");
         exit(1);
     }
-    fprintf(stderr, "*** eval illegal state\n");
+    diagnostic("*** eval illegal state\n");
+    exit(1);
+}
+
+object* eval(object* exp, object* env) {
+    object* result;
+    int frame;
+
+    frame = the_vm->stackSize;
+    result = eval_in_frame(exp, env, frame);
+    the_vm->stackSize = frame;
+    push(the_vm, result);
+    return result;
+}
+
+/* applies proc to an evaluated argument list from C code */
+object* apply_procedure(object* proc, object* args) {
+    if (is_primitive(proc)) {
+        if (proc->data.primitive_proc.fn == apply_proc) {
+            return apply_procedure(apply_operator(args),
+                apply_operands(args));
+        }
+        fresh_arguments = 0;
+        return (proc->data.primitive_proc.fn)(args);
+    }
+    else if (is_record_procedure(proc)) {
+        return apply_record_proc(proc, args);
+    }
+    else if (is_compound_proc(proc)) {
+        return eval(make_begin(proc->data.compound_proc.body),
+            extend_env(proc->data.compound_proc.params,
+                args,
+                proc->data.compound_proc.env));
+    }
+    diagnostic("*** cannot apply a non procedure\n");
     exit(1);
 }
 
 /**************************** PRINT ******************************/
 
-void write_pair(FILE* out, object* pair) {
-    object* car_obj;
-    object* cdr_obj;
+/* The printer walks a datum with an explicit stack of tasks, so long
+ * and deep structure does not use the C stack. write first marks the
+ * pairs and vectors that close a cycle, write-shared every one met
+ * twice; those print with a datum label #n= and are referred to as
+ * #n# after. write-simple skips the pass. */
 
-    car_obj = car(pair);
-    cdr_obj = cdr(pair);
-    swrite(out, car_obj);
-    if (cdr_obj->type == PAIR) { /* nested pairs/lists */
-        fprintf(out, " ");
-        write_pair(out, cdr_obj);
+#define PRINT_STACK_INIT 64
+
+typedef enum {
+    PRINT_OBJECT,  /* print obj */
+    PRINT_REST,    /* print the rest of a list from obj */
+    PRINT_ITEM,    /* print vector obj from index */
+    PRINT_CLOSE,   /* the closing paren, or leaving obj when marking */
+} print_kind;
+
+typedef struct print_task {
+    print_kind kind;
+    object* obj;
+    long index;
+} print_task;
+
+/* the bits of an object's value in the label table; the label itself
+ * is kept above them, plus one */
+#define PRINT_OPEN   1  /* being walked, meeting it again is a cycle */
+#define PRINT_DONE   2
+#define PRINT_WANTED 4  /* prints with a label */
+#define PRINT_LABEL_SHIFT 3
+
+typedef struct print_stack {
+    print_task local[PRINT_STACK_INIT];
+    print_task* tasks;
+    long capacity;
+    long top;
+} print_stack;
+
+void print_stack_init(print_stack* stack) {
+    stack->tasks = stack->local;
+    stack->capacity = PRINT_STACK_INIT;
+    stack->top = 0;
+}
+
+void print_stack_free(print_stack* stack) {
+    if (stack->tasks != stack->local) {
+        free(stack->tasks);
     }
-    else if (cdr_obj->type == THE_NIL) {
-        return;
+}
+
+void print_push(print_stack* stack, print_kind kind, object* obj,
+    long index) {
+    print_task* tasks;
+
+    if (stack->top == stack->capacity) {
+        tasks = malloc(stack->capacity * 2 * sizeof(print_task));
+        if (tasks == NULL) {
+            diagnostic("*** write - out of memory\n");
+            exit(1);
+        }
+        memcpy(tasks, stack->tasks, stack->top * sizeof(print_task));
+        print_stack_free(stack);
+        stack->tasks = tasks;
+        stack->capacity *= 2;
     }
-    else {
-        fprintf(out, " . ");
-        swrite(out, cdr_obj);
+    stack->tasks[stack->top].kind = kind;
+    stack->tasks[stack->top].obj = obj;
+    stack->tasks[stack->top++].index = index;
+}
+
+char is_labelable(object* obj) {
+    return obj->type == PAIR ||
+        (obj->type == VECTOR && obj->data.vector.length > 0);
+}
+
+/* marks in labels what needs a datum label, answering 0 if nothing */
+char find_labels(object_table* labels, object* obj, label_mode mode) {
+    print_stack stack;
+    print_task task;
+    long* value;
+    long i;
+    char added;
+    char any;
+
+    any = 0;
+    print_stack_init(&stack);
+    print_push(&stack, PRINT_OBJECT, obj, 0);
+    while (stack.top > 0) {
+        task = stack.tasks[--stack.top];
+        if (task.kind == PRINT_CLOSE) {
+            value = object_table_find(labels, task.obj, &added);
+            *value = (*value & ~PRINT_OPEN) | PRINT_DONE;
+            continue;
+        }
+        obj = task.obj;
+        if (!is_labelable(obj)) {
+            continue;
+        }
+        value = object_table_find(labels, obj, &added);
+        if (!added) {
+            if ((*value & PRINT_OPEN) || mode == LABEL_SHARED) {
+                *value |= PRINT_WANTED;
+                any = 1;
+            }
+            continue;
+        }
+        *value = PRINT_OPEN;
+        print_push(&stack, PRINT_CLOSE, obj, 0);
+        if (obj->type == PAIR) {
+            print_push(&stack, PRINT_OBJECT, obj->data.pair.cdr, 0);
+            print_push(&stack, PRINT_OBJECT, obj->data.pair.car, 0);
+        }
+        else {
+            for (i = obj->data.vector.length - 1; i >= 0; i--) {
+                print_push(&stack, PRINT_OBJECT,
+                    obj->data.vector.items[i], 0);
+            }
+        }
+    }
+    print_stack_free(&stack);
+    return any;
+}
+
+/* answers the slot of obj if it prints with a label */
+long* wanted_label(object_table* labels, object* obj) {
+    long* value;
+    char added;
+
+    if (labels == NULL || !is_labelable(obj)) {
+        return NULL;
+    }
+    value = object_table_find(labels, obj, &added);
+    return (*value & PRINT_WANTED) ? value : NULL;
+}
+
+void write_atom(writer* out, object* obj);
+
+void write_datum(writer* out, object* obj, label_mode mode) {
+    object_table table;
+    object_table* labels;
+    print_stack stack;
+    print_task task;
+    long* value;
+    long next_label;
+
+    object_table_init(&table);
+    labels = NULL;
+    if (mode != LABEL_NONE && is_labelable(obj) &&
+        find_labels(&table, obj, mode)) {
+        labels = &table;
+    }
+    next_label = 0;
+    print_stack_init(&stack);
+    print_push(&stack, PRINT_OBJECT, obj, 0);
+    while (stack.top > 0) {
+        task = stack.tasks[--stack.top];
+        obj = task.obj;
+        switch (task.kind) {
+        case PRINT_OBJECT:
+            value = wanted_label(labels, obj);
+            if (value != NULL) {
+                if ((*value >> PRINT_LABEL_SHIFT) > 0) {
+                    writer_printf(out, "#%ld#",
+                        (*value >> PRINT_LABEL_SHIFT) - 1);
+                    break;
+                }
+                *value |= (next_label + 1) << PRINT_LABEL_SHIFT;
+                writer_printf(out, "#%ld=", next_label++);
+            }
+            if (obj->type == PAIR) {
+                writer_putc(out, '(');
+                print_push(&stack, PRINT_CLOSE, obj, 0);
+                print_push(&stack, PRINT_REST, obj->data.pair.cdr, 0);
+                print_push(&stack, PRINT_OBJECT, obj->data.pair.car, 0);
+            }
+            else if (obj->type == VECTOR) {
+                writer_puts(out, "#(");
+                print_push(&stack, PRINT_CLOSE, obj, 0);
+                print_push(&stack, PRINT_ITEM, obj, 0);
+            }
+            else {
+                write_atom(out, obj);
+            }
+            break;
+        case PRINT_REST:
+            if (is_nil(obj)) {
+                break;
+            }
+            if (obj->type == PAIR && wanted_label(labels, obj) == NULL) {
+                writer_putc(out, ' ');
+                print_push(&stack, PRINT_REST, obj->data.pair.cdr, 0);
+                print_push(&stack, PRINT_OBJECT, obj->data.pair.car, 0);
+            }
+            else {
+                writer_puts(out, " . ");
+                print_push(&stack, PRINT_OBJECT, obj, 0);
+            }
+            break;
+        case PRINT_ITEM:
+            if (task.index < obj->data.vector.length) {
+                if (task.index > 0) {
+                    writer_putc(out, ' ');
+                }
+                print_push(&stack, PRINT_ITEM, obj, task.index + 1);
+                print_push(&stack, PRINT_OBJECT,
+                    obj->data.vector.items[task.index], 0);
+            }
+            break;
+        case PRINT_CLOSE:
+            writer_putc(out, ')');
+            break;
+        }
     }
+    print_stack_free(&stack);
+    object_table_free(&table);
 }
 
-void swrite(FILE* out, object* obj) {
+void swrite(writer* out, object* obj) {
+    write_datum(out, obj, LABEL_CYCLES);
+}
+
+/* writes the objects that hold no other data to print */
+void write_atom(writer* out, object* obj) {
     char c;
     char* str;
+    char* escape;
+    char buffer[NUMBER_BUFFER_MAX];
+    long start;
+    long i;
 
     switch (obj->type) {
     case THE_NIL:
-        fprintf(out, "()");
+        writer_puts(out, "()");
         break;
     case BOOLEAN:
-        fprintf(out, "#%c", is_false(obj) ? 'f' : 't');
+        writer_puts(out, is_false(obj) ? "#f" : "#t");
         break;
     case SYMBOL:
-        fprintf(out, "%s", obj->data.symbol.value);
+        writer_puts(out, obj->data.symbol.value);
         break;
     case FIXNUM:
-        fprintf(out, "%ld", obj->data.fixnum.value);
-        break;
     case FLONUM:
-        fprintf(out, "%lf", obj->data.flonum.value);
-        break;
     case CPXNUM:
-        if (cimag(obj->data.cpxnum.value) == 0.0) {
-            fprintf(out, "%lf", creal(obj->data.cpxnum.value));
-        }
-        else {
-            fprintf(out, "#C(%lf %lf)", creal(obj->data.cpxnum.value),
-                cimag(obj->data.cpxnum.value));
-        }
+        format_number(buffer, obj, 10);
+        writer_puts(out, buffer);
         break;
     case STRING:
+        /* the runs between escaped characters go in whole */
         str = obj->data.string.value;
-        putc('"', out);
-        while (*str != '\0') {
-            switch (*str) {
+        writer_putc(out, '"');
+        start = 0;
+        for (i = 0; i < obj->data.string.length; i++) {
+            switch (str[i]) {
             case '\n':
-                fprintf(out, "\\n");
+                escape = "\\n";
                 break;
             case '\\':
-                fprintf(out, "\\\\");
+                escape = "\\\\";
                 break;
             case '"':
-                fprintf(out, "\\\"");
+                escape = "\\\"";
                 break;
             default:
-                putc(*str, out);
+                continue;
             }
-            str++;
+            writer_write(out, str + start, i - start);
+            writer_puts(out, escape);
+            start = i + 1;
         }
-        putc('"', out);
+        writer_write(out, str + start, i - start);
+        writer_putc(out, '"');
         break;
     case CHARACTER:
         c = obj->data.character.value;
-        fprintf(out, "#\\");
+        writer_puts(out, "#\\");
         switch (c) {
         case '\n':
-            fprintf(out, "newl");
+            writer_puts(out, "newl");
             break;
         case ' ':
-            fprintf(out, "space");
+            writer_puts(out, "space");
             break;
         default:
-            putc(c, out);
+            writer_putc(out, c);
         }
         break;
-    case PAIR:
-        fprintf(out, "(");
-        write_pair(out, obj);
-        fprintf(out, ")");
+    case BYTEVECTOR:
+        writer_puts(out, "#u8(");
+        for (i = 0; i < obj->data.bytevector.length; i++) {
+            writer_printf(out, i > 0 ? " %d" : "%d",
+                obj->data.bytevector.bytes[i]);
+        }
+        writer_putc(out, ')');
         break;
     case COMPOUND_PROC:
-        fprintf(out, "#<comound-procedure: %p>", obj);
+        writer_printf(out, "#<comound-procedure: %p>", obj);
         break;
     case PRIMITIVE_PROC:
-        fprintf(out, "#<primitive-procedure: %p>", obj);
+        writer_printf(out, "#<primitive-procedure: %p>", obj);
         break;
     case INPUT_PORT:
-        fprintf(out, "#<input-port>");
+        writer_puts(out, "#<input-port>");
         break;
     case OUTPUT_PORT:
-        fprintf(out, "#<output-port>");
+        writer_puts(out, "#<output-port>");
         break;
     case EOF_OBJECT:
-        fprintf(out, "#<eof>");
+        writer_puts(out, "#<eof>");
+        break;
+    case MATRIX:
+        writer_printf(out, "#<%smatrix %ldx%ld>",
+            obj->data.matrix.m->is_complex ? "complex-" : "",
+            obj->data.matrix.m->rows, obj->data.matrix.m->cols);
+        break;
+    case BITSET:
+        writer_printf(out, "#<bitset %ld>", obj->data.bitset.nbits);
+        break;
+    case HASH_TABLE:
+        writer_printf(out, "#<hash-table %ld>",
+            obj->data.hash_table.t->count);
+        break;
+    case RECORD_TYPE:
+        writer_printf(out, "#<record-type %s>",
+            obj->data.record_type.name->data.symbol.value);
+        break;
+    case RECORD:
+        writer_printf(out, "#<%s>",
+            obj->data.record.rtd->data.record_type.name->data.symbol.value);
+        break;
+    case RECORD_PROC:
+        writer_printf(out, "#<record-procedure: %p>", obj);
+        break;
+    case PROMISE:
+        writer_puts(out, "#<promise>");
+        break;
+    case PMAP:
+        writer_printf(out, "#<%s%s %ld>",
+            obj->data.pmap.edit ? "transient-" : "",
+            obj->data.pmap.is_set ? "pset" : "pmap", obj->data.pmap.count);
+        break;
+    case STRING_BUILDER:
+        writer_printf(out, "#<string-builder %ld>",
+            obj->data.builder.length);
         break;
     default:
-        fprintf(stderr, "cannot write unknown type\n");
+        diagnostic("cannot write unknown type\n");
         exit(1);
     }
 }
 
 /***************************** REPL ******************************/
 
-int main(void) {
+char stdin_is_terminal(void) {
+#if defined(_MSC_VER)
+    return _isatty(_fileno(stdin)) != 0;
+#elif defined(HAVE_MMAP)
+    return isatty(fileno(stdin)) != 0;
+#else
+    return 1;
+#endif
+}
+
+/* evaluates the expressions of -e in turn */
+void eval_text(char* text) {
+    reader* in;
+    object* exp;
+    int frame;
+
+    in = open_string_reader(text);
+    frame = the_vm->stackSize;
+    while ((exp = sread(in)) != NULL) {
+        eval(exp, the_global);
+        the_vm->stackSize = frame;
+    }
+    release_reader(in);
+    free(in);
+}
+
+void usage(void) {
+    diagnostic("usage: sch [--unsafe] [--image file [--relocate-image]] "
+        "[-i] [-l file] [-e expr] [script [argument ...]]\n");
+    exit(1);
+}
+
+/*
+ * sch runs a script, with the arguments after it for command-line,
+ * or without one a REPL on standard input. -l loads a file and -e
+ * evaluates expressions, in the order given, before either; with -e
+ * and no script there is no REPL. Prompts, echo and collector
+ * messages are only for terminals, or with -i.
+ */
+int main(int argc, char** argv) {
     object* exp;
+    char* image = NULL;
+    char batch = 0;
+    int frame;
+    int first;
+    int i;
+
+    interactive = 0;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        else if (strcmp(argv[i], "--unsafe") == 0) {
+            unsafe_mode = 1;
+        }
+        else if (strcmp(argv[i], "-i") == 0) {
+            interactive = 1;
+        }
+        else if (strcmp(argv[i], "--relocate-image") == 0) {
+            relocate_image = 1;
+        }
+        else if (strcmp(argv[i], "--image") == 0 ||
+                 strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-e") == 0) {
+            if (++i == argc) {
+                usage();
+            }
+            batch |= (strcmp(argv[i - 1], "-e") == 0);
+            if (strcmp(argv[i - 1], "--image") == 0) {
+                image = argv[i];
+            }
+        }
+        else {
+            usage();
+        }
+    }
+    first = i;
+    if (first < argc) {
+        command_argc = argc - first;
+        command_argv = argv + first;
+        batch = 1;
+    }
+    else {
+        command_argc = 1;
+        command_argv = argv;
+    }
+    if (!batch && stdin_is_terminal()) {
+        interactive = 1;
+    }
 
-    printf("Welcome to Bootstrap Scheme. "
-        "Use ctrl-c to exit.\n");
+    init(image);
+    frame = the_vm->stackSize;
 
-    init();
+    for (i = 1; i < first; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            load_file(argv[++i], 1);
+        }
+        else if (strcmp(argv[i], "-e") == 0) {
+            eval_text(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--image") == 0) {
+            i++;
+        }
+        the_vm->stackSize = frame;
+    }
+    if (first < argc) {
+        load_file(argv[first], 0);
+    }
+    if (batch) {
+        return 0;
+    }
 
+    if (interactive) {
+        writer_puts(stdout_writer, "Welcome to Bootstrap Scheme. "
+            "Use ctrl-c to exit.\n");
+    }
     while (1) {
-        printf("> ");
-        exp = sread(stdin);
+        the_vm->stackSize = frame;
+        if (interactive) {
+            writer_puts(stdout_writer, "> ");
+        }
+        exp = sread(stdin_reader);
         if (exp == NULL) {
             break;
         }
-        swrite(stdout, eval(exp, the_global));
-        printf("\n");
+        exp = eval(exp, the_global);
+        if (interactive) {
+            swrite(stdout_writer, exp);
+            writer_putc(stdout_writer, '\n');
+            writer_done(stdout_writer);
+        }
     }
 
-    printf("Goodbye\n");
+    if (interactive) {
+        writer_puts(stdout_writer, "Goodbye\n");
+    }
+    writer_flush(stdout_writer);
 
     return 0;
 }
@@ -0,0 +1,105 @@
+; read-csv-row and csv-fold on quoted fields: delimiters, doubled
+; quotes and line ends inside quotes, CRLF rows, tabs and typed
+; columns. Takes the scratch file to use, /tmp/sch-csv-quoting by
+; default; exits 1 with the row that came back wrong.
+
+(define scratch
+  (if (null? (cdr (command-line)))
+      "/tmp/sch-csv-quoting"
+      (cadr (command-line))))
+
+(define (expect ok what)
+  (if ok
+      #t
+      (begin (write what) (exit 1))))
+
+(define lf (string (integer->char 10)))
+(define crlf (string (integer->char 13) (integer->char 10)))
+(define tab (integer->char 9))
+
+(define (write-text text)
+  (define out (open-binary-output-file scratch))
+  (write-bytevector (string->utf8 text) out)
+  (close-output-port out))
+
+; the rows read from text, with delimiter and types when given
+(define (rows-of text options)
+  (write-text text)
+  (define in (open-input-port scratch))
+  (define rows
+    (apply csv-fold
+           (cons (lambda (row acc) (cons row acc))
+                 (cons '() (cons in options)))))
+  (close-input-port in)
+  (reverse rows))
+
+(define (check text options expected)
+  (define rows (rows-of text options))
+  (expect (equal? rows expected) rows))
+
+(check (string-append "a,b,c" lf "1,,3" lf)
+       '()
+       (list (vector "a" "b" "c") (vector "1" "" "3")))
+
+; delimiters, doubled quotes and line ends inside quotes
+(check (string-append "\"x,y\",\"say \"\"hi\"\"\",\"two" lf "lines\""
+                      lf "\"\",\"\"\"\"" lf)
+       '()
+       (list (vector "x,y" "say \"hi\"" (string-append "two" lf "lines"))
+             (vector "" "\"")))
+
+; CRLF line ends, also inside and right after a quoted field
+(check (string-append "a,\"b\"" crlf "\"c" crlf "d\",e" crlf)
+       '()
+       (list (vector "a" "b") (vector (string-append "c" crlf "d") "e")))
+
+; a blank line is a row without fields, and the last row needs no
+; line end
+(check (string-append "a" lf lf "b")
+       '()
+       (list (vector "a") (vector) (vector "b")))
+
+; a quote inside a plain field is kept
+(check (string-append "ab\"c,d" lf)
+       '()
+       (list (vector "ab\"c" "d")))
+
+; tab separated, commas are plain text
+(check (string-append "a,b" (string tab) "\"c" (string tab) "d\"" lf)
+       (list tab)
+       (list (vector "a,b" (string-append "c" (string tab) "d"))))
+
+; typed columns, an empty typed field is #f
+(check (string-append "x,1,2.5,3" lf "\"y\",-4,,5" lf)
+       (list #\, '(string fixnum flonum number))
+       (list (vector "x" 1 2.5 3) (vector "y" -4 #f 5)))
+
+; fields longer than the scan's 16 bytes, with the delimiter at each
+; offset
+(define (long-rows n acc)
+  (if (= n 0)
+      acc
+      (long-rows (- n 1)
+                 (cons (vector (make-string n #\a) (make-string 17 #\b))
+                       acc))))
+
+(define (long-text rows)
+  (if (null? rows)
+      ""
+      (string-append (vector-ref (car rows) 0) ","
+                     (vector-ref (car rows) 1) lf
+                     (long-text (cdr rows)))))
+
+(define expected (long-rows 40 '()))
+(check (long-text expected) '() expected)
+
+; read-csv-row reads one row at a time and then answers EOF
+(write-text (string-append "1,2" lf "3,4" lf))
+(define in (open-input-port scratch))
+(expect (equal? (read-csv-row in) (vector "1" "2")) 1)
+(expect (equal? (read-csv-row in) (vector "3" "4")) 3)
+(expect (eof-object? (read-csv-row in)) 'eof)
+(close-input-port in)
+
+(write 'ok)
+(exit 0)
@@ -0,0 +1,62 @@
+; fasl-write and fasl-read through a file must give back an equal
+; datum, with shared structure and cycles intact. Takes the scratch
+; file to use, /tmp/sch-fasl-roundtrip by default; exits 1 with the
+; datum that came back wrong.
+
+(define scratch
+  (if (null? (cdr (command-line)))
+      "/tmp/sch-fasl-roundtrip"
+      (cadr (command-line))))
+
+(define (round-trip x)
+  (define out (open-binary-output-file scratch))
+  (fasl-write x out)
+  (close-output-port out)
+  (define in (open-binary-input-file scratch))
+  (define y (fasl-read in))
+  (close-input-port in)
+  y)
+
+(define (expect ok what)
+  (if ok
+      #t
+      (begin (write what) (exit 1))))
+
+(define (check xs)
+  (if (null? xs)
+      #t
+      (begin (expect (equal? (round-trip (car xs)) (car xs)) (car xs))
+             (check (cdr xs)))))
+
+(check (list 0 -1 4611686018427387903 -4611686018427387904
+             1.5 -0.0 1e300 (make-rectangular 1.5 -2.0)
+             "" "text with \"quotes\"" 'symbol #\a #t #f '()
+             '(1 (2 3) . 4) (vector 1 "two" 'three (vector))
+             (bytevector 0 1 255)))
+
+; equal? does not look inside matrices
+(define m (list->matrix (list (list 1 (make-rectangular 2 3)) (list 4 5))))
+(expect (equal? (matrix->list (round-trip m)) (matrix->list m)) m)
+
+; two references to one pair come back as one pair
+(define shared (list 1 2))
+(define pair (round-trip (cons shared shared)))
+(expect (eq? (car pair) (cdr pair)) pair)
+
+; a cycle comes back as a cycle
+(define cycle (list 1 2 3))
+(set-cdr! (cddr cycle) cycle)
+(define back (round-trip cycle))
+(expect (eq? (cdddr back) back) 'cycle)
+
+; a table keeps its entries
+(define table (make-equal-hash-table))
+(hash-table-set! table "key" '(1 2))
+(hash-table-set! table 42 'answer)
+(define copy (round-trip table))
+(expect (equal? (hash-table-ref/default copy "key" #f) '(1 2)) "key")
+(expect (eq? (hash-table-ref/default copy 42 #f) 'answer) 42)
+(expect (= (hash-table-count copy) 2) (hash-table-count copy))
+
+(write 'ok)
+(exit 0)
@@ -0,0 +1,107 @@
+; save-image and --image must bring back the heap as it was saved:
+; shared structure, closures, primitives, rebuilt tables and maps,
+; and streams whose step functions are in the executable. Run in two
+; steps, and again with --relocate-image to restore away from the
+; image base:
+;
+;   sch tests/image-restore.scm save /tmp/sch-image-restore
+;   sch --image /tmp/sch-image-restore tests/image-restore.scm check
+;   sch --image /tmp/sch-image-restore --relocate-image \
+;       tests/image-restore.scm check
+;
+; The check exits 1 with the part that came back wrong.
+
+(define mode (cadr (command-line)))
+
+(define (expect ok what)
+  (if ok
+      #t
+      (begin (write what) (exit 1))))
+
+(define-record-type point (make-point x y) point? (x point-x) (y point-y))
+
+(define (make-state)
+  (define shared (list 1 2 3))
+  (define by-identity (make-eq-hash-table))
+  (define by-value (make-equal-hash-table))
+  (define builder (string-builder))
+  (define bits (make-bitset 200))
+  (define counter 0)
+  (hash-table-set! by-identity shared 'shared)
+  (hash-table-set! by-value "key" 'value)
+  (builder-add! builder "grown ")
+  (builder-add! builder "text")
+  (bitset-set! bits 3)
+  (bitset-set! bits 150)
+  (vector shared
+          (cons shared shared)
+          by-identity
+          by-value
+          (pmap-set (pmap-set (make-pmap) "a" 1) shared 2)
+          builder
+          bits
+          (list->matrix '((1 2) (3 4)))
+          (make-point 7 8)
+          (lambda () (set! counter (+ counter 1)) counter)
+          car
+          (stream-map square (stream-from 1))
+          "string"
+          'symbol
+          point?
+          point-y))
+
+(define state
+  (if (equal? mode "save")
+      (make-state)
+      state))
+
+(if (equal? mode "save")
+    (begin (save-image (caddr (command-line)))
+           (exit 0)))
+
+(define shared (vector-ref state 0))
+(expect (equal? shared '(1 2 3)) shared)
+(expect (eq? (car (vector-ref state 1)) shared) 'shared-pair)
+(expect (eq? (cdr (vector-ref state 1)) shared) 'shared-pair)
+
+; addresses may have moved, so the identity table was rehashed
+(expect (eq? (hash-table-ref/default (vector-ref state 2) shared #f)
+             'shared)
+        'by-identity)
+(expect (eq? (hash-table-ref/default (vector-ref state 3) "key" #f)
+             'value)
+        'by-value)
+(hash-table-set! (vector-ref state 3) "more" 'room)
+(expect (= (hash-table-count (vector-ref state 3)) 2) 'by-value-grows)
+
+(expect (= (pmap-ref (vector-ref state 4) "a") 1) 'pmap)
+(expect (= (pmap-ref (vector-ref state 4) shared) 2) 'pmap-identity)
+
+(builder-add! (vector-ref state 5) "!")
+(expect (equal? (builder->string (vector-ref state 5)) "grown text!")
+        'builder)
+
+(expect (equal? (bitset->list (vector-ref state 6)) '(3 150)) 'bitset)
+
+(expect (equal? (matrix->list (vector-ref state 7)) '((1.0 2.0) (3.0 4.0)))
+        'matrix)
+
+; the record type is the saved one, not the one this run defined
+(expect ((vector-ref state 14) (vector-ref state 8)) 'record)
+(expect (= ((vector-ref state 15) (vector-ref state 8)) 8) 'record-field)
+
+; the closure keeps its environment, and changes to it are private
+(expect (= ((vector-ref state 9)) 1) 'closure)
+(expect (= ((vector-ref state 9)) 2) 'closure)
+
+(expect (eq? (vector-ref state 10) car) 'primitive)
+(expect (= ((vector-ref state 10) '(5 6)) 5) 'primitive-call)
+
+(expect (equal? (stream->list (stream-take 4 (vector-ref state 11)))
+                '(1 4 9 16))
+        'stream)
+
+(expect (eq? (string->symbol "symbol") (vector-ref state 13)) 'symbol)
+
+(write 'ok)
+(exit 0)
@@ -0,0 +1,75 @@
+; load keeps a fasl cache next to a library. An edit that keeps the
+; size, a damaged or truncated cache, and one left from other
+; contents must all load the source as it is now. Takes the library
+; file to write, /tmp/sch-load-cache.scm by default, whose cache is
+; that name with .fasl added; exits 1 with the value loaded wrong.
+
+(define library
+  (if (null? (cdr (command-line)))
+      "/tmp/sch-load-cache.scm"
+      (cadr (command-line))))
+
+(define cache (string-append library ".fasl"))
+
+(define (expect ok what)
+  (if ok
+      #t
+      (begin (write what) (exit 1))))
+
+(define (write-bytes file bytes)
+  (define out (open-binary-output-file file))
+  (write-bytevector bytes out)
+  (close-output-port out))
+
+(define (read-bytes file)
+  (define in (open-binary-input-file file))
+  (define bytes (read-bytevector 1000000 in))
+  (close-input-port in)
+  bytes)
+
+; a library of the same size whatever n is, so only the contents
+; tell versions apart
+(define (write-library n)
+  (write-bytes library
+               (string->utf8
+                (string-append "(define value " (number->string n) ")"
+                               (string (integer->char 10))
+                               "(define twice (* 2 value))"
+                               (string (integer->char 10))))))
+
+(define (check n)
+  (load library)
+  (expect (= value n) value)
+  (expect (= twice (* 2 n)) twice))
+
+; first load writes the cache, the second reads it
+(write-library 1)
+(check 1)
+(expect (> (bytevector-length (read-bytes cache)) 0) 'no-cache)
+(check 1)
+
+; same size, and most likely the same modification time
+(write-library 2)
+(check 2)
+
+; a flipped byte in the body fails the cache's own hash
+(define bytes (read-bytes cache))
+(define last (- (bytevector-length bytes) 1))
+(bytevector-u8-set! bytes last
+                    (bitwise-xor (bytevector-u8-ref bytes last) 1))
+(write-bytes cache bytes)
+(check 2)
+
+; so does a cache cut short
+(write-bytes cache (bytevector-copy (read-bytes cache) 0 40))
+(check 2)
+
+; a cache from other contents stays unused once the source changes
+(define old (read-bytes cache))
+(write-library 3)
+(check 3)
+(write-bytes cache old)
+(check 3)
+
+(write 'ok)
+(exit 0)
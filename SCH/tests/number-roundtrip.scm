@@ -0,0 +1,89 @@
+; Numbers printed by number->string and write must read back as the
+; same number, and flonums print in their shortest form. Takes the
+; scratch file to use, /tmp/sch-number-roundtrip by default; exits 1
+; with the number that came back wrong.
+
+(define scratch
+  (if (null? (cdr (command-line)))
+      "/tmp/sch-number-roundtrip"
+      (cadr (command-line))))
+
+(define (expect ok what)
+  (if ok
+      #t
+      (begin (write what) (exit 1))))
+
+; flonums spread over the whole exponent range, both ways from 1
+(define (spread x factor n acc)
+  (if (= n 0)
+      acc
+      (spread (* x factor) factor (- n 1) (cons x acc))))
+
+(define numbers
+  (append (list 0 1 -1 9223372036854775807 -9223372036854775808
+                0.1 0.5 -0.5 1.5 -0.0 (/ 1.0 3) 5e-324
+                2.2250738585072014e-308 1.7976931348623157e308
+                123456.789 1e21 1e22 1e-7 9007199254740993.0
+                (string->number "+inf.0") (string->number "-inf.0"))
+          (spread 1.0 1.37 2200 '())
+          (spread 1.0 0.731 2300 '())))
+
+(define (check-strings xs)
+  (if (null? xs)
+      #t
+      (begin (expect (eqv? (string->number (number->string (car xs)))
+                           (car xs))
+                     (car xs))
+             (check-strings (cdr xs)))))
+
+(check-strings numbers)
+
+; write and read through a file, where the #C notation of complex
+; numbers reads too
+(define written (cons (make-rectangular 1.5 -2.25) numbers))
+(define out (open-output-port scratch))
+(write written out)
+(close-output-port out)
+(define in (open-input-port scratch))
+(define back (read in))
+(close-input-port in)
+
+(define (check-read xs ys)
+  (if (null? xs)
+      (expect (null? ys) ys)
+      (begin (expect (eqv? (car xs) (car ys)) (car xs))
+             (check-read (cdr xs) (cdr ys)))))
+
+(check-read written back)
+
+; shortest forms and the reader's notations
+(define (check-pairs pairs)
+  (if (null? pairs)
+      #t
+      (begin (expect (equal? (car (car pairs)) (cdr (car pairs)))
+                     (car pairs))
+             (check-pairs (cdr pairs)))))
+
+(check-pairs
+ (list (cons (number->string 0.1) "0.1")
+       (cons (number->string 1.5) "1.5")
+       (cons (number->string -0.0) "-0.0")
+       (cons (number->string 255 16) "ff")
+       (cons (string->number "-.5") -0.5)
+       (cons (string->number "+.5") 0.5)
+       (cons (string->number ".5e1") 5.0)
+       (cons (string->number "1e3") 1000.0)
+       (cons (string->number "#xff") 255)
+       (cons (string->number "#b-101") -5)
+       (cons (string->number "ff" 16) 255)
+       (cons (string->number "1.") 1.0)
+       (cons (string->number "abc") #f)
+       (cons (string->number "1e") #f)
+       (cons (string->number "-") #f)))
+
+; NaN reads back, and is not equal to itself
+(define nan (string->number (number->string (string->number "+nan.0"))))
+(expect (eq? (= nan nan) #f) nan)
+
+(write (length numbers))
+(exit 0)
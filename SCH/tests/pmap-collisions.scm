@@ -0,0 +1,21 @@
+; pmap-set on keys whose hashes share a prefix builds a chain of
+; single-child nodes, allocating each level before the one above is
+; filled in. Run it under a collector that fires often; it exits 1 if
+; a key reads back wrong.
+
+(define (fill m i n)
+  (if (= i n)
+      m
+      (fill (pmap-set m i (* i i)) (+ i 1) n)))
+
+(define (check m i n)
+  (if (= i n)
+      #t
+      (if (= (pmap-ref m i) (* i i))
+          (check m (+ i 1) n)
+          (begin (write i) (exit 1)))))
+
+(define m (fill (make-pmap) 0 5000))
+(write (pmap-count m))
+(check m 0 5000)
+(exit 0)